@@ -0,0 +1,661 @@
+#include "ahci.h"
+#include "blkdev.h"
+#include "bio.h"
+#include "pci.h"
+#include "irq.h"
+#include "slab.h"
+#include "mm.h"
+#include "zone.h"
+#include "serial.h"
+
+/*
+ * AHCI disks on the block request layer.
+ *
+ * A port is a request queue. Its request_fn pulls requests off the
+ * elevator into free command slots; with NCQ that is up to 32 (or the
+ * drive's queue depth) READ/WRITE FPDMA QUEUED commands in flight, and
+ * the drive completes them in any order, reporting finished tags by
+ * clearing their SACT bits. Without NCQ one READ/WRITE DMA EXT runs at a
+ * time. Flushes are non-queued commands, so they wait for the port to go
+ * idle and hold back everything behind them. The write cache is turned
+ * on at probe; RQ_fua writes set the FUA bit of WRITE FPDMA QUEUED, or
+ * use WRITE DMA FUA EXT, when the drive supports FUA.
+ */
+
+#define ATA_CMD_READ_DMA_EXT        0x25
+#define ATA_CMD_WRITE_DMA_EXT       0x35
+#define ATA_CMD_WRITE_DMA_FUA_EXT   0x3d
+#define ATA_CMD_READ_FPDMA_QUEUED   0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED  0x61
+#define ATA_CMD_FLUSH_CACHE_EXT     0xea
+#define ATA_CMD_IDENTIFY            0xec
+#define ATA_CMD_SET_FEATURES        0xef
+
+#define SETFEATURES_WC_ON           0x02
+
+/* FPDMA: FUA is bit 7 of the device register */
+#define FIS_DEVICE_FUA              0x80
+
+#define ID_QUEUE_DEPTH          75
+#define ID_SATA_CAP             76
+#define ID_SATA_CAP_NCQ         (1 << 8)
+#define ID_COMMAND_SET_1        82
+#define ID_COMMAND_SET_2        83
+#define ID_CFSSE                84
+#define ID_COMMAND_ENABLED_1    85
+#define ID_CMD1_WRITE_CACHE     (1 << 5)
+#define ID_CMD2_LBA48           (1 << 10)
+#define ID_CFSSE_FUA            (1 << 6)
+#define ID_SECTOR_SIZE          106
+#define ID_SS_VALID_MASK        0xc000
+#define ID_SS_VALID             0x4000
+#define ID_SS_MULTIPLE          (1 << 13)
+#define ID_LBA28_SECTORS        60
+#define ID_LBA48_SECTORS        100
+
+/* requests per command; keeps the worst case inside one PRD table */
+#define AHCI_MAX_SECTORS        128
+
+/* odd sized requests are bounced through this many pages */
+#define AHCI_BOUNCE_ORDER       2
+#define AHCI_BOUNCE_SIZE        (PAGE_SIZE << AHCI_BOUNCE_ORDER)
+
+#define AHCI_SPIN_TIMEOUT       1000000
+
+struct ahci_port {
+    int port_no;
+    volatile struct ahci_port_regs *regs;
+    struct request_queue *queue;
+    struct block_device bdev;
+
+    struct ahci_cmd_header *cmd_list; //32 headers, then the FIS receive area
+    struct ahci_cmd_table *tables[AHCI_MAX_SLOTS];
+    uint32_t table_phys[AHCI_MAX_SLOTS];
+
+    struct request *slots[AHCI_MAX_SLOTS];
+    uint32_t active; //slots in use
+    unsigned int depth; //usable slots
+    int ncq;
+    int fua;
+    unsigned int phys_sectors;
+    int flushing; //a non-queued command owns the port
+    struct request *held; //taken off the elevator, waiting for the port
+
+    uint8_t *bounce;
+    uint32_t bounce_phys;
+    int bounce_slot; //-1 when free
+
+    uint32_t nr_sectors;
+};
+
+static volatile struct ahci_hba_regs *hba;
+static struct ahci_port *ahci_ports[AHCI_MAX_PORTS];
+static int nr_ahci_disks; //sda, sdb, ... in probe order
+
+static void ahci_issue_more(struct ahci_port *port);
+
+static int ahci_stop_port(volatile struct ahci_port_regs *regs)
+{
+    int spin;
+
+    regs->cmd &= ~PORT_CMD_ST;
+    for (spin = 0; (regs->cmd & PORT_CMD_CR) && spin < AHCI_SPIN_TIMEOUT; spin++);
+    regs->cmd &= ~PORT_CMD_FRE;
+    for (; (regs->cmd & PORT_CMD_FR) && spin < AHCI_SPIN_TIMEOUT; spin++);
+
+    return spin == AHCI_SPIN_TIMEOUT ? -1 : 0;
+}
+
+static void ahci_start_port(volatile struct ahci_port_regs *regs)
+{
+    int spin;
+
+    for (spin = 0; (regs->tfd & (PORT_TFD_BSY | PORT_TFD_DRQ)) && spin < AHCI_SPIN_TIMEOUT; spin++);
+    regs->cmd |= PORT_CMD_FRE;
+    regs->cmd |= PORT_CMD_ST;
+}
+
+static void ahci_fill_fis(struct ahci_cmd_table *table, uint8_t command,
+                          uint32_t lba, unsigned int count, int tag)
+{
+    struct fis_reg_h2d *fis = (struct fis_reg_h2d *)table->cfis;
+
+    memset(fis, 0, sizeof(struct fis_reg_h2d));
+    fis->fis_type = FIS_TYPE_REG_H2D;
+    fis->flags = FIS_H2D_COMMAND;
+    fis->command = command;
+    fis->device = 0x40; // LBA
+    fis->lba0 = (uint8_t)lba;
+    fis->lba1 = (uint8_t)(lba >> 8);
+    fis->lba2 = (uint8_t)(lba >> 16);
+    fis->lba3 = (uint8_t)(lba >> 24);
+
+    if (tag >= 0) {
+        // FPDMA: the count moves to the features field, the tag to count
+        fis->featurel = (uint8_t)count;
+        fis->featureh = (uint8_t)(count >> 8);
+        fis->countl = (uint8_t)(tag << 3);
+    }
+    else {
+        fis->countl = (uint8_t)count;
+        fis->counth = (uint8_t)(count >> 8);
+    }
+}
+
+/*
+ * PRD table straight from the request's pages, merging contiguous
+ * segments. returns the entry count, 0 if the request has to bounce.
+ */
+static unsigned int ahci_build_prdt(struct ahci_cmd_table *table, struct request *rq)
+{
+    struct bio *bio;
+    struct bio_vec *bv;
+    unsigned int n = 0;
+    uint32_t next = 0;
+    int i;
+
+    if (IS_FLAG(rq->rq_flags, RQ_nomerge)) {
+        return 0;
+    }
+
+    rq_for_each_bio(bio, rq) {
+        bio_for_each_segment(bv, bio, i) {
+            uint32_t addr = page_to_phys(bv->bv_page) + bv->bv_offset;
+
+            if ((addr | bv->bv_len) & 1) {
+                return 0;
+            }
+            if (n && addr == next) {
+                table->prdt[n - 1].dbc += bv->bv_len;
+            }
+            else {
+                if (n == AHCI_PRDT_ENTRIES) {
+                    return 0;
+                }
+                table->prdt[n].dba = addr;
+                table->prdt[n].dbau = 0;
+                table->prdt[n].rsv = 0;
+                table->prdt[n].dbc = bv->bv_len - 1;
+                n++;
+            }
+            next = addr + bv->bv_len;
+        }
+    }
+    return n;
+}
+
+/* can rq go out now, and does it need the bounce buffer */
+static int ahci_can_issue(struct ahci_port *port, struct request *rq)
+{
+    unsigned int busy = 0;
+
+    if (port->flushing) {
+        return 0;
+    }
+    if (IS_FLAG(rq->rq_flags, RQ_flush) || !port->ncq) {
+        return port->active == 0;
+    }
+    for (uint32_t a = port->active; a; a &= a - 1) {
+        busy++;
+    }
+    return busy < port->depth;
+}
+
+static int ahci_free_slot(struct ahci_port *port)
+{
+    for (unsigned int slot = 0; slot < port->depth; slot++) {
+        if (!(port->active & (1u << slot))) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/*
+ * build and issue rq in slot. returns 1 if it has to wait (bounce busy),
+ * -1 if it cannot be done at all.
+ */
+static int ahci_issue(struct ahci_port *port, int slot, struct request *rq)
+{
+    struct ahci_cmd_header *hdr = &port->cmd_list[slot];
+    struct ahci_cmd_table *table = port->tables[slot];
+    unsigned int nprd = 0;
+    uint8_t command;
+    int queued = 0;
+    int fua;
+
+    hdr->flags = (sizeof(struct fis_reg_h2d) / 4) & CMD_HDR_CFL_MASK;
+    hdr->prdbc = 0;
+    hdr->ctba = port->table_phys[slot];
+    hdr->ctbau = 0;
+
+    if (IS_FLAG(rq->rq_flags, RQ_flush)) {
+        ahci_fill_fis(table, ATA_CMD_FLUSH_CACHE_EXT, 0, 0, -1);
+        port->flushing = 1;
+    }
+    else {
+        nprd = ahci_build_prdt(table, rq);
+        if (!nprd) {
+            uint32_t len = rq->rq_nr_sectors * DISK_SECTOR_SIZE;
+
+            if (len > AHCI_BOUNCE_SIZE) {
+                printk("ahci: cannot map %u sectors at %u\n", rq->rq_nr_sectors, rq->rq_sector);
+                return -1;
+            }
+            if (port->bounce_slot >= 0) {
+                return 1;
+            }
+            if (rq->rq_rw == BIO_WRITE) {
+                memset(port->bounce, 0, len);
+                blk_rq_copy(rq, port->bounce, 0);
+            }
+            table->prdt[0].dba = port->bounce_phys;
+            table->prdt[0].dbau = 0;
+            table->prdt[0].rsv = 0;
+            table->prdt[0].dbc = len - 1;
+            nprd = 1;
+            port->bounce_slot = slot;
+        }
+
+        if (rq->rq_rw == BIO_WRITE) {
+            hdr->flags |= CMD_HDR_WRITE;
+        }
+
+        fua = port->fua && IS_FLAG(rq->rq_flags, RQ_fua);
+        if (port->ncq) {
+            command = rq->rq_rw == BIO_WRITE ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+            ahci_fill_fis(table, command, rq->rq_sector, rq->rq_nr_sectors, slot);
+            if (fua) {
+                ((struct fis_reg_h2d *)table->cfis)->device |= FIS_DEVICE_FUA;
+            }
+            queued = 1;
+        }
+        else {
+            if (rq->rq_rw == BIO_READ) {
+                command = ATA_CMD_READ_DMA_EXT;
+            }
+            else {
+                command = fua ? ATA_CMD_WRITE_DMA_FUA_EXT : ATA_CMD_WRITE_DMA_EXT;
+            }
+            ahci_fill_fis(table, command, rq->rq_sector, rq->rq_nr_sectors, -1);
+        }
+    }
+    hdr->prdtl = nprd;
+
+    port->slots[slot] = rq;
+    port->active |= 1u << slot;
+    if (queued) {
+        port->regs->sact = 1u << slot;
+    }
+    port->regs->ci = 1u << slot;
+    return 0;
+}
+
+/* fill free slots from the elevator; interrupts are off */
+static void ahci_issue_more(struct ahci_port *port)
+{
+    struct request *rq;
+    int slot, ret;
+
+    for (;;) {
+        rq = port->held;
+        port->held = NULL;
+        if (!rq) {
+            rq = elv_next_request(port->queue);
+        }
+        if (!rq) {
+            return;
+        }
+
+        slot = ahci_free_slot(port);
+        if (!ahci_can_issue(port, rq) || slot < 0) {
+            port->held = rq;
+            return;
+        }
+
+        ret = ahci_issue(port, slot, rq);
+        if (ret > 0) {
+            port->held = rq;
+            return;
+        }
+        if (ret < 0) {
+            blk_end_request(rq, -1);
+        }
+    }
+}
+
+static void ahci_request_fn(struct request_queue *q)
+{
+    ahci_issue_more((struct ahci_port *)q->queuedata);
+}
+
+static void ahci_end_slot(struct ahci_port *port, int slot, int error)
+{
+    struct request *rq = port->slots[slot];
+
+    if (port->bounce_slot == slot) {
+        if (!error && rq->rq_rw == BIO_READ) {
+            blk_rq_copy(rq, port->bounce, 1);
+        }
+        port->bounce_slot = -1;
+    }
+    if (IS_FLAG(rq->rq_flags, RQ_flush)) {
+        port->flushing = 0;
+    }
+
+    port->slots[slot] = NULL;
+    port->active &= ~(1u << slot);
+    blk_end_request(rq, error);
+}
+
+/*
+ * a task file or host bus error fails every outstanding command; the
+ * port is restarted to clear the condition.
+ */
+static void ahci_port_error(struct ahci_port *port, uint32_t is)
+{
+    printk("ahci: port %d error, is %x tfd %x serr %x\n",
+           port->port_no, is, port->regs->tfd, port->regs->serr);
+
+    ahci_stop_port(port->regs);
+    port->regs->serr = 0xffffffff;
+    port->regs->is = 0xffffffff;
+
+    for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if (port->active & (1u << slot)) {
+            ahci_end_slot(port, slot, -1);
+        }
+    }
+    ahci_start_port(port->regs);
+}
+
+static void ahci_port_intr(struct ahci_port *port)
+{
+    uint32_t is = port->regs->is;
+    uint32_t pending;
+
+    port->regs->is = is;
+
+    if (is & PORT_IS_ERROR) {
+        ahci_port_error(port, is);
+    }
+    else {
+        // a slot is done once the HBA clears CI and, for NCQ, the drive SACT
+        pending = port->regs->ci | port->regs->sact;
+        for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+            if ((port->active & (1u << slot)) && !(pending & (1u << slot))) {
+                ahci_end_slot(port, slot, 0);
+            }
+        }
+    }
+
+    ahci_issue_more(port);
+}
+
+void ahci_irq_handler(registers_t *regs)
+{
+    uint32_t is;
+
+    if (!hba) {
+        return;
+    }
+
+    is = hba->is;
+    for (int i = 0; i < AHCI_MAX_PORTS; i++) {
+        if ((is & (1u << i)) && ahci_ports[i]) {
+            ahci_port_intr(ahci_ports[i]);
+        }
+    }
+    hba->is = is;
+}
+
+/* polled non-queued command on slot 0, used before the port takes requests */
+static int ahci_exec_polled(struct ahci_port *port, uint8_t command, uint8_t feature, uint32_t len)
+{
+    struct ahci_cmd_header *hdr = &port->cmd_list[0];
+    struct ahci_cmd_table *table = port->tables[0];
+    int spin;
+
+    hdr->flags = (sizeof(struct fis_reg_h2d) / 4) & CMD_HDR_CFL_MASK;
+    hdr->prdtl = len ? 1 : 0;
+    hdr->prdbc = 0;
+    hdr->ctba = port->table_phys[0];
+    hdr->ctbau = 0;
+
+    ahci_fill_fis(table, command, 0, 0, -1);
+    ((struct fis_reg_h2d *)table->cfis)->device = 0;
+    ((struct fis_reg_h2d *)table->cfis)->featurel = feature;
+    table->prdt[0].dba = port->bounce_phys;
+    table->prdt[0].dbau = 0;
+    table->prdt[0].rsv = 0;
+    table->prdt[0].dbc = len - 1;
+
+    port->regs->is = 0xffffffff;
+    port->regs->ci = 1;
+    for (spin = 0; (port->regs->ci & 1) && spin < AHCI_SPIN_TIMEOUT; spin++) {
+        if (port->regs->is & PORT_IS_TFES) {
+            break;
+        }
+    }
+
+    if (spin == AHCI_SPIN_TIMEOUT || (port->regs->is & PORT_IS_TFES) ||
+        (port->regs->tfd & PORT_TFD_ERR)) {
+        port->regs->is = 0xffffffff;
+        return -1;
+    }
+    port->regs->is = 0xffffffff;
+    return 0;
+}
+
+static int ahci_identify(struct ahci_port *port, uint32_t hba_cap)
+{
+    uint16_t *id = (uint16_t *)port->bounce;
+    unsigned int qdepth;
+
+    if (ahci_exec_polled(port, ATA_CMD_IDENTIFY, 0, DISK_SECTOR_SIZE)) {
+        return -1;
+    }
+
+    if (id[ID_COMMAND_SET_2] & ID_CMD2_LBA48) {
+        if (id[ID_LBA48_SECTORS + 2] || id[ID_LBA48_SECTORS + 3]) {
+            port->nr_sectors = 0xffffffff;
+        }
+        else {
+            port->nr_sectors = id[ID_LBA48_SECTORS] | ((uint32_t)id[ID_LBA48_SECTORS + 1] << 16);
+        }
+    }
+    else {
+        port->nr_sectors = id[ID_LBA28_SECTORS] | ((uint32_t)id[ID_LBA28_SECTORS + 1] << 16);
+    }
+
+    port->fua = (id[ID_COMMAND_SET_2] & ID_CMD2_LBA48) && (id[ID_CFSSE] & ID_CFSSE_FUA);
+    port->phys_sectors = 1;
+    if ((id[ID_SECTOR_SIZE] & ID_SS_VALID_MASK) == ID_SS_VALID && (id[ID_SECTOR_SIZE] & ID_SS_MULTIPLE)) {
+        port->phys_sectors = 1u << (id[ID_SECTOR_SIZE] & 0xf);
+    }
+    if ((id[ID_COMMAND_SET_1] & ID_CMD1_WRITE_CACHE) && !(id[ID_COMMAND_ENABLED_1] & ID_CMD1_WRITE_CACHE) &&
+        ahci_exec_polled(port, ATA_CMD_SET_FEATURES, SETFEATURES_WC_ON, 0)) {
+        printk("ahci: port %d: drive refused to enable its write cache\n", port->port_no);
+    }
+
+    port->depth = ((hba_cap >> HBA_CAP_NCS_SHIFT) & 0x1f) + 1;
+    port->ncq = (hba_cap & HBA_CAP_SNCQ) && (id[ID_SATA_CAP] & ID_SATA_CAP_NCQ);
+    if (port->ncq) {
+        qdepth = (id[ID_QUEUE_DEPTH] & 0x1f) + 1;
+        if (qdepth < port->depth) {
+            port->depth = qdepth;
+        }
+    }
+    return 0;
+}
+
+/* undo a partly built port, queue included; the port is stopped */
+static void ahci_free_port(struct ahci_port *port)
+{
+    if (port->queue) {
+        kfree(port->queue);
+    }
+    if (port->bounce) {
+        free_pages(virt_to_page(port->bounce), AHCI_BOUNCE_ORDER);
+    }
+    for (unsigned int slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if (port->tables[slot]) {
+            free_pages(virt_to_page(port->tables[slot]), 0);
+        }
+    }
+    if (port->cmd_list) {
+        port->regs->clb = 0;
+        port->regs->fb = 0;
+        free_pages(virt_to_page(port->cmd_list), 0);
+    }
+    kfree(port);
+}
+
+/* allocate the port's command list, FIS area, tables and bounce buffer */
+static struct ahci_port *ahci_alloc_port(int port_no, uint32_t hba_cap)
+{
+    struct ahci_port *port;
+    struct page *page;
+    unsigned int nslots = ((hba_cap >> HBA_CAP_NCS_SHIFT) & 0x1f) + 1;
+
+    port = (struct ahci_port *)kmalloc(sizeof(struct ahci_port), 0);
+    if (!port) {
+        return NULL;
+    }
+    memset(port, 0, sizeof(struct ahci_port));
+    port->port_no = port_no;
+    port->regs = &hba->ports[port_no];
+    port->bounce_slot = -1;
+
+    // 1K command list and 256 byte FIS area share a page
+    page = alloc_pages(0, 0);
+    if (!page) {
+        kfree(port);
+        return NULL;
+    }
+    port->cmd_list = (struct ahci_cmd_header *)page_address(page);
+    memset(port->cmd_list, 0, PAGE_SIZE);
+
+    if (ahci_stop_port(port->regs)) {
+        printk("ahci: port %d does not stop\n", port_no);
+        free_pages(page, 0);
+        kfree(port);
+        return NULL;
+    }
+    port->regs->clb = page_to_phys(page);
+    port->regs->clbu = 0;
+    port->regs->fb = page_to_phys(page) + 1024;
+    port->regs->fbu = 0;
+
+    for (unsigned int slot = 0; slot < nslots; slot++) {
+        page = alloc_pages(0, 0);
+        if (!page) {
+            ahci_free_port(port);
+            return NULL;
+        }
+        port->tables[slot] = (struct ahci_cmd_table *)page_address(page);
+        port->table_phys[slot] = page_to_phys(page);
+        memset(port->tables[slot], 0, PAGE_SIZE);
+    }
+
+    page = alloc_pages(0, AHCI_BOUNCE_ORDER);
+    if (!page) {
+        ahci_free_port(port);
+        return NULL;
+    }
+    port->bounce = (uint8_t *)page_address(page);
+    port->bounce_phys = page_to_phys(page);
+
+    port->regs->serr = 0xffffffff;
+    port->regs->is = 0xffffffff;
+    ahci_start_port(port->regs);
+    return port;
+}
+
+void ahci_init(void)
+{
+    struct pci_dev pdev;
+    uint32_t abar, cap, pi;
+
+    if (pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, 0, &pdev) ||
+        pdev.prog_if != PCI_PROG_IF_AHCI) {
+        printk("ahci: no AHCI controller\n");
+        return;
+    }
+
+    abar = pdev.bar[AHCI_ABAR] & PCI_BAR_MEM_MASK;
+    hba = (volatile struct ahci_hba_regs *)ioremap(abar, sizeof(struct ahci_hba_regs));
+    if (!hba) {
+        return;
+    }
+    pci_set_master(&pdev);
+    pci_write_config_word(pdev.bus, pdev.slot, pdev.func, PCI_COMMAND,
+                          pci_read_config_word(pdev.bus, pdev.slot, pdev.func, PCI_COMMAND) |
+                          PCI_COMMAND_MEMORY);
+
+    hba->ghc |= HBA_GHC_AE;
+    cap = hba->cap;
+    pi = hba->pi;
+    printk("ahci: abar %x, cap %x, ports %x, version %x\n", abar, cap, pi, hba->vs);
+
+    for (int i = 0; i < AHCI_MAX_PORTS; i++) {
+        volatile struct ahci_port_regs *regs = &hba->ports[i];
+        struct ahci_port *port;
+
+        if (!(pi & (1u << i)) || nr_ahci_disks == 256 / 16) {
+            continue;
+        }
+        if ((regs->ssts & PORT_SSTS_DET_MASK) != PORT_SSTS_DET_PRESENT ||
+            regs->sig != PORT_SIG_ATA) {
+            continue;
+        }
+
+        port = ahci_alloc_port(i, cap);
+        if (!port) {
+            printk("ahci: port %d: out of memory\n", i);
+            continue;
+        }
+        if (ahci_identify(port, cap)) {
+            printk("ahci: port %d: IDENTIFY failed\n", i);
+            goto fail;
+        }
+
+        port->bdev.bd_dev = MKDEV(SCSI_DISK0_MAJOR, nr_ahci_disks * 16);
+        port->queue = blk_init_queue(port->bdev.bd_dev, ahci_request_fn, port);
+        if (!port->queue) {
+            goto fail;
+        }
+        port->queue->max_sectors = AHCI_MAX_SECTORS;
+        port->queue->fua = port->fua;
+        port->queue->phys_sectors = port->phys_sectors;
+
+        port->bdev.bd_name[0] = 's';
+        port->bdev.bd_name[1] = 'd';
+        port->bdev.bd_name[2] = 'a' + nr_ahci_disks;
+        port->bdev.bd_name[3] = '\0';
+        port->bdev.bd_ops = NULL;
+        port->bdev.bd_queue = port->queue;
+        port->bdev.bd_nr_sectors = port->nr_sectors;
+        port->bdev.bd_private = port;
+        port->bdev.bd_minors = DISK_MINORS;
+        if (register_blkdev(&port->bdev)) {
+            goto fail;
+        }
+        nr_ahci_disks++;
+
+        ahci_ports[i] = port;
+        regs->ie = PORT_IE_DEFAULT;
+        printk("ahci: port %d: %s, %u sectors, %s depth %u%s\n", i, port->bdev.bd_name,
+               port->nr_sectors, port->ncq ? "NCQ" : "no NCQ", port->depth, port->fua ? ", FUA" : "");
+        continue;
+fail:
+        ahci_stop_port(regs);
+        ahci_free_port(port);
+    }
+
+    if (request_irq(pdev.irq_line, ahci_irq_handler)) {
+        return;
+    }
+    hba->is = 0xffffffff;
+    hba->ghc |= HBA_GHC_IE;
+}
@@ -0,0 +1,608 @@
+#include "blkdev.h"
+#include "blktrace.h"
+#include "bio.h"
+#include "slab.h"
+#include "mm.h"
+#include "timer.h"
+#include "system.h"
+#include "serial.h"
+#include "string.h"
+
+static kmem_cache_t *request_cache;
+
+static struct request *blk_alloc_request(void)
+{
+    if (!request_cache) {
+        request_cache = kmem_cache_create("request", sizeof(struct request),
+                                          KMALLOC_MINALIGN, SLAB_HWCACHE_ALIGN, NULL);
+        if (!request_cache) {
+            printk("Failed to create request cache\n");
+            return NULL;
+        }
+    }
+    return (struct request *)kmem_cache_alloc(request_cache, 0);
+}
+
+static void blk_free_request(struct request *rq)
+{
+    kmem_cache_free(request_cache, rq);
+}
+
+/* the driver hangs the queue on its block_device before registering it */
+struct request_queue *blk_init_queue(dev_t dev, request_fn_t *fn, void *queuedata)
+{
+    struct request_queue *q;
+
+    q = (struct request_queue *)kmalloc(sizeof(struct request_queue), 0);
+    if (!q) {
+        printk("blk_init_queue: failed to allocate queue for dev %u\n", dev);
+        return NULL;
+    }
+
+    q->q_dev = dev;
+    for (int rw = BIO_READ; rw <= BIO_WRITE; rw++) {
+        INIT_LIST_HEAD(&q->sort_list[rw]);
+        INIT_LIST_HEAD(&q->fifo_list[rw]);
+    }
+    q->nr_queued = 0;
+    INIT_LIST_HEAD(&q->in_flight);
+    q->nr_in_flight = 0;
+    INIT_LIST_HEAD(&q->done_list);
+    q->head_pos = 0;
+    q->starved = 0;
+    q->plugged = 0;
+    q->max_sectors = BLK_MAX_SECTORS;
+    q->nr_sectors = 0;
+    q->fua = 0;
+    q->phys_sectors = 1;
+    q->request_fn = fn;
+    q->queuedata = queuedata;
+    q->nr_requests = 0;
+    memset(&q->stats, 0, sizeof(q->stats));
+
+    return q;
+}
+
+struct request_queue *blk_get_queue(dev_t dev)
+{
+    struct block_device *bdev = bdget(dev);
+
+    return bdev ? bdev->bd_queue : NULL;
+}
+
+/* bring io_ticks and time_in_queue up to now, then move in_flight. irqs off */
+static void blk_account_in_flight(struct request_queue *q, int delta)
+{
+    struct disk_stats *st = &q->stats;
+    unsigned long long now = rdtsc();
+
+    if (st->in_flight) {
+        st->io_ticks += now - st->stamp;
+        st->time_in_queue += (now - st->stamp) * st->in_flight;
+    }
+    st->stamp = now;
+    st->in_flight += delta;
+}
+
+static unsigned int bio_nr_sectors(struct bio *bio)
+{
+    return (bio->bi_size + DISK_SECTOR_SIZE - 1) / DISK_SECTOR_SIZE;
+}
+
+/* does [sector, sector + nr) touch a request on list (linked by rq_sort) */
+static int blk_overlaps_list(struct list_head *list, int rw, uint32_t sector, unsigned int nr)
+{
+    struct request *rq;
+
+    list_for_each_entry(rq, list, rq_sort) {
+        if (rq->rq_rw != rw) {
+            continue;
+        }
+        if (rq->rq_sector < sector + nr && sector < rq->rq_sector + rq->rq_nr_sectors) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* ... queued or already at the driver, in direction rw */
+static int blk_overlaps(struct request_queue *q, int rw, uint32_t sector, unsigned int nr)
+{
+    return blk_overlaps_list(&q->sort_list[rw], rw, sector, nr) ||
+           blk_overlaps_list(&q->in_flight, rw, sector, nr);
+}
+
+/* sorted insert; equal sectors keep arrival order */
+static void elv_add_sort(struct request_queue *q, struct request *rq)
+{
+    struct request *pos;
+
+    list_for_each_entry(pos, &q->sort_list[rq->rq_rw], rq_sort) {
+        if (pos->rq_sector > rq->rq_sector) {
+            break;
+        }
+    }
+    list_add_tail(&pos->rq_sort, &rq->rq_sort);
+}
+
+static void elv_remove(struct request_queue *q, struct request *rq)
+{
+    list_del(&rq->rq_sort);
+    list_del(&rq->rq_fifo);
+    q->nr_queued--;
+}
+
+/*
+ * rq and next are neighbours on the sort list; fold next into rq if the
+ * two runs now touch. The merged request keeps the earlier deadline and
+ * the older fifo position.
+ */
+static void elv_attempt_merge(struct request_queue *q, struct request *rq, struct request *next)
+{
+    struct request *older;
+
+    if ((rq->rq_flags | next->rq_flags) & RQ_nomerge) {
+        return;
+    }
+    if ((rq->rq_flags ^ next->rq_flags) & RQ_fua) {
+        return;
+    }
+    if (rq->rq_sector + rq->rq_nr_sectors != next->rq_sector) {
+        return;
+    }
+    if (rq->rq_nr_sectors + next->rq_nr_sectors > q->max_sectors) {
+        return;
+    }
+
+    older = (next->rq_deadline - rq->rq_deadline < 0) ? next : rq;
+    rq->rq_deadline = older->rq_deadline;
+    if (older == next) {
+        /* take next's place in the fifo */
+        generic_del(&rq->rq_fifo);
+        generic_add(next->rq_fifo.prev, &rq->rq_fifo, &next->rq_fifo);
+    }
+    if (next->rq_start_time < rq->rq_start_time) {
+        rq->rq_start_time = next->rq_start_time;
+    }
+
+    while (!list_is_empty(&next->rq_bios)) {
+        struct bio *bio = list_first_entry(&next->rq_bios, struct bio, bi_list);
+        list_del(&bio->bi_list);
+        list_add_tail(&rq->rq_bios, &bio->bi_list);
+    }
+    rq->rq_nr_sectors += next->rq_nr_sectors;
+
+    elv_remove(q, next);
+    blk_free_request(next);
+    q->stats.merges[rq->rq_rw]++;
+    blk_account_in_flight(q, -1);
+}
+
+/* try to append or prepend the bio to a queued request of the same direction */
+static int elv_merge(struct request_queue *q, struct bio *bio)
+{
+    struct request *rq;
+    struct list_head *head = &q->sort_list[bio->bi_rw];
+    unsigned int nr = bio_nr_sectors(bio);
+    int fua = IS_FLAG(bio->bi_flags, BIO_fua) ? RQ_fua : 0;
+
+    if (bio->bi_size % DISK_SECTOR_SIZE) {
+        return -1;
+    }
+
+    list_for_each_entry(rq, head, rq_sort) {
+        if (IS_FLAG(rq->rq_flags, RQ_nomerge) || (rq->rq_flags & RQ_fua) != fua) {
+            continue;
+        }
+        if (rq->rq_nr_sectors + nr > q->max_sectors) {
+            continue;
+        }
+
+        if (rq->rq_sector + rq->rq_nr_sectors == bio->bi_sector) {
+            list_add_tail(&rq->rq_bios, &bio->bi_list);
+            rq->rq_nr_sectors += nr;
+            q->stats.merges[rq->rq_rw]++;
+            blk_add_trace(rq, BLK_TA_MERGE, bio->bi_sector, nr);
+            if (rq->rq_sort.next != head) {
+                elv_attempt_merge(q, rq, list_next_entry(rq, rq_sort));
+            }
+            return 0;
+        }
+
+        if (bio->bi_sector + nr == rq->rq_sector) {
+            list_add(&rq->rq_bios, &bio->bi_list);
+            rq->rq_sector = bio->bi_sector;
+            rq->rq_nr_sectors += nr;
+            q->stats.merges[rq->rq_rw]++;
+            blk_add_trace(rq, BLK_TA_MERGE, bio->bi_sector, nr);
+            if (rq->rq_sort.prev != head) {
+                elv_attempt_merge(q, list_entry(rq->rq_sort.prev, struct request, rq_sort), rq);
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * queue an empty flush bio behind everything already queued and wait
+ * for it to be dispatched, so later I/O cannot be sorted ahead of it
+ */
+static void blk_queue_flush(struct request_queue *q, struct bio *bio)
+{
+    struct request *rq;
+    unsigned long flags;
+
+    blk_drain_queue(q);
+
+    rq = blk_alloc_request();
+    if (!rq) {
+        printk("blk_queue_flush: out of requests\n");
+        bio_endio(bio, -1);
+        return;
+    }
+
+    rq->rq_dev = bio->bi_dev;
+    rq->rq_rw = BIO_WRITE;
+    rq->rq_flags = RQ_nomerge | RQ_flush;
+    rq->rq_sector = q->head_pos;
+    rq->rq_nr_sectors = 0;
+    rq->rq_deadline = timer_ticks;
+    rq->rq_errors = 0;
+    rq->rq_start_time = rdtsc();
+    INIT_LIST_HEAD(&rq->rq_bios);
+    list_add_tail(&rq->rq_bios, &bio->bi_list);
+
+    local_irq_save(flags);
+    list_add(&q->sort_list[BIO_WRITE], &rq->rq_sort);
+    list_add_tail(&q->fifo_list[BIO_WRITE], &rq->rq_fifo);
+    q->nr_queued++;
+    q->nr_requests++;
+    blk_account_in_flight(q, 1);
+    blk_add_trace(rq, BLK_TA_QUEUE, rq->rq_sector, 0);
+    local_irq_restore(flags);
+
+    blk_drain_queue(q);
+}
+
+/* a partition's bio addresses the disk from here on */
+static int blk_partition_remap(struct block_device *bdev, struct bio *bio)
+{
+    unsigned int nr = bio_nr_sectors(bio);
+
+    if (bio->bi_size && (bio->bi_sector >= bdev->bd_nr_sectors ||
+                         nr > bdev->bd_nr_sectors - bio->bi_sector)) {
+        printk("generic_make_request: sector %u beyond end of %s\n",
+               bio->bi_sector, bdev->bd_name);
+        return -1;
+    }
+    bio->bi_sector += bdev->bd_start_sect;
+    bio->bi_dev = bdev->bd_contains->bd_dev;
+    return 0;
+}
+
+void generic_make_request(struct bio *bio)
+{
+    struct block_device *bdev = bdget(bio->bi_dev);
+    struct request_queue *q = bdev ? bdev->bd_queue : NULL;
+    struct request *rq;
+    unsigned int nr = bio_nr_sectors(bio);
+    unsigned long flags;
+
+    if (!q) {
+        printk("generic_make_request: no queue for dev %u\n", bio->bi_dev);
+        bio_endio(bio, -1);
+        return;
+    }
+
+    if (bdev->bd_contains != bdev && blk_partition_remap(bdev, bio)) {
+        bio_endio(bio, -1);
+        return;
+    }
+
+    if (IS_FLAG(bio->bi_flags, BIO_flush)) {
+        if (!bio->bi_size) {
+            blk_queue_flush(q, bio);
+            return;
+        }
+        // preflush: the data goes in behind a flush of its own
+        CLEAR_FLAG(bio->bi_flags, BIO_flush);
+        if (blkdev_issue_flush(bio->bi_dev)) {
+            bio_endio(bio, -1);
+            return;
+        }
+    }
+    if (bio->bi_rw == BIO_READ) {
+        CLEAR_FLAG(bio->bi_flags, BIO_fua);
+    }
+
+    if (!nr || nr > q->max_sectors) {
+        printk("generic_make_request: bad bio of %u sectors\n", nr);
+        bio_endio(bio, -1);
+        return;
+    }
+
+    if (q->nr_sectors && (bio->bi_sector >= q->nr_sectors ||
+                          nr > q->nr_sectors - bio->bi_sector)) {
+        printk("generic_make_request: sector %u beyond end of dev %u\n",
+               bio->bi_sector, bio->bi_dev);
+        bio_endio(bio, -1);
+        return;
+    }
+
+    blk_complete_requests(q);
+
+    /*
+     * the elevator reorders freely and drivers may complete out of
+     * order, so anything that overlaps a pending write (or a write
+     * overlapping a pending read) waits for the queue to drain first.
+     */
+    local_irq_save(flags);
+    if (blk_overlaps(q, BIO_WRITE, bio->bi_sector, nr) ||
+        (bio->bi_rw == BIO_WRITE && blk_overlaps(q, BIO_READ, bio->bi_sector, nr))) {
+        local_irq_restore(flags);
+        blk_drain_queue(q);
+        local_irq_save(flags);
+    }
+
+    if (!elv_merge(q, bio)) {
+        goto out;
+    }
+    local_irq_restore(flags);
+
+    rq = blk_alloc_request();
+    if (!rq) {
+        blk_drain_queue(q);
+        rq = blk_alloc_request();
+        if (!rq) {
+            printk("generic_make_request: out of requests\n");
+            bio_endio(bio, -1);
+            return;
+        }
+    }
+
+    rq->rq_dev = bio->bi_dev;
+    rq->rq_rw = bio->bi_rw;
+    rq->rq_flags = (bio->bi_size % DISK_SECTOR_SIZE) ? RQ_nomerge : 0;
+    if (IS_FLAG(bio->bi_flags, BIO_fua)) {
+        rq->rq_flags |= RQ_fua;
+    }
+    rq->rq_sector = bio->bi_sector;
+    rq->rq_nr_sectors = nr;
+    rq->rq_deadline = timer_ticks +
+        (bio->bi_rw == BIO_READ ? READ_EXPIRE : WRITE_EXPIRE);
+    rq->rq_errors = 0;
+    rq->rq_start_time = rdtsc();
+    INIT_LIST_HEAD(&rq->rq_bios);
+    list_add_tail(&rq->rq_bios, &bio->bi_list);
+
+    local_irq_save(flags);
+    elv_add_sort(q, rq);
+    list_add_tail(&q->fifo_list[rq->rq_rw], &rq->rq_fifo);
+    q->nr_queued++;
+    q->nr_requests++;
+    blk_account_in_flight(q, 1);
+    blk_add_trace(rq, BLK_TA_QUEUE, rq->rq_sector, nr);
+
+out:
+    local_irq_restore(flags);
+    if (!q->plugged) {
+        blk_run_queue(q);
+    }
+}
+
+/* C-LOOK: the first request at or above the head, else wrap to the lowest */
+static struct request *elv_clook(struct request_queue *q, int rw)
+{
+    struct request *rq;
+
+    list_for_each_entry(rq, &q->sort_list[rw], rq_sort) {
+        if (rq->rq_sector >= q->head_pos) {
+            return rq;
+        }
+    }
+    return list_first_entry(&q->sort_list[rw], struct request, rq_sort);
+}
+
+/*
+ * pick the next request for the driver and take it off the queue.
+ * returns NULL when the queue is empty.
+ */
+struct request *elv_next_request(struct request_queue *q)
+{
+    struct request *rq;
+    int reads = !list_is_empty(&q->fifo_list[BIO_READ]);
+    int writes = !list_is_empty(&q->fifo_list[BIO_WRITE]);
+    int rw;
+
+    if (!reads && !writes) {
+        return NULL;
+    }
+
+    if (reads && (!writes || q->starved < WRITES_STARVED)) {
+        rw = BIO_READ;
+        if (writes) {
+            q->starved++;
+        }
+    }
+    else {
+        rw = BIO_WRITE;
+        q->starved = 0;
+    }
+
+    rq = list_first_entry(&q->fifo_list[rw], struct request, rq_fifo);
+    if (timer_ticks - rq->rq_deadline < 0) {
+        rq = elv_clook(q, rw);
+    }
+
+    elv_remove(q, rq);
+    q->head_pos = rq->rq_sector + rq->rq_nr_sectors;
+
+    list_add_tail(&q->in_flight, &rq->rq_sort);
+    q->nr_in_flight++;
+    rq->rq_issue_time = rdtsc();
+    blk_add_trace(rq, BLK_TA_ISSUE, rq->rq_sector, rq->rq_nr_sectors);
+    return rq;
+}
+
+/*
+ * the driver is done with rq. Called from interrupt context, so the
+ * bios are only completed later by blk_complete_requests().
+ */
+void blk_end_request(struct request *rq, int error)
+{
+    struct request_queue *q = blk_get_queue(rq->rq_dev);
+    struct disk_stats *st = &q->stats;
+
+    rq->rq_errors = error;
+    list_del(&rq->rq_sort);
+    q->nr_in_flight--;
+
+    blk_add_trace(rq, BLK_TA_COMPLETE, rq->rq_sector, rq->rq_nr_sectors);
+    if (IS_FLAG(rq->rq_flags, RQ_flush)) {
+        st->flushes++;
+    }
+    else {
+        st->ios[rq->rq_rw]++;
+        st->sectors[rq->rq_rw] += rq->rq_nr_sectors;
+        st->ticks[rq->rq_rw] += rdtsc() - rq->rq_start_time;
+    }
+    blk_account_in_flight(q, -1);
+    list_add_tail(&q->done_list, &rq->rq_fifo);
+}
+
+/*
+ * the drive has rq's data, but rq wants it on the media and the driver
+ * cannot ask for that. Send rq back as a flush, ahead of anything queued
+ * since; its bios complete when the flush does. irqs off.
+ */
+static void blk_requeue_postflush(struct request_queue *q, struct request *rq)
+{
+    rq->rq_flags = RQ_nomerge | RQ_flush;
+    rq->rq_rw = BIO_WRITE;
+    rq->rq_sector = q->head_pos;
+    rq->rq_nr_sectors = 0;
+    rq->rq_deadline = timer_ticks;
+    rq->rq_start_time = rdtsc();
+
+    list_add(&q->sort_list[BIO_WRITE], &rq->rq_sort);
+    list_add(&q->fifo_list[BIO_WRITE], &rq->rq_fifo);
+    q->nr_queued++;
+    blk_account_in_flight(q, 1);
+    blk_add_trace(rq, BLK_TA_QUEUE, rq->rq_sector, 0);
+
+    if (q->request_fn) {
+        q->request_fn(q);
+    }
+}
+
+/* run the bio completions of every request the driver has finished */
+void blk_complete_requests(struct request_queue *q)
+{
+    struct request *rq;
+    struct list_head *temp;
+    unsigned long flags;
+
+    for (;;) {
+        local_irq_save(flags);
+        if (list_is_empty(&q->done_list)) {
+            local_irq_restore(flags);
+            return;
+        }
+        rq = list_first_entry(&q->done_list, struct request, rq_fifo);
+        list_del(&rq->rq_fifo);
+        if (IS_FLAG(rq->rq_flags, RQ_fua) && !q->fua && !rq->rq_errors) {
+            blk_requeue_postflush(q, rq);
+            local_irq_restore(flags);
+            continue;
+        }
+        local_irq_restore(flags);
+
+        list_for_each_del(temp, &rq->rq_bios) {
+            struct bio *bio = list_entry(temp, struct bio, bi_list);
+            list_del(&bio->bi_list);
+            bio_endio(bio, rq->rq_errors);
+        }
+        blk_free_request(rq);
+    }
+}
+
+/* sleep until the driver finishes a request, then complete it */
+void blk_wait_completion(struct request_queue *q)
+{
+    __asm__ volatile("cli");
+    if (list_is_empty(&q->done_list)) {
+        /* sti only takes effect after hlt, so no wakeup is lost */
+        __asm__ volatile("sti; hlt");
+    }
+    else {
+        __asm__ volatile("sti");
+    }
+    blk_complete_requests(q);
+}
+
+void blk_run_queue(struct request_queue *q)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    if (q->nr_queued && q->request_fn) {
+        q->request_fn(q);
+    }
+    local_irq_restore(flags);
+
+    blk_complete_requests(q);
+}
+
+/* wait until everything queued so far has been completed by the driver */
+void blk_drain_queue(struct request_queue *q)
+{
+    blk_run_queue(q);
+    while (q->nr_queued || q->nr_in_flight || !list_is_empty(&q->done_list)) {
+        blk_wait_completion(q);
+    }
+}
+
+void blk_plug(dev_t dev)
+{
+    struct request_queue *q = blk_get_queue(dev);
+    if (q) {
+        q->plugged++;
+    }
+}
+
+void blk_unplug(dev_t dev)
+{
+    struct request_queue *q = blk_get_queue(dev);
+    if (!q || !q->plugged) {
+        return;
+    }
+    if (--q->plugged == 0) {
+        blk_run_queue(q);
+    }
+}
+
+/*
+ * copy between a request's bios and a linear buffer holding its sectors,
+ * for drivers that have to bounce. to_rq: buffer -> bios.
+ */
+void blk_rq_copy(struct request *rq, uint8_t *buf, int to_rq)
+{
+    struct bio *bio;
+    struct bio_vec *bv;
+    int i;
+
+    rq_for_each_bio(bio, rq) {
+        uint8_t *p = buf + (bio->bi_sector - rq->rq_sector) * DISK_SECTOR_SIZE;
+
+        bio_for_each_segment(bv, bio, i) {
+            if (to_rq) {
+                memcpy(bvec_virt(bv), p, bv->bv_len);
+            }
+            else {
+                memcpy(p, bvec_virt(bv), bv->bv_len);
+            }
+            p += bv->bv_len;
+        }
+    }
+}
@@ -0,0 +1,81 @@
+#include "blktrace.h"
+#include "blkdev.h"
+#include "bio.h"
+#include "timer.h"
+#include "string.h"
+#include "serial.h"
+
+static struct blk_io_trace trace_ring[BLK_TRACE_ENTRIES];
+static unsigned long trace_seq; //events recorded since blk_trace_start()
+static unsigned long long trace_start;
+
+int blk_trace_enabled;
+
+void __blk_add_trace(struct request *rq, char action, uint32_t sector, unsigned int nr_sectors)
+{
+    struct blk_io_trace *t = &trace_ring[trace_seq++ % BLK_TRACE_ENTRIES];
+
+    t->time = rdtsc();
+    t->sector = sector;
+    t->nr_sectors = nr_sectors;
+    t->dev = rq->rq_dev;
+    t->action = action;
+    if (IS_FLAG(rq->rq_flags, RQ_flush)) {
+        t->rw = 'F';
+    }
+    else {
+        t->rw = rq->rq_rw == BIO_WRITE ? 'W' : 'R';
+    }
+    t->error = 0;
+    t->q2c = t->d2c = 0;
+    if (action == BLK_TA_COMPLETE) {
+        t->error = rq->rq_errors;
+        t->q2c = t->time - rq->rq_start_time;
+        t->d2c = t->time - rq->rq_issue_time;
+    }
+}
+
+void blk_trace_start(void)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    memset(trace_ring, 0, sizeof(trace_ring));
+    trace_seq = 0;
+    trace_start = rdtsc();
+    blk_trace_enabled = 1;
+    local_irq_restore(flags);
+}
+
+void blk_trace_stop(void)
+{
+    blk_trace_enabled = 0;
+}
+
+/* oldest event first. Tracing is paused while printing */
+void blk_trace_dump(void)
+{
+    int enabled = blk_trace_enabled;
+    unsigned long seq;
+
+    blk_trace_enabled = 0;
+    seq = trace_seq > BLK_TRACE_ENTRIES ? trace_seq - BLK_TRACE_ENTRIES : 0;
+    if (seq) {
+        printk("blktrace: %lu events lost\n", seq);
+    }
+
+    for (; seq < trace_seq; seq++) {
+        struct blk_io_trace *t = &trace_ring[seq % BLK_TRACE_ENTRIES];
+
+        printk("%u:%u %lu %lu %c %c %u + %u", MAJOR(t->dev), MINOR(t->dev), seq,
+               tsc_to_us(t->time - trace_start), t->action, t->rw, t->sector, t->nr_sectors);
+        if (t->action == BLK_TA_COMPLETE) {
+            printk(" q2c %lu us d2c %lu us", tsc_to_us(t->q2c), tsc_to_us(t->d2c));
+            if (t->error) {
+                printk(" error %d", t->error);
+            }
+        }
+        printk("\n");
+    }
+    blk_trace_enabled = enabled;
+}
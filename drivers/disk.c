@@ -1,28 +1,44 @@
 
 #include "disk.h"
+#include "bio.h"
+#include "blkdev.h"
+#include "mm.h"
 /* #include "screen.h" */
-/* #include "fs.h" // temporary! */
 
 #include "hardware.h"
+#include "registers.h"
+#include "pic.h"
+#include "pci.h"
+#include "zone.h"
 #include "serial.h"
+#include "string.h"
 
 // Talk to hard disk using ATA (Advanced Technology Attachment)
 // Most of this is from: http://lateblt.tripod.com/atapi.htm
 //
 
-// TODO: consider "offset from I/O base" format. 
-#define ATA_DATA_REGISTER               0x1f0 // read + write
-#define ATA_ERR_REGISTER                0x1f1 // read
-#define ATA_FEATURES_REGISTER           0x1f1 // write
-#define ATA_SECTOR_COUNT_REGISTER       0x1f2 // read + write
-#define ATA_LBA_LOW_REGISTER            0x1f3 // read + write
-#define ATA_LBA_MID_REGISTER            0x1f4 // read + write
-#define ATA_LBA_HIGH_REGISTER           0x1f5 // read + write
-#define ATA_DRIVE_HEAD_REGISTER         0x1f6 // read + write
-#define ATA_STATUS_REGISTER             0x1f7 // read
-#define ATA_COMMAND_REGISTER            0x1f7 // write
-#define ATA_ALT_STATUS_REGISTER         0x3f6 // read
-#define ATA_DEVICE_CONTROL_REGISTER     0x3f6 // write
+// task file registers, offsets from the channel's command block
+#define ATA_DATA_REGISTER               0x00 // read + write
+#define ATA_ERR_REGISTER                0x01 // read
+#define ATA_FEATURES_REGISTER           0x01 // write
+#define ATA_SECTOR_COUNT_REGISTER       0x02 // read + write
+#define ATA_LBA_LOW_REGISTER            0x03 // read + write
+#define ATA_LBA_MID_REGISTER            0x04 // read + write
+#define ATA_LBA_HIGH_REGISTER           0x05 // read + write
+#define ATA_DRIVE_HEAD_REGISTER         0x06 // read + write
+#define ATA_STATUS_REGISTER             0x07 // read
+#define ATA_COMMAND_REGISTER            0x07 // write
+// offsets from the control block
+#define ATA_ALT_STATUS_REGISTER         0x00 // read
+#define ATA_DEVICE_CONTROL_REGISTER     0x00 // write
+
+// legacy ISA ports and IRQs of the two channels
+#define ATA_PRIMARY_IO                  0x1f0
+#define ATA_PRIMARY_CTL                 0x3f6
+#define ATA_PRIMARY_IRQ                 14
+#define ATA_SECONDARY_IO                0x170
+#define ATA_SECONDARY_CTL               0x376
+#define ATA_SECONDARY_IRQ               15
 
 #define ATA_SECTOR_SIZE 512
 
@@ -35,7 +51,7 @@
 #define ATA_STATUS_ERR                      (1 << 0)
 
 
-// ATA errors ( "port_byte_in(ATA_ERR_REGISTER" )
+// ATA errors ( "port_byte_in(ch->io + ATA_ERR_REGISTER" )
 #define ATA_ERROR_BAD_BLOCK                 (1 << 7)
 #define ATA_ERROR_UNCORRECTABLE_DATA_ERR    (1 << 6)
 #define ATA_ERROR_MEDIA_CHANGED             (1 << 5)
@@ -49,159 +65,429 @@
 #define ATA_READ_WITH_RETRY     0x20 // osdev
 #define ATA_WRITE_WITH_RETRY    0x30 // osdev. see page 303 of ATA v6 spec.
 #define ATA_CACHE_FLUSH         0xe7 // toaruos
+#define ATA_READ_MULTIPLE       0xc4
+#define ATA_WRITE_MULTIPLE      0xc5
+#define ATA_SET_MULTIPLE_MODE   0xc6
+#define ATA_SET_FEATURES        0xef
+
+#define ATA_READ_DMA            0xc8
+#define ATA_WRITE_DMA           0xca
+#define ATA_IDENTIFY            0xec
+
+// LBA48 ("EXT") forms
+#define ATA_READ_SECTORS_EXT    0x24
+#define ATA_READ_DMA_EXT        0x25
+#define ATA_READ_MULTIPLE_EXT   0x29
+#define ATA_WRITE_SECTORS_EXT   0x34
+#define ATA_WRITE_DMA_EXT       0x35
+#define ATA_WRITE_MULTIPLE_EXT  0x39
+#define ATA_WRITE_DMA_FUA_EXT   0x3d
+#define ATA_WRITE_MULTIPLE_FUA_EXT 0xce
+
+// SET FEATURES subcommands
+#define SETFEATURES_WC_ON       0x02
+
+// a 28-bit command cannot reach this sector or beyond
+#define ATA_LBA28_LIMIT         (1u << 28)
+
+// sector count register is 8 bits, 0 meaning 256
+#define ATA_MAX_SECTORS         256
+
+// IDENTIFY DEVICE words (ATA/ATAPI-7)
+#define ID_SERIAL               10 // 10 words
+#define ID_MODEL                27 // 20 words
+#define ID_MAX_MULTIPLE         47 // low byte
+#define ID_CAPABILITIES         49
+#define ID_LBA28_SECTORS        60 // 2 words
+#define ID_MWDMA_MODES          63
+#define ID_COMMAND_SET_1        82
+#define ID_COMMAND_SET_2        83
+#define ID_CFSSE                84 // command set/feature supported extension
+#define ID_COMMAND_ENABLED_1    85
+#define ID_UDMA_MODES           88
+#define ID_SECTOR_SIZE          106 // physical/logical sector size
+#define ID_LBA48_SECTORS        100 // 4 words
+
+#define ID_CAP_DMA              (1 << 8)
+#define ID_CAP_LBA              (1 << 9)
+#define ID_CMD1_WRITE_CACHE     (1 << 5)
+#define ID_CMD2_LBA48           (1 << 10)
+#define ID_CFSSE_FUA            (1 << 6)
+#define ID_SS_VALID_MASK        0xc000 // word 106 is valid if these read 01
+#define ID_SS_VALID             0x4000
+#define ID_SS_MULTIPLE          (1 << 13) // physical sector holds 2^(bits 3:0) logical
+
+/*
+ * walks a request's data one sector at a time. bio_add_buf() splits
+ * buffers on page boundaries, so a sector may straddle two segments;
+ * it never straddles two bios, every merged bio being whole sectors.
+ */
+struct rq_cursor {
+    struct request *rq;
+    struct bio *bio;
+    unsigned short vec; //index into bio->bi_io_vec
+    unsigned int off; //bytes consumed of that segment
+    unsigned int done; //bytes consumed of the bio
+};
+
+static void rq_cursor_init(struct rq_cursor *c, struct request *rq) {
+    c->rq = rq;
+    c->bio = list_first_entry(&rq->rq_bios, struct bio, bi_list);
+    c->vec = 0;
+    c->off = 0;
+    c->done = 0;
+}
+
+static void rq_cursor_advance(struct rq_cursor *c, unsigned int len) {
+    c->done += len;
+    c->off += len;
+    while (c->vec < c->bio->bi_vcnt && c->off >= c->bio->bi_io_vec[c->vec].bv_len) {
+        c->off -= c->bio->bi_io_vec[c->vec].bv_len;
+        c->vec++;
+    }
+    if (c->done == c->bio->bi_size && c->bio->bi_list.next != &c->rq->rq_bios) {
+        c->bio = list_next_entry(c->bio, bi_list);
+        c->vec = 0;
+        c->off = 0;
+        c->done = 0;
+    }
+}
+
+/*
+ * bytes of the next sector (short only at the tail of an odd-sized bio).
+ * returns them in place when one segment holds the whole sector,
+ * NULL when it has to be bounced through rq_cursor_copy().
+ */
+static uint8_t *rq_cursor_sector(struct rq_cursor *c, unsigned int *len) {
+    struct bio_vec *bv = &c->bio->bi_io_vec[c->vec];
+
+    *len = c->bio->bi_size - c->done;
+    if (*len > ATA_SECTOR_SIZE) {
+        *len = ATA_SECTOR_SIZE;
+    }
+    if (bv->bv_len - c->off >= *len) {
+        return bvec_virt(bv) + c->off;
+    }
+    return NULL;
+}
+
+static void rq_cursor_copy(struct rq_cursor *c, uint8_t *buf, unsigned int len, int rw) {
+    while (len) {
+        struct bio_vec *bv = &c->bio->bi_io_vec[c->vec];
+        unsigned int chunk = bv->bv_len - c->off;
+        if (chunk > len) {
+            chunk = len;
+        }
+
+        if (rw == BIO_READ) {
+            memcpy(bvec_virt(bv) + c->off, buf, chunk);
+        }
+        else {
+            memcpy(buf, bvec_virt(bv) + c->off, chunk);
+        }
+        buf += chunk;
+        len -= chunk;
+        rq_cursor_advance(c, chunk);
+    }
+}
+
+/*
+ * PCI bus-master IDE (PIIX). BAR4 of the IDE function is the BMIBA; the
+ * primary channel's registers are the first 8 ports, the secondary's the
+ * next 8. The engine walks a
+ * table of physical region descriptors, each a dword-aligned physical
+ * address and an even byte count that must not cross a 64K boundary.
+ */
+#define BM_COMMAND          0x00
+#define BM_STATUS           0x02
+#define BM_PRDT             0x04
+
+#define BM_CMD_START        (1 << 0)
+#define BM_CMD_READ         (1 << 3) // device to memory
+
+#define BM_STATUS_ACTIVE    (1 << 0)
+#define BM_STATUS_ERR       (1 << 1)
+#define BM_STATUS_IRQ       (1 << 2)
 
-static void ata_wait_until_not_busy() {
+#define PRD_EOT             0x8000
+#define PRD_BOUNDARY        0x10000
+#define PRD_MAX             (PAGE_SIZE / sizeof(struct ata_prd))
+
+struct ata_prd {
+    uint32_t addr; // physical
+    uint16_t count; // bytes, 0 means 64K
+    uint16_t flags; // PRD_EOT on the last entry
+} __attribute__((packed));
+
+/*
+ * Requests from a channel's queue are run off its IRQ (14 or 15). A
+ * request is one READ or WRITE command for all its sectors. The drive
+ * interrupts once per DRQ block (a sector, or multi_count sectors once
+ * READ/WRITE MULTIPLE is enabled) and, for writes, once more when the
+ * last block is on the media; the handler moves the data and issues
+ * nothing else, so nothing spins on the status register while the
+ * drive seeks.
+ *
+ * The drive's write cache is switched on; it is only flushed for flush
+ * requests, and RQ_fua writes use the FUA EXT commands, which the
+ * queue offers when the drive has them and READ/WRITE MULTIPLE is on
+ * (the PIO fallback of a DMA request needs a FUA command too).
+ */
+#define ATA_IDLE    0
+#define ATA_READ    1 //READ issued, an interrupt per block
+#define ATA_WRITE   2 //WRITE issued, an interrupt per block written
+#define ATA_FLUSH   3 //CACHE FLUSH issued
+#define ATA_DMA     4 //bus-master transfer, one interrupt at the end
+
+/* what IDENTIFY DEVICE told us about the drive */
+struct ata_identity {
+    char model[41];
+    uint32_t nr_sectors; //capacity, clamped to what a 32-bit sector reaches
+    int lba48;
+    unsigned int max_multiple; //0: READ/WRITE MULTIPLE unsupported
+    int dma;
+    uint8_t mwdma_modes; //supported multiword DMA modes, bit n = mode n
+    uint8_t udma_modes; //supported Ultra DMA modes
+    int write_cache; //supported
+    int write_cache_on; //currently enabled
+    int fua; //WRITE DMA/MULTIPLE FUA EXT
+    unsigned int phys_sectors; //logical sectors per physical sector
+};
+
+/* one per IDE channel; only the master drive of each is used */
+static struct ata_channel {
+    uint16_t io; //command block
+    uint16_t ctl; //control block
+    uint8_t irq;
+    struct block_device bdev;
+    struct request_queue *queue;
+    struct request *rq; //in flight, NULL when idle
+    struct rq_cursor cursor;
+    unsigned int done; //sectors transferred
+    unsigned int multi_count; //sectors per DRQ block, 0: MULTIPLE unsupported
+    struct ata_identity id;
+    uint16_t bmiba; //bus-master I/O base, 0: PIO only
+    struct ata_prd *prdt; //one page, so never crosses 64K
+    uint32_t prdt_phys;
+    int state;
+    int err;
+} ata_channels[2] = {
+    { .io = ATA_PRIMARY_IO, .ctl = ATA_PRIMARY_CTL, .irq = ATA_PRIMARY_IRQ },
+    { .io = ATA_SECONDARY_IO, .ctl = ATA_SECONDARY_CTL, .irq = ATA_SECONDARY_IRQ },
+};
+
+static void ata_start_request(struct ata_channel *ch);
+static void ata_issue_rw(struct ata_channel *ch, int dma);
+
+static void ata_wait_until_not_busy(struct ata_channel *ch) {
     uint8_t status;
     do {
-        status = port_byte_in(ATA_STATUS_REGISTER);
+        status = port_byte_in(ch->io + ATA_STATUS_REGISTER);
     } while (status & ATA_STATUS_BUSY);
 }
 
-static void ata_wait_until_status(uint8_t desired_status) {
+static void ata_wait_until_status(struct ata_channel *ch, uint8_t desired_status) {
     uint8_t status;
     do {
-        status = port_byte_in(ATA_STATUS_REGISTER);
+        status = port_byte_in(ch->io + ATA_STATUS_REGISTER);
     } while (!(status & desired_status));
 }
 
-static void waste_cycle_time() {
+static void waste_cycle_time(struct ata_channel *ch) {
     // page 337
-    port_byte_in(ATA_ALT_STATUS_REGISTER);
+    port_byte_in(ch->ctl + ATA_ALT_STATUS_REGISTER);
 }
 
-void disk_write_sector(uint32_t lba, uint8_t *buf, uint16_t nchar);
-
-void disk_write(uint32_t lba, uint8_t *buf, uint32_t nchar) {
-    uint32_t chars_written = 0;
-    uint8_t *c_buf = buf;
-    uint32_t c_lba = lba;
-    for (; chars_written < nchar; c_buf += ATA_SECTOR_SIZE, c_lba += 1) {
-        uint16_t chars_to_write = ATA_SECTOR_SIZE;
-        if ((nchar - chars_written) < ATA_SECTOR_SIZE) {
-            chars_to_write = nchar - chars_written;
-        }
+static void ata_issue(struct ata_channel *ch, uint32_t lba, unsigned int nsectors, uint8_t command);
 
-        disk_write_sector(c_lba, c_buf, chars_to_write);
+/* BSY first: the other status bits are undefined while it is set */
+static void ata_wait_drq(struct ata_channel *ch) {
+    ata_wait_until_not_busy(ch);
+    ata_wait_until_status(ch, ATA_STATUS_DATA_TRANSFER_REQUESTED);
+}
 
-        chars_written += chars_to_write;
+/*
+ * the polled commands below share the channel with the IRQ driven queue:
+ * let it finish the request it has started, then keep interrupts off so
+ * no new one starts until the polled command is done. -1 if a request is
+ * in flight with interrupts already off, so it could never finish.
+ */
+static int ata_polled_begin(struct ata_channel *ch, unsigned long *flags) {
+    local_irq_save(*flags);
+    while (ch->rq) {
+        if (!(*flags & 0x200)) {
+            local_irq_restore(*flags);
+            printk("ata: polled command with a request in flight\n");
+            return -1;
+        }
+        local_irq_restore(*flags);
+        blk_drain_queue(ch->queue);
+        local_irq_save(*flags);
     }
+    return 0;
 }
 
-
 /* NOTE: if you don't write a full sector 
  * in port_multiword_out, it will somehow leave the disk in 
  * a bad state that causes subsequent commands to silently fail.
  * (e.g. a read returning all 0s)
+ * so a short tail is padded out to 512 with zeroes.
+ *
+ * polled; one WRITE SECTORS command per ATA_MAX_SECTORS. The data may
+ * sit in the drive's write cache until the next flush.
  */
-void disk_write_sector(uint32_t lba, uint8_t *in_buf, uint16_t nchar) {
-    if (nchar > ATA_SECTOR_SIZE) {
-        printk("Bad write\n");
-        return;
-    }
-
-    uint8_t buf[ATA_SECTOR_SIZE];
-    // if given buf size is less than ATA_SECTOR_SIZE, 
-    // pad out to 512. 
-    // TODO: inefficient
-    int i = 0;
-    for (; i < nchar; i++) {
-        buf[i] = in_buf[i]; 
-    }
-
-    for (; i < ATA_SECTOR_SIZE; i++) {
-        buf[i] = 0;
-    }
-
-    // stop interrupts
-    asm volatile ("cli");
+int disk_write(uint32_t lba, uint8_t *buf, uint32_t nchar) {
+    struct ata_channel *ch = &ata_channels[0];
+    int err = 0;
+    uint8_t tail[ATA_SECTOR_SIZE];
+    unsigned long flags;
 
-    // busy wait until disk is ready.
-    ata_wait_until_status(ATA_STATUS_READY);
-
-    // https://wiki.osdev.org/ATA_read/write_sectors
-    port_byte_out(ATA_DRIVE_HEAD_REGISTER, 0xe0); // LBA mode
+    while (nchar) {
+        uint32_t nsectors = (nchar + ATA_SECTOR_SIZE - 1) / ATA_SECTOR_SIZE;
+        if (nsectors > ATA_MAX_SECTORS) {
+            nsectors = ATA_MAX_SECTORS;
+        }
 
-    // send # of sectors to write (1, in this case)
-    port_byte_out(ATA_SECTOR_COUNT_REGISTER, 0x01);
+        if (ata_polled_begin(ch, &flags)) {
+            return -1;
+        }
 
-    // byte 1 (bit 0-7) of LBA
-    port_byte_out(ATA_LBA_LOW_REGISTER, (uint8_t) lba & 0xff);
+        ata_issue(ch, lba, nsectors, ATA_WRITE_WITH_RETRY);
 
-    // byte 2 (bit 8-15) of LBA
-    port_byte_out(ATA_LBA_MID_REGISTER, (uint8_t) (lba >> 8) & 0xff);
+        // read alternate status register and ignore result
+        waste_cycle_time(ch);
 
-    // byte 3 (bit 16-23) of LBA
-    port_byte_out(ATA_LBA_HIGH_REGISTER, (uint8_t) (lba >> 16) & 0xff);
+        for (uint32_t i = 0; i < nsectors; i++) {
+            uint8_t *p = buf;
+            uint32_t chunk = ATA_SECTOR_SIZE;
 
-    // command: write with retry
-    port_byte_out(ATA_COMMAND_REGISTER, ATA_WRITE_WITH_RETRY);
+            if (nchar < ATA_SECTOR_SIZE) {
+                chunk = nchar;
+                memset(tail, 0, ATA_SECTOR_SIZE);
+                memcpy(tail, buf, chunk);
+                p = tail;
+            }
 
-    // read alternate status register and ignore result
-    waste_cycle_time();
+            ata_wait_drq(ch);
+            port_multiword_out(ch->io + ATA_DATA_REGISTER, p, ATA_SECTOR_SIZE / 2);
 
-    ata_wait_until_status(ATA_STATUS_DATA_TRANSFER_REQUESTED);
+            buf += chunk;
+            nchar -= chunk;
+        }
 
-    port_multiword_out(ATA_DATA_REGISTER, buf, ATA_SECTOR_SIZE / 2);
+        ata_wait_until_not_busy(ch);
 
-    // see osdev "cache flush"
-    port_byte_out(ATA_COMMAND_REGISTER, ATA_CACHE_FLUSH);
+        // check if an error was set:
+        uint8_t status = port_byte_in(ch->io + ATA_STATUS_REGISTER);
+        if (status & ATA_STATUS_ERR) {
+            // uh oh!
+            printk("Error writing disk...");
+            err = -1;
+        }
 
-    ata_wait_until_not_busy();
+        local_irq_restore(flags);
 
-    // check if an error was set:
-    uint8_t status = port_byte_in(ATA_STATUS_REGISTER);
-    if (status & ATA_STATUS_ERR) {
-        // uh oh!
-        printk("Error writing disk...");
+        lba += nsectors;
     }
-
-    // re-enable interrupts
-    asm volatile ("sti");
+    return err;
 }
 
-void disk_read_internal(uint32_t lba, uint8_t *buf, uint8_t nsectors) {
+/* program the task file and start a command, 1 to ATA_MAX_SECTORS sectors */
+static void ata_issue(struct ata_channel *ch, uint32_t lba, unsigned int nsectors, uint8_t command) {
     // busy wait until disk is ready.
-    ata_wait_until_status(ATA_STATUS_READY);
-    ata_wait_until_not_busy();
+    ata_wait_until_status(ch, ATA_STATUS_READY);
+    ata_wait_until_not_busy(ch);
 
     // https://wiki.osdev.org/ATA_read/write_sectors
     // we want bits 5 and 7 set. 1010 0000. 
-    uint8_t lba_highest = ((lba >> 24) & 0xff);
+    // LBA28: only bits 24-27 go in the low nibble, bit 6 selects LBA mode
+    uint8_t lba_highest = ((lba >> 24) & 0x0f);
     // https://wiki.osdev.org/ATA_PIO_Mode 
     // Drive / Head registers
-    port_byte_out(ATA_DRIVE_HEAD_REGISTER, 0xe0 | lba_highest);
+    port_byte_out(ch->io + ATA_DRIVE_HEAD_REGISTER, 0xe0 | lba_highest);
 
-    // send # of sectors to read
-    port_byte_out(ATA_SECTOR_COUNT_REGISTER, nsectors);
+    // send # of sectors to transfer, 256 is sent as 0
+    port_byte_out(ch->io + ATA_SECTOR_COUNT_REGISTER, (uint8_t) nsectors);
 
     // byte 1 (bit 0-7) of LBA
-    port_byte_out(ATA_LBA_LOW_REGISTER, (uint8_t) (lba & 0xff));
+    port_byte_out(ch->io + ATA_LBA_LOW_REGISTER, (uint8_t) (lba & 0xff));
 
     // byte 2 (bit 8-15) of LBA
-    port_byte_out(ATA_LBA_MID_REGISTER, (uint8_t) ((lba >> 8) & 0xff));
+    port_byte_out(ch->io + ATA_LBA_MID_REGISTER, (uint8_t) ((lba >> 8) & 0xff));
 
     // byte 3 (bit 16-23) of LBA
-    port_byte_out(ATA_LBA_HIGH_REGISTER, (uint8_t) ((lba >> 16) & 0xff));
+    port_byte_out(ch->io + ATA_LBA_HIGH_REGISTER, (uint8_t) ((lba >> 16) & 0xff));
 
-    // command: read with retry
-    port_byte_out(ATA_COMMAND_REGISTER, ATA_READ_WITH_RETRY);
+    port_byte_out(ch->io + ATA_COMMAND_REGISTER, command);
+}
+
+/*
+ * LBA48: each task file register is written twice, high order byte
+ * first. Up to 65536 sectors, 0 meaning 65536.
+ */
+static void ata_issue_ext(struct ata_channel *ch, uint32_t lba, unsigned int nsectors, uint8_t command) {
+    ata_wait_until_status(ch, ATA_STATUS_READY);
+    ata_wait_until_not_busy(ch);
+
+    // LBA bit only; the address lives entirely in the LBA registers
+    port_byte_out(ch->io + ATA_DRIVE_HEAD_REGISTER, 0x40);
+
+    port_byte_out(ch->io + ATA_SECTOR_COUNT_REGISTER, (uint8_t) (nsectors >> 8));
+    port_byte_out(ch->io + ATA_LBA_LOW_REGISTER, (uint8_t) ((lba >> 24) & 0xff));
+    port_byte_out(ch->io + ATA_LBA_MID_REGISTER, 0); // bits 32-39, sectors are 32 bit here
+    port_byte_out(ch->io + ATA_LBA_HIGH_REGISTER, 0); // bits 40-47
+
+    port_byte_out(ch->io + ATA_SECTOR_COUNT_REGISTER, (uint8_t) nsectors);
+    port_byte_out(ch->io + ATA_LBA_LOW_REGISTER, (uint8_t) (lba & 0xff));
+    port_byte_out(ch->io + ATA_LBA_MID_REGISTER, (uint8_t) ((lba >> 8) & 0xff));
+    port_byte_out(ch->io + ATA_LBA_HIGH_REGISTER, (uint8_t) ((lba >> 16) & 0xff));
+
+    port_byte_out(ch->io + ATA_COMMAND_REGISTER, command);
+}
+
+static void ata_start_read(struct ata_channel *ch, uint32_t lba, uint8_t nsectors) {
+    ata_issue(ch, lba, nsectors, ATA_READ_WITH_RETRY);
 
     // wait until not busy
-    ata_wait_until_not_busy();
+    ata_wait_until_not_busy(ch);
+}
 
-    for (int i = 0; i < nsectors; i++) {
-        ata_wait_until_status(ATA_STATUS_DATA_TRANSFER_REQUESTED);
-        port_multiword_in(ATA_DATA_REGISTER, (uint8_t *)(buf + i*ATA_SECTOR_SIZE), ATA_SECTOR_SIZE / 2);
-    }
-    ata_wait_until_not_busy();
+static void ata_read_sector(struct ata_channel *ch, uint8_t *buf) {
+    ata_wait_drq(ch);
+    port_multiword_in(ch->io + ATA_DATA_REGISTER, buf, ATA_SECTOR_SIZE / 2);
+}
+
+static int ata_end_read(struct ata_channel *ch) {
+    ata_wait_until_not_busy(ch);
 
     // check if an error was set:
-    uint8_t status = port_byte_in(ATA_STATUS_REGISTER);
+    uint8_t status = port_byte_in(ch->io + ATA_STATUS_REGISTER);
     if (status & ATA_STATUS_ERR) {
         // uh oh!
         printk("Error reading disk... (2)");
+        return -1;
     }
+    return 0;
+}
 
+int disk_read_internal(uint32_t lba, uint8_t *buf, uint8_t nsectors) {
+    struct ata_channel *ch = &ata_channels[0];
+    unsigned long flags;
+    int err;
+
+    if (ata_polled_begin(ch, &flags)) {
+        return -1;
+    }
+
+    ata_start_read(ch, lba, nsectors);
+
+    for (int i = 0; i < nsectors; i++) {
+        ata_read_sector(ch, buf + i*ATA_SECTOR_SIZE);
+    }
+    err = ata_end_read(ch);
+
+    local_irq_restore(flags);
+    return err;
 }
 
 /* disk read function for use before interrupts are ready.
@@ -215,13 +501,521 @@ void disk_read_bootloader(uint32_t lba, uint8_t *buf, uint8_t chunk) {
 
 /* WARNING: disk_read assumes buf has enough space for the read! */
 void disk_read(uint32_t lba, uint8_t *buf) {
-    // stop interrupts
-    asm volatile ("cli");
-
     disk_read_internal(lba, buf, 0x01);
+}
+
+
+/* sectors moved per DRQ block at this point of the request */
+static unsigned int ata_block_sectors(struct ata_channel *ch) {
+    unsigned int left = ch->rq->rq_nr_sectors - ch->done;
+    unsigned int block = ch->multi_count ? ch->multi_count : 1;
+
+    return left < block ? left : block;
+}
+
+static void ata_pio_in(struct ata_channel *ch, unsigned int nsectors) {
+    uint8_t bounce[ATA_SECTOR_SIZE];
+    unsigned int len;
+    uint8_t *p;
+
+    for (unsigned int i = 0; i < nsectors; i++) {
+        p = rq_cursor_sector(&ch->cursor, &len);
+        if (p && len == ATA_SECTOR_SIZE) {
+            port_multiword_in(ch->io + ATA_DATA_REGISTER, p, ATA_SECTOR_SIZE / 2);
+            rq_cursor_advance(&ch->cursor, len);
+        }
+        else {
+            port_multiword_in(ch->io + ATA_DATA_REGISTER, bounce, ATA_SECTOR_SIZE / 2);
+            rq_cursor_copy(&ch->cursor, bounce, len, BIO_READ);
+        }
+    }
+    ch->done += nsectors;
+}
+
+static void ata_pio_out(struct ata_channel *ch, unsigned int nsectors) {
+    uint8_t bounce[ATA_SECTOR_SIZE];
+    unsigned int len;
+    uint8_t *p;
+
+    for (unsigned int i = 0; i < nsectors; i++) {
+        p = rq_cursor_sector(&ch->cursor, &len);
+        if (p && len == ATA_SECTOR_SIZE) {
+            rq_cursor_advance(&ch->cursor, len);
+        }
+        else {
+            // pad short tails; see the note above disk_write
+            memset(bounce, 0, ATA_SECTOR_SIZE);
+            rq_cursor_copy(&ch->cursor, bounce, len, BIO_WRITE);
+            p = bounce;
+        }
+        port_multiword_out(ch->io + ATA_DATA_REGISTER, p, ATA_SECTOR_SIZE / 2);
+    }
+    ch->done += nsectors;
+}
+
+/*
+ * describe the request's segments in the PRD table, merging physically
+ * contiguous ones. returns the entry count, 0 if the request cannot go
+ * by DMA (odd sizes or alignment, or too many pieces).
+ */
+static unsigned int ata_build_prdt(struct ata_channel *ch) {
+    struct request *rq = ch->rq;
+    struct bio *bio;
+    struct bio_vec *bv;
+    unsigned int n = 0;
+    int i;
+
+    if (IS_FLAG(rq->rq_flags, RQ_nomerge)) {
+        return 0;
+    }
+
+    rq_for_each_bio(bio, rq) {
+        bio_for_each_segment(bv, bio, i) {
+            uint32_t addr = page_to_phys(bv->bv_page) + bv->bv_offset;
+            uint32_t len = bv->bv_len;
+
+            if ((addr | len) & 1) {
+                return 0;
+            }
+
+            while (len) {
+                uint32_t chunk = PRD_BOUNDARY - (addr % PRD_BOUNDARY);
+                if (chunk > len) {
+                    chunk = len;
+                }
+
+                if (n && ch->prdt[n - 1].addr + (ch->prdt[n - 1].count ? ch->prdt[n - 1].count : PRD_BOUNDARY) == addr &&
+                    addr % PRD_BOUNDARY != 0) {
+                    // continues the previous region inside the same 64K
+                    ch->prdt[n - 1].count += chunk;
+                }
+                else {
+                    if (n == PRD_MAX) {
+                        return 0;
+                    }
+                    ch->prdt[n].addr = addr;
+                    ch->prdt[n].count = (uint16_t) chunk; // 64K wraps to 0
+                    ch->prdt[n].flags = 0;
+                    n++;
+                }
+                addr += chunk;
+                len -= chunk;
+            }
+        }
+    }
+
+    if (n) {
+        ch->prdt[n - 1].flags = PRD_EOT;
+    }
+    return n;
+}
+
+/* start a bus-master transfer for ch->rq; -1 if it has to go by PIO */
+static int ata_dma_start(struct ata_channel *ch) {
+    struct request *rq = ch->rq;
+    uint8_t cmd = (rq->rq_rw == BIO_READ) ? BM_CMD_READ : 0;
+
+    if (!ch->bmiba || !ata_build_prdt(ch)) {
+        return -1;
+    }
+
+    port_byte_out(ch->bmiba + BM_COMMAND, 0);
+    port_dword_out(ch->bmiba + BM_PRDT, ch->prdt_phys);
+    port_byte_out(ch->bmiba + BM_COMMAND, cmd);
+    // error and interrupt bits are write-1-to-clear
+    port_byte_out(ch->bmiba + BM_STATUS,
+                  port_byte_in(ch->bmiba + BM_STATUS) | BM_STATUS_ERR | BM_STATUS_IRQ);
+
+    ch->state = ATA_DMA;
+    ata_issue_rw(ch, 1);
+    port_byte_out(ch->bmiba + BM_COMMAND, cmd | BM_CMD_START);
+    return 0;
+}
+
+/* stop the engine after its interrupt; returns -1 if it reported an error */
+static int ata_dma_end(struct ata_channel *ch) {
+    uint8_t status = port_byte_in(ch->bmiba + BM_STATUS);
+
+    port_byte_out(ch->bmiba + BM_COMMAND, 0);
+    port_byte_out(ch->bmiba + BM_STATUS, status | BM_STATUS_ERR | BM_STATUS_IRQ);
+
+    return (status & BM_STATUS_ERR) ? -1 : 0;
+}
 
-    // re-enable interrupts
-    asm volatile ("sti");
+/*
+ * pick the command for ch->rq and start it. The 48-bit forms are only
+ * used when the transfer reaches past the 28-bit limit, or for FUA.
+ */
+static void ata_issue_rw(struct ata_channel *ch, int dma) {
+    struct request *rq = ch->rq;
+    int fua = ch->queue->fua && IS_FLAG(rq->rq_flags, RQ_fua);
+    int ext = ch->id.lba48 && (fua || rq->rq_sector + rq->rq_nr_sectors > ATA_LBA28_LIMIT);
+    uint8_t cmd;
+
+    if (rq->rq_rw == BIO_READ) {
+        if (dma) {
+            cmd = ext ? ATA_READ_DMA_EXT : ATA_READ_DMA;
+        }
+        else if (ch->multi_count) {
+            cmd = ext ? ATA_READ_MULTIPLE_EXT : ATA_READ_MULTIPLE;
+        }
+        else {
+            cmd = ext ? ATA_READ_SECTORS_EXT : ATA_READ_WITH_RETRY;
+        }
+    }
+    else if (fua) {
+        cmd = dma ? ATA_WRITE_DMA_FUA_EXT : ATA_WRITE_MULTIPLE_FUA_EXT;
+    }
+    else {
+        if (dma) {
+            cmd = ext ? ATA_WRITE_DMA_EXT : ATA_WRITE_DMA;
+        }
+        else if (ch->multi_count) {
+            cmd = ext ? ATA_WRITE_MULTIPLE_EXT : ATA_WRITE_MULTIPLE;
+        }
+        else {
+            cmd = ext ? ATA_WRITE_SECTORS_EXT : ATA_WRITE_WITH_RETRY;
+        }
+    }
+
+    if (ext) {
+        ata_issue_ext(ch, rq->rq_sector, rq->rq_nr_sectors, cmd);
+    }
+    else {
+        ata_issue(ch, rq->rq_sector, rq->rq_nr_sectors, cmd);
+    }
+}
+
+static void ata_finish_request(struct ata_channel *ch) {
+    if (ch->err) {
+        printk("ata: %s of %u sectors at lba %u failed\n",
+               ch->rq->rq_rw == BIO_WRITE ? "write" : "read",
+               ch->rq->rq_nr_sectors, ch->rq->rq_sector);
+    }
+    blk_end_request(ch->rq, ch->err);
+    ata_start_request(ch);
+}
+
+/* take the next request off the elevator, if the channel is free */
+static void ata_start_request(struct ata_channel *ch) {
+    struct request *rq = elv_next_request(ch->queue);
+
+    ch->rq = rq;
+    if (!rq) {
+        ch->state = ATA_IDLE;
+        return;
+    }
+
+    rq_cursor_init(&ch->cursor, rq);
+    ch->done = 0;
+    ch->err = 0;
+
+    if (IS_FLAG(rq->rq_flags, RQ_flush)) {
+        ch->state = ATA_FLUSH;
+        ata_wait_until_not_busy(ch);
+        port_byte_out(ch->io + ATA_COMMAND_REGISTER, ATA_CACHE_FLUSH);
+    }
+    else if (!ata_dma_start(ch)) {
+        return;
+    }
+    else if (rq->rq_rw == BIO_WRITE) {
+        ch->state = ATA_WRITE;
+        ata_issue_rw(ch, 0);
+        waste_cycle_time(ch);
+
+        // PIO out: DRQ for the first block comes without an interrupt
+        ata_wait_drq(ch);
+        ata_pio_out(ch, ata_block_sectors(ch));
+    }
+    else {
+        ch->state = ATA_READ;
+        ata_issue_rw(ch, 0);
+    }
+}
+
+/* IRQ 14: primary channel, IRQ 15: secondary */
+void ata_irq_handler(registers_t *regs) {
+    struct ata_channel *ch = &ata_channels[regs->int_no - 32 == ATA_SECONDARY_IRQ];
+
+    if (!ch->queue) {
+        // no disk registered on this channel
+        return;
+    }
+
+    // reading the status register acknowledges the interrupt
+    uint8_t status = port_byte_in(ch->io + ATA_STATUS_REGISTER);
+
+    if (ch->state == ATA_IDLE) {
+        // a polled command (disk_read/disk_write) or spurious
+        return;
+    }
+
+    if (ch->state == ATA_DMA) {
+        if (ata_dma_end(ch) || (status & (ATA_STATUS_ERR | ATA_STATUS_DEVICE_FAULT))) {
+            ch->err = -1;
+        }
+        ch->done = ch->rq->rq_nr_sectors;
+        ata_finish_request(ch);
+        return;
+    }
+
+    if (status & (ATA_STATUS_ERR | ATA_STATUS_DEVICE_FAULT)) {
+        ch->err = -1;
+        ata_finish_request(ch);
+        return;
+    }
+
+    switch (ch->state) {
+    case ATA_READ:
+        ata_pio_in(ch, ata_block_sectors(ch));
+        if (ch->done == ch->rq->rq_nr_sectors) {
+            ata_finish_request(ch);
+        }
+        break;
+
+    case ATA_WRITE:
+        // the previous block is written; the last interrupt ends the command
+        if (ch->done == ch->rq->rq_nr_sectors) {
+            ata_finish_request(ch);
+        }
+        else {
+            ata_pio_out(ch, ata_block_sectors(ch));
+        }
+        break;
+
+    case ATA_FLUSH:
+        ata_finish_request(ch);
+        break;
+    }
+}
+
+/* request_fn of the ATA queue, called with interrupts off */
+static void disk_request_fn(struct request_queue *q) {
+    struct ata_channel *ch = (struct ata_channel *) q->queuedata;
+
+    if (ch->state == ATA_IDLE) {
+        ata_start_request(ch);
+    }
+}
+
+/* polled, before the channel takes requests. returns -1 if the drive refuses */
+static int ata_set_multiple(struct ata_channel *ch, unsigned int count) {
+    ata_wait_until_not_busy(ch);
+    port_byte_out(ch->io + ATA_DRIVE_HEAD_REGISTER, 0xe0);
+    port_byte_out(ch->io + ATA_SECTOR_COUNT_REGISTER, (uint8_t) count);
+    port_byte_out(ch->io + ATA_COMMAND_REGISTER, ATA_SET_MULTIPLE_MODE);
+    waste_cycle_time(ch);
+    ata_wait_until_not_busy(ch);
+
+    if (port_byte_in(ch->io + ATA_STATUS_REGISTER) & ATA_STATUS_ERR) {
+        return -1;
+    }
+    return 0;
+}
+
+/* polled; turn on the drive's write cache. -1 if the drive refuses */
+static int ata_enable_write_cache(struct ata_channel *ch) {
+    ata_wait_until_not_busy(ch);
+    port_byte_out(ch->io + ATA_DRIVE_HEAD_REGISTER, 0xe0);
+    port_byte_out(ch->io + ATA_FEATURES_REGISTER, SETFEATURES_WC_ON);
+    port_byte_out(ch->io + ATA_COMMAND_REGISTER, ATA_SET_FEATURES);
+    waste_cycle_time(ch);
+    ata_wait_until_not_busy(ch);
+
+    if (port_byte_in(ch->io + ATA_STATUS_REGISTER) & ATA_STATUS_ERR) {
+        return -1;
+    }
+    return 0;
+}
+
+/* find the PIIX IDE function and set up bus mastering for the channel */
+static void ata_init_dma(struct ata_channel *ch) {
+    struct pci_dev dev;
+    struct page *page;
+
+    ch->bmiba = 0;
+
+    if (!ch->id.dma) {
+        printk("ata: drive does not do DMA, PIO only\n");
+        return;
+    }
+
+    if (pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, 0, &dev)) {
+        printk("ata: no PCI IDE controller, PIO only\n");
+        return;
+    }
+    // prog-if bit 7: bus mastering supported; BAR4 must be an I/O BAR
+    if (!(dev.prog_if & 0x80) || !(dev.bar[4] & PCI_BAR_IO)) {
+        printk("ata: IDE controller cannot bus-master, PIO only\n");
+        return;
+    }
+
+    page = alloc_pages(0, 0);
+    if (!page) {
+        printk("ata: no page for the PRD table, PIO only\n");
+        return;
+    }
+    ch->prdt = (struct ata_prd *) page_address(page);
+    ch->prdt_phys = page_to_phys(page);
+
+    pci_set_master(&dev);
+    // the secondary channel's bus-master registers follow the primary's
+    ch->bmiba = (uint16_t)(dev.bar[4] & PCI_BAR_IO_MASK) + (ch == &ata_channels[1] ? 8 : 0);
+    printk("ata: bus-master DMA at io %x\n", ch->bmiba);
+}
+
+/* IDENTIFY strings are big-endian within each word and space padded */
+static void ata_id_string(uint16_t *id, int word, int nwords, char *out) {
+    int i;
+
+    for (i = 0; i < nwords; i++) {
+        out[2 * i] = (char) (id[word + i] >> 8);
+        out[2 * i + 1] = (char) (id[word + i] & 0xff);
+    }
+    out[2 * nwords] = '\0';
+    for (i = 2 * nwords - 1; i >= 0 && out[i] == ' '; i--) {
+        out[i] = '\0';
+    }
+}
+
+/* polled IDENTIFY DEVICE on the channel's master drive. -1 if none answers */
+static int ata_identify(struct ata_channel *ch) {
+    struct ata_identity *ident = &ch->id;
+    uint16_t id[256];
+    uint8_t status;
+
+    // nothing drives a floating bus, so it reads all ones
+    if (port_byte_in(ch->io + ATA_STATUS_REGISTER) == 0xff) {
+        return -1;
+    }
+
+    ata_wait_until_not_busy(ch);
+    port_byte_out(ch->io + ATA_DRIVE_HEAD_REGISTER, 0xa0);
+    port_byte_out(ch->io + ATA_SECTOR_COUNT_REGISTER, 0);
+    port_byte_out(ch->io + ATA_LBA_LOW_REGISTER, 0);
+    port_byte_out(ch->io + ATA_LBA_MID_REGISTER, 0);
+    port_byte_out(ch->io + ATA_LBA_HIGH_REGISTER, 0);
+    port_byte_out(ch->io + ATA_COMMAND_REGISTER, ATA_IDENTIFY);
+    waste_cycle_time(ch);
+
+    if (port_byte_in(ch->io + ATA_STATUS_REGISTER) == 0) {
+        return -1; // no drive
+    }
+    ata_wait_until_not_busy(ch);
+
+    // ATAPI and SATA-bridged packet devices put a signature here
+    if (port_byte_in(ch->io + ATA_LBA_MID_REGISTER) || port_byte_in(ch->io + ATA_LBA_HIGH_REGISTER)) {
+        return -1;
+    }
+
+    do {
+        status = port_byte_in(ch->io + ATA_STATUS_REGISTER);
+        if (status & ATA_STATUS_ERR) {
+            return -1;
+        }
+    } while (!(status & ATA_STATUS_DATA_TRANSFER_REQUESTED));
+
+    port_multiword_in(ch->io + ATA_DATA_REGISTER, (uint8_t *) id, 256);
+
+    ata_id_string(id, ID_MODEL, 20, ident->model);
+
+    ident->lba48 = (id[ID_COMMAND_SET_2] & ID_CMD2_LBA48) != 0;
+    if (ident->lba48) {
+        // sectors are 32 bit above us; anything past 2 TB is out of reach
+        if (id[ID_LBA48_SECTORS + 2] || id[ID_LBA48_SECTORS + 3]) {
+            ident->nr_sectors = 0xffffffff;
+        }
+        else {
+            ident->nr_sectors = id[ID_LBA48_SECTORS] | ((uint32_t) id[ID_LBA48_SECTORS + 1] << 16);
+        }
+    }
+    else {
+        ident->nr_sectors = id[ID_LBA28_SECTORS] | ((uint32_t) id[ID_LBA28_SECTORS + 1] << 16);
+    }
+
+    ident->max_multiple = id[ID_MAX_MULTIPLE] & 0xff;
+    ident->dma = (id[ID_CAPABILITIES] & ID_CAP_DMA) != 0;
+    ident->mwdma_modes = id[ID_MWDMA_MODES] & 0x07;
+    ident->udma_modes = id[ID_UDMA_MODES] & 0x7f;
+    ident->write_cache = (id[ID_COMMAND_SET_1] & ID_CMD1_WRITE_CACHE) != 0;
+    ident->write_cache_on = (id[ID_COMMAND_ENABLED_1] & ID_CMD1_WRITE_CACHE) != 0;
+    ident->fua = ident->lba48 && (id[ID_CFSSE] & ID_CFSSE_FUA) != 0;
+    ident->phys_sectors = 1;
+    if ((id[ID_SECTOR_SIZE] & ID_SS_VALID_MASK) == ID_SS_VALID && (id[ID_SECTOR_SIZE] & ID_SS_MULTIPLE)) {
+        ident->phys_sectors = 1u << (id[ID_SECTOR_SIZE] & 0xf);
+    }
+
+    if (!(id[ID_CAPABILITIES] & ID_CAP_LBA)) {
+        printk("ata: drive has no LBA support\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int ata_init_channel(struct ata_channel *ch, int major, const char *name) {
+    struct ata_identity *id = &ch->id;
+
+    if (ata_identify(ch)) {
+        return -1;
+    }
+    printk("ata: %s: %s, %u sectors (%u MB)%s\n", name, id->model, id->nr_sectors,
+           id->nr_sectors / 2048, id->lba48 ? ", LBA48" : "");
+    printk("ata: %s: multiple %u, dma %d mwdma %x udma %x, write cache %d (on %d), fua %d\n",
+           name, id->max_multiple, id->dma, id->mwdma_modes, id->udma_modes,
+           id->write_cache, id->write_cache_on, id->fua);
+
+    ch->bdev.bd_dev = MKDEV(major, 0);
+    ch->queue = blk_init_queue(ch->bdev.bd_dev, disk_request_fn, ch);
+    if (!ch->queue) {
+        printk("disk_init: no request queue for %s\n", name);
+        return -1;
+    }
+    ch->state = ATA_IDLE;
+
+    // largest DRQ block the drive offers
+    ch->multi_count = 0;
+    if (id->max_multiple > 1 && !ata_set_multiple(ch, id->max_multiple)) {
+        ch->multi_count = id->max_multiple;
+    }
+
+    if (id->write_cache && !id->write_cache_on) {
+        if (ata_enable_write_cache(ch)) {
+            printk("ata: %s: drive refused to enable its write cache\n", name);
+        }
+        else {
+            id->write_cache_on = 1;
+        }
+    }
+    ch->queue->fua = id->fua && ch->multi_count;
+    ch->queue->phys_sectors = id->phys_sectors;
+
+    ata_init_dma(ch);
+
+    strcpy(ch->bdev.bd_name, name);
+    ch->bdev.bd_ops = NULL;
+    ch->bdev.bd_queue = ch->queue;
+    ch->bdev.bd_nr_sectors = id->nr_sectors;
+    ch->bdev.bd_block_size = 0;
+    ch->bdev.bd_private = ch;
+    ch->bdev.bd_minors = DISK_MINORS;
+    if (register_blkdev(&ch->bdev)) {
+        ch->queue = NULL;
+        return -1;
+    }
+
+    // nIEN clear: the drive raises the channel's IRQ when a command needs attention
+    port_byte_out(ch->ctl + ATA_DEVICE_CONTROL_REGISTER, 0x00);
+    IRQ_clear_mask(ch->irq);
+    return 0;
+}
+
+void disk_init(void) {
+    if (ata_init_channel(&ata_channels[0], IDE0_MAJOR, "hda")) {
+        printk("disk_init: no ATA disk on the primary channel\n");
+    }
+    if (ata_init_channel(&ata_channels[1], IDE1_MAJOR, "hdc")) {
+        printk("disk_init: no ATA disk on the secondary channel\n");
+    }
 }
 
 void test_disk(void) {
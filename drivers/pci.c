@@ -0,0 +1,119 @@
+#include "pci.h"
+#include "hardware.h"
+#include "serial.h"
+
+/*
+ * PCI configuration space through configuration mechanism #1:
+ * write the enable bit, bus, slot, function and dword offset to 0xcf8,
+ * then move the dword at 0xcfc.
+ */
+
+static uint32_t pci_config_address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset)
+{
+    return (1u << 31) | ((uint32_t)bus << 16) | ((uint32_t)(slot & 0x1f) << 11) |
+           ((uint32_t)(func & 0x07) << 8) | (offset & 0xfc);
+}
+
+uint32_t pci_read_config_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset)
+{
+    port_dword_out(PCI_CONFIG_ADDRESS, pci_config_address(bus, slot, func, offset));
+    return port_dword_in(PCI_CONFIG_DATA);
+}
+
+uint16_t pci_read_config_word(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset)
+{
+    uint32_t val = pci_read_config_dword(bus, slot, func, offset);
+    return (uint16_t)(val >> ((offset & 2) * 8));
+}
+
+uint8_t pci_read_config_byte(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset)
+{
+    uint32_t val = pci_read_config_dword(bus, slot, func, offset);
+    return (uint8_t)(val >> ((offset & 3) * 8));
+}
+
+void pci_write_config_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t val)
+{
+    port_dword_out(PCI_CONFIG_ADDRESS, pci_config_address(bus, slot, func, offset));
+    port_dword_out(PCI_CONFIG_DATA, val);
+}
+
+/*
+ * a 16-bit access to the word's half of the data port: a dword
+ * read-modify-write would write back the other half too, and Status
+ * next to Command is write-1-to-clear
+ */
+void pci_write_config_word(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t val)
+{
+    port_dword_out(PCI_CONFIG_ADDRESS, pci_config_address(bus, slot, func, offset));
+    port_word_out(PCI_CONFIG_DATA + (offset & 2), val);
+}
+
+static void pci_fill_dev(uint8_t bus, uint8_t slot, uint8_t func, struct pci_dev *dev)
+{
+    dev->bus = bus;
+    dev->slot = slot;
+    dev->func = func;
+    dev->vendor = pci_read_config_word(bus, slot, func, PCI_VENDOR_ID);
+    dev->device = pci_read_config_word(bus, slot, func, PCI_DEVICE_ID);
+    dev->class = pci_read_config_byte(bus, slot, func, PCI_CLASS);
+    dev->subclass = pci_read_config_byte(bus, slot, func, PCI_SUBCLASS);
+    dev->prog_if = pci_read_config_byte(bus, slot, func, PCI_PROG_IF);
+    dev->irq_line = pci_read_config_byte(bus, slot, func, PCI_INTERRUPT_LINE);
+    for (int i = 0; i < 6; i++) {
+        dev->bar[i] = pci_read_config_dword(bus, slot, func, PCI_BAR0 + i * 4);
+    }
+}
+
+/* brute force scan of every bus/slot/function for a config dword */
+static int pci_find(uint8_t offset, uint32_t mask, uint32_t value, int nth, struct pci_dev *dev)
+{
+    for (int bus = 0; bus < 256; bus++) {
+        for (int slot = 0; slot < 32; slot++) {
+            int nfunc = 1;
+
+            if (pci_read_config_word(bus, slot, 0, PCI_VENDOR_ID) == PCI_VENDOR_NONE) {
+                continue;
+            }
+            if (pci_read_config_byte(bus, slot, 0, PCI_HEADER_TYPE) & PCI_HEADER_MULTIFUNC) {
+                nfunc = 8;
+            }
+
+            for (int func = 0; func < nfunc; func++) {
+                if (pci_read_config_word(bus, slot, func, PCI_VENDOR_ID) == PCI_VENDOR_NONE) {
+                    continue;
+                }
+                if ((pci_read_config_dword(bus, slot, func, offset) & mask) != value) {
+                    continue;
+                }
+                if (nth-- == 0) {
+                    pci_fill_dev(bus, slot, func, dev);
+                    printk("pci %x:%x.%x vendor %x device %x class %x/%x\n",
+                           bus, slot, func, dev->vendor, dev->device, dev->class, dev->subclass);
+                    return 0;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+int pci_find_class(uint8_t class, uint8_t subclass, int nth, struct pci_dev *dev)
+{
+    return pci_find(PCI_CLASS_REVISION, 0xffff0000,
+                    ((uint32_t)class << 24) | ((uint32_t)subclass << 16), nth, dev);
+}
+
+int pci_find_device(uint16_t vendor, uint16_t device, int nth, struct pci_dev *dev)
+{
+    return pci_find(PCI_VENDOR_ID, 0xffffffff, ((uint32_t)device << 16) | vendor, nth, dev);
+}
+
+/* let the function master the bus (DMA) and decode its I/O BARs */
+void pci_set_master(struct pci_dev *dev)
+{
+    uint16_t cmd = pci_read_config_word(dev->bus, dev->slot, dev->func, PCI_COMMAND);
+
+    cmd |= PCI_COMMAND_IO | PCI_COMMAND_MASTER;
+    pci_write_config_word(dev->bus, dev->slot, dev->func, PCI_COMMAND, cmd);
+}
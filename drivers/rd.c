@@ -0,0 +1,193 @@
+#include "initrd.h"
+#include "blkdev.h"
+#include "bio.h"
+#include "system.h"
+#include "mm.h"
+#include "zone.h"
+#include "page.h"
+#include "serial.h"
+#include "string.h"
+
+/*
+ * RAM disks on the block request layer.
+ *
+ * ram0 is a scratch disk of RD_SIZE KB whose pages are only allocated
+ * the first time they are written; reading a page never written gives
+ * zeros. It is as fast a device as the buffer cache can sit on, which
+ * makes it the baseline for filesystem benchmarks and a tmp filesystem.
+ *
+ * If GRUB loaded a module it becomes "initrd", a linear view of the
+ * image where the boot loader left it, and the root device. Writes to
+ * it go to that memory and are gone on the next boot.
+ *
+ * Requests are done in the request_fn itself, there is no interrupt.
+ */
+
+#define RD_SIZE         16384 //KB
+#define RD_SECTORS_PER_PAGE (PAGE_SIZE / DISK_SECTOR_SIZE)
+
+#define INITRD_MINOR    250
+
+struct rd_device {
+    struct block_device bdev;
+    struct request_queue *queue;
+    unsigned int nr_pages;
+    struct page **pages; //ram0: lazily filled, NULL where never written
+    uint8_t *base; //initrd: the image, linear
+};
+
+static struct rd_device ram0, initrd;
+
+/* kernel address of byte offset off on the device, NULL for a hole */
+static uint8_t *rd_lookup(struct rd_device *rd, uint32_t off, int write)
+{
+    unsigned int idx = off / PAGE_SIZE;
+    struct page *page;
+
+    if (rd->base) {
+        return rd->base + off;
+    }
+
+    page = rd->pages[idx];
+    if (!page && write) {
+        page = alloc_pages(0, 0);
+        if (!page) {
+            return NULL;
+        }
+        memset(page_address(page), 0, PAGE_SIZE);
+        rd->pages[idx] = page;
+    }
+    if (!page) {
+        return NULL;
+    }
+    return (uint8_t *)page_address(page) + off % PAGE_SIZE;
+}
+
+/* copy one bio segment, a page of the device at a time */
+static int rd_do_bvec(struct rd_device *rd, uint8_t *buf, unsigned int len, uint32_t off, int write)
+{
+    while (len) {
+        unsigned int chunk = PAGE_SIZE - off % PAGE_SIZE;
+        uint8_t *mem;
+
+        if (chunk > len) {
+            chunk = len;
+        }
+        mem = rd_lookup(rd, off, write);
+        if (write) {
+            if (!mem) {
+                printk("%s: out of memory at sector %u\n", rd->bdev.bd_name, off / DISK_SECTOR_SIZE);
+                return -1;
+            }
+            memcpy(mem, buf, chunk);
+        }
+        else if (mem) {
+            memcpy(buf, mem, chunk);
+        }
+        else {
+            memset(buf, 0, chunk);
+        }
+        buf += chunk;
+        off += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static int rd_do_request(struct rd_device *rd, struct request *rq)
+{
+    struct bio *bio;
+    struct bio_vec *bv;
+    int write = rq->rq_rw == BIO_WRITE;
+    int i;
+
+    if (IS_FLAG(rq->rq_flags, RQ_flush)) {
+        return 0;
+    }
+    if (rq->rq_sector + rq->rq_nr_sectors > rd->bdev.bd_nr_sectors) {
+        printk("%s: request at %u past the end\n", rd->bdev.bd_name, rq->rq_sector);
+        return -1;
+    }
+
+    rq_for_each_bio(bio, rq) {
+        uint32_t off = bio->bi_sector * DISK_SECTOR_SIZE;
+
+        bio_for_each_segment(bv, bio, i) {
+            if (rd_do_bvec(rd, bvec_virt(bv), bv->bv_len, off, write)) {
+                return -1;
+            }
+            off += bv->bv_len;
+        }
+    }
+    return 0;
+}
+
+static void rd_request_fn(struct request_queue *q)
+{
+    struct rd_device *rd = (struct rd_device *)q->queuedata;
+    struct request *rq;
+
+    while ((rq = elv_next_request(q))) {
+        blk_end_request(rq, rd_do_request(rd, rq));
+    }
+}
+
+static int rd_register(struct rd_device *rd, dev_t dev, const char *name, uint32_t nr_sectors)
+{
+    rd->queue = blk_init_queue(dev, rd_request_fn, rd);
+    if (!rd->queue) {
+        return -1;
+    }
+    // nothing is more durable than the memory itself
+    rd->queue->fua = 1;
+
+    strncpy(rd->bdev.bd_name, name, sizeof(rd->bdev.bd_name) - 1);
+    rd->bdev.bd_dev = dev;
+    rd->bdev.bd_queue = rd->queue;
+    rd->bdev.bd_nr_sectors = nr_sectors;
+    rd->bdev.bd_private = rd;
+    return register_blkdev(&rd->bdev);
+}
+
+static void initrd_init(void)
+{
+    uint32_t size = initrd_end - initrd_start;
+
+    if (!size) {
+        return;
+    }
+    if (initrd_end > (phy_layout.max_low_pfn << PAGE_SHIFT)) {
+        printk("initrd: 0x%x - 0x%x is not in low memory, ignored\n", initrd_start, initrd_end);
+        return;
+    }
+
+    initrd.base = (uint8_t *)__va(initrd_start);
+    initrd.nr_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (rd_register(&initrd, MKDEV(RAMDISK_MAJOR, INITRD_MINOR), "initrd", size / DISK_SECTOR_SIZE)) {
+        return;
+    }
+    ROOT_DEV = initrd.bdev.bd_dev;
+    printk("initrd: %u KB, root device\n", size / 1024);
+}
+
+void rd_init(void)
+{
+    unsigned int order = 0;
+    struct page *page;
+
+    ram0.nr_pages = RD_SIZE * 1024 / PAGE_SIZE;
+    while ((PAGE_SIZE << order) < ram0.nr_pages * sizeof(struct page *)) {
+        order++;
+    }
+    page = alloc_pages(0, order);
+    if (!page) {
+        printk("ram0: no memory for the page table\n");
+    }
+    else {
+        ram0.pages = (struct page **)page_address(page);
+        memset(ram0.pages, 0, PAGE_SIZE << order);
+        rd_register(&ram0, MKDEV(RAMDISK_MAJOR, 0), "ram0", ram0.nr_pages * RD_SECTORS_PER_PAGE);
+    }
+
+    initrd_init();
+}
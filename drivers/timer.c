@@ -8,8 +8,14 @@
 #include "timer.h"
 #include "registers.h"
 #include "serial.h"
+#include "kernel.h"
+#include "system.h"
+
+#define TSC_CALIBRATE_TICKS 10
+#define TSC_KHZ_DEFAULT     1000000 //if the timer is not running yet
 
 int timer_ticks = 0;
+unsigned long tsc_khz = TSC_KHZ_DEFAULT;
 
 /* Timer interrupt handler */
 void timer_driver(registers_t *regs) {
@@ -21,3 +27,38 @@ void timer_driver(registers_t *regs) {
     serial_writestring("\n");
   }
 }
+
+/* count TSC cycles over a few timer ticks. interrupts must be on */
+void tsc_calibrate(void)
+{
+  volatile int *ticks = &timer_ticks;
+  unsigned long long start, cycles;
+  unsigned long eflags;
+  int t;
+
+  __asm__ __volatile__("pushfl; popl %0" : "=g"(eflags));
+  if (!(eflags & 0x200)) {
+    printk("tsc: interrupts off, assuming %lu kHz\n", tsc_khz);
+    return;
+  }
+
+  t = *ticks;
+  while (*ticks == t)
+    ;
+  start = rdtsc();
+  t = *ticks;
+  while (*ticks - t < TSC_CALIBRATE_TICKS)
+    ;
+  cycles = rdtsc() - start;
+
+  do_div(cycles, TSC_CALIBRATE_TICKS * 1000 / FREQUENCY);
+  tsc_khz = (unsigned long)cycles;
+  printk("tsc: %lu kHz\n", tsc_khz);
+}
+
+unsigned long tsc_to_us(unsigned long long cycles)
+{
+  cycles *= 1000;
+  do_div(cycles, tsc_khz);
+  return (unsigned long)cycles;
+}
@@ -0,0 +1,474 @@
+#include "virtio_blk.h"
+#include "virtio.h"
+#include "blkdev.h"
+#include "bio.h"
+#include "pci.h"
+#include "irq.h"
+#include "hardware.h"
+#include "system.h"
+#include "slab.h"
+#include "mm.h"
+#include "zone.h"
+#include "serial.h"
+
+/*
+ * virtio-blk on the block request layer.
+ *
+ * The request_fn moves everything the elevator will give it onto the
+ * virtqueue and kicks the device once for the whole batch; with event
+ * index negotiated the kick is skipped entirely while the device is
+ * still working through earlier entries. Each request uses one ring slot
+ * through an indirect descriptor table kept next to its header and
+ * status byte. Flushes wait for the queue to empty, as with AHCI.
+ */
+
+#define VIRTBLK_MAX_DEVS    4
+#define VIRTBLK_MAX_REQS    32
+#define VIRTBLK_MAX_SECTORS 128
+
+/* per request page: header, status byte, indirect table */
+#define VIRTBLK_STATUS_OFF  16
+#define VIRTBLK_INDIRECT_OFF 64
+#define VIRTBLK_MAX_SG      ((PAGE_SIZE - VIRTBLK_INDIRECT_OFF) / sizeof(struct vring_desc))
+
+#define VIRTBLK_BOUNCE_ORDER 2
+#define VIRTBLK_BOUNCE_SIZE (PAGE_SIZE << VIRTBLK_BOUNCE_ORDER)
+
+#define VIRTBLK_FEATURES    ((1u << VIRTIO_RING_F_INDIRECT_DESC) | (1u << VIRTIO_RING_F_EVENT_IDX) | \
+                             (1u << VIRTIO_BLK_F_SEG_MAX) | (1u << VIRTIO_BLK_F_RO) | \
+                             (1u << VIRTIO_BLK_F_FLUSH) | (1u << VIRTIO_BLK_F_TOPOLOGY))
+
+struct virtblk_req {
+    struct request *rq;
+    struct virtio_blk_outhdr *hdr;
+    uint8_t *status;
+    struct vring_desc *indirect;
+    uint32_t phys; //of hdr, the start of the page
+};
+
+struct virtblk {
+    unsigned short iobase;
+    uint32_t features;
+    struct virtqueue *vq;
+    struct request_queue *queue;
+    struct block_device bdev;
+    uint32_t nr_sectors;
+    unsigned int max_sg; //header and status included
+
+    struct virtblk_req reqs[VIRTBLK_MAX_REQS];
+    uint32_t free_reqs; //bitmap
+    unsigned int nr_active;
+    int flushing;
+    struct request *held; //taken off the elevator, waiting for room
+    struct vring_sg sg[VIRTBLK_MAX_SG]; //scratch for the request being queued
+
+    uint8_t *bounce;
+    uint32_t bounce_phys;
+    struct virtblk_req *bounce_req;
+};
+
+static struct virtblk *virtblk_devs[VIRTBLK_MAX_DEVS];
+static int nr_virtblk;
+static uint16_t virtblk_irqs; //lines already hooked
+
+static struct virtblk_req *virtblk_get_req(struct virtblk *vb)
+{
+    for (int i = 0; i < VIRTBLK_MAX_REQS; i++) {
+        if (vb->free_reqs & (1u << i)) {
+            vb->free_reqs &= ~(1u << i);
+            return &vb->reqs[i];
+        }
+    }
+    return NULL;
+}
+
+static void virtblk_put_req(struct virtblk *vb, struct virtblk_req *vbr)
+{
+    vbr->rq = NULL;
+    vb->free_reqs |= 1u << (vbr - vb->reqs);
+}
+
+/* data segments straight from the request's pages; 0 if it has to bounce */
+static unsigned int virtblk_map_rq(struct virtblk *vb, struct request *rq, struct vring_sg *sg)
+{
+    struct bio *bio;
+    struct bio_vec *bv;
+    unsigned int n = 0;
+    uint32_t next = 0;
+    int write = rq->rq_rw == BIO_READ;
+    int i;
+
+    if (IS_FLAG(rq->rq_flags, RQ_nomerge)) {
+        return 0;
+    }
+
+    rq_for_each_bio(bio, rq) {
+        bio_for_each_segment(bv, bio, i) {
+            uint32_t addr = page_to_phys(bv->bv_page) + bv->bv_offset;
+
+            if (n && addr == next) {
+                sg[n - 1].len += bv->bv_len;
+            }
+            else {
+                if (n + 3 > vb->max_sg) {
+                    return 0;
+                }
+                sg[n].addr = addr;
+                sg[n].len = bv->bv_len;
+                sg[n].write = write;
+                n++;
+            }
+            next = addr + bv->bv_len;
+        }
+    }
+    return n;
+}
+
+static int virtblk_can_issue(struct virtblk *vb, struct request *rq)
+{
+    if (vb->flushing || !vb->free_reqs) {
+        return 0;
+    }
+    if (IS_FLAG(rq->rq_flags, RQ_flush)) {
+        return vb->nr_active == 0;
+    }
+    return 1;
+}
+
+/* 0 queued, 1 has to wait for room, -1 failed */
+static int virtblk_add_rq(struct virtblk *vb, struct request *rq)
+{
+    struct vring_sg *sg = vb->sg;
+    struct virtblk_req *vbr;
+    unsigned int nsg = 0;
+    int bounced = 0;
+
+    if (IS_FLAG(rq->rq_flags, RQ_flush) && !(vb->features & (1u << VIRTIO_BLK_F_FLUSH))) {
+        // no write cache to flush
+        blk_end_request(rq, 0);
+        return 0;
+    }
+    if (rq->rq_rw == BIO_WRITE && (vb->features & (1u << VIRTIO_BLK_F_RO))) {
+        return -1;
+    }
+
+    vbr = virtblk_get_req(vb);
+
+    sg[nsg].addr = vbr->phys;
+    sg[nsg].len = sizeof(struct virtio_blk_outhdr);
+    sg[nsg].write = 0;
+    nsg++;
+
+    if (IS_FLAG(rq->rq_flags, RQ_flush)) {
+        vbr->hdr->type = VIRTIO_BLK_T_FLUSH;
+        vbr->hdr->sector = 0;
+    }
+    else {
+        unsigned int n = virtblk_map_rq(vb, rq, &sg[nsg]);
+
+        if (!n) {
+            uint32_t len = rq->rq_nr_sectors * DISK_SECTOR_SIZE;
+
+            if (len > VIRTBLK_BOUNCE_SIZE) {
+                printk("virtio-blk: cannot map %u sectors at %u\n", rq->rq_nr_sectors, rq->rq_sector);
+                virtblk_put_req(vb, vbr);
+                return -1;
+            }
+            if (vb->bounce_req) {
+                virtblk_put_req(vb, vbr);
+                return 1;
+            }
+            if (rq->rq_rw == BIO_WRITE) {
+                memset(vb->bounce, 0, len);
+                blk_rq_copy(rq, vb->bounce, 0);
+            }
+            sg[nsg].addr = vb->bounce_phys;
+            sg[nsg].len = len;
+            sg[nsg].write = rq->rq_rw == BIO_READ;
+            n = 1;
+            bounced = 1;
+        }
+        nsg += n;
+        vbr->hdr->type = rq->rq_rw == BIO_WRITE ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        vbr->hdr->sector = rq->rq_sector;
+    }
+    vbr->hdr->ioprio = 0;
+
+    *vbr->status = 0xff;
+    sg[nsg].addr = vbr->phys + VIRTBLK_STATUS_OFF;
+    sg[nsg].len = 1;
+    sg[nsg].write = 1;
+    nsg++;
+
+    if (virtqueue_add_buf(vb->vq, sg, nsg, vbr, vbr->indirect, vbr->phys + VIRTBLK_INDIRECT_OFF)) {
+        virtblk_put_req(vb, vbr);
+        return 1;
+    }
+
+    vbr->rq = rq;
+    if (bounced) {
+        vb->bounce_req = vbr;
+    }
+    if (IS_FLAG(rq->rq_flags, RQ_flush)) {
+        vb->flushing = 1;
+    }
+    vb->nr_active++;
+    return 0;
+}
+
+/* queue what the elevator has, then one kick; interrupts are off */
+static void virtblk_issue_more(struct virtblk *vb)
+{
+    struct request *rq;
+    int ret;
+
+    for (;;) {
+        rq = vb->held;
+        vb->held = NULL;
+        if (!rq) {
+            rq = elv_next_request(vb->queue);
+        }
+        if (!rq) {
+            break;
+        }
+        if (!virtblk_can_issue(vb, rq)) {
+            vb->held = rq;
+            break;
+        }
+
+        ret = virtblk_add_rq(vb, rq);
+        if (ret > 0) {
+            vb->held = rq;
+            break;
+        }
+        if (ret < 0) {
+            blk_end_request(rq, -1);
+        }
+    }
+
+    virtqueue_kick(vb->vq);
+}
+
+static int virtblk_open(struct block_device *bdev, int mode)
+{
+    struct virtblk *vb = (struct virtblk *)bdev->bd_private;
+
+    if (IS_FLAG(mode, FMODE_WRITE) && (vb->features & (1u << VIRTIO_BLK_F_RO))) {
+        printk("virtio-blk: %s is read-only\n", bdev->bd_name);
+        return -1;
+    }
+    return 0;
+}
+
+static const struct block_device_operations virtblk_ops = {
+    .open = virtblk_open,
+};
+
+static void virtblk_request_fn(struct request_queue *q)
+{
+    virtblk_issue_more((struct virtblk *)q->queuedata);
+}
+
+static void virtblk_end_req(struct virtblk *vb, struct virtblk_req *vbr)
+{
+    struct request *rq = vbr->rq;
+    int error = *vbr->status != VIRTIO_BLK_S_OK;
+
+    if (error) {
+        printk("virtio-blk: request at %u failed, status %u\n", rq->rq_sector, *vbr->status);
+    }
+    if (vb->bounce_req == vbr) {
+        if (!error && rq->rq_rw == BIO_READ) {
+            blk_rq_copy(rq, vb->bounce, 1);
+        }
+        vb->bounce_req = NULL;
+    }
+    if (IS_FLAG(rq->rq_flags, RQ_flush)) {
+        vb->flushing = 0;
+    }
+
+    vb->nr_active--;
+    virtblk_put_req(vb, vbr);
+    blk_end_request(rq, error);
+}
+
+static void virtblk_done(struct virtblk *vb)
+{
+    struct virtblk_req *vbr;
+
+    do {
+        while ((vbr = (struct virtblk_req *)virtqueue_get_buf(vb->vq, NULL))) {
+            virtblk_end_req(vb, vbr);
+        }
+    } while (!virtqueue_enable_cb(vb->vq));
+
+    virtblk_issue_more(vb);
+}
+
+void virtblk_irq_handler(registers_t *regs __attribute__((unused)))
+{
+    for (int i = 0; i < nr_virtblk; i++) {
+        // reading ISR acknowledges it, so a shared line sees each device once
+        if (port_byte_in(virtblk_devs[i]->iobase + VIRTIO_PCI_ISR) & VIRTIO_PCI_ISR_QUEUE) {
+            virtblk_done(virtblk_devs[i]);
+        }
+    }
+}
+
+static int virtblk_alloc_reqs(struct virtblk *vb)
+{
+    for (int i = 0; i < VIRTBLK_MAX_REQS; i++) {
+        struct page *page = alloc_pages(0, 0);
+        uint8_t *base;
+
+        if (!page) {
+            return -1;
+        }
+        base = (uint8_t *)page_address(page);
+        vb->reqs[i].rq = NULL;
+        vb->reqs[i].hdr = (struct virtio_blk_outhdr *)base;
+        vb->reqs[i].status = base + VIRTBLK_STATUS_OFF;
+        vb->reqs[i].indirect = (struct vring_desc *)(base + VIRTBLK_INDIRECT_OFF);
+        vb->reqs[i].phys = page_to_phys(page);
+        vb->free_reqs |= 1u << i;
+    }
+    return 0;
+}
+
+static void virtblk_free_reqs(struct virtblk *vb)
+{
+    for (int i = VIRTBLK_MAX_REQS - 1; i >= 0; i--) {
+        if (vb->reqs[i].hdr) {
+            free_pages(virt_to_page(vb->reqs[i].hdr), 0);
+        }
+    }
+}
+
+static int virtblk_probe(struct pci_dev *pdev)
+{
+    struct virtblk *vb;
+    struct page *page;
+    unsigned short iobase = pdev->bar[0] & PCI_BAR_IO_MASK;
+    uint32_t host, cap_hi;
+
+    vb = (struct virtblk *)kmalloc(sizeof(struct virtblk), 0);
+    if (!vb) {
+        return -1;
+    }
+    memset(vb, 0, sizeof(struct virtblk));
+    vb->iobase = iobase;
+    pci_set_master(pdev);
+
+    port_byte_out(iobase + VIRTIO_PCI_STATUS, 0);
+    port_byte_out(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    port_byte_out(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    host = port_dword_in(iobase + VIRTIO_PCI_HOST_FEATURES);
+    vb->features = host & VIRTBLK_FEATURES;
+    port_dword_out(iobase + VIRTIO_PCI_GUEST_FEATURES, vb->features);
+
+    vb->vq = vring_setup(iobase, 0, vb->features);
+    if (!vb->vq) {
+        goto fail;
+    }
+    page = alloc_pages(0, VIRTBLK_BOUNCE_ORDER);
+    if (!page) {
+        goto fail_vq;
+    }
+    vb->bounce = (uint8_t *)page_address(page);
+    vb->bounce_phys = page_to_phys(page);
+    if (virtblk_alloc_reqs(vb)) {
+        goto fail_reqs;
+    }
+
+    vb->max_sg = VIRTBLK_MAX_SG;
+    if (!vb->vq->indirect && vb->max_sg > vb->vq->num) {
+        vb->max_sg = vb->vq->num;
+    }
+    if (vb->features & (1u << VIRTIO_BLK_F_SEG_MAX)) {
+        uint32_t seg_max = port_dword_in(iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_SEG_MAX);
+
+        if (seg_max && seg_max + 2 < vb->max_sg) {
+            vb->max_sg = seg_max + 2;
+        }
+    }
+
+    vb->nr_sectors = port_dword_in(iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_CAPACITY);
+    cap_hi = port_dword_in(iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4);
+    if (cap_hi) {
+        vb->nr_sectors = 0xffffffff;
+    }
+
+    // 0xff is "not connected"; only the PIC's 16 lines can be requested
+    if (pdev->irq_line >= 16) {
+        printk("virtio-blk: no usable IRQ line (%u)\n", pdev->irq_line);
+        goto fail_reqs;
+    }
+    if (!(virtblk_irqs & (1u << pdev->irq_line))) {
+        if (request_irq(pdev->irq_line, virtblk_irq_handler)) {
+            goto fail_reqs;
+        }
+        virtblk_irqs |= 1u << pdev->irq_line;
+    }
+
+    vb->bdev.bd_dev = MKDEV(VIRTBLK_MAJOR, nr_virtblk * 16);
+    vb->queue = blk_init_queue(vb->bdev.bd_dev, virtblk_request_fn, vb);
+    if (!vb->queue) {
+        goto fail_reqs;
+    }
+    vb->queue->max_sectors = VIRTBLK_MAX_SECTORS;
+    if (vb->features & (1u << VIRTIO_BLK_F_TOPOLOGY)) {
+        vb->queue->phys_sectors = 1u << (port_byte_in(iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_PHYS_EXP) & 0xf);
+    }
+
+    vb->bdev.bd_name[0] = 'v';
+    vb->bdev.bd_name[1] = 'd';
+    vb->bdev.bd_name[2] = 'a' + nr_virtblk;
+    vb->bdev.bd_name[3] = '\0';
+    vb->bdev.bd_ops = &virtblk_ops;
+    vb->bdev.bd_queue = vb->queue;
+    vb->bdev.bd_nr_sectors = vb->nr_sectors;
+    vb->bdev.bd_private = vb;
+    vb->bdev.bd_minors = DISK_MINORS;
+    if (register_blkdev(&vb->bdev)) {
+        goto fail_queue;
+    }
+
+    virtblk_devs[nr_virtblk++] = vb;
+    port_byte_out(iobase + VIRTIO_PCI_STATUS,
+                  VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+    printk("virtio-blk: %s, %u sectors, ring %u%s%s%s\n", vb->bdev.bd_name, vb->nr_sectors, vb->vq->num,
+           vb->vq->indirect ? ", indirect" : "", vb->vq->event_idx ? ", event idx" : "",
+           (vb->features & (1u << VIRTIO_BLK_F_FLUSH)) ? ", flush" : "");
+    return 0;
+
+    // never DRIVER_OK, so the device has not touched the rings. the
+    // IRQ handler stays: it serves every device on the line
+fail_queue:
+    kfree(vb->queue);
+fail_reqs:
+    virtblk_free_reqs(vb);
+    free_pages(virt_to_page(vb->bounce), VIRTBLK_BOUNCE_ORDER);
+fail_vq:
+    vring_free(vb->vq);
+fail:
+    port_byte_out(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+    kfree(vb);
+    return -1;
+}
+
+void virtio_blk_init(void)
+{
+    struct pci_dev pdev;
+
+    for (int nth = 0; nr_virtblk < VIRTBLK_MAX_DEVS &&
+         !pci_find_device(VIRTIO_PCI_VENDOR, VIRTIO_BLK_PCI_DEVICE, nth, &pdev); nth++) {
+        if (!(pdev.bar[0] & PCI_BAR_IO)) {
+            continue;
+        }
+        if (virtblk_probe(&pdev)) {
+            printk("virtio-blk: %x:%x.%x failed to initialise\n", pdev.bus, pdev.slot, pdev.func);
+        }
+    }
+}
@@ -0,0 +1,226 @@
+#include "virtio.h"
+#include "hardware.h"
+#include "system.h"
+#include "slab.h"
+#include "mm.h"
+#include "zone.h"
+#include "serial.h"
+
+/*
+ * split virtqueues for the legacy virtio PCI interface.
+ *
+ * Callers hold interrupts off around every call here; the rings are only
+ * shared with the device, never between two CPUs.
+ */
+
+static unsigned int vring_size(uint16_t num)
+{
+    unsigned int avail_end = 16 * num + 2 * (3 + num);
+
+    avail_end = (avail_end + VRING_ALIGN - 1) & ~(VRING_ALIGN - 1);
+    return avail_end + ((2 * 3 + 8 * num + VRING_ALIGN - 1) & ~(VRING_ALIGN - 1));
+}
+
+struct virtqueue *vring_setup(unsigned short iobase, uint16_t index, uint32_t features)
+{
+    struct virtqueue *vq;
+    struct page *page;
+    unsigned int order = 0;
+    uint8_t *base;
+    uint16_t num;
+
+    port_word_out(iobase + VIRTIO_PCI_QUEUE_SEL, index);
+    num = port_word_in(iobase + VIRTIO_PCI_QUEUE_NUM);
+    if (!num || port_dword_in(iobase + VIRTIO_PCI_QUEUE_PFN)) {
+        printk("virtio: queue %u unavailable\n", index);
+        return NULL;
+    }
+
+    while ((unsigned int)(PAGE_SIZE << order) < vring_size(num)) {
+        order++;
+    }
+
+    vq = (struct virtqueue *)kmalloc(sizeof(struct virtqueue), 0);
+    if (!vq) {
+        goto fail;
+    }
+    vq->data = (void **)kmalloc(num * sizeof(void *), 0);
+    if (!vq->data) {
+        goto fail_vq;
+    }
+    page = alloc_pages(0, order);
+    if (!page) {
+        goto fail_data;
+    }
+
+    base = (uint8_t *)page_address(page);
+    memset(base, 0, PAGE_SIZE << order);
+    memset(vq->data, 0, num * sizeof(void *));
+
+    vq->iobase = iobase;
+    vq->index = index;
+    vq->num = num;
+    vq->order = order;
+    vq->desc = (struct vring_desc *)base;
+    vq->avail = (struct vring_avail *)(base + 16 * num);
+    vq->used = (struct vring_used *)(base + ((16 * num + 2 * (3 + num) + VRING_ALIGN - 1) &
+                                             ~(VRING_ALIGN - 1)));
+
+    for (uint16_t i = 0; i < num - 1; i++) {
+        vq->desc[i].next = i + 1;
+    }
+    vq->free_head = 0;
+    vq->num_free = num;
+    vq->avail_idx = 0;
+    vq->num_added = 0;
+    vq->last_used_idx = 0;
+    vq->indirect = !!(features & (1u << VIRTIO_RING_F_INDIRECT_DESC));
+    vq->event_idx = !!(features & (1u << VIRTIO_RING_F_EVENT_IDX));
+
+    port_dword_out(iobase + VIRTIO_PCI_QUEUE_PFN, page_to_phys(page) >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+    return vq;
+
+fail_data:
+    kfree(vq->data);
+fail_vq:
+    kfree(vq);
+fail:
+    printk("virtio: no memory for a %u entry queue\n", num);
+    return NULL;
+}
+
+/* detach the rings from the device and free them */
+void vring_free(struct virtqueue *vq)
+{
+    port_word_out(vq->iobase + VIRTIO_PCI_QUEUE_SEL, vq->index);
+    port_dword_out(vq->iobase + VIRTIO_PCI_QUEUE_PFN, 0);
+    free_pages(virt_to_page(vq->desc), vq->order);
+    kfree(vq->data);
+    kfree(vq);
+}
+
+int virtqueue_add_buf(struct virtqueue *vq, struct vring_sg *sg, unsigned int nsg, void *data,
+                      struct vring_desc *indirect, uint32_t indirect_phys)
+{
+    uint16_t head, i, prev = 0;
+
+    if (!nsg || !vq->num_free) {
+        return -1;
+    }
+
+    head = vq->free_head;
+    if (vq->indirect && indirect && nsg > 1) {
+        for (i = 0; i < nsg; i++) {
+            indirect[i].addr = sg[i].addr;
+            indirect[i].len = sg[i].len;
+            indirect[i].flags = (sg[i].write ? VRING_DESC_F_WRITE : 0) |
+                                (i + 1u < nsg ? VRING_DESC_F_NEXT : 0);
+            indirect[i].next = i + 1;
+        }
+        vq->desc[head].addr = indirect_phys;
+        vq->desc[head].len = nsg * sizeof(struct vring_desc);
+        vq->desc[head].flags = VRING_DESC_F_INDIRECT;
+        vq->free_head = vq->desc[head].next;
+        vq->num_free--;
+    }
+    else {
+        if (vq->num_free < nsg) {
+            return -1;
+        }
+        i = head;
+        for (unsigned int n = 0; n < nsg; n++) {
+            vq->desc[i].addr = sg[n].addr;
+            vq->desc[i].len = sg[n].len;
+            vq->desc[i].flags = (sg[n].write ? VRING_DESC_F_WRITE : 0) |
+                                (n + 1 < nsg ? VRING_DESC_F_NEXT : 0);
+            prev = i;
+            i = vq->desc[i].next;
+        }
+        vq->free_head = vq->desc[prev].next;
+        vq->num_free -= nsg;
+    }
+
+    vq->data[head] = data;
+    vq->avail->ring[vq->avail_idx % vq->num] = head;
+
+    // descriptors before the index that makes them visible
+    wmb();
+    vq->avail_idx++;
+    vq->avail->idx = vq->avail_idx;
+    vq->num_added++;
+    return 0;
+}
+
+/* notify the device of everything added since the last kick, if it wants to hear */
+void virtqueue_kick(struct virtqueue *vq)
+{
+    uint16_t new_idx = vq->avail_idx;
+    uint16_t old = new_idx - vq->num_added;
+    int notify;
+
+    if (!vq->num_added) {
+        return;
+    }
+    vq->num_added = 0;
+
+    // our avail->idx store before reading what the device asked for
+    mb();
+    if (vq->event_idx) {
+        notify = vring_need_event(vring_avail_event(vq), new_idx, old);
+    }
+    else {
+        notify = !(vq->used->flags & VRING_USED_F_NO_NOTIFY);
+    }
+
+    if (notify) {
+        port_word_out(vq->iobase + VIRTIO_PCI_QUEUE_NOTIFY, vq->index);
+    }
+}
+
+static void vring_detach(struct virtqueue *vq, uint16_t head)
+{
+    uint16_t i = head;
+
+    vq->num_free++;
+    while (vq->desc[i].flags & VRING_DESC_F_NEXT) {
+        i = vq->desc[i].next;
+        vq->num_free++;
+    }
+    vq->desc[i].next = vq->free_head;
+    vq->free_head = head;
+}
+
+void *virtqueue_get_buf(struct virtqueue *vq, uint32_t *len)
+{
+    struct vring_used_elem *elem;
+    void *data;
+
+    if (vq->last_used_idx == vq->used->idx) {
+        return NULL;
+    }
+    // the index before the entry it covers
+    rmb();
+
+    elem = &vq->used->ring[vq->last_used_idx % vq->num];
+    data = vq->data[elem->id];
+    vq->data[elem->id] = NULL;
+    if (len) {
+        *len = elem->len;
+    }
+    vring_detach(vq, elem->id);
+    vq->last_used_idx++;
+    return data;
+}
+
+int virtqueue_enable_cb(struct virtqueue *vq)
+{
+    if (vq->event_idx) {
+        vring_used_event(vq) = vq->last_used_idx;
+    }
+    else {
+        vq->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+    }
+    // publish before looking for completions that raced with it
+    mb();
+    return vq->last_used_idx == vq->used->idx;
+}
@@ -0,0 +1,230 @@
+#include "bio.h"
+#include "blkdev.h"
+#include "slab.h"
+#include "mm.h"
+#include "disk.h"
+#include "serial.h"
+
+static kmem_cache_t *bio_cache;
+
+static void bio_cache_init(void)
+{
+    bio_cache = kmem_cache_create("bio", sizeof(struct bio),
+                                  KMALLOC_MINALIGN, SLAB_HWCACHE_ALIGN, NULL);
+    if (!bio_cache) {
+        printk("Failed to create bio cache\n");
+    }
+}
+
+struct bio *bio_alloc(void)
+{
+    struct bio *bio;
+
+    if (!bio_cache) {
+        bio_cache_init();
+    }
+
+    bio = (struct bio *)kmem_cache_alloc(bio_cache, 0);
+    if (!bio) {
+        return NULL;
+    }
+
+    bio->bi_dev = 0;
+    bio->bi_sector = 0;
+    bio->bi_rw = BIO_READ;
+    bio->bi_flags = 0;
+    bio->bi_vcnt = 0;
+    bio->bi_size = 0;
+    bio->bi_end_io = NULL;
+    bio->bi_private = NULL;
+    INIT_LIST_NULL(&bio->bi_list);
+
+    return bio;
+}
+
+void bio_put(struct bio *bio)
+{
+    if (bio) {
+        kmem_cache_free(bio_cache, bio);
+    }
+}
+
+/*
+ * append a page segment. Segments that continue the previous one in the
+ * same page are folded into it. returns -1 once bi_io_vec is full.
+ */
+int bio_add_page(struct bio *bio, struct page *page, unsigned int len, unsigned int offset)
+{
+    struct bio_vec *prev = NULL;
+
+    if (bio->bi_vcnt) {
+        prev = &bio->bi_io_vec[bio->bi_vcnt - 1];
+        if (prev->bv_page == page && prev->bv_offset + prev->bv_len == offset) {
+            prev->bv_len += len;
+            bio->bi_size += len;
+            return 0;
+        }
+    }
+
+    if (bio->bi_vcnt == BIO_MAX_VECS) {
+        return -1;
+    }
+
+    bio->bi_io_vec[bio->bi_vcnt].bv_page = page;
+    bio->bi_io_vec[bio->bi_vcnt].bv_len = len;
+    bio->bi_io_vec[bio->bi_vcnt].bv_offset = offset;
+    bio->bi_vcnt++;
+    bio->bi_size += len;
+    return 0;
+}
+
+/* add a kernel virtual buffer, split wherever it crosses a page */
+int bio_add_buf(struct bio *bio, void *buf, unsigned int len)
+{
+    uint8_t *p = (uint8_t *)buf;
+
+    while (len) {
+        unsigned int offset = (unsigned long)p % PAGE_SIZE;
+        unsigned int chunk = PAGE_SIZE - offset;
+        if (chunk > len) {
+            chunk = len;
+        }
+        if (bio_add_page(bio, virt_to_page(p), chunk, offset)) {
+            return -1;
+        }
+        p += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+void submit_bio(int rw, struct bio *bio)
+{
+    bio->bi_rw = rw;
+    CLEAR_FLAG(bio->bi_flags, BIO_uptodate | BIO_done);
+
+    generic_make_request(bio);
+}
+
+/* submit and sleep until the driver completes the bio */
+int submit_bio_wait(int rw, struct bio *bio)
+{
+    struct request_queue *q;
+
+    submit_bio(rw, bio);
+
+    /* a plugged queue would hold the bio forever; kick it */
+    q = blk_get_queue(bio->bi_dev);
+    if (q) {
+        blk_run_queue(q);
+    }
+
+    while (!IS_FLAG(*(volatile unsigned short *)&bio->bi_flags, BIO_done)) {
+        //sleep (event bio completes)
+        blk_wait_completion(q);
+    }
+
+    return IS_FLAG(bio->bi_flags, BIO_uptodate) ? 0 : -1;
+}
+
+/* called once every segment of the bio has been moved, in process context */
+void bio_endio(struct bio *bio, int error)
+{
+    if (!error) {
+        SET_FLAG(bio->bi_flags, BIO_uptodate);
+    }
+    SET_FLAG(bio->bi_flags, BIO_done);
+
+    if (bio->bi_end_io) {
+        bio->bi_end_io(bio, error);
+    }
+}
+
+/*
+ * make everything the device has completed so far durable. Issued for
+ * fsync and other barriers only; plain writes may stay in the drive's
+ * write cache.
+ */
+int blkdev_issue_flush(unsigned short dev)
+{
+    int iRet = 0;
+    struct bio *bio = bio_alloc();
+    if (!bio) {
+        printk("blkdev_issue_flush: failed bio_alloc\n");
+        return -1;
+    }
+
+    bio->bi_dev = dev;
+    SET_FLAG(bio->bi_flags, BIO_flush);
+    iRet = submit_bio_wait(BIO_WRITE, bio);
+    bio_put(bio);
+    return iRet;
+}
+
+int bio_rw_buf(unsigned short dev, int rw, uint32_t sector, void *buf, unsigned int len)
+{
+    int iRet = 0;
+    struct bio *bio = bio_alloc();
+    if (!bio) {
+        printk("bio_rw_buf: failed bio_alloc\n");
+        return -1;
+    }
+
+    bio->bi_dev = dev;
+    bio->bi_sector = sector;
+    if (bio_add_buf(bio, buf, len)) {
+        printk("bio_rw_buf: %u bytes do not fit in one bio\n", len);
+        bio_put(bio);
+        return -1;
+    }
+
+    iRet = submit_bio_wait(rw, bio);
+    bio_put(bio);
+    return iRet;
+}
+
+static void end_bio_nowait(struct bio *bio, int error)
+{
+    if (error) {
+        printk("write-behind of sector %u on dev %u failed\n",
+               bio->bi_sector, bio->bi_dev);
+    }
+    kfree(bio->bi_private);
+    bio_put(bio);
+}
+
+/*
+ * queue a write of a private copy of buf and return without waiting.
+ * Used under blk_plug() so that a burst of small writes can be merged
+ * by the elevator; errors are only logged.
+ */
+int bio_write_buf_nowait(unsigned short dev, uint32_t sector, void *buf, unsigned int len)
+{
+    void *copy;
+    struct bio *bio = bio_alloc();
+    if (!bio) {
+        printk("bio_write_buf_nowait: failed bio_alloc\n");
+        return -1;
+    }
+
+    copy = kmalloc(len, 0);
+    if (!copy) {
+        bio_put(bio);
+        return bio_rw_buf(dev, BIO_WRITE, sector, buf, len);
+    }
+    memcpy(copy, buf, len);
+
+    bio->bi_dev = dev;
+    bio->bi_sector = sector;
+    bio->bi_end_io = end_bio_nowait;
+    bio->bi_private = copy;
+    if (bio_add_buf(bio, copy, len)) {
+        printk("bio_write_buf_nowait: %u bytes do not fit in one bio\n", len);
+        kfree(copy);
+        bio_put(bio);
+        return -1;
+    }
+
+    submit_bio(BIO_WRITE, bio);
+    return 0;
+}
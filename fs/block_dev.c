@@ -0,0 +1,183 @@
+#include "blkdev.h"
+#include "bio.h"
+#include "buffer.h"
+#include "disk.h"
+#include "serial.h"
+#include "timer.h"
+
+/*
+ * registry of block devices. Drivers embed a struct block_device in
+ * their per-disk state, fill in dev_t, name, queue and capacity, and
+ * register it; everything above the block layer then finds the device
+ * (and its queue and block size) by dev_t.
+ */
+
+dev_t ROOT_DEV;
+
+static struct block_device *bdevs[MAX_BLKDEV];
+
+int register_blkdev(struct block_device *bdev)
+{
+    int free = -1;
+
+    if (!bdev->bd_dev || !bdev->bd_queue) {
+        printk("register_blkdev: %s has no device number or queue\n", bdev->bd_name);
+        return -1;
+    }
+
+    for (int i = 0; i < MAX_BLKDEV; i++) {
+        if (bdevs[i] && bdevs[i]->bd_dev == bdev->bd_dev) {
+            printk("register_blkdev: %u:%u already registered\n",
+                   MAJOR(bdev->bd_dev), MINOR(bdev->bd_dev));
+            return -1;
+        }
+        if (!bdevs[i] && free < 0) {
+            free = i;
+        }
+    }
+    if (free < 0) {
+        printk("register_blkdev: no room for %s\n", bdev->bd_name);
+        return -1;
+    }
+
+    if (!bdev->bd_block_size) {
+        bdev->bd_block_size = BLKDEV_DEFAULT_BLOCK_SIZE;
+    }
+    bdev->bd_openers = 0;
+    if (!bdev->bd_contains) {
+        bdev->bd_contains = bdev;
+    }
+    bdevs[free] = bdev;
+
+    // the queue and the root device belong to the whole disk
+    if (bdev->bd_contains == bdev) {
+        bdev->bd_queue->nr_sectors = bdev->bd_nr_sectors;
+        if (!ROOT_DEV) {
+            ROOT_DEV = bdev->bd_dev;
+        }
+    }
+    printk("blkdev: %s is %u:%u, %u sectors\n", bdev->bd_name,
+           MAJOR(bdev->bd_dev), MINOR(bdev->bd_dev), bdev->bd_nr_sectors);
+    return 0;
+}
+
+void unregister_blkdev(struct block_device *bdev)
+{
+    int i = blkdev_index(bdev->bd_dev);
+
+    if (i >= 0) {
+        bdevs[i] = NULL;
+    }
+    if (ROOT_DEV == bdev->bd_dev) {
+        ROOT_DEV = 0;
+    }
+}
+
+int blkdev_index(dev_t dev)
+{
+    for (int i = 0; i < MAX_BLKDEV; i++) {
+        if (bdevs[i] && bdevs[i]->bd_dev == dev) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+struct block_device *blkdev_at(int index)
+{
+    if (index < 0 || index >= MAX_BLKDEV) {
+        return NULL;
+    }
+    return bdevs[index];
+}
+
+struct block_device *bdget(dev_t dev)
+{
+    return blkdev_at(blkdev_index(dev));
+}
+
+struct block_device *blkdev_get(dev_t dev, int mode)
+{
+    struct block_device *bdev = bdget(dev);
+
+    if (!bdev) {
+        printk("blkdev_get: no device %u:%u\n", MAJOR(dev), MINOR(dev));
+        return NULL;
+    }
+    if (bdev->bd_ops && bdev->bd_ops->open && bdev->bd_ops->open(bdev, mode)) {
+        return NULL;
+    }
+    bdev->bd_openers++;
+    return bdev;
+}
+
+/* the last close pushes the drive's write cache out */
+void blkdev_put(struct block_device *bdev)
+{
+    if (!bdev || !bdev->bd_openers) {
+        return;
+    }
+    if (--bdev->bd_openers) {
+        return;
+    }
+    blkdev_issue_flush(bdev->bd_dev);
+    if (bdev->bd_ops && bdev->bd_ops->release) {
+        bdev->bd_ops->release(bdev);
+    }
+}
+
+/*
+ * block size the buffer cache uses on this device: a power of two from
+ * one sector up to a buffer slot. Set it before any block is cached.
+ */
+int set_blocksize(struct block_device *bdev, unsigned int size)
+{
+    if (size < DISK_SECTOR_SIZE || size > BUFFER_SIZE || (size & (size - 1))) {
+        printk("set_blocksize: %u bytes not supported on %s\n", size, bdev->bd_name);
+        return -1;
+    }
+    bdev->bd_block_size = size;
+    return 0;
+}
+
+static unsigned long stat_ms(unsigned long long cycles)
+{
+    return tsc_to_us(cycles) / 1000;
+}
+
+/*
+ * major minor name, then reads: ios merges sectors ms, writes: ios
+ * merges sectors ms, then in_flight io_ms weighted_ms flushes
+ */
+void diskstats_show(void)
+{
+    for (int i = 0; i < MAX_BLKDEV; i++) {
+        struct block_device *bdev = bdevs[i];
+        struct disk_stats *st;
+        unsigned long flags;
+
+        if (!bdev || bdev->bd_contains != bdev) {
+            continue;
+        }
+        st = &bdev->bd_queue->stats;
+
+        // account the time since the last in_flight change
+        local_irq_save(flags);
+        if (st->in_flight) {
+            unsigned long long now = rdtsc();
+
+            st->io_ticks += now - st->stamp;
+            st->time_in_queue += (now - st->stamp) * st->in_flight;
+            st->stamp = now;
+        }
+        local_irq_restore(flags);
+
+        printk("%u %u %s %lu %lu %lu %lu %lu %lu %lu %lu %u %lu %lu %lu\n",
+               MAJOR(bdev->bd_dev), MINOR(bdev->bd_dev), bdev->bd_name,
+               st->ios[BIO_READ], st->merges[BIO_READ], st->sectors[BIO_READ],
+               stat_ms(st->ticks[BIO_READ]),
+               st->ios[BIO_WRITE], st->merges[BIO_WRITE], st->sectors[BIO_WRITE],
+               stat_ms(st->ticks[BIO_WRITE]),
+               st->in_flight, stat_ms(st->io_ticks), stat_ms(st->time_in_queue), st->flushes);
+    }
+}
@@ -4,22 +4,80 @@
 #include "serial.h"
 #include "disk.h"
 #include "buffer.h"
+#include "bio.h"
+#include "blkdev.h"
 
-#define BUFFERS 100
-#define BUFFER_SIZE 1024
 kmem_cache_t *bcache;
 struct buffer_cache buffer_cache;
+struct bcache_stats bstats[NR_BSTAT_DEV];
 
 struct buffer_head *search_hash(unsigned short dev_no, unsigned long blocknr);
 
 void test_bcache(void);
+static int buffer_rw(int rw, unsigned short bio_flags, struct buffer_head *bh);
+
+/*
+ * hand out one BUFFER_SIZE slot from a buffer page, pulling a fresh
+ * page from the buddy allocator when every page we own is full
+ */
+static char *alloc_buffer_data(struct buffer_head *bh)
+{
+    struct page *page = NULL;
+    int slot = 0;
+
+    if (list_is_empty(&buffer_cache.b_pages)) {
+        page = alloc_pages(0, 0);
+        if (!page) {
+            return NULL;
+        }
+        SET_FLAG(page->flags, PG_FLAG_buffer);
+        page->private = 0;
+        list_add(&buffer_cache.b_pages, &page->lru);
+        buffer_cache.b_nr_pages++;
+    }
+    page = list_first_entry(&buffer_cache.b_pages, struct page, lru);
+
+    while (page->private & (1 << slot)) {
+        slot++;
+    }
+    page->private |= (1 << slot);
+    if (page->private == (1 << BUFFERS_PER_PAGE) - 1) {
+        list_del(&page->lru); //page is full
+    }
+
+    bh->b_page = page;
+    return (char *)page_address(page) + slot * BUFFER_SIZE;
+}
+
+/* returns 1 if this gave the whole page back to the buddy allocator */
+static int free_buffer_data(struct buffer_head *bh)
+{
+    struct page *page = bh->b_page;
+    int slot = (bh->b_data - (char *)page_address(page)) / BUFFER_SIZE;
+
+    if (page->private == (1 << BUFFERS_PER_PAGE) - 1) {
+        list_add(&buffer_cache.b_pages, &page->lru); //full page gets a hole
+    }
+    page->private &= ~(1 << slot);
+    bh->b_data = NULL;
+    bh->b_page = NULL;
+
+    if (page->private) {
+        return 0;
+    }
+    list_del(&page->lru);
+    CLEAR_FLAG(page->flags, PG_FLAG_buffer);
+    free_pages(page, 0);
+    buffer_cache.b_nr_pages--;
+    return 1;
+}
 
 void binit(struct buffer_head *bhead, unsigned short b_dev, unsigned long blocknr)
 {
     bhead->flags = 0;
-    bhead->b_data = kmalloc(BUFFER_SIZE, 0);
+    bhead->b_data = alloc_buffer_data(bhead);
     if (!bhead->b_data) {
-        printk("failed buffer_head kmalloc\n");
+        printk("failed buffer_head data page\n");
         return;
     }
     bhead->b_dev = b_dev;
@@ -32,7 +90,7 @@ void binit(struct buffer_head *bhead, unsigned short b_dev, unsigned long blockn
 void display_buffer_cache(void) 
 {
     int iCnt = 0;
-    for (; iCnt < DEV_NO; iCnt++) {
+    for (; iCnt < NR_HASH; iCnt++) {
         struct list_head *run;
         struct buffer_head *bh;
         printk("================ b_hash %d=================\n", iCnt);
@@ -44,6 +102,184 @@ void display_buffer_cache(void)
     }
 }
 
+/*
+ * grow while under the RAM share and the zone is comfortably above its
+ * low watermark; past that getblk() recycles instead of allocating
+ */
+static int buffer_can_grow(void)
+{
+    if (buffer_cache.b_nr_buffers >= buffer_cache.b_max_buffers) {
+        return 0;
+    }
+    if (!list_is_empty(&buffer_cache.b_pages)) {
+        return 1; //a partly used page still has a slot
+    }
+    return zone.free_pages > zone.pages_low * 2;
+}
+
+static struct buffer_head *alloc_buffer(unsigned short b_dev, unsigned long blocknr)
+{
+    struct buffer_head *bh = kmem_cache_alloc(bcache, 0);
+    if (!bh) {
+        return NULL;
+    }
+    binit(bh, b_dev, blocknr);
+    if (!bh->b_data) {
+        kmem_cache_free(bcache, bh);
+        return NULL;
+    }
+    buffer_cache.b_nr_buffers++;
+    buffer_cache.b_kin = buffer_cache.b_nr_buffers / 4;
+    return bh;
+}
+
+static void free_buffer(struct buffer_head *bh, int *pages_freed)
+{
+    list_del(&bh->b_free);
+    list_del(&bh->b_hash);
+    if (!IS_FLAG(bh->flags, BH_hot)) {
+        buffer_cache.b_nr_cold--;
+    }
+    *pages_freed += free_buffer_data(bh);
+    kmem_cache_free(bcache, bh);
+    buffer_cache.b_nr_buffers--;
+    buffer_cache.b_kin = buffer_cache.b_nr_buffers / 4;
+}
+
+static void shrink_queue(struct list_head *queue, int nr_pages, int *pages_freed)
+{
+    struct list_head *run;
+    struct buffer_head *bh;
+
+    list_for_each_del(run, queue) {
+        if (*pages_freed >= nr_pages ||
+                buffer_cache.b_nr_buffers <= BUFFERS_MIN) {
+            return;
+        }
+        bh = list_entry(run, struct buffer_head, b_free);
+        if (IS_FLAG(bh->flags, BH_lock)) {
+            continue; //a cold buffer in use keeps its place on A1in
+        }
+        if (IS_FLAG(bh->flags, BH_dirty) || IS_FLAG(bh->flags, BH_delay)) {
+            continue; //never drop data that hasn't reached the disk
+        }
+        free_buffer(bh, pages_freed);
+    }
+}
+
+/*
+ * shrinker callback: drop clean free buffers, cold queue first, until
+ * nr_pages whole pages went back to the buddy allocator
+ */
+int shrink_buffer_cache(int nr_pages)
+{
+    int pages_freed = 0;
+    unsigned long flags;
+
+    // the allocator may call in with interrupts already off
+    local_irq_save(flags);
+    shrink_queue(&buffer_cache.b_cold, nr_pages, &pages_freed);
+    shrink_queue(&buffer_cache.b_hot, nr_pages, &pages_freed);
+    local_irq_restore(flags);
+
+    return pages_freed;
+}
+
+static struct shrinker buffer_shrinker = {
+    .shrink = shrink_buffer_cache,
+};
+
+struct bcache_stats *bcache_stats(unsigned short dev_no)
+{
+    int index = blkdev_index(dev_no);
+
+    if (index < 0) {
+        return NULL;
+    }
+    return &bstats[index];
+}
+
+void display_bcache_stats(void)
+{
+    int iCnt = 0;
+    printk("================ bcache stats =================\n");
+    printk("buffers %u / %u in %u pages, cold %u / kin %u\n",
+            buffer_cache.b_nr_buffers, buffer_cache.b_max_buffers,
+            buffer_cache.b_nr_pages, buffer_cache.b_nr_cold, buffer_cache.b_kin);
+    for (; iCnt < NR_BSTAT_DEV; iCnt++) {
+        struct bcache_stats *st = &bstats[iCnt];
+        unsigned long lookups = st->hits + st->misses;
+        if (!lookups) {
+            continue;
+        }
+        printk("%s: hits %lu misses %lu evictions %lu ghost hits %lu hit rate %lu%%\n",
+                blkdev_at(iCnt) ? blkdev_at(iCnt)->bd_name : "?", st->hits, st->misses, st->evictions, st->ghost_hits,
+                (st->hits * 100) / lookups);
+    }
+}
+
+/*
+ * A1out bookkeeping. The ring only remembers which blocks were pushed out
+ * of the cold queue, it never holds data.
+ */
+static void ghost_remember(struct buffer_head *bh)
+{
+    struct bghost *g = &buffer_cache.b_ghost[buffer_cache.b_ghost_next];
+    g->dev = bh->b_dev;
+    g->blocknr = bh->b_blocknr;
+    g->valid = 1;
+    buffer_cache.b_ghost_next = (buffer_cache.b_ghost_next + 1) % BGHOST_SIZE;
+}
+
+static int ghost_forget(unsigned short dev_no, unsigned long blocknr)
+{
+    int iCnt = 0;
+    for (; iCnt < BGHOST_SIZE; iCnt++) {
+        struct bghost *g = &buffer_cache.b_ghost[iCnt];
+        if (g->valid && g->dev == dev_no && g->blocknr == blocknr) {
+            g->valid = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* the oldest cold buffer nobody is using */
+static struct buffer_head *oldest_cold(void)
+{
+    struct list_head *run;
+    struct buffer_head *bh;
+
+    list_for_each(run, &buffer_cache.b_cold) {
+        bh = list_entry(run, struct buffer_head, b_free);
+        if (!IS_FLAG(bh->flags, BH_lock)) {
+            return bh;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * pick the buffer to reuse on a miss: the oldest cold buffer while the
+ * cold queue is over its share (or nothing is hot), else the LRU hot one.
+ */
+static struct buffer_head *select_victim(void)
+{
+    struct buffer_head *bh = NULL;
+
+    if (buffer_cache.b_nr_cold > buffer_cache.b_kin ||
+            list_is_empty(&buffer_cache.b_hot)) {
+        bh = oldest_cold();
+    }
+    if (!bh && !list_is_empty(&buffer_cache.b_hot)) {
+        bh = list_first_entry(&buffer_cache.b_hot, struct buffer_head, b_free);
+    }
+    if (!bh) {
+        bh = oldest_cold();
+    }
+    return bh;
+}
+
 void create_buffer_cache(void) 
 {
     bcache = kmem_cache_create("buffer_head", sizeof(struct buffer_head), KMALLOC_MINALIGN, SLAB_HWCACHE_ALIGN, NULL);
@@ -54,25 +290,39 @@ void create_buffer_cache(void)
 
 
     int iCnt = 0;
-    for (; iCnt < DEV_NO; iCnt++) {
+    for (; iCnt < NR_HASH; iCnt++) {
         INIT_LIST_HEAD(&buffer_cache.b_hash[iCnt]);
     }
-    INIT_LIST_HEAD(&buffer_cache.b_free);
+    INIT_LIST_HEAD(&buffer_cache.b_cold);
+    INIT_LIST_HEAD(&buffer_cache.b_hot);
+    buffer_cache.b_nr_cold = 0;
+    buffer_cache.b_kin = 0;
+    buffer_cache.b_ghost_next = 0;
+    INIT_LIST_HEAD(&buffer_cache.b_pages);
+    buffer_cache.b_nr_pages = 0;
+    buffer_cache.b_nr_buffers = 0;
+    buffer_cache.b_max_buffers = (zone.present_pages / BCACHE_RAM_SHARE) * BUFFERS_PER_PAGE;
+    if (buffer_cache.b_max_buffers < BUFFERS_MIN) {
+        buffer_cache.b_max_buffers = BUFFERS_MIN;
+    }
+    memset(buffer_cache.b_ghost, 0, sizeof(buffer_cache.b_ghost));
+    memset(bstats, 0, sizeof(bstats));
 
     struct buffer_head *tmp = NULL;
-    for (iCnt = 0; iCnt < BUFFERS; iCnt++) {
-        tmp = kmem_cache_alloc(bcache, 0); 
+    for (iCnt = 0; iCnt < BUFFERS_MIN; iCnt++) {
+        tmp = alloc_buffer(ROOT_DEV, iCnt);
         if (!tmp) {
             printk("failed allocating buffer_head for %d\n", iCnt);
             break;
         }
-       
-        binit(tmp, DEV_NO, iCnt);
+
         /*
          * add to correct hash list and also to freelist */
-        list_add(&buffer_cache.b_hash[hash_fn(iCnt, DEV_NO)], &tmp->b_hash);
-        list_add(&buffer_cache.b_free, &tmp->b_free);
+        list_add(&buffer_cache.b_hash[hash_fn(iCnt, ROOT_DEV)], &tmp->b_hash);
+        list_add(&buffer_cache.b_cold, &tmp->b_free);
+        buffer_cache.b_nr_cold++;
     }
+    register_shrinker(&buffer_shrinker);
     printk("size of buffer_head is %d\n", sizeof(struct buffer_head));
 
     printk("displaying buffer cache................\n");
@@ -111,7 +361,7 @@ static inline struct buffer_head *unlocked_buffer(struct buffer_head *bh)
 struct buffer_head *getblk(unsigned short dev_no, unsigned long blocknr)
 {
     struct buffer_head *bh = NULL;
-    struct list_head *run = NULL;
+    struct bcache_stats *st = bcache_stats(dev_no);
     printk("inside getblk \n");
     while (1) {
         bh = search_hash(dev_no, blocknr);
@@ -123,19 +373,34 @@ struct buffer_head *getblk(unsigned short dev_no, unsigned long blocknr)
                 continue;
             }
             printk("getblk scenario 1\n");
-            list_del(&bh->b_free); //remove from the free list
+            if (st) {
+                if (IS_FLAG(bh->flags, BH_uptodate)) {
+                    st->hits++;
+                }
+                else {
+                    st->misses++;
+                }
+            }
+            if (IS_FLAG(bh->flags, BH_hot)) {
+                list_del(&bh->b_free); //remove from the free list
+            }
+            //a cold buffer stays put: A1in is a FIFO from when it was loaded
             return locked_buffer(bh);
         }
         else { //block is not on hash queue
             printk("block not on hash queue\n");
-            if (list_is_empty(&buffer_cache.b_free)) { //scenario 4
+            if (buffer_can_grow() && (bh = alloc_buffer(dev_no, blocknr))) {
+                printk("getblk grew pool to %d\n", buffer_cache.b_nr_buffers);
+                goto assign;
+            }
+            /*
+             * remove the 2Q victim from its free list */
+            bh = select_victim();
+            if (!bh) { //scenario 4
                 //sleep till any buffer doesn't become free
                 printk("getblk scenario 4\n");
                 continue; //to avoid race conditions 
             }
-            /*
-             * remove the first free buffer from free list */
-            bh = list_first_entry(&buffer_cache.b_free, struct buffer_head, b_free);
             list_del(&bh->b_free);
 
             if (IS_FLAG(bh->flags, BH_delay)) { //scenario 3 marked for delayed write
@@ -143,9 +408,14 @@ struct buffer_head *getblk(unsigned short dev_no, unsigned long blocknr)
                 //For async write ig we should use interrupt driven i/o
                 //put the write block in queue, it gets scheduled accordingly
                 //and raises an interrupt when completed
-                disk_write_blk(bh->b_blocknr, bh->b_data);
+                buffer_rw(BIO_WRITE, 0, bh);
                 CLEAR_FLAG(bh->flags, BH_delay);
-                list_add(&buffer_cache.b_free, &bh->b_free);
+                if (IS_FLAG(bh->flags, BH_hot)) {
+                    list_add(&buffer_cache.b_hot, &bh->b_free);
+                }
+                else {
+                    list_add(&buffer_cache.b_cold, &bh->b_free);
+                }
                 continue; 
             }
 
@@ -154,12 +424,45 @@ struct buffer_head *getblk(unsigned short dev_no, unsigned long blocknr)
             //scenario 2 -- found a free buffer, use it 
             //remove the buffer from the old hash queue
 
-            list_del(&bh->b_hash);
+            if (IS_FLAG(bh->flags, BH_uptodate)) {
+                struct bcache_stats *old = bcache_stats(bh->b_dev);
+                if (old) {
+                    old->evictions++;
+                }
+            }
+            if (IS_FLAG(bh->flags, BH_hot)) {
+                CLEAR_FLAG(bh->flags, BH_hot);
+            }
+            else {
+                if (IS_FLAG(bh->flags, BH_uptodate)) {
+                    ghost_remember(bh);
+                }
+                buffer_cache.b_nr_cold--;
+            }
 
+            list_del(&bh->b_hash);
+assign:
             bh->b_dev = dev_no;
             bh->b_blocknr = blocknr;
+            CLEAR_FLAG(bh->flags, BH_uptodate | BH_dirty | BH_old);
+
+            /* seen recently enough to still be in A1out: straight to Am */
+            if (ghost_forget(dev_no, blocknr)) {
+                SET_FLAG(bh->flags, BH_hot);
+                if (st) {
+                    st->ghost_hits++;
+                }
+            }
+            else {
+                //the one time a buffer enters A1in
+                list_add_tail(&buffer_cache.b_cold, &bh->b_free);
+                buffer_cache.b_nr_cold++;
+            }
+            if (st) {
+                st->misses++;
+            }
 
-            list_add(&buffer_cache.b_hash[hash_fn(dev_no, blocknr)], &bh->b_hash);
+            list_add(&buffer_cache.b_hash[hash_fn(blocknr, dev_no)], &bh->b_hash);
             
             return locked_buffer(bh);
         }
@@ -178,17 +481,72 @@ void brelse(struct buffer_head *bh)
      */
     asm volatile ("cli");
 
-    if ( !IS_FLAG(bh->flags, BH_dirty) && !IS_FLAG(bh->flags, BH_old)) {
-        list_add_tail(&buffer_cache.b_free, &bh->b_free);
-    }
-    else {
-        list_add(&buffer_cache.b_free, &bh->b_free);
+    /*
+     * hot buffers go to the MRU end of Am. cold ones never left A1in:
+     * they keep the place they got when they were loaded.
+     */
+    if (IS_FLAG(bh->flags, BH_hot)) {
+        if ( !IS_FLAG(bh->flags, BH_dirty) && !IS_FLAG(bh->flags, BH_old)) {
+            list_add_tail(&buffer_cache.b_hot, &bh->b_free);
+        }
+        else {
+            list_add(&buffer_cache.b_hot, &bh->b_free);
+        }
     }
 
     asm volatile ("sti");
     unlocked_buffer(bh);
 }
 
+static void end_buffer_io(struct bio *bio, int error)
+{
+    struct buffer_head *bh = (struct buffer_head *)bio->bi_private;
+
+    if (error) {
+        printk("buffer I/O error on block %lu\n", bh->b_blocknr);
+        CLEAR_FLAG(bh->flags, BH_uptodate);
+        return;
+    }
+    SET_FLAG(bh->flags, BH_uptodate);
+    if (bio->bi_rw == BIO_WRITE) {
+        CLEAR_FLAG(bh->flags, BH_dirty | BH_delay);
+    }
+}
+
+/*
+ * move one buffer to/from its device. A buffer holds one block of the
+ * device's block size, so block n starts at sector n * (size / sector).
+ * bio_flags: BIO_flush and/or BIO_fua for a write at a commit point.
+ */
+static int buffer_rw(int rw, unsigned short bio_flags, struct buffer_head *bh)
+{
+    int iRet = 0;
+    struct block_device *bdev = bdget(bh->b_dev);
+    struct bio *bio;
+
+    if (!bdev) {
+        printk("buffer_rw: no device %u for block %lu\n", bh->b_dev, bh->b_blocknr);
+        return -1;
+    }
+    bio = bio_alloc();
+    if (!bio) {
+        printk("failed bio_alloc for block %lu\n", bh->b_blocknr);
+        return -1;
+    }
+
+    bio->bi_dev = bh->b_dev;
+    bio->bi_sector = bh->b_blocknr * (bdev->bd_block_size / DISK_SECTOR_SIZE);
+    bio->bi_flags |= bio_flags;
+    bio->bi_end_io = end_buffer_io;
+    bio->bi_private = bh;
+    bio_add_page(bio, bh->b_page, bdev->bd_block_size,
+            bh->b_data - (char *)page_address(bh->b_page));
+
+    iRet = submit_bio_wait(rw, bio);
+    bio_put(bio);
+    return iRet;
+}
+
 struct buffer_head *bread(unsigned short dev_no, unsigned long blocknr)
 {
     printk("invoed bread for blocknr %d\n", blocknr);
@@ -196,7 +554,7 @@ struct buffer_head *bread(unsigned short dev_no, unsigned long blocknr)
     //check is buffer is valid
     
     printk("invoed bread 2 \n");
-    if (IS_FLAG(bh->flags, BH_dirty)) {
+    if (IS_FLAG(bh->flags, BH_uptodate) || IS_FLAG(bh->flags, BH_dirty)) {
         return bh;
     }
 
@@ -205,7 +563,10 @@ struct buffer_head *bread(unsigned short dev_no, unsigned long blocknr)
      * initiate disk read and sleep till then   
      */
     printk("invoking disk_read inside bread\n");
-    disk_read(bh->b_blocknr, bh->b_data);
+    if (buffer_rw(BIO_READ, 0, bh)) {
+        brelse(bh);
+        return NULL;
+    }
     printk("invoking disk_read compledted bread\n");
     return bh;
 }
@@ -213,7 +574,7 @@ struct buffer_head *bread(unsigned short dev_no, unsigned long blocknr)
 
 void bwrite(struct buffer_head *bh)
 {
-    disk_write(bh->b_blocknr, bh->b_data, BUFFER_SIZE);
+    buffer_rw(BIO_WRITE, 0, bh);
     /*
      * if I/O is synchronous 
      *      sleep(event I/O completes)
@@ -227,19 +588,50 @@ void bwrite(struct buffer_head *bh)
     brelse(bh);
 }
 
+/*
+ * the block was changed in memory: it reaches the disk when the buffer
+ * is reused (delayed write) or when its owner writes it out
+ */
+void mark_buffer_dirty(struct buffer_head *bh)
+{
+    SET_FLAG(bh->flags, BH_dirty | BH_delay);
+}
+
+/* write bh out if it is dirty; unlike bwrite() the caller keeps it */
+int write_dirty_buffer(struct buffer_head *bh)
+{
+    if (!IS_FLAG(bh->flags, BH_dirty)) {
+        return 0;
+    }
+    return buffer_rw(BIO_WRITE, 0, bh);
+}
+
+/*
+ * write bh as a commit record: everything the device completed before
+ * it is made durable first, and bh itself is on the media when this
+ * returns. The caller keeps its reference.
+ */
+int sync_dirty_buffer(struct buffer_head *bh)
+{
+    if (!IS_FLAG(bh->flags, BH_dirty)) {
+        return 0;
+    }
+    return buffer_rw(BIO_WRITE, BIO_flush | BIO_fua, bh);
+}
+
 void test_disk_block(void)
 {
     uint8_t buffer[BUFFER_SIZE];
     memset(buffer, 0, BUFFER_SIZE);
 
-    disk_read(16, buffer);
+    disk_read(16 * BLOCK_SECTORS, buffer);
     printk("disk content %s\n", buffer);
 
 }
 void test_bcache(void)
 {
     printk("testing buffer cache .............\n");
-    struct buffer_head *bh = getblk(DEV_NO, 16);
+    struct buffer_head *bh = getblk(ROOT_DEV, 16);
     if (!bh) {
         printk(" getblk failed \n");
         return ;
@@ -256,18 +648,26 @@ void test_bcache(void)
     
     printk("bwrite completed\n");
 
+    /* drop the cached copy so bread below goes back to the disk */
+    CLEAR_FLAG(bh->flags, BH_uptodate);
     memset(bh->b_data, 0, BUFFER_SIZE);
 
     struct buffer_head *tmp = NULL;
 
     printk("invoking bread\n");
-    tmp = bread(DEV_NO, 16); 
+    tmp = bread(ROOT_DEV, 16); 
 
+    if (!tmp) {
+        printk(" bread failed \n");
+        return ;
+    }
     printk("bread completed\n");
     printk("buffer content %s\n", tmp->b_data);
 
     brelse(tmp);
 
+    display_bcache_stats();
+
     /* test_disk_block(); */
 
 }
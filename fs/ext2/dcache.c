@@ -3,10 +3,33 @@
 #include "string.h"
 #include "serial.h"
 
+/*
+ * Dentries stay in the hash table after their last reference is put, on
+ * the unused list in least recently used order, until they are pruned.
+ * That includes negative dentries (no inode): a name looked up and not
+ * found is remembered, so the next lookup of it fails without asking
+ * the filesystem. Creating or renaming something onto a name drops the
+ * negative dentries for it.
+ *
+ * Path walks read the hash chains with no lock and no reference (see
+ * __d_lookup_rcu()), so changes to a dentry a walker may be looking at
+ * go through its d_seq, and a dentry is published on a chain only once
+ * it is fully set up. One leaving a chain keeps its next pointer, which
+ * leads a walker standing on it back into some chain, and from there to
+ * a hash table head.
+ */
+
 /* Dentry cache hash table */
 static struct list_head dentry_hashtable[DENTRY_HASH_SIZE];
 static kmem_cache_t *dentry_cache;
 
+/* unused dentries, most recently used first */
+static LIST_HEAD(dentry_unused);
+static unsigned int nr_unused;
+
+/* bumped around every d_move(), which can change any path below the dentry */
+seqcount_t rename_seq = SEQCNT_ZERO;
+
 /* Simple hash function for dentry cache */
 static inline unsigned int d_hash(struct dentry *parent, const char *name)
 {
@@ -45,21 +68,86 @@ void dcache_init(void)
     printk("Dentry cache initialized\n");
 }
 
+static inline int d_hash_is_head(struct list_head *node)
+{
+    return node >= dentry_hashtable && node < dentry_hashtable + DENTRY_HASH_SIZE;
+}
+
+/* Free a dentry that is unhashed and unused, and put its parent */
+static void d_free(struct dentry *dentry)
+{
+    struct dentry *parent = dentry->d_parent;
+    
+    write_seqcount_invalidate(&dentry->d_seq);
+    if (dentry->d_inode) {
+        list_del(&dentry->d_alias);
+        iput(dentry->d_inode);
+    }
+    if (parent != dentry) {
+        list_del(&dentry->d_child);
+    }
+    kmem_cache_free(dentry_cache, dentry);
+    
+    if (parent != dentry) {
+        dput(parent);
+    }
+}
+
+/* Take an unused dentry off the LRU */
+static void d_lru_del(struct dentry *dentry)
+{
+    list_del_init(&dentry->d_lru);
+    nr_unused--;
+}
+
+/*
+ * Free up to count unused dentries from the cold end of the LRU. One
+ * looked up again since it was queued gets another round instead.
+ */
+void prune_dcache(int count)
+{
+    struct dentry *dentry;
+    unsigned int scan = nr_unused;
+    
+    while (count > 0 && scan-- > 0 && !list_is_empty(&dentry_unused)) {
+        dentry = list_last_entry(&dentry_unused, struct dentry, d_lru);
+        if (dentry->d_flags & DCACHE_REFERENCED) {
+            dentry->d_flags &= ~DCACHE_REFERENCED;
+            list_del(&dentry->d_lru);
+            list_add(&dentry_unused, &dentry->d_lru);
+            continue;
+        }
+        d_lru_del(dentry);
+        d_drop(dentry);
+        d_free(dentry);
+        count--;
+    }
+}
+
 /* Allocate a new dentry */
 struct dentry *d_alloc(struct dentry *parent, const char *name)
 {
     struct dentry *dentry;
     
+    if (nr_unused > DENTRY_UNUSED_MAX) {
+        prune_dcache(nr_unused - DENTRY_UNUSED_MAX);
+    }
+    
     dentry = (struct dentry *)kmem_cache_alloc(dentry_cache, 0);
     if (!dentry) {
-        return NULL;
+        prune_dcache(DENTRY_PRUNE_BATCH);
+        dentry = (struct dentry *)kmem_cache_alloc(dentry_cache, 0);
+        if (!dentry) {
+            return NULL;
+        }
     }
     
-    /* Initialize dentry */
+    /* Initialize dentry; slab memory is uninitialised, d_seq included */
+    seqcount_init(&dentry->d_seq);
     dentry->d_count = 1;
-    dentry->d_flags = 0;
+    dentry->d_flags = DCACHE_UNHASHED;
     dentry->d_inode = NULL;
-    dentry->d_parent = parent ? parent : dentry;  /* root points to itself */
+    dentry->d_parent = parent ? dget(parent) : dentry;  /* root points to itself */
     dentry->d_op = NULL;
     dentry->sb = NULL;
     
@@ -75,7 +163,8 @@ struct dentry *d_alloc(struct dentry *parent, const char *name)
     INIT_LIST_HEAD(&dentry->d_lru);
     INIT_LIST_HEAD(&dentry->d_child);
     INIT_LIST_HEAD(&dentry->d_subdirs);
-    INIT_LIST_HEAD(&dentry->d_hash);
+    INIT_LIST_NULL(&dentry->d_hash);
+    INIT_LIST_HEAD(&dentry->d_alias);
     
     /* Add to parent's subdirectory list */
     if (parent && parent != dentry) {
@@ -98,7 +187,7 @@ struct dentry *d_alloc_root(struct inode *root_inode)
     if (dentry) {
         dentry->d_inode = root_inode;
         dentry->sb = root_inode->i_sb;
-        list_add(&root_inode->i_dentry, &dentry->d_child);
+        list_add(&root_inode->i_dentry, &dentry->d_alias);
     }
     
     return dentry;
@@ -111,8 +200,10 @@ void d_instantiate(struct dentry *dentry, struct inode *inode)
         return;
     }
     
+    write_seqcount_begin(&dentry->d_seq);
     dentry->d_inode = inode;
-    list_add(&inode->i_dentry, &dentry->d_child);
+    write_seqcount_end(&dentry->d_seq);
+    list_add(&inode->i_dentry, &dentry->d_alias);
 }
 
 /* Lookup dentry in cache */
@@ -133,7 +224,10 @@ struct dentry *d_lookup(struct dentry *parent, const char *name)
         dentry = list_entry(tmp, struct dentry, d_hash);
         
         if (dentry->d_parent == parent && !strcmp(dentry->d_name, name)) {
-            dentry->d_count++;
+            if (!dentry->d_count++) {
+                d_lru_del(dentry);
+            }
+            dentry->d_flags |= DCACHE_REFERENCED;
             return dentry;
         }
     }
@@ -141,11 +235,43 @@ struct dentry *d_lookup(struct dentry *parent, const char *name)
     return NULL;
 }
 
-/* Add dentry to cache */
-void d_add(struct dentry *dentry, struct inode *inode)
+/*
+ * d_lookup() for the lockless path walk: no reference is taken and
+ * nothing is written. The dentry found is only good if *seqp, its d_seq
+ * as of the name check, is still current when the caller is done with
+ * it. NULL means not cached, or that the chain changed under us.
+ */
+struct dentry *__d_lookup_rcu(struct dentry *parent, const char *name, unsigned int *seqp)
 {
-    unsigned int hash;
+    struct list_head *head, *tmp;
+    struct dentry *dentry;
+    unsigned int seq;
     
+    head = &dentry_hashtable[d_hash(parent, name)];
+    for (tmp = head->next; tmp != head; tmp = tmp->next) {
+        /* off the end of a dropped dentry, or into another chain */
+        if (!tmp || d_hash_is_head(tmp)) {
+            return NULL;
+        }
+        dentry = list_entry(tmp, struct dentry, d_hash);
+        
+        seq = raw_seqcount_begin(&dentry->d_seq);
+        if (dentry->d_parent != parent || strcmp(dentry->d_name, name)) {
+            continue;
+        }
+        if (read_seqcount_retry(&dentry->d_seq, seq)) {
+            return NULL;
+        }
+        *seqp = seq;
+        return dentry;
+    }
+    
+    return NULL;
+}
+
+/* Add dentry to cache, positive or, with no inode, negative */
+void d_add(struct dentry *dentry, struct inode *inode)
+{
     if (!dentry) {
         return;
     }
@@ -156,22 +282,72 @@ void d_add(struct dentry *dentry, struct inode *inode)
     }
     
     /* Add to hash table */
-    hash = d_hash(dentry->d_parent, dentry->d_name);
-    list_add(&dentry_hashtable[hash], &dentry->d_hash);
-    dentry->d_flags &= ~DCACHE_UNHASHED;
+    d_rehash(dentry);
 }
 
-/* Delete dentry from cache */
-void d_delete(struct dentry *dentry)
+/* Remove dentry from the hash table */
+void d_drop(struct dentry *dentry)
 {
     if (!dentry) {
         return;
     }
     
-    /* Remove from hash table */
     if (!(dentry->d_flags & DCACHE_UNHASHED)) {
-        list_del(&dentry->d_hash);
+        /* d_hash.next stays valid for walkers still on it */
+        generic_del(&dentry->d_hash);
         dentry->d_flags |= DCACHE_UNHASHED;
+        write_seqcount_invalidate(&dentry->d_seq);
+    }
+}
+
+/*
+ * The name was removed: the dentry stays cached as a negative one. If
+ * someone else still holds it they keep the inode, and the dentry is
+ * only unhashed so lookups stop finding it.
+ */
+void d_delete(struct dentry *dentry)
+{
+    struct inode *inode;
+    
+    if (!dentry || !dentry->d_inode) {
+        return;
+    }
+    if (dentry->d_count > 1) {
+        d_drop(dentry);
+        return;
+    }
+    
+    inode = dentry->d_inode;
+    write_seqcount_begin(&dentry->d_seq);
+    dentry->d_inode = NULL;
+    write_seqcount_end(&dentry->d_seq);
+    list_del(&dentry->d_alias);
+    iput(inode);
+}
+
+/* name now exists in parent: drop the negative dentries for it */
+void d_drop_negative(struct dentry *parent, const char *name)
+{
+    struct list_head *head, *tmp, *next;
+    struct dentry *dentry;
+    
+    if (!parent || !name) {
+        return;
+    }
+    
+    head = &dentry_hashtable[d_hash(parent, name)];
+    for (tmp = head->next; tmp != head; tmp = next) {
+        next = tmp->next;
+        dentry = list_entry(tmp, struct dentry, d_hash);
+        
+        if (dentry->d_inode || dentry->d_parent != parent || strcmp(dentry->d_name, name)) {
+            continue;
+        }
+        d_drop(dentry);
+        if (!dentry->d_count) {
+            d_lru_del(dentry);
+            d_free(dentry);
+        }
     }
 }
 
@@ -182,27 +358,26 @@ void dput(struct dentry *dentry)
         return;
     }
     
-    dentry->d_count--;
+    if (--dentry->d_count) {
+        return;
+    }
     
-    if (dentry->d_count == 0) {
-        /* Remove from parent's subdirectory list */
-        if (dentry->d_parent != dentry) {
-            list_del(&dentry->d_child);
-        }
-        
-        /* Remove from hash table */
-        d_delete(dentry);
-        
-        /* Free the dentry */
-        kmem_cache_free(dentry_cache, dentry);
+    /* An unhashed dentry can't be found again; free it */
+    if (d_unhashed(dentry)) {
+        d_free(dentry);
+        return;
     }
+    
+    /* Otherwise it stays cached, aging on the LRU until pruned */
+    list_add(&dentry_unused, &dentry->d_lru);
+    nr_unused++;
 }
 
-/* Increment dentry reference */
+/* Increment dentry reference; an unused one, reached without d_lookup(), leaves the LRU */
 struct dentry *dget(struct dentry *dentry)
 {
-    if (dentry) {
-        dentry->d_count++;
+    if (dentry && !dentry->d_count++) {
+        d_lru_del(dentry);
     }
     return dentry;
 }
@@ -220,8 +395,14 @@ void d_rehash(struct dentry *dentry)
         return;
     }
     
-    unsigned int hash = d_hash(dentry->d_parent, dentry->d_name);
-    list_add(&dentry_hashtable[hash], &dentry->d_hash);
+    struct list_head *head = &dentry_hashtable[d_hash(dentry->d_parent, dentry->d_name)];
+    
+    /* link the dentry up before a walker can reach it */
+    dentry->d_hash.next = head->next;
+    dentry->d_hash.prev = head;
+    wmb();
+    head->next->prev = &dentry->d_hash;
+    head->next = &dentry->d_hash;
     dentry->d_flags &= ~DCACHE_UNHASHED;
 }
 
@@ -232,12 +413,27 @@ void d_move(struct dentry *dentry, struct dentry *target)
         return;
     }
     
-    /* Remove from old position */
-    d_delete(dentry);
+    write_seqcount_begin(&rename_seq);
     
-    /* Update parent */
-    dentry->d_parent = target->d_parent;
+    /* Remove from old position; target is overwritten, lookups stop finding it */
+    d_drop(dentry);
+    d_drop(target);
+    
+    /* Update parent and name */
+    write_seqcount_begin(&dentry->d_seq);
+    if (dentry->d_parent != target->d_parent) {
+        struct dentry *old_parent = dentry->d_parent;
+        
+        list_del(&dentry->d_child);
+        dentry->d_parent = dget(target->d_parent);
+        list_add(&dentry->d_parent->d_subdirs, &dentry->d_child);
+        dput(old_parent);
+    }
+    strcpy(dentry->d_name, target->d_name);
+    write_seqcount_end(&dentry->d_seq);
     
     /* Add to new position */
-    d_add(dentry, dentry->d_inode);
+    d_rehash(dentry);
+    
+    write_seqcount_end(&rename_seq);
 }
@@ -3,8 +3,12 @@
 #include "serial.h"
 #include "string.h"
 #include "mm.h"
+#include "blkdev.h"
+#include "buffer.h"
+#include "timer.h"
 
 /* External references to global data in fs.c */
+extern dev_t filesys_dev;
 extern bgdesc_t bgdt[1024];
 extern ext2_super_block super;
 extern uint16_t n_block_groups;
@@ -12,76 +16,175 @@ extern uint16_t n_block_groups;
 #define S_BLOCK_SIZE 1024
 #define EXT2_BLK_SIZE 1024
 
+/*
+ * group bitmaps stay in the buffer cache, held (so never evicted) for the
+ * EXT2_MAX_GROUP_LOADED groups used last, like the 2.4 ext2 bitmap slots.
+ * Allocating or freeing only flips a bit in the held buffer and marks it
+ * dirty; it reaches the disk as a delayed write once the slot is given
+ * up, or from ext2_sync_bitmaps().
+ */
+#define EXT2_MAX_GROUP_LOADED 8
+
+struct bitmap_cache {
+    int nr;
+    uint16_t group[EXT2_MAX_GROUP_LOADED]; //most recently used first
+    struct buffer_head *bh[EXT2_MAX_GROUP_LOADED];
+};
+
+static struct bitmap_cache block_bitmaps, inode_bitmaps;
+
+static struct buffer_head *load_bitmap(struct bitmap_cache *c, uint16_t group, int inode)
+{
+    struct buffer_head *bh;
+    uint32_t blocknr;
+    int i;
+
+    for (i = 0; i < c->nr; i++) {
+        if (c->group[i] == group) {
+            break;
+        }
+    }
+    if (i < c->nr) {
+        bh = c->bh[i];
+    }
+    else {
+        blocknr = inode ? bgdt[group].bg_inode_bitmap : bgdt[group].bg_block_bitmap;
+        bh = bread(filesys_dev, blocknr);
+        if (!bh) {
+            printk("ext2: cannot read %s bitmap of group %u\n", inode ? "inode" : "block", group);
+            return NULL;
+        }
+        if (c->nr == EXT2_MAX_GROUP_LOADED) {
+            brelse(c->bh[--c->nr]);
+        }
+        i = c->nr++;
+    }
+
+    // move to the front
+    for (; i > 0; i--) {
+        c->group[i] = c->group[i - 1];
+        c->bh[i] = c->bh[i - 1];
+    }
+    c->group[0] = group;
+    c->bh[0] = bh;
+    return bh;
+}
+
+static void put_bitmaps(struct bitmap_cache *c, int release)
+{
+    for (int i = 0; i < c->nr; i++) {
+        write_dirty_buffer(c->bh[i]);
+        if (release) {
+            brelse(c->bh[i]);
+        }
+    }
+    if (release) {
+        c->nr = 0;
+    }
+}
+
+/* write the dirty held bitmaps; with release, also let go of them (unmount) */
+void ext2_sync_bitmaps(int release)
+{
+    blk_plug(filesys_dev);
+    put_bitmaps(&block_bitmaps, release);
+    put_bitmaps(&inode_bitmaps, release);
+    blk_unplug(filesys_dev);
+}
+
 /* Bitmap operations */
 
 void set_bit(uint8_t *bitmap, uint16_t i)
 {
-    uint16_t byte = i / 8;
-    uint8_t bit = i % 8;
-    bitmap[byte] |= (1 << bit);
+    bitmap[i / 8] |= (1 << (i % 8));
 }
 
 void unset_bit(uint8_t *bitmap, uint16_t i)
 {
-    uint16_t byte = i / 8;
-    uint8_t bit = i % 8;
-    bitmap[byte] ^= (1 << bit);
-}
-
-/* Find first free bit in bitmap */
-uint32_t first_free_bm(uint8_t *bitmap, uint8_t allowed_start)
-{
-    uint32_t first_free_block;
-    /* calculate ki block madhlya konty byte pasun
-     * start karaycha ahe
-     */
-    uint8_t start_byte = allowed_start / 8;
-    
-    for (int j = start_byte; j < S_BLOCK_SIZE; j++) {
-        uint8_t bmj = bitmap[j];
-        if (bmj == 255) continue; // full...
-        
-        uint8_t match;
-        for (int k = 0; k < 8; k++) {
-            if (((bmj >> k) & 1) == 0) {
-               match = k; 
-               break; 
-            }
-        }
-        uint16_t first_free_entry = j * 8 + match;
-        if (first_free_entry < allowed_start) continue;
-        return first_free_entry;
+    bitmap[i / 8] &= ~(1 << (i % 8));
+}
+
+/*
+ * first clear bit at or after start, or size if there is none. Bit i is
+ * bit i % 8 of byte i / 8, which on x86 is bit i % 32 of little endian
+ * word i / 32, so a full word is skipped with one compare.
+ */
+uint32_t find_next_zero_bit(const uint8_t *bitmap, uint32_t size, uint32_t start)
+{
+    const uint32_t *p = (const uint32_t *)bitmap;
+    uint32_t i = start / 32;
+    uint32_t word;
+
+    if (start >= size) {
+        return size;
     }
-    return 0;
+    word = p[i] | ((1u << (start % 32)) - 1); //bits below start count as used
+    while (word == 0xffffffff) {
+        if (++i * 32 >= size) {
+            return size;
+        }
+        word = p[i];
+    }
+    i = i * 32 + __builtin_ctz(~word);
+    return i < size ? i : size;
 }
 
+/* blocks in group; the last one may be short */
+static uint32_t group_blocks(uint16_t group)
+{
+    uint32_t first = group * super.s_blocks_per_group;
 
-/* Find first free block in block group */
-uint32_t first_free_block(bgdesc_t *d)
+    if (super.s_blocks_count - first < super.s_blocks_per_group) {
+        return super.s_blocks_count - first;
+    }
+    return super.s_blocks_per_group;
+}
+
+/* Find first free block in block group, -1 if the bitmap has none */
+int first_free_block(uint16_t group, uint32_t *res)
 {
-    uint8_t bitmap[S_BLOCK_SIZE];
-    disk_read_blk(d->bg_block_bitmap, bitmap);
-    return first_free_bm(bitmap, 0);
+    struct buffer_head *bh = load_bitmap(&block_bitmaps, group, 0);
+    uint32_t size = group_blocks(group);
+    uint32_t bit;
+
+    if (!bh) {
+        return -1;
+    }
+    bit = find_next_zero_bit((uint8_t *)bh->b_data, size, 0);
+    if (bit == size) {
+        return -1;
+    }
+    *res = group * super.s_blocks_per_group + bit;
+    return 0;
 }
 
-/* Find first free inode in block group */
-uint32_t first_free_inode(bgdesc_t *d)
+/* Find first free inode in block group, -1 if the bitmap has none */
+int first_free_inode(uint16_t group, uint32_t *res)
 {
-    uint8_t bitmap[S_BLOCK_SIZE];
-    disk_read_blk(d->bg_inode_bitmap, bitmap);
-    return first_free_bm(bitmap, EXT2_FREE_INO_START);
+    struct buffer_head *bh = load_bitmap(&inode_bitmaps, group, 1);
+    uint32_t size = super.s_inodes_per_group;
+    uint32_t bit;
+
+    if (!bh) {
+        return -1;
+    }
+    bit = find_next_zero_bit((uint8_t *)bh->b_data, size, group ? 0 : EXT2_FREE_INO_START);
+    if (bit == size) {
+        return -1;
+    }
+    *res = group * super.s_inodes_per_group + bit + 1; //inode numbers start at 1
+    return 0;
 }
 
 /* Find first free block across all block groups */
 int first_free_block_num(uint32_t *res)
 {
     for (int i = 0; i < n_block_groups; i++) {
-        bgdesc_t d = bgdt[i];
-        uint16_t n_free_blocks = d.bg_free_blocks_count;
-        if (n_free_blocks == 0) continue;
+        if (bgdt[i].bg_free_blocks_count == 0) continue;
 
-        *res = first_free_block(&d);
-        return 0;
+        if (!first_free_block(i, res)) {
+            return 0;
+        }
     }
 
     // Disk full
@@ -92,12 +195,11 @@ int first_free_block_num(uint32_t *res)
 int first_free_inode_num(uint32_t *res)
 {
     for (int i = 0; i < n_block_groups; i++) {
-        bgdesc_t d = bgdt[i];
-        uint16_t n_free_inodes = d.bg_free_inodes_count;
-        if (n_free_inodes == 0) continue;
+        if (bgdt[i].bg_free_inodes_count == 0) continue;
 
-        *res = first_free_inode(&d);
-        return 0;
+        if (!first_free_inode(i, res)) {
+            return 0;
+        }
     }
 
     return -1;
@@ -108,19 +210,18 @@ int first_free_inode_num(uint32_t *res)
 void mark_block(uint32_t block_num, uint8_t val)
 {
     uint16_t block_grp_n = block_num / super.s_blocks_per_group;
-    bgdesc_t d = bgdt[block_grp_n];
-    uint8_t bitmap[S_BLOCK_SIZE];
-    disk_read_blk(d.bg_block_bitmap, bitmap);
-
-    uint16_t bit_to_set = block_num % super.s_inodes_per_group;
+    uint16_t bit_to_set = block_num % super.s_blocks_per_group;
+    struct buffer_head *bh = load_bitmap(&block_bitmaps, block_grp_n, 0);
 
+    if (!bh) {
+        return;
+    }
     if (val == 1) {
-        set_bit(bitmap, bit_to_set);
+        set_bit((uint8_t *)bh->b_data, bit_to_set);
     } else {
-        unset_bit(bitmap, bit_to_set);
+        unset_bit((uint8_t *)bh->b_data, bit_to_set);
     }
-
-    disk_write_blk(d.bg_block_bitmap, bitmap);
+    mark_buffer_dirty(bh);
 }
 
 void set_block_bitmap(uint32_t block_num)
@@ -138,19 +239,18 @@ void unset_block_bitmap(uint32_t block_num)
 void mark_inode(uint32_t inode_num, uint8_t val)
 {
     uint16_t block_grp_n = (inode_num - 1) / super.s_inodes_per_group;
-    bgdesc_t d = bgdt[block_grp_n];
-    uint8_t bitmap[S_BLOCK_SIZE];
-    disk_read_blk(d.bg_inode_bitmap, bitmap);
-
     uint16_t bit_to_set = (inode_num - 1) % super.s_inodes_per_group;
+    struct buffer_head *bh = load_bitmap(&inode_bitmaps, block_grp_n, 1);
 
+    if (!bh) {
+        return;
+    }
     if (val == 1) {
-        set_bit(bitmap, bit_to_set);
+        set_bit((uint8_t *)bh->b_data, bit_to_set);
     } else {
-        unset_bit(bitmap, bit_to_set);
+        unset_bit((uint8_t *)bh->b_data, bit_to_set);
     }
-
-    disk_write_blk(d.bg_inode_bitmap, bitmap);
+    mark_buffer_dirty(bh);
 }
 
 void set_inode_bitmap(uint32_t inode_num)
@@ -165,90 +265,376 @@ void unset_inode_bitmap(uint32_t inode_num)
 
 /* Block group descriptor operations */
 
-void update_inode_bg_desc(uint32_t free_inode_n)
+void update_inode_bg_desc(uint32_t free_inode_n, int is_dir)
 {
-    uint16_t inode_bg_n = (free_inode_n - 1) / super.s_blocks_per_group;
-    bgdesc_t inode_bg_desc = bgdt[inode_bg_n];
-    inode_bg_desc.bg_free_inodes_count -= 1;
-    inode_bg_desc.bg_used_dirs_count += 1;
+    uint16_t inode_bg_n = (free_inode_n - 1) / super.s_inodes_per_group;
+    bgdesc_t *inode_bg_desc = &bgdt[inode_bg_n];
+    inode_bg_desc->bg_free_inodes_count -= 1;
+    if (is_dir) {
+        inode_bg_desc->bg_used_dirs_count += 1;
+    }
 }
 
 void update_block_bg_desc(uint32_t free_block_n)
 {
     /* pahile block cha group determine karaycha */
     uint16_t block_bg_n = free_block_n / super.s_blocks_per_group;
-    bgdesc_t block_bg_desc = bgdt[block_bg_n];
-    block_bg_desc.bg_free_blocks_count -= 1;
+    bgdesc_t *block_bg_desc = &bgdt[block_bg_n];
+    block_bg_desc->bg_free_blocks_count -= 1;
 }
 
-/* Sync BGDT to disk */
-void disk_sync_bgdt(void)
+/*
+ * replace block with len bytes of src, zero padded, through the buffer
+ * cache so a cached copy of the block never goes stale
+ */
+static void write_block_cached(uint32_t block, const void *src, uint32_t len)
+{
+    struct buffer_head *bh = getblk(filesys_dev, block);
+
+    if (!bh) {
+        printk("ext2: no buffer for block %u\n", block);
+        return;
+    }
+    memset(bh->b_data, 0, BUFFER_SIZE);
+    memcpy(bh->b_data, src, len);
+    mark_buffer_dirty(bh);
+    write_dirty_buffer(bh);
+    brelse(bh);
+}
+
+/* Sync BGDT to disk; the copy in group 1 too with backup set */
+void disk_sync_bgdt(int backup)
 {
-    uint8_t buf[S_BLOCK_SIZE];
-    uint8_t *bgdt_cast = (uint8_t *) bgdt;
     uint32_t lim = n_block_groups * sizeof(bgdesc_t);
-    
-    memset(buf, 0, S_BLOCK_SIZE);
 
-    for (int i = 0; i < lim; i++) {
-        *(buf + i) = *(bgdt_cast + i);
+    if (lim > S_BLOCK_SIZE) {
+        printk("ext2: %u group descriptors do not fit one block\n", n_block_groups);
+        return;
+    }
+    write_block_cached(BGDT_BLK_NO, bgdt, lim);
+    if (backup) {
+        write_block_cached(BGDT_BLK_NO + super.s_blocks_per_group, bgdt, lim);
+    }
+}
+
+/*
+ * Sync superblock to disk; the copy in group 1 too with backup set.
+ * super is the one authoritative copy: the primary goes out through its
+ * cached block, which is the mount's s_sbh, so the two never disagree.
+ */
+void disk_sync_super(int backup)
+{
+    uint8_t super_blockn = SUPER_BLK_NO;
+    struct buffer_head *bh = bread(filesys_dev, super_blockn);
+
+    if (!bh) {
+        printk("ext2: cannot read the superblock to update it\n");
+        return;
     }
+    memcpy(bh->b_data, &super, sizeof(super));
+    mark_buffer_dirty(bh);
+    write_dirty_buffer(bh);
+    brelse(bh);
 
-    uint8_t bgdt_blockn = BGDT_BLK_NO;
-    disk_write_blk(bgdt_blockn, buf);
-    
-    // Also write the backup block
-    disk_write_blk(bgdt_blockn + super.s_blocks_per_group, buf);
+    if (backup) {
+        write_block_cached(super_blockn + super.s_blocks_per_group, &super, sizeof(super));
+    }
 }
 
-/* Sync superblock to disk */
-void disk_sync_super(void)
+/*
+ * the free counters in super and bgdt change on every allocation but
+ * are only written when the filesystem is synced, or by an allocation
+ * once they have been dirty for EXT2_COMMIT_TICKS. Those writes go to
+ * the primary copies; the backups in group 1 are only rewritten at
+ * unmount, which is when fsck would compare them.
+ */
+#define EXT2_COMMIT_TICKS 100 //about 5s at the default PIT rate
+
+static int super_dirty; //super or bgdt differ from the disk
+static int dirty_since; //timer_ticks when they first did
+
+void ext2_mark_super_dirty(void)
 {
-    uint8_t super_blockn = 1; 
-    disk_write_blk(super_blockn, (uint8_t *) &super);
-    // Write backup
-    disk_write_blk(super_blockn + super.s_blocks_per_group, (uint8_t *) &super);
+    if (!super_dirty) {
+        super_dirty = 1;
+        dirty_since = timer_ticks;
+    }
 }
 
-/* Reserve a free block */
-int reserve_free_block(uint32_t *block_n)
+/* write the counters out if they changed; with backups, always, copies included */
+void ext2_commit_super(int backups)
+{
+    if (!super_dirty && !backups) {
+        return;
+    }
+    // super (1) and BGDT (2) are adjacent: one command
+    blk_plug(filesys_dev);
+    disk_sync_bgdt(backups);
+    disk_sync_super(backups);
+    blk_unplug(filesys_dev);
+    super_dirty = 0;
+}
+
+/* periodic writeback, driven by allocations */
+static void ext2_commit_expired(void)
+{
+    if (super_dirty && timer_ticks - dirty_since >= EXT2_COMMIT_TICKS) {
+        ext2_sync_bitmaps(0);
+        ext2_commit_super(0);
+    }
+}
+
+/*
+ * goal-directed allocation. The search starts at goal and runs forward
+ * through its group, then on through the following groups, so a file
+ * written sequentially gets consecutive blocks. With prealloc_count set,
+ * up to EXT2_PREALLOC_BLOCKS free blocks right after the one returned
+ * are claimed too and handed back as a window for the caller's next
+ * allocations (see ext2_alloc_block()).
+ */
+int ext2_new_block(uint32_t goal, uint32_t *block_n,
+                   uint32_t *prealloc_block, uint32_t *prealloc_count)
 {
-    if (first_free_block_num(block_n)) {
+    uint32_t bpg = super.s_blocks_per_group;
+    uint16_t group, g;
+    struct buffer_head *bh;
+    uint32_t size, bit = 0, n;
+
+    if (!super.s_free_blocks_count) {
+        printk("No free blocks available.\n");
+        return -1;
+    }
+    if (goal >= super.s_blocks_count) {
+        goal = 0;
+    }
+    group = goal / bpg;
+
+    for (n = 0; n <= n_block_groups; n++) {
+        g = (group + n) % n_block_groups;
+        if (!bgdt[g].bg_free_blocks_count) continue;
+        if (!(bh = load_bitmap(&block_bitmaps, g, 0))) continue;
+
+        size = group_blocks(g);
+        // the goal's group twice: after the goal, then before it
+        bit = find_next_zero_bit((uint8_t *)bh->b_data, size, (n == 0) ? goal % bpg : 0);
+        if (bit < size) {
+            break;
+        }
+    }
+    if (n > n_block_groups) {
         printk("No free blocks available.\n");
         return -1;
     }
-    set_block_bitmap(*block_n);
 
-    update_block_bg_desc(*block_n);
-    disk_sync_bgdt();
+    set_bit((uint8_t *)bh->b_data, bit);
+    *block_n = g * bpg + bit;
+    n = 1;
+
+    if (prealloc_count) {
+        *prealloc_block = *block_n + 1;
+        *prealloc_count = 0;
+        while (*prealloc_count < EXT2_PREALLOC_BLOCKS && ++bit < size &&
+               !(bh->b_data[bit / 8] & (1 << (bit % 8)))) {
+            set_bit((uint8_t *)bh->b_data, bit);
+            (*prealloc_count)++;
+        }
+        n += *prealloc_count;
+    }
+    mark_buffer_dirty(bh);
 
-    super.s_free_blocks_count -= 1;
-    disk_sync_super();
+    bgdt[g].bg_free_blocks_count -= n;
+    super.s_free_blocks_count -= n;
+    ext2_mark_super_dirty();
 
+    ext2_commit_expired();
     return 0;
 }
 
-/* Reserve an inode */
-int reserve_inode(uint32_t inode_n)
+/* give back count blocks from block on; they must be in one group */
+void ext2_free_blocks(uint32_t block, uint32_t count)
 {
-    set_inode_bitmap(inode_n);
+    uint16_t group = block / super.s_blocks_per_group;
+
+    for (uint32_t i = 0; i < count; i++) {
+        unset_block_bitmap(block + i);
+    }
+    bgdt[group].bg_free_blocks_count += count;
+    super.s_free_blocks_count += count;
+    ext2_mark_super_dirty();
+}
 
-    update_inode_bg_desc(inode_n);
-    disk_sync_bgdt();
+/* Reserve a free block, the first one on the disk */
+int reserve_free_block(uint32_t *block_n)
+{
+    return ext2_new_block(0, block_n, NULL, NULL);
+}
 
+/* Reserve an inode */
+int reserve_inode(uint32_t inode_n, int is_dir)
+{
+    set_inode_bitmap(inode_n);
+    update_inode_bg_desc(inode_n, is_dir);
     super.s_free_inodes_count -= 1;
-    disk_sync_super();
-    
+    ext2_mark_super_dirty();
+
+    ext2_commit_expired();
     return 0;
 }
 
-/* Reserve a free inode */
+/* Reserve a free inode, the first one on the disk */
 int reserve_free_inode(uint32_t *inode_n)
 {
     if (first_free_inode_num(inode_n)) {
         printk("No free inodes available.\n");
         return -1;
     }
-    reserve_inode(*inode_n);
+    reserve_inode(*inode_n, 0);
     return 0;
 }
+
+/*
+ * Orlov inode placement. A directory made in the root starts a new
+ * subtree, so it goes to the group with the fewest directories among
+ * those with at least the average free inodes and blocks. Deeper
+ * directories stay near their parent unless its group is crowded, and
+ * files go into their parent's group, where its data will be allocated
+ * too (ext2_inode_goal()).
+ */
+static uint32_t orlov_rotor; //spreads top level directories over equal groups
+
+static int find_group_orlov(uint16_t parent_group, int top_level)
+{
+    int ngroups = n_block_groups;
+    int ipg = super.s_inodes_per_group;
+    int avefreei = super.s_free_inodes_count / ngroups;
+    int avefreeb = super.s_free_blocks_count / ngroups;
+    int ndirs = 0;
+    int best_group = -1, best_ndir = ipg;
+    int max_dirs, min_inodes, min_blocks, group;
+
+    for (int i = 0; i < ngroups; i++) {
+        ndirs += bgdt[i].bg_used_dirs_count;
+    }
+
+    if (top_level) {
+        int start = orlov_rotor++ % ngroups;
+
+        for (int i = 0; i < ngroups; i++) {
+            bgdesc_t *d = &bgdt[(start + i) % ngroups];
+
+            if (d->bg_used_dirs_count >= best_ndir) continue;
+            if (d->bg_free_inodes_count < avefreei) continue;
+            if (d->bg_free_blocks_count < avefreeb) continue;
+            best_group = (start + i) % ngroups;
+            best_ndir = d->bg_used_dirs_count;
+        }
+        if (best_group >= 0) {
+            return best_group;
+        }
+        goto fallback;
+    }
+
+    max_dirs = ndirs / ngroups + ipg / 16;
+    min_inodes = avefreei - ipg / 4;
+    min_blocks = avefreeb - (int)super.s_blocks_per_group / 4;
+
+    for (int i = 0; i < ngroups; i++) {
+        bgdesc_t *d = &bgdt[group = (parent_group + i) % ngroups];
+
+        if (d->bg_used_dirs_count >= max_dirs) continue;
+        if (d->bg_free_inodes_count < min_inodes) continue;
+        if (d->bg_free_blocks_count < min_blocks) continue;
+        return group;
+    }
+
+fallback:
+    for (int i = 0; i < ngroups; i++) {
+        group = (parent_group + i) % ngroups;
+        if (bgdt[group].bg_free_inodes_count &&
+            bgdt[group].bg_free_inodes_count >= avefreei) {
+            return group;
+        }
+    }
+    if (avefreei) {
+        // the average was too much to ask for: any free inode will do
+        avefreei = 0;
+        goto fallback;
+    }
+    return -1;
+}
+
+static int find_group_other(uint16_t parent_group, uint32_t parent_ino)
+{
+    int ngroups = n_block_groups;
+    int group = parent_group;
+
+    if (bgdt[group].bg_free_inodes_count && bgdt[group].bg_free_blocks_count) {
+        return group;
+    }
+
+    // parent's group is full: hash to a group siblings will agree on
+    group = (group + parent_ino) % ngroups;
+    for (int i = 1; i < ngroups; i <<= 1) {
+        group += i;
+        if (group >= ngroups) {
+            group -= ngroups;
+        }
+        if (bgdt[group].bg_free_inodes_count && bgdt[group].bg_free_blocks_count) {
+            return group;
+        }
+    }
+
+    // then any group with a free inode
+    group = parent_group;
+    for (int i = 0; i < ngroups; i++) {
+        if (++group >= ngroups) {
+            group = 0;
+        }
+        if (bgdt[group].bg_free_inodes_count) {
+            return group;
+        }
+    }
+    return -1;
+}
+
+/* allocate an inode for a new file or directory in directory parent_ino */
+int ext2_new_inode_num(uint32_t parent_ino, int is_dir, uint32_t *inode_n)
+{
+    uint16_t parent_group = (parent_ino - 1) / super.s_inodes_per_group;
+    int group;
+
+    if (is_dir) {
+        group = find_group_orlov(parent_group, parent_ino == EXT2_ROOT_INO);
+    }
+    else {
+        group = find_group_other(parent_group, parent_ino);
+    }
+    if (group < 0 || first_free_inode(group, inode_n)) {
+        // counters and bitmaps disagree; fall back to a plain scan
+        if (first_free_inode_num(inode_n)) {
+            printk("No free inodes available.\n");
+            return -1;
+        }
+    }
+    return reserve_inode(*inode_n, is_dir);
+}
+
+/* give back inode_n */
+void ext2_free_inode_num(uint32_t inode_n, int is_dir)
+{
+    bgdesc_t *d = &bgdt[(inode_n - 1) / super.s_inodes_per_group];
+
+    unset_inode_bitmap(inode_n);
+    d->bg_free_inodes_count += 1;
+    if (is_dir && d->bg_used_dirs_count) {
+        d->bg_used_dirs_count -= 1;
+    }
+    super.s_free_inodes_count += 1;
+    ext2_mark_super_dirty();
+}
+
+/* first block of inode_n's group, where its data should start */
+uint32_t ext2_inode_goal(uint32_t inode_n)
+{
+    return ((inode_n - 1) / super.s_inodes_per_group) * super.s_blocks_per_group;
+}
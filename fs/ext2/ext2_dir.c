@@ -4,6 +4,14 @@
 #include "serial.h"
 #include "string.h"
 #include "slab.h"
+#include "ext2_balloc.h"
+#include "ext2_extents.h"
+#include "ext2_dir.h"
+#include "buffer.h"
+
+/* External references */
+extern ext2_super_block super;
+extern dev_t filesys_dev;
 
 /* Forward declarations */
 static struct dentry *ext2_lookup(struct inode *dir, struct dentry *dentry);
@@ -43,76 +51,353 @@ struct inode_operations ext2_file_inode_operations = {
     .truncate_range = NULL,
 };
 
+/* blocks in a directory; they are all data, its size is kept block aligned */
+uint32_t ext2_dir_blocks(inode_t *inode)
+{
+    return inode->i_size / EXT2_BLK_SIZE;
+}
+
+struct buffer_head *ext2_dir_bread(ext2_file_handle *dir, uint32_t lblock)
+{
+    uint32_t block = indirect_block(dir->inode, lblock);
+
+    if (!block) {
+        printk("ext2: hole at block %u of directory %u\n", lblock, dir->inode_n);
+        return NULL;
+    }
+    return bread(filesys_dev, block);
+}
+
+/* an empty directory block: one free record spanning it */
+void ext2_dir_init_block(uint8_t *blk)
+{
+    memset(blk, 0, EXT2_BLK_SIZE);
+    ((dentry_t *)blk)->rec_len = EXT2_BLK_SIZE;
+}
+
+/* a new directory's first block: "." and "..", the second running to the end */
+void ext2_dir_init_dots(uint8_t *blk, uint32_t inode_n, uint32_t parent)
+{
+    dentry_t *de = (dentry_t *)blk;
+
+    memset(blk, 0, EXT2_BLK_SIZE);
+    de->inode = inode_n;
+    de->rec_len = EXT2_DIR_REC_LEN(1);
+    de->name_len = 1;
+    de->file_type = EXT2_FT_DIR;
+    de->name[0] = '.';
+
+    de = (dentry_t *)(blk + EXT2_DIR_REC_LEN(1));
+    de->inode = parent;
+    de->rec_len = EXT2_BLK_SIZE - EXT2_DIR_REC_LEN(1);
+    de->name_len = 2;
+    de->file_type = EXT2_FT_DIR;
+    de->name[0] = '.';
+    de->name[1] = '.';
+}
+
+/* add an empty block to the end of dir; *lblock gets its index */
+struct buffer_head *ext2_dir_append(ext2_file_handle *dir, uint32_t *lblock)
+{
+    struct buffer_head *bh;
+    uint32_t n = ext2_dir_blocks(&dir->inode);
+    uint32_t goal, block;
+
+    goal = n ? indirect_block(dir->inode, n - 1) + 1 : ext2_inode_goal(dir->inode_n);
+    if (ext2_new_block(goal, &block, NULL, NULL)) {
+        return NULL;
+    }
+    if (!(bh = getblk(filesys_dev, block))) {
+        ext2_free_blocks(block, 1);
+        return NULL;
+    }
+    ext2_dir_init_block((uint8_t *)bh->b_data);
+
+    dir->inode.i_size += EXT2_BLK_SIZE;
+    dir->inode.i_blocks += EXT2_BLK_SIZE / DISK_SECTOR_SIZE;
+    if (set_i_block(&dir->inode, dir->inode_n, n, block)) {
+        dir->inode.i_size -= EXT2_BLK_SIZE;
+        dir->inode.i_blocks -= EXT2_BLK_SIZE / DISK_SECTOR_SIZE;
+        brelse(bh);
+        ext2_free_blocks(block, 1);
+        return NULL;
+    }
+    *lblock = n;
+    return bh;
+}
+
+/* the record at off, NULL at the end of the block or if it is corrupt */
+dentry_t *ext2_dirent_at(uint8_t *blk, uint32_t off)
+{
+    dentry_t *de = (dentry_t *)(blk + off);
+
+    if (off >= EXT2_BLK_SIZE) {
+        return NULL;
+    }
+    if (off > EXT2_BLK_SIZE - EXT2_DIRENT_HDR || de->rec_len < EXT2_DIRENT_HDR ||
+        de->rec_len % 4 || de->rec_len > EXT2_BLK_SIZE - off ||
+        de->name_len + EXT2_DIRENT_HDR > de->rec_len) {
+        printk("ext2: bad directory entry at offset %u\n", off);
+        return NULL;
+    }
+    return de;
+}
+
+dentry_t *ext2_dirent_find(uint8_t *blk, const char *name, int len)
+{
+    dentry_t *de;
+
+    for (uint32_t off = 0; (de = ext2_dirent_at(blk, off)); off += de->rec_len) {
+        if (de->inode && de->name_len == len && !memcmp(de->name, name, len)) {
+            return de;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * put d in the first record with room for it: a free one, or the slack
+ * after a live one, which is split off. 0 on success, 1 if the block is
+ * full, -1 if the name is already there.
+ */
+int ext2_dirent_add(uint8_t *blk, dentry_t *d)
+{
+    uint16_t need = EXT2_DIR_REC_LEN(d->name_len);
+    uint16_t used, slot_used = 0;
+    dentry_t *de, *slot = NULL;
+
+    for (uint32_t off = 0; (de = ext2_dirent_at(blk, off)); off += de->rec_len) {
+        if (de->inode && de->name_len == d->name_len && !memcmp(de->name, d->name, d->name_len)) {
+            return -1;
+        }
+        used = de->inode ? EXT2_DIR_REC_LEN(de->name_len) : 0;
+        if (!slot && de->rec_len >= used + need) {
+            slot = de;
+            slot_used = used;
+        }
+    }
+    if (!slot) {
+        return 1;
+    }
+
+    if (slot_used) {
+        de = (dentry_t *)((uint8_t *)slot + slot_used);
+        de->rec_len = slot->rec_len - slot_used;
+        slot->rec_len = slot_used;
+        slot = de;
+    }
+    slot->inode = d->inode;
+    slot->name_len = d->name_len;
+    slot->file_type = d->file_type;
+    memcpy(slot->name, d->name, d->name_len);
+    return 0;
+}
+
+/* drop the record de from blk by merging it into the one before it */
+int ext2_dirent_delete(uint8_t *blk, dentry_t *de)
+{
+    dentry_t *p, *prev = NULL;
+    uint32_t off;
+
+    for (off = 0; (p = ext2_dirent_at(blk, off)) && p != de; off += p->rec_len) {
+        prev = p;
+    }
+    if (p != de) {
+        return -1;
+    }
+
+    if (prev) {
+        prev->rec_len += de->rec_len;
+    }
+    else {
+        de->inode = 0;
+    }
+    return 0;
+}
+
+/*
+ * the block holding name, *res pointing at its record; NULL if it is not
+ * there. *lost is set if a block could not be read, so it may have been.
+ */
+static struct buffer_head *find_dirent(ext2_file_handle *dir, const char *name, dentry_t **res,
+                                       int *lost)
+{
+    struct buffer_head *bh;
+    int len = strlen(name);
+    int ret;
+
+    *lost = 0;
+
+    if (dir->inode.i_flags & EXT2_INDEX_FL) {
+        ret = ext2_dx_find_entry(dir, name, len, &bh, res);
+        if (ret >= 0) {
+            return ret ? NULL : bh;
+        }
+        // the index is unusable, but the leaves are plain directory blocks
+    }
+
+    for (uint32_t i = 0; i < ext2_dir_blocks(&dir->inode); i++) {
+        if (!(bh = ext2_dir_bread(dir, i))) {
+            *lost = 1;
+            continue;
+        }
+        if ((*res = ext2_dirent_find((uint8_t *)bh->b_data, name, len))) {
+            return bh;
+        }
+        brelse(bh);
+    }
+    return NULL;
+}
+
+/* the block holding name, *res pointing at its record; NULL if it is not there */
+struct buffer_head *ext2_find_dirent(ext2_file_handle *dir, const char *name, dentry_t **res)
+{
+    int lost;
+
+    return find_dirent(dir, name, res, &lost);
+}
+
+/* inode number of name in dir; 1 if it is not there, -1 if dir could not be read */
+int ext2_find_entry(ext2_file_handle *dir, const char *name, uint32_t *inode_n)
+{
+    struct buffer_head *bh;
+    dentry_t *de;
+    int lost;
+
+    if (!(bh = find_dirent(dir, name, &de, &lost))) {
+        return lost ? -1 : 1;
+    }
+    *inode_n = de->inode;
+    brelse(bh);
+    return 0;
+}
+
+/* remove name from dir; its record is merged into the one before it */
+int ext2_delete_entry(ext2_file_handle *dir, const char *name)
+{
+    struct buffer_head *bh;
+    dentry_t *de;
+
+    if (!(bh = ext2_find_dirent(dir, name, &de))) {
+        return -1;
+    }
+    if (ext2_dirent_delete((uint8_t *)bh->b_data, de)) {
+        brelse(bh);
+        return -1;
+    }
+    bwrite(bh);
+    return 0;
+}
+
+/*
+ * add d to dir. Unindexed directories take it in the first block with
+ * room; one that fills its only block is indexed instead of extended.
+ * The directory inode is written if it changes.
+ */
+int ext2_add_entry(ext2_file_handle *dir, dentry_t *d)
+{
+    struct buffer_head *bh;
+    uint32_t n = ext2_dir_blocks(&dir->inode);
+    uint32_t lblock;
+    int ret;
+
+    if (dir->inode.i_flags & EXT2_INDEX_FL) {
+        return ext2_dx_add_entry(dir, d);
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (!(bh = ext2_dir_bread(dir, i))) {
+            return -1;
+        }
+        ret = ext2_dirent_add((uint8_t *)bh->b_data, d);
+        if (ret == 0) {
+            bwrite(bh);
+            return 0;
+        }
+        if (ret < 0) {
+            brelse(bh);
+            return -1;
+        }
+        if (n == 1 && (super.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+            return ext2_dx_make_indexed(dir, bh, d);
+        }
+        brelse(bh);
+    }
+
+    if (!(bh = ext2_dir_append(dir, &lblock))) {
+        return -1;
+    }
+    ext2_dirent_add((uint8_t *)bh->b_data, d);
+    bwrite(bh);
+    return 0;
+}
+
 /* Lookup directory entry */
 static struct dentry *ext2_lookup(struct inode *dir, struct dentry *dentry)
 {
-    uint32_t block_len;
-    uint32_t dentries_per_blk;
     ext2_file_handle dir_file;
+    inode_t disk_inode;
+    uint32_t inode_n;
+    int ret;
     
     if (!dir || !dentry) {
         return NULL;
     }
     
-    /* Convert VFS inode to ext2_file_handle for existing code */
-    dir_file.inode = *(inode_t*)dir;  /* Cast VFS inode to ext2 inode */
+    dir_file.inode = get_inode(dir->i_no);
     dir_file.inode_n = dir->i_no;
     
-    block_len = i_block_len(dir_file.inode);
-    dentries_per_blk = EXT2_BLK_SIZE / sizeof(dentry_t);
-    
-    /* Search through directory blocks */
-    for (uint32_t i = 0; i < block_len; i++) {
-        uint8_t *block = get_file_block(dir_file, i);
-        if (!block) {
-            continue;
-        }
-        
-        dentry_t *entries = (dentry_t *)block;
-        
-        for (uint32_t j = 0; j < dentries_per_blk; j++) {
-            dentry_t *entry = &entries[j];
-            
-            if (entry->inode == 0) {
-                continue;  /* Empty entry */
-            }
-            
-            if (!strcmp(entry->name, dentry->d_name)) {
-                /* Found matching entry */
-                inode_t disk_inode = get_inode(entry->inode);
-                
-                /* Create VFS inode */
-                struct inode *inode = iget(dir->i_dev, entry->inode);
-                if (!inode) {
-                    kfree(block);
-                    return NULL;
-                }
-                
-                /* Copy ext2 inode data to VFS inode */
-                inode->i_mode = disk_inode.i_mode;
-                inode->i_size = disk_inode.i_size;
-                inode->i_blocks = disk_inode.i_blocks;
-                
-                /* Set operations based on file type */
-                if (disk_inode.i_mode & EXT2_S_IFDIR) {
-                    inode->i_op = &ext2_dir_inode_operations;
-                } else {
-                    inode->i_op = &ext2_file_inode_operations;
-                }
-                
-                /* Instantiate dentry with inode */
-                d_instantiate(dentry, inode);
-                
-                kfree(block);
-                return dentry;
-            }
+    /* only a clean miss is cached; errors leave the dentry unhashed */
+    ret = ext2_find_entry(&dir_file, dentry->d_name, &inode_n);
+    if (ret) {
+        if (ret > 0) {
+            d_add(dentry, NULL);
         }
-        
-        kfree(block);
+        return NULL;
     }
+    disk_inode = get_inode(inode_n);
     
-    /* Not found */
-    return NULL;
+    /* Create VFS inode */
+    struct inode *inode = iget(dir->i_dev, inode_n);
+    if (!inode) {
+        return NULL;
+    }
+    
+    /* Copy ext2 inode data to VFS inode */
+    inode->i_mode = disk_inode.i_mode;
+    inode->i_size = disk_inode.i_size;
+    inode->i_blocks = disk_inode.i_blocks;
+    
+    /* Set operations based on file type */
+    if (disk_inode.i_mode & EXT2_S_IFDIR) {
+        inode->i_op = &ext2_dir_inode_operations;
+    } else {
+        inode->i_op = &ext2_file_inode_operations;
+    }
+    
+    /* Instantiate dentry with inode and hash it */
+    d_add(dentry, inode);
+    return dentry;
+}
+
+/* the directory grew: bring the in-core inode up to date */
+static void ext2_dir_changed(struct inode *dir, ext2_file_handle *dir_file)
+{
+    dir->i_size = dir_file->inode.i_size;
+    dir->i_blocks = dir_file->inode.i_blocks;
+    ext2_bmap_update(dir, &dir_file->inode);
+}
+
+/* point a new inode at its first data block, through an extent tree if the
+ * filesystem has the feature */
+static void ext2_map_first_block(inode_t *inode, uint32_t inode_n, uint32_t block)
+{
+    if (super.s_feature_incompat & EXT4_FEATURE_INCOMPAT_EXTENTS) {
+        ext2_ext_tree_init(inode);
+        ext2_ext_insert(inode, inode_n, 0, block);
+    } else {
+        inode->i_block[0] = block;
+    }
 }
 
 /* Create regular file */
@@ -128,12 +413,13 @@ static int ext2_create(struct inode *dir, struct dentry *dentry, int mode)
     }
     
     /* Allocate inode and block */
-    if (reserve_free_inode(&free_inode_n) != 0) {
+    if (ext2_new_inode_num(dir->i_no, 0, &free_inode_n) != 0) {
         printk("ext2_create: no free inodes\n");
         return -1;
     }
     
-    if (reserve_free_block(&free_block_n) != 0) {
+    /* data next to the inode */
+    if (ext2_new_block(ext2_inode_goal(free_inode_n), &free_block_n, NULL, NULL) != 0) {
         printk("ext2_create: no free blocks\n");
         return -1;
     }
@@ -144,26 +430,28 @@ static int ext2_create(struct inode *dir, struct dentry *dentry, int mode)
     new_inode.i_size = 0;
     new_inode.i_blocks = 2;  /* 1 block = 2 sectors */
     new_inode.i_links_count = 1;
-    new_inode.i_block[0] = free_block_n;
+
+    ext2_map_first_block(&new_inode, free_inode_n, free_block_n);
     
     /* Write inode to disk */
     write_inode_table(free_inode_n, new_inode);
     
     /* Create directory entry */
     new_dentry.inode = free_inode_n;
-    new_dentry.rec_len = sizeof(dentry_t);
     new_dentry.name_len = strlen(dentry->d_name);
+    new_dentry.rec_len = EXT2_DIR_REC_LEN(new_dentry.name_len);
     new_dentry.file_type = EXT2_FT_REG_FILE;
-    strncpy(new_dentry.name, dentry->d_name, sizeof(new_dentry.name) - 1);
+    memcpy(new_dentry.name, dentry->d_name, new_dentry.name_len);
     
     /* Add to parent directory */
-    dir_file.inode = *(inode_t*)dir;
+    dir_file.inode = get_inode(dir->i_no);
     dir_file.inode_n = dir->i_no;
     
-    if (add_dentry(dir_file, new_dentry) != 0) {
+    if (ext2_add_entry(&dir_file, &new_dentry) != 0) {
         printk("ext2_create: failed to add dentry\n");
         return -1;
     }
+    ext2_dir_changed(dir, &dir_file);
     
     /* Create VFS inode and instantiate dentry */
     struct inode *vfs_inode = iget(dir->i_dev, free_inode_n);
@@ -192,12 +480,13 @@ static int ext2_mkdir(struct inode *dir, struct dentry *dentry, int mode)
     }
     
     /* Allocate inode and block */
-    if (reserve_free_inode(&free_inode_n) != 0) {
+    if (ext2_new_inode_num(dir->i_no, 1, &free_inode_n) != 0) {
         printk("ext2_mkdir: no free inodes\n");
         return -1;
     }
     
-    if (reserve_free_block(&free_block_n) != 0) {
+    /* data next to the inode */
+    if (ext2_new_block(ext2_inode_goal(free_inode_n), &free_block_n, NULL, NULL) != 0) {
         printk("ext2_mkdir: no free blocks\n");
         return -1;
     }
@@ -205,27 +494,43 @@ static int ext2_mkdir(struct inode *dir, struct dentry *dentry, int mode)
     /* Create new directory inode */
     new_inode = new_dir_inode();
     new_inode.i_mode |= mode;
+    new_inode.i_size = EXT2_BLK_SIZE;
     new_inode.i_blocks = 2;
-    new_inode.i_block[0] = free_block_n;
+    ext2_map_first_block(&new_inode, free_inode_n, free_block_n);
+    new_inode.i_links_count = 2;  /* its entry and "." */
+
+    /* its one block, holding "." and ".." */
+    struct buffer_head *bh = getblk(filesys_dev, free_block_n);
+    if (!bh) {
+        ext2_free_blocks(free_block_n, 1);
+        ext2_free_inode_num(free_inode_n, 1);
+        return -1;
+    }
+    ext2_dir_init_dots((uint8_t *)bh->b_data, free_inode_n, dir->i_no);
+    bwrite(bh);
     
     /* Write inode to disk */
     write_inode_table(free_inode_n, new_inode);
     
     /* Create directory entry */
     new_dentry.inode = free_inode_n;
-    new_dentry.rec_len = sizeof(dentry_t);
     new_dentry.name_len = strlen(dentry->d_name);
+    new_dentry.rec_len = EXT2_DIR_REC_LEN(new_dentry.name_len);
     new_dentry.file_type = EXT2_FT_DIR;
-    strncpy(new_dentry.name, dentry->d_name, sizeof(new_dentry.name) - 1);
+    memcpy(new_dentry.name, dentry->d_name, new_dentry.name_len);
     
     /* Add to parent directory */
-    dir_file.inode = *(inode_t*)dir;
+    dir_file.inode = get_inode(dir->i_no);
     dir_file.inode_n = dir->i_no;
     
-    if (add_dentry(dir_file, new_dentry) != 0) {
+    if (ext2_add_entry(&dir_file, &new_dentry) != 0) {
         printk("ext2_mkdir: failed to add dentry\n");
         return -1;
     }
+    /* the new ".." links to the parent */
+    dir_file.inode.i_links_count++;
+    write_inode_table(dir_file.inode_n, dir_file.inode);
+    ext2_dir_changed(dir, &dir_file);
     
     /* Create VFS inode and instantiate dentry */
     struct inode *vfs_inode = iget(dir->i_dev, free_inode_n);
@@ -244,18 +549,33 @@ static int ext2_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 /* Remove directory */
 static int ext2_rmdir(struct inode *dir, struct dentry *dentry)
 {
-    /* Simplified implementation - just mark inode as free */
+    ext2_file_handle dir_file;
+    int is_dir;
+
+    /* Simplified implementation - unlink and free the inode */
     if (!dir || !dentry || !dentry->d_inode) {
         return -1;
     }
     
     uint32_t inode_num = dentry->d_inode->i_no;
+    is_dir = (dentry->d_inode->i_mode & EXT2_S_IFDIR) != 0;
+    
+    /* Remove from parent directory */
+    dir_file.inode = get_inode(dir->i_no);
+    dir_file.inode_n = dir->i_no;
+    if (ext2_delete_entry(&dir_file, dentry->d_name)) {
+        printk("ext2_rmdir: %s not found\n", dentry->d_name);
+        return -1;
+    }
+    if (is_dir && dir_file.inode.i_links_count > 1) {
+        dir_file.inode.i_links_count--;
+        write_inode_table(dir_file.inode_n, dir_file.inode);
+    }
     
-    /* Free inode bitmap */
-    unset_inode_bitmap(inode_num);
+    /* Free the inode number */
+    ext2_free_inode_num(inode_num, is_dir);
     
     /* TODO: Free data blocks */
-    /* TODO: Remove from parent directory */
     
     printk("ext2_rmdir: removed directory inode %d\n", inode_num);
     
@@ -276,3 +596,107 @@ static int ext2_rename(struct inode *old_dir, struct dentry *old_dentry,
     
     return -1;
 }
+
+/* a 12 byte name, so every record takes EXT2_DIR_REC_LEN(12) = 20 bytes */
+static void test_dirent_name(dentry_t *d, uint32_t n)
+{
+    memcpy(d->name, "dirent_tst", 10);
+    d->name[10] = '0' + n / 10;
+    d->name[11] = '0' + n % 10;
+    d->name_len = 12;
+    d->inode = 100 + n;
+    d->file_type = EXT2_FT_REG_FILE;
+}
+
+static uint8_t test_dirent_blk[EXT2_BLK_SIZE];
+
+/* rec_len of the record at off, read from its fixed header alone */
+static uint16_t test_rec_len(uint8_t *blk, uint32_t off)
+{
+    uint16_t rec_len;
+
+    memcpy(&rec_len, blk + off + 4, sizeof(rec_len));
+    return rec_len;
+}
+
+void test_dirent(void)
+{
+    uint8_t *blk = test_dirent_blk;
+    uint16_t rec = EXT2_DIR_REC_LEN(12);
+    uint32_t n, last;
+    dentry_t d, *de, *prev;
+    int failed = 0;
+
+    printk("testing directory records .............\n");
+
+    // "a" goes into the slack after "..", which is cut down to its own size
+    ext2_dir_init_dots(blk, 2, 2);
+    memset(&d, 0, sizeof(d));
+    d.inode = 11;
+    d.name_len = 1;
+    d.name[0] = 'a';
+    de = ext2_dirent_at(blk, EXT2_DIR_REC_LEN(1));
+    if (ext2_dirent_add(blk, &d) || de->rec_len != EXT2_DIR_REC_LEN(2) ||
+        ext2_dirent_find(blk, "a", 1) != (dentry_t *)(blk + 2 * EXT2_DIR_REC_LEN(1)) ||
+        ext2_dirent_find(blk, "a", 1)->rec_len != EXT2_BLK_SIZE - 2 * EXT2_DIR_REC_LEN(1)) {
+        printk(" split into slack failed\n");
+        failed++;
+    }
+
+    // 50 records of 20 bytes fill the 1000 left after the dots exactly
+    ext2_dir_init_dots(blk, 2, 2);
+    n = (EXT2_BLK_SIZE - 2 * EXT2_DIR_REC_LEN(1)) / rec;
+    for (uint32_t i = 0; i < n; i++) {
+        test_dirent_name(&d, i);
+        if (ext2_dirent_add(blk, &d)) {
+            printk(" add %u of %u failed\n", i, n);
+            failed++;
+            break;
+        }
+    }
+    last = EXT2_BLK_SIZE - rec;
+    test_dirent_name(&d, n - 1);
+    de = ext2_dirent_find(blk, d.name, d.name_len);
+    if (!de || (uint32_t)((uint8_t *)de - blk) != last || test_rec_len(blk, last) != rec ||
+        ext2_dirent_at(blk, last + rec)) {
+        printk(" record ending at the block boundary not found\n");
+        failed++;
+    }
+    test_dirent_name(&d, n);
+    if (ext2_dirent_add(blk, &d) != 1) {
+        printk(" full block took another record\n");
+        failed++;
+    }
+
+    // deleting a record hands its space to the one before it
+    test_dirent_name(&d, 10);
+    de = ext2_dirent_find(blk, d.name, d.name_len);
+    test_dirent_name(&d, 9);
+    prev = ext2_dirent_find(blk, d.name, d.name_len);
+    if (!de || !prev || ext2_dirent_delete(blk, de) || prev->rec_len != 2 * rec ||
+        ext2_dirent_find(blk, de->name, de->name_len) != NULL) {
+        printk(" delete did not merge into the previous record\n");
+        failed++;
+    }
+    // the last one: the previous record then runs to the end of the block
+    test_dirent_name(&d, n - 1);
+    de = ext2_dirent_find(blk, d.name, d.name_len);
+    if (!de || ext2_dirent_delete(blk, de) ||
+        test_rec_len(blk, last - rec) != EXT2_BLK_SIZE - (last - rec)) {
+        printk(" delete at the block boundary did not merge\n");
+        failed++;
+    }
+    // and the freed slack takes a new record again
+    test_dirent_name(&d, 10);
+    if (ext2_dirent_add(blk, &d) ||
+        ext2_dirent_find(blk, d.name, d.name_len) != (dentry_t *)(blk + 2 * EXT2_DIR_REC_LEN(1) + 10 * rec)) {
+        printk(" freed record was not reused\n");
+        failed++;
+    }
+
+    if (failed) {
+        printk("directory records: %d failed\n", failed);
+    } else {
+        printk("directory records ok\n");
+    }
+}
@@ -0,0 +1,517 @@
+#include "ext2_dir.h"
+#include "buffer.h"
+#include "serial.h"
+#include "string.h"
+#include "slab.h"
+
+/*
+ * hashed directory index, in the ext3 htree layout. Block 0 of an indexed
+ * directory is a dx_root: "." and ".." records, the second spanning the
+ * block so a plain scan skips the rest, then an array of (hash, block)
+ * entries sorted by hash. An entry covers the hashes from its own up to
+ * the next one's; the first, whose hash field holds the array's count and
+ * limit, covers everything below the second. With one level of indirection
+ * the root's entries point at dx_node blocks holding the same arrays, the
+ * rest at leaves: ordinary directory blocks. A lookup reads the root, a
+ * node and a leaf whatever the directory's size.
+ */
+
+extern ext2_super_block super;
+
+#define DX_MAX_LEVELS   2 //the root and one level of nodes
+
+struct fake_dirent {
+    uint32_t inode;
+    uint16_t rec_len;
+    uint8_t name_len;
+    uint8_t file_type;
+} __attribute__((packed));
+
+struct dx_countlimit {
+    uint16_t limit;
+    uint16_t count;
+} __attribute__((packed));
+
+struct dx_entry {
+    uint32_t hash;
+    uint32_t block; //logical block in the directory
+} __attribute__((packed));
+
+struct dx_root_info {
+    uint32_t reserved_zero;
+    uint8_t hash_version;
+    uint8_t info_length; //8
+    uint8_t indirect_levels;
+    uint8_t unused_flags;
+} __attribute__((packed));
+
+struct dx_root {
+    struct fake_dirent dot;
+    char dot_name[4];
+    struct fake_dirent dotdot;
+    char dotdot_name[4];
+    struct dx_root_info info;
+    struct dx_entry entries[];
+} __attribute__((packed));
+
+struct dx_node {
+    struct fake_dirent fake; //inode 0, spanning the block
+    struct dx_entry entries[];
+} __attribute__((packed));
+
+#define DX_ROOT_LIMIT ((EXT2_BLK_SIZE - sizeof(struct dx_root)) / sizeof(struct dx_entry))
+#define DX_NODE_LIMIT ((EXT2_BLK_SIZE - sizeof(struct dx_node)) / sizeof(struct dx_entry))
+
+/* one index block on the way down */
+struct dx_frame {
+    struct buffer_head *bh;
+    struct dx_entry *entries;
+    struct dx_entry *at; //entry followed
+    int dirty;
+};
+
+/* a live record of a leaf being split */
+struct dx_map_entry {
+    uint32_t hash;
+    uint16_t offs;
+};
+
+#define DX_MAP_MAX (EXT2_BLK_SIZE / (EXT2_DIRENT_HDR + 4))
+
+static inline uint16_t dx_get_count(struct dx_entry *entries)
+{
+    return ((struct dx_countlimit *)entries)->count;
+}
+
+static inline uint16_t dx_get_limit(struct dx_entry *entries)
+{
+    return ((struct dx_countlimit *)entries)->limit;
+}
+
+static inline void dx_set_count(struct dx_entry *entries, uint16_t count)
+{
+    ((struct dx_countlimit *)entries)->count = count;
+}
+
+static inline void dx_set_limit(struct dx_entry *entries, uint16_t limit)
+{
+    ((struct dx_countlimit *)entries)->limit = limit;
+}
+
+static void dx_release(struct dx_frame *frames, int depth)
+{
+    for (int k = 0; k <= depth; k++) {
+        if (frames[k].dirty) {
+            bwrite(frames[k].bh);
+        }
+        else {
+            brelse(frames[k].bh);
+        }
+    }
+}
+
+/*
+ * hash name with the directory's function and walk down to the leaf
+ * that holds, or would hold, it. Returns the depth of the last frame.
+ */
+static int dx_probe(ext2_file_handle *dir, const char *name, int len,
+                    struct dx_hash_info *hinfo, struct dx_frame *frames)
+{
+    struct buffer_head *bh;
+    struct dx_root *root;
+    struct dx_entry *entries, *p, *q, *m;
+    unsigned int count, limit = DX_ROOT_LIMIT;
+    int levels;
+
+    if (!(bh = ext2_dir_bread(dir, 0))) {
+        return -1;
+    }
+    root = (struct dx_root *)bh->b_data;
+    if (root->info.reserved_zero || root->info.info_length != sizeof(struct dx_root_info) ||
+        root->info.indirect_levels >= DX_MAX_LEVELS) {
+        printk("ext2: bad index root in directory %u\n", dir->inode_n);
+        brelse(bh);
+        return -1;
+    }
+    hinfo->hash_version = root->info.hash_version;
+    hinfo->seed = super.s_hash_seed;
+    if (ext2fs_dirhash(name, len, hinfo)) {
+        printk("ext2: directory %u has unknown hash %u\n", dir->inode_n, hinfo->hash_version);
+        brelse(bh);
+        return -1;
+    }
+    levels = root->info.indirect_levels;
+    entries = root->entries;
+
+    for (int k = 0; ; k++) {
+        frames[k].bh = bh;
+        frames[k].dirty = 0;
+        count = dx_get_count(entries);
+        if (dx_get_limit(entries) != limit || !count || count > limit) {
+            printk("ext2: bad index block in directory %u\n", dir->inode_n);
+            dx_release(frames, k);
+            return -1;
+        }
+
+        // the last entry at or below the hash, entry 0 if there is none
+        p = entries + 1;
+        q = entries + count - 1;
+        while (p <= q) {
+            m = p + (q - p) / 2;
+            if (m->hash > hinfo->hash) {
+                q = m - 1;
+            }
+            else {
+                p = m + 1;
+            }
+        }
+        frames[k].entries = entries;
+        frames[k].at = p - 1;
+        if (k == levels) {
+            return k;
+        }
+
+        if (!(bh = ext2_dir_bread(dir, frames[k].at->block))) {
+            dx_release(frames, k);
+            return -1;
+        }
+        entries = ((struct dx_node *)bh->b_data)->entries;
+        limit = DX_NODE_LIMIT;
+    }
+}
+
+/*
+ * move the frames to the next leaf if it may still hold names with this
+ * hash: a leaf split between equal hashes flags its index entry by
+ * setting the low bit. 1 if it moved, 0 if the search is over.
+ */
+static int dx_next_leaf(ext2_file_handle *dir, uint32_t hash, struct dx_frame *frames, int depth)
+{
+    struct buffer_head *bh;
+    int k = depth;
+
+    while (++frames[k].at >= frames[k].entries + dx_get_count(frames[k].entries)) {
+        if (!k--) {
+            return 0;
+        }
+    }
+    if ((frames[k].at->hash & ~1) != hash) {
+        return 0;
+    }
+
+    for (; k < depth; k++) {
+        if (!(bh = ext2_dir_bread(dir, frames[k].at->block))) {
+            return -1;
+        }
+        brelse(frames[k + 1].bh);
+        frames[k + 1].bh = bh;
+        frames[k + 1].entries = ((struct dx_node *)bh->b_data)->entries;
+        frames[k + 1].at = frames[k + 1].entries;
+    }
+    return 1;
+}
+
+/*
+ * 0 if found, with the leaf in *bhp and the record in *res; 1 if name is
+ * not in dir, -1 if the index cannot be used
+ */
+int ext2_dx_find_entry(ext2_file_handle *dir, const char *name, int len,
+                       struct buffer_head **bhp, dentry_t **res)
+{
+    struct dx_frame frames[DX_MAX_LEVELS];
+    struct dx_hash_info hinfo;
+    struct buffer_head *bh;
+    dentry_t *de;
+    int depth, ret;
+
+    if ((depth = dx_probe(dir, name, len, &hinfo, frames)) < 0) {
+        return -1;
+    }
+    do {
+        if (!(bh = ext2_dir_bread(dir, frames[depth].at->block))) {
+            ret = -1;
+            break;
+        }
+        de = ext2_dirent_find((uint8_t *)bh->b_data, name, len);
+        if (de) {
+            *bhp = bh;
+            *res = de;
+            dx_release(frames, depth);
+            return 0;
+        }
+        brelse(bh);
+    } while ((ret = dx_next_leaf(dir, hinfo.hash, frames, depth)) > 0);
+
+    dx_release(frames, depth);
+    return ret < 0 ? -1 : 1;
+}
+
+/* index entry for block, right after the one the frame followed */
+static void dx_insert_block(struct dx_frame *frame, uint32_t hash, uint32_t block)
+{
+    struct dx_entry *entries = frame->entries, *old = frame->at;
+    uint16_t count = dx_get_count(entries);
+
+    memmove(old + 2, old + 1, (entries + count - old - 1) * sizeof(*old));
+    old[1].hash = hash;
+    old[1].block = block;
+    dx_set_count(entries, count + 1);
+    frame->dirty = 1;
+}
+
+/* copy the records in map to an empty block, packed, the last running to its end */
+static void dx_copy_dirents(uint8_t *from, uint8_t *to, struct dx_map_entry *map, int count)
+{
+    dentry_t *de = NULL, *src;
+    uint32_t off = 0;
+
+    ext2_dir_init_block(to);
+    for (int i = 0; i < count; i++) {
+        src = (dentry_t *)(from + map[i].offs);
+        de = (dentry_t *)(to + off);
+        memcpy(de, src, EXT2_DIRENT_HDR + src->name_len);
+        de->rec_len = EXT2_DIR_REC_LEN(src->name_len);
+        off += de->rec_len;
+    }
+    if (de) {
+        de->rec_len += EXT2_BLK_SIZE - off;
+    }
+}
+
+static void dx_sort_map(struct dx_map_entry *map, int count)
+{
+    for (int i = 1; i < count; i++) {
+        struct dx_map_entry e = map[i];
+        int j;
+
+        for (j = i; j > 0 && map[j - 1].hash > e.hash; j--) {
+            map[j] = map[j - 1];
+        }
+        map[j] = e;
+    }
+}
+
+/*
+ * move the upper half of a full leaf, by hash, into a new block and
+ * index it. The leaf is written and released.
+ */
+static int dx_split_leaf(ext2_file_handle *dir, struct dx_hash_info *hinfo,
+                         struct dx_frame *frame, struct buffer_head *bh)
+{
+    struct dx_map_entry map[DX_MAP_MAX];
+    struct dx_hash_info h = *hinfo;
+    struct buffer_head *nbh;
+    uint8_t *blk = (uint8_t *)bh->b_data;
+    uint8_t *tmp;
+    uint32_t hash2, lblock;
+    int count = 0, split, continued;
+    dentry_t *de;
+
+    for (uint32_t off = 0; (de = ext2_dirent_at(blk, off)); off += de->rec_len) {
+        if (!de->inode) {
+            continue;
+        }
+        ext2fs_dirhash(de->name, de->name_len, &h);
+        map[count].hash = h.hash;
+        map[count].offs = off;
+        count++;
+    }
+    if (count < 2) {
+        printk("ext2: cannot split leaf of directory %u\n", dir->inode_n);
+        brelse(bh);
+        return -1;
+    }
+    dx_sort_map(map, count);
+
+    split = count / 2;
+    hash2 = map[split].hash;
+    continued = hash2 == map[split - 1].hash;
+
+    if (!(tmp = (uint8_t *)kmalloc(EXT2_BLK_SIZE, 0))) {
+        brelse(bh);
+        return -1;
+    }
+    if (!(nbh = ext2_dir_append(dir, &lblock))) {
+        kfree(tmp);
+        brelse(bh);
+        return -1;
+    }
+    dx_copy_dirents(blk, (uint8_t *)nbh->b_data, map + split, count - split);
+    dx_copy_dirents(blk, tmp, map, split);
+    memcpy(blk, tmp, EXT2_BLK_SIZE);
+    kfree(tmp);
+
+    dx_insert_block(frame, hash2 | continued, lblock);
+    bwrite(nbh);
+    bwrite(bh);
+    return 0;
+}
+
+/* the root is full and has no nodes below it: its entries move to a new node */
+static int dx_grow_root(ext2_file_handle *dir, struct dx_frame *frames)
+{
+    struct dx_root *root = (struct dx_root *)frames[0].bh->b_data;
+    struct dx_entry *entries = frames[0].entries;
+    struct dx_entry *nentries;
+    struct buffer_head *nbh;
+    uint32_t lblock;
+
+    if (!(nbh = ext2_dir_append(dir, &lblock))) {
+        return -1;
+    }
+    nentries = ((struct dx_node *)nbh->b_data)->entries;
+    memcpy(nentries, entries, dx_get_count(entries) * sizeof(struct dx_entry));
+    dx_set_limit(nentries, DX_NODE_LIMIT);
+
+    dx_set_count(entries, 1);
+    entries[0].block = lblock;
+    root->info.indirect_levels = 1;
+    frames[0].dirty = 1;
+    bwrite(nbh);
+    return 0;
+}
+
+/* the node in frames[1] is full: its upper half moves to a new node */
+static int dx_split_node(ext2_file_handle *dir, struct dx_frame *frames)
+{
+    struct dx_entry *entries = frames[1].entries;
+    struct dx_entry *nentries;
+    struct buffer_head *nbh;
+    uint16_t count = dx_get_count(entries);
+    uint16_t split = count / 2;
+    uint32_t hash2 = entries[split].hash;
+    uint32_t lblock;
+
+    if (!(nbh = ext2_dir_append(dir, &lblock))) {
+        return -1;
+    }
+    nentries = ((struct dx_node *)nbh->b_data)->entries;
+    memcpy(nentries, entries + split, (count - split) * sizeof(struct dx_entry));
+    dx_set_limit(nentries, DX_NODE_LIMIT);
+    dx_set_count(nentries, count - split);
+
+    dx_set_count(entries, split);
+    frames[1].dirty = 1;
+    dx_insert_block(&frames[0], hash2, lblock);
+    bwrite(nbh);
+    return 0;
+}
+
+/*
+ * add d to an indexed directory. A full leaf is split, after first
+ * making room in the index above it, and the insert retried.
+ */
+int ext2_dx_add_entry(ext2_file_handle *dir, dentry_t *d)
+{
+    struct dx_frame frames[DX_MAX_LEVELS];
+    struct dx_hash_info hinfo;
+    struct buffer_head *bh;
+    struct dx_entry *entries;
+    int depth, ret;
+
+    while (1) {
+        if ((depth = dx_probe(dir, d->name, d->name_len, &hinfo, frames)) < 0) {
+            return -1;
+        }
+        if (!(bh = ext2_dir_bread(dir, frames[depth].at->block))) {
+            dx_release(frames, depth);
+            return -1;
+        }
+        ret = ext2_dirent_add((uint8_t *)bh->b_data, d);
+        if (ret <= 0) {
+            if (ret) {
+                brelse(bh);
+            }
+            else {
+                bwrite(bh);
+            }
+            dx_release(frames, depth);
+            return ret;
+        }
+
+        entries = frames[depth].entries;
+        if (dx_get_count(entries) < dx_get_limit(entries)) {
+            ret = dx_split_leaf(dir, &hinfo, &frames[depth], bh);
+        }
+        else {
+            brelse(bh);
+            if (depth == 0) {
+                ret = dx_grow_root(dir, frames);
+            }
+            else if (dx_get_count(frames[0].entries) < dx_get_limit(frames[0].entries)) {
+                ret = dx_split_node(dir, frames);
+            }
+            else {
+                printk("ext2: index of directory %u is full\n", dir->inode_n);
+                ret = -1;
+            }
+        }
+        dx_release(frames, depth);
+        if (ret) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * dir's only block is full: its records move to a new block 1, block 0
+ * becomes the root indexing it, and d goes in through the index. Takes
+ * bh, block 0. Directories made here have no "." and ".." records; the
+ * root gets them anyway, ".." free unless the old block had one.
+ */
+int ext2_dx_make_indexed(ext2_file_handle *dir, struct buffer_head *bh, dentry_t *d)
+{
+    struct dx_map_entry map[DX_MAP_MAX];
+    struct buffer_head *nbh;
+    struct dx_root *root;
+    uint8_t *blk = (uint8_t *)bh->b_data;
+    uint32_t dotdot = 0, lblock;
+    int count = 0;
+    dentry_t *de;
+
+    for (uint32_t off = 0; (de = ext2_dirent_at(blk, off)); off += de->rec_len) {
+        if (!de->inode) {
+            continue;
+        }
+        if (de->name_len == 1 && de->name[0] == '.') {
+            continue;
+        }
+        if (de->name_len == 2 && de->name[0] == '.' && de->name[1] == '.') {
+            dotdot = de->inode;
+            continue;
+        }
+        map[count++].offs = off;
+    }
+
+    if (!(nbh = ext2_dir_append(dir, &lblock))) {
+        brelse(bh);
+        return -1;
+    }
+    dx_copy_dirents(blk, (uint8_t *)nbh->b_data, map, count);
+    bwrite(nbh);
+
+    memset(blk, 0, EXT2_BLK_SIZE);
+    root = (struct dx_root *)blk;
+    root->dot.inode = dir->inode_n;
+    root->dot.rec_len = 12;
+    root->dot.name_len = 1;
+    root->dot.file_type = EXT2_FT_DIR;
+    root->dot_name[0] = '.';
+    root->dotdot.inode = dotdot;
+    root->dotdot.rec_len = EXT2_BLK_SIZE - 12;
+    root->dotdot.name_len = 2;
+    root->dotdot.file_type = EXT2_FT_DIR;
+    root->dotdot_name[0] = '.';
+    root->dotdot_name[1] = '.';
+    root->info.hash_version = super.s_def_hash_version <= DX_HASH_TEA ?
+                              super.s_def_hash_version : DX_HASH_HALF_MD4;
+    root->info.info_length = sizeof(struct dx_root_info);
+    dx_set_limit(root->entries, DX_ROOT_LIMIT);
+    dx_set_count(root->entries, 1);
+    root->entries[0].block = lblock;
+    bwrite(bh);
+
+    dir->inode.i_flags |= EXT2_INDEX_FL;
+    write_inode_table(dir->inode_n, dir->inode);
+    return ext2_dx_add_entry(dir, d);
+}
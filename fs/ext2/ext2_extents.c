@@ -0,0 +1,355 @@
+#include "ext2_extents.h"
+#include "ext2_balloc.h"
+#include "buffer.h"
+#include "serial.h"
+#include "string.h"
+
+/*
+ * extent tree lookup and insertion. Lookup is a binary search per level,
+ * so a file laid out in a few long runs maps with no metadata reads at
+ * all while the tree fits in the inode. Insertion extends the extent a
+ * new block continues, else adds one; a full node is split (or, for the
+ * root, pushed down into a new block) and the insert is retried.
+ */
+
+extern dev_t filesys_dev;
+
+#define ROOT_MAX ((sizeof(((inode_t *)0)->i_block) - sizeof(struct ext4_extent_header)) / \
+                  sizeof(struct ext4_extent))
+#define NODE_MAX ((EXT2_BLK_SIZE - sizeof(struct ext4_extent_header)) / sizeof(struct ext4_extent))
+
+/* one level of a walk from the root down */
+struct ext_path {
+    struct ext4_extent_header *eh;
+    struct buffer_head *bh; //NULL for the root, which lives in the inode
+    int pos; //entry followed (index) or found (leaf), -1 for none
+    int dirty;
+};
+
+static inline uint32_t ext_len(struct ext4_extent *ex)
+{
+    return ex->ee_len > EXT_INIT_MAX_LEN ? ex->ee_len - EXT_INIT_MAX_LEN : ex->ee_len;
+}
+
+static int ext_check_header(struct ext4_extent_header *eh, int depth)
+{
+    if (eh->eh_magic != EXT4_EXT_MAGIC || eh->eh_entries > eh->eh_max ||
+        (depth >= 0 && eh->eh_depth != depth)) {
+        printk("ext2: bad extent header\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * last entry whose first block is at or below block, -1 if there is
+ * none. Index and leaf entries are the same size and both lead with
+ * their first block, so one search serves both.
+ */
+static int ext_binsearch(struct ext4_extent_header *eh, uint32_t block)
+{
+    struct ext4_extent *e = EXT_FIRST_EXTENT(eh);
+    int lo = 0, hi = eh->eh_entries - 1;
+
+    if (hi < 0 || e[0].ee_block > block) {
+        return -1;
+    }
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+
+        if (e[mid].ee_block <= block) {
+            lo = mid;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+static void ext_release_path(struct ext_path *path, int depth)
+{
+    for (int k = 1; k <= depth; k++) {
+        if (!path[k].bh) {
+            continue;
+        }
+        if (path[k].dirty) {
+            bwrite(path[k].bh);
+        }
+        else {
+            brelse(path[k].bh);
+        }
+        path[k].bh = NULL;
+    }
+}
+
+/* walk to the leaf that maps, or would map, block; returns the depth, or -1 */
+static int ext_find_path(uint32_t *i_block, uint32_t block, struct ext_path *path)
+{
+    struct ext4_extent_header *eh = (struct ext4_extent_header *)i_block;
+    struct buffer_head *bh;
+    int depth;
+
+    if (ext_check_header(eh, -1)) {
+        return -1;
+    }
+    depth = eh->eh_depth;
+    if (depth > EXT_MAX_DEPTH) {
+        printk("ext2: extent tree %d deep\n", depth);
+        return -1;
+    }
+
+    path[0].eh = eh;
+    path[0].bh = NULL;
+    path[0].dirty = 0;
+    for (int k = 0; ; k++) {
+        path[k].pos = ext_binsearch(path[k].eh, block);
+        if (k == depth) {
+            return depth;
+        }
+        if (!path[k].eh->eh_entries) {
+            printk("ext2: empty extent index\n");
+            ext_release_path(path, k);
+            return -1;
+        }
+        if (path[k].pos < 0) {
+            path[k].pos = 0; //below the first key: the first child
+        }
+
+        bh = bread(filesys_dev, EXT_FIRST_INDEX(path[k].eh)[path[k].pos].ei_leaf_lo);
+        if (!bh) {
+            printk("ext2: cannot read extent node\n");
+            ext_release_path(path, k);
+            return -1;
+        }
+        path[k + 1].bh = bh;
+        path[k + 1].eh = (struct ext4_extent_header *)bh->b_data;
+        path[k + 1].dirty = 0;
+        if (ext_check_header(path[k + 1].eh, depth - k - 1)) {
+            ext_release_path(path, k + 1);
+            return -1;
+        }
+    }
+}
+
+void ext2_ext_tree_init(inode_t *inode)
+{
+    struct ext4_extent_header *eh = (struct ext4_extent_header *)inode->i_block;
+
+    memset(inode->i_block, 0, sizeof(inode->i_block));
+    eh->eh_magic = EXT4_EXT_MAGIC;
+    eh->eh_max = ROOT_MAX;
+    inode->i_flags |= EXT4_EXTENTS_FL;
+}
+
+/*
+ * physical block for logical block of the tree rooted in i_block, 0 for
+ * a hole. len, if set, gets the blocks from there to the extent's end.
+ */
+uint32_t ext2_ext_map(uint32_t *i_block, uint32_t block, uint32_t *len)
+{
+    struct ext_path path[EXT_MAX_DEPTH + 1];
+    struct ext4_extent *ex;
+    uint32_t pblock = 0;
+    int depth = ext_find_path(i_block, block, path);
+
+    if (depth < 0) {
+        return 0;
+    }
+    if (path[depth].pos >= 0) {
+        ex = EXT_FIRST_EXTENT(path[depth].eh) + path[depth].pos;
+        // unwritten extents read as holes
+        if (ex->ee_len <= EXT_INIT_MAX_LEN && block - ex->ee_block < ex->ee_len) {
+            pblock = ex->ee_start_lo + (block - ex->ee_block);
+            if (len) {
+                *len = ex->ee_len - (block - ex->ee_block);
+            }
+        }
+    }
+    ext_release_path(path, depth);
+    return pblock;
+}
+
+static struct buffer_head *ext_new_node(inode_t *inode, uint32_t inode_n, uint16_t depth)
+{
+    struct ext4_extent_header *eh;
+    struct buffer_head *bh;
+    uint32_t blk;
+
+    if (ext2_new_block(ext2_inode_goal(inode_n), &blk, NULL, NULL)) {
+        return NULL;
+    }
+    bh = getblk(filesys_dev, blk);
+    if (!bh) {
+        ext2_free_blocks(blk, 1);
+        return NULL;
+    }
+    memset(bh->b_data, 0, EXT2_BLK_SIZE);
+    eh = (struct ext4_extent_header *)bh->b_data;
+    eh->eh_magic = EXT4_EXT_MAGIC;
+    eh->eh_max = NODE_MAX;
+    eh->eh_depth = depth;
+    inode->i_blocks += EXT2_BLK_SIZE / DISK_SECTOR_SIZE;
+    return bh;
+}
+
+/* the root is full: its entries move to a new block, which becomes the root's only child */
+static int ext_grow_root(inode_t *inode, uint32_t inode_n)
+{
+    struct ext4_extent_header *root = (struct ext4_extent_header *)inode->i_block;
+    struct ext4_extent_header *eh;
+    struct ext4_extent_idx *ix;
+    struct buffer_head *bh;
+
+    if (root->eh_depth >= EXT_MAX_DEPTH) {
+        printk("ext2: extent tree of inode %u is full\n", inode_n);
+        return -1;
+    }
+    bh = ext_new_node(inode, inode_n, root->eh_depth);
+    if (!bh) {
+        return -1;
+    }
+    eh = (struct ext4_extent_header *)bh->b_data;
+    memcpy(eh + 1, root + 1, root->eh_entries * sizeof(struct ext4_extent));
+    eh->eh_entries = root->eh_entries;
+
+    ix = EXT_FIRST_INDEX(root);
+    ix->ei_block = EXT_FIRST_EXTENT(eh)->ee_block;
+    ix->ei_leaf_lo = bh->b_blocknr;
+    ix->ei_leaf_hi = 0;
+    ix->ei_unused = 0;
+    root->eh_entries = 1;
+    root->eh_depth++;
+    bwrite(bh);
+    return 0;
+}
+
+/*
+ * split full node path[k] into a new block, its parent having room for
+ * the index entry. Appending past a leaf's last extent starts an empty
+ * leaf so sequential files pack their leaves full; anything else moves
+ * the upper half.
+ */
+static int ext_split(inode_t *inode, uint32_t inode_n, struct ext_path *path, int k, uint32_t block)
+{
+    struct ext4_extent_header *eh = path[k].eh, *neh;
+    struct ext4_extent_header *parent = path[k - 1].eh;
+    struct ext4_extent *e = EXT_FIRST_EXTENT(eh);
+    struct ext4_extent_idx *ix;
+    struct buffer_head *bh;
+    int n = eh->eh_entries;
+    int m = (eh->eh_depth == 0 && path[k].pos == n - 1) ? n : n / 2;
+
+    bh = ext_new_node(inode, inode_n, eh->eh_depth);
+    if (!bh) {
+        return -1;
+    }
+    neh = (struct ext4_extent_header *)bh->b_data;
+    memcpy(neh + 1, e + m, (n - m) * sizeof(struct ext4_extent));
+    neh->eh_entries = n - m;
+    eh->eh_entries = m;
+    path[k].dirty = 1;
+
+    // the new node's entry goes right after the old one's
+    ix = EXT_FIRST_INDEX(parent) + path[k - 1].pos + 1;
+    memmove(ix + 1, ix, (parent->eh_entries - path[k - 1].pos - 1) * sizeof(*ix));
+    ix->ei_block = (m < n) ? e[m].ee_block : block;
+    ix->ei_leaf_lo = bh->b_blocknr;
+    ix->ei_leaf_hi = 0;
+    ix->ei_unused = 0;
+    parent->eh_entries++;
+    path[k - 1].dirty = 1;
+    bwrite(bh);
+    return 0;
+}
+
+/*
+ * map logical block to pblock. The caller writes the inode afterwards:
+ * the root and i_blocks may have changed, even on failure.
+ */
+int ext2_ext_insert(inode_t *inode, uint32_t inode_n, uint32_t block, uint32_t pblock)
+{
+    struct ext_path path[EXT_MAX_DEPTH + 1];
+    struct ext4_extent_header *eh;
+    struct ext4_extent *ex;
+    int depth, pos, k, ret;
+
+    while (1) {
+        depth = ext_find_path(inode->i_block, block, path);
+        if (depth < 0) {
+            return -1;
+        }
+        eh = path[depth].eh;
+        pos = path[depth].pos;
+        ex = EXT_FIRST_EXTENT(eh);
+        ret = 0;
+
+        if (pos >= 0 && block - ex[pos].ee_block < ext_len(&ex[pos])) {
+            printk("ext2: block %u of inode %u already mapped\n", block, inode_n);
+            ret = -1;
+            break;
+        }
+
+        // the run before continues into this block
+        if (pos >= 0 && ex[pos].ee_len < EXT_INIT_MAX_LEN &&
+            block == ex[pos].ee_block + ex[pos].ee_len &&
+            pblock == ex[pos].ee_start_lo + ex[pos].ee_len) {
+            ex[pos].ee_len++;
+            path[depth].dirty = 1;
+            break;
+        }
+        // or the run after starts right behind it
+        if (pos + 1 < eh->eh_entries && ex[pos + 1].ee_len < EXT_INIT_MAX_LEN &&
+            block + 1 == ex[pos + 1].ee_block && pblock + 1 == ex[pos + 1].ee_start_lo) {
+            ex[pos + 1].ee_block--;
+            ex[pos + 1].ee_start_lo--;
+            ex[pos + 1].ee_len++;
+            path[depth].dirty = 1;
+            break;
+        }
+
+        if (eh->eh_entries < eh->eh_max) {
+            ex += pos + 1;
+            memmove(ex + 1, ex, (eh->eh_entries - pos - 1) * sizeof(*ex));
+            ex->ee_block = block;
+            ex->ee_len = 1;
+            ex->ee_start_hi = 0;
+            ex->ee_start_lo = pblock;
+            eh->eh_entries++;
+            path[depth].dirty = 1;
+            break;
+        }
+
+        // the leaf is full: split below the lowest ancestor with room, or push the root down
+        for (k = depth - 1; k >= 0 && path[k].eh->eh_entries == path[k].eh->eh_max; k--)
+            ;
+        if (k < 0) {
+            ret = ext_grow_root(inode, inode_n);
+        }
+        else {
+            ret = ext_split(inode, inode_n, path, k + 1, block);
+        }
+        ext_release_path(path, depth);
+        if (ret) {
+            return -1;
+        }
+    }
+    // a new first extent lowers the leaf's key, and with it every index
+    // key above that still starts its node
+    if (!ret && pos < 0) {
+        for (k = depth - 1; k >= 0; k--) {
+            struct ext4_extent_idx *ix = EXT_FIRST_INDEX(path[k].eh) + path[k].pos;
+
+            if (ix->ei_block <= block) {
+                break;
+            }
+            ix->ei_block = block;
+            path[k].dirty = 1;
+            if (path[k].pos != 0) {
+                break;
+            }
+        }
+    }
+    ext_release_path(path, depth);
+    return ret;
+}
@@ -6,6 +6,8 @@
 #include "slab.h"
 #include "namei.h"
 #include "task.h"
+#include "buffer.h"
+#include "bio.h"
 
 /* Forward declarations */
 static ssize_t ext2_file_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos);
@@ -13,6 +15,7 @@ static ssize_t ext2_file_write(struct file *filp, const char __user *buf, size_t
 static int ext2_file_open(struct inode *inode, struct file *filp);
 static int ext2_file_release(struct inode *inode, struct file *filp);
 static loff_t ext2_llseek(struct file *file, loff_t offset, int whence);
+static int ext2_fsync(struct file *filp, int datasync);
 
 extern struct task_struct *current;
 
@@ -24,7 +27,7 @@ struct file_operations ext2_file_operations = {
     .write = ext2_file_write,
     .open = ext2_file_open,
     .release = ext2_file_release,
-    .fsync = NULL,
+    .fsync = ext2_fsync,
 };
 
 extern kmem_cache_t *file_cache;
@@ -45,7 +48,9 @@ static int ext2_file_open(struct inode *inode, struct file *filp)
 /* File release operation */
 static int ext2_file_release(struct inode *inode, struct file *filp)
 {
-    /* Nothing special to do */
+    if (inode) {
+        ext2_discard_prealloc(inode);
+    }
     return 0;
 }
 
@@ -122,7 +127,7 @@ static ssize_t ext2_file_read(struct file *filp, char __user *buf, size_t count,
         }
         
         /* Get block number for this file offset */
-        uint32_t block_num = indirect_block(*(inode_t*)inode, block_idx);
+        uint32_t block_num = ext2_bmap(inode, block_idx);
         if (block_num == 0) {
             break;  /* Sparse file or error */
         }
@@ -150,6 +155,7 @@ static ssize_t ext2_file_read(struct file *filp, char __user *buf, size_t count,
 static ssize_t ext2_file_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos)
 {
     struct inode *inode;
+    inode_t disk_inode;
     loff_t pos;
     size_t written_bytes = 0;
     uint32_t block_size = EXT2_BLK_SIZE;
@@ -164,6 +170,7 @@ static ssize_t ext2_file_write(struct file *filp, const char __user *buf, size_t
     }
     
     pos = *ppos;
+    disk_inode = get_inode(inode->i_no);
     
     /* Write data block by block */
     while (written_bytes < count) {
@@ -176,17 +183,23 @@ static ssize_t ext2_file_write(struct file *filp, const char __user *buf, size_t
         }
         
         /* Get or allocate block for this file offset */
-        uint32_t block_num = indirect_block(*(inode_t*)inode, block_idx);
+        uint32_t block_num = ext2_bmap(inode, block_idx);
         
         if (block_num == 0) {
-            /* Need to allocate a new block */
-            if (reserve_free_block(&block_num) != 0) {
+            /* Need to allocate a new block, next to the last one */
+            if (ext2_alloc_block(inode, ext2_find_goal(inode, block_idx), &block_num) != 0) {
                 break;  /* No free blocks */
             }
             
             /* Update inode with new block */
-            /* This is simplified - in reality we'd need to update the inode properly */
+            inode->i_blocks += block_size / DISK_SECTOR_SIZE;
+            disk_inode.i_blocks = inode->i_blocks;
+            set_i_block(&disk_inode, inode->i_no, block_idx, block_num);
+            inode->i_blocks = disk_inode.i_blocks; //indirect or extent blocks too
+            ext2_bmap_update(inode, &disk_inode);
         }
+        inode->u.ext2_i.i_next_alloc_block = block_idx + 1;
+        inode->u.ext2_i.i_next_alloc_goal = block_num + 1;
         
         /* Read block using buffer cache */
         struct buffer_head *bh = bread(inode->i_dev, block_num);
@@ -215,6 +228,19 @@ static ssize_t ext2_file_write(struct file *filp, const char __user *buf, size_t
     return written_bytes;
 }
 
+/*
+ * file data goes out with bwrite() as it is written, so all that is left
+ * is to get it out of the drive's write cache. Nothing here writes the
+ * inode either, so fdatasync has nothing less to do.
+ */
+static int ext2_fsync(struct file *filp, int datasync __attribute__((unused)))
+{
+    if (!filp || !filp->f_dentry || !filp->f_dentry->d_inode) {
+        return -1;
+    }
+    return blkdev_issue_flush(filp->f_dentry->d_inode->i_dev);
+}
+
 void init_file_entry(struct file *file)
 {
     file->f_count++;
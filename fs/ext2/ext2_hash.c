@@ -0,0 +1,231 @@
+#include "ext2_dir.h"
+#include "serial.h"
+#include "string.h"
+
+/*
+ * directory name hashes, as ext3 computes them so indexes built by either
+ * side can be read by the other. The superblock picks the function
+ * (s_def_hash_version) and may seed it (s_hash_seed).
+ */
+
+#define DELTA 0x9e3779b9
+
+static void tea_transform(uint32_t buf[4], const uint32_t in[])
+{
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+    int n = 16;
+
+    do {
+        sum += DELTA;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    } while (--n);
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/* the MD4 selection, majority and parity functions */
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+
+#define ROUND(f, a, b, c, d, x, s) \
+    (a += f(b, c, d) + x, a = (a << s) | (a >> (32 - s)))
+#define K1 0
+#define K2 013240474631U
+#define K3 015666365641U
+
+/* MD4 with half the rounds and a 32 byte input */
+static void half_md4_transform(uint32_t buf[4], const uint32_t in[])
+{
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    ROUND(F, a, b, c, d, in[0] + K1, 3);
+    ROUND(F, d, a, b, c, in[1] + K1, 7);
+    ROUND(F, c, d, a, b, in[2] + K1, 11);
+    ROUND(F, b, c, d, a, in[3] + K1, 19);
+    ROUND(F, a, b, c, d, in[4] + K1, 3);
+    ROUND(F, d, a, b, c, in[5] + K1, 7);
+    ROUND(F, c, d, a, b, in[6] + K1, 11);
+    ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+    ROUND(G, a, b, c, d, in[1] + K2, 3);
+    ROUND(G, d, a, b, c, in[3] + K2, 5);
+    ROUND(G, c, d, a, b, in[5] + K2, 9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2, 3);
+    ROUND(G, d, a, b, c, in[2] + K2, 5);
+    ROUND(G, c, d, a, b, in[4] + K2, 9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+    ROUND(H, a, b, c, d, in[3] + K3, 3);
+    ROUND(H, d, a, b, c, in[7] + K3, 9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3, 3);
+    ROUND(H, d, a, b, c, in[5] + K3, 9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+static uint32_t dx_hack_hash(const char *name, int len)
+{
+    uint32_t hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+    while (len--) {
+        uint32_t hash = hash1 + (hash0 ^ (*name++ * 7152373));
+
+        if (hash & 0x80000000) {
+            hash -= 0x7fffffff;
+        }
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+/* pack up to num words of name into buf, padding with the length */
+static void str2hashbuf(const char *msg, int len, uint32_t *buf, int num)
+{
+    uint32_t pad, val;
+
+    pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+
+    val = pad;
+    if (len > num * 4) {
+        len = num * 4;
+    }
+    for (int i = 0; i < len; i++) {
+        if ((i % 4) == 0) {
+            val = pad;
+        }
+        val = msg[i] + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0) {
+        *buf++ = val;
+    }
+    while (--num >= 0) {
+        *buf++ = pad;
+    }
+}
+
+int ext2fs_dirhash(const char *name, int len, struct dx_hash_info *hinfo)
+{
+    uint32_t hash, minor_hash = 0;
+    uint32_t in[8], buf[4];
+    int i;
+
+    buf[0] = 0x67452301;
+    buf[1] = 0xefcdab89;
+    buf[2] = 0x98badcfe;
+    buf[3] = 0x10325476;
+
+    // an all zero seed means the default one
+    if (hinfo->seed) {
+        for (i = 0; i < 4 && !hinfo->seed[i]; i++)
+            ;
+        if (i < 4) {
+            memcpy(buf, hinfo->seed, sizeof(buf));
+        }
+    }
+
+    switch (hinfo->hash_version) {
+    case DX_HASH_LEGACY:
+        hash = dx_hack_hash(name, len);
+        break;
+    case DX_HASH_HALF_MD4:
+        for (; len > 0; len -= 32, name += 32) {
+            str2hashbuf(name, len, in, 8);
+            half_md4_transform(buf, in);
+        }
+        minor_hash = buf[2];
+        hash = buf[1];
+        break;
+    case DX_HASH_TEA:
+        for (; len > 0; len -= 16, name += 16) {
+            str2hashbuf(name, len, in, 4);
+            tea_transform(buf, in);
+        }
+        hash = buf[0];
+        minor_hash = buf[1];
+        break;
+    default:
+        hinfo->hash = 0;
+        return -1;
+    }
+
+    hash &= ~1;
+    if (hash == ((uint32_t)EXT2_HTREE_EOF << 1)) {
+        hash = ((uint32_t)EXT2_HTREE_EOF - 1) << 1;
+    }
+    hinfo->hash = hash;
+    hinfo->minor_hash = minor_hash;
+    return 0;
+}
+
+/* hashes and minor hashes as e2fsprogs' dx_hash gives them */
+static const struct {
+    const char *name;
+    int version;
+    int seeded;
+    uint32_t hash;
+    uint32_t minor_hash;
+} dirhash_vectors[] = {
+    { ".", DX_HASH_LEGACY, 0, 0x71d73e48, 0 },
+    { "lost+found", DX_HASH_LEGACY, 0, 0x5e2aba24, 0 },
+    { "hello", DX_HASH_LEGACY, 0, 0x32252546, 0 },
+    { "a_file_name_longer_than_thirty_two_bytes_x", DX_HASH_LEGACY, 0, 0xd37ef290, 0 },
+    { ".", DX_HASH_HALF_MD4, 0, 0x3df9c490, 0x700a9a17 },
+    { "lost+found", DX_HASH_HALF_MD4, 0, 0x591de422, 0x6ffc56e0 },
+    { "hello", DX_HASH_HALF_MD4, 0, 0x1746da32, 0x420013b5 },
+    { "a_file_name_longer_than_thirty_two_bytes_x", DX_HASH_HALF_MD4, 0, 0x0f586fb8, 0xc72fc730 },
+    { "hello", DX_HASH_HALF_MD4, 1, 0x344ca36e, 0x2ef16de2 },
+    { ".", DX_HASH_TEA, 0, 0x31fd669c, 0x12dc5935 },
+    { "lost+found", DX_HASH_TEA, 0, 0x2dbf9e80, 0xbfebee4f },
+    { "hello", DX_HASH_TEA, 0, 0x6f5bb1a8, 0x231917c2 },
+    { "a_file_name_longer_than_thirty_two_bytes_x", DX_HASH_TEA, 0, 0xaa070d74, 0x428db918 },
+    { "hello", DX_HASH_TEA, 1, 0x9e019d48, 0xb0a99d55 },
+};
+
+void test_dirhash(void)
+{
+    /* s_hash_seed 00112233-4455-6677-8899-aabbccddeeff */
+    uint32_t seed[4] = { 0x33221100, 0x77665544, 0xbbaa9988, 0xffeeddcc };
+    struct dx_hash_info hinfo;
+    int failed = 0;
+    unsigned int i;
+
+    printk("testing directory hashes .............\n");
+    for (i = 0; i < sizeof(dirhash_vectors) / sizeof(dirhash_vectors[0]); i++) {
+        hinfo.hash_version = dirhash_vectors[i].version;
+        hinfo.seed = dirhash_vectors[i].seeded ? seed : NULL;
+        if (ext2fs_dirhash(dirhash_vectors[i].name, strlen(dirhash_vectors[i].name), &hinfo) ||
+            hinfo.hash != dirhash_vectors[i].hash ||
+            hinfo.minor_hash != dirhash_vectors[i].minor_hash) {
+            printk(" hash %d of %s: got %x/%x want %x/%x\n",
+                   dirhash_vectors[i].version, dirhash_vectors[i].name,
+                   hinfo.hash, hinfo.minor_hash,
+                   dirhash_vectors[i].hash, dirhash_vectors[i].minor_hash);
+            failed++;
+        }
+    }
+    if (failed) {
+        printk("directory hashes: %d failed\n", failed);
+    } else {
+        printk("directory hashes ok\n");
+    }
+}
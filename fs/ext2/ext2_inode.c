@@ -3,12 +3,16 @@
 #include "serial.h"
 #include "string.h"
 #include "slab.h"
+#include "buffer.h"
+#include "ext2_balloc.h"
+#include "ext2_extents.h"
 
 #define S_BLOCK_SIZE 1024
 
 /* External references */
 extern bgdesc_t bgdt[1024];
 extern ext2_super_block super;
+extern dev_t filesys_dev;
 
 /* External operation tables */
 extern struct inode_operations ext2_dir_inode_operations;
@@ -35,7 +39,7 @@ void write_inode_table(uint32_t inode_n, inode_t new_inode)
 
     uint8_t buf[S_BLOCK_SIZE];
 
-    bh = bread(DEV_NO, block_to_update);
+    bh = bread(filesys_dev, block_to_update);
 
     if (!bh) {
         printk("failed to read block %d\n", block_to_update);
@@ -65,13 +69,14 @@ struct inode *ext2_new_inode(struct inode *dir, int mode)
     struct inode *inode;
     
     /* Allocate inode number */
-    if (reserve_free_inode(&free_inode_n) != 0) {
+    if (ext2_new_inode_num(dir ? dir->i_no : EXT2_ROOT_INO, !!(mode & EXT2_S_IFDIR),
+                           &free_inode_n) != 0) {
         printk("ext2_new_inode: no free inodes\n");
         return NULL;
     }
     
     /* Get VFS inode structure */
-    inode = iget(dir ? dir->i_dev : DEV_NO, free_inode_n);
+    inode = iget(dir ? dir->i_dev : filesys_dev, free_inode_n);
     if (!inode) {
         printk("ext2_new_inode: failed to get inode\n");
         return NULL;
@@ -96,6 +101,62 @@ struct inode *ext2_new_inode(struct inode *dir, int mode)
     return inode;
 }
 
+/* give the unused part of the preallocation window back */
+void ext2_discard_prealloc(struct inode *inode)
+{
+    struct ext2_inode_info *ei = &inode->u.ext2_i;
+
+    if (ei->i_prealloc_count) {
+        ext2_free_blocks(ei->i_prealloc_block, ei->i_prealloc_count);
+        ei->i_prealloc_count = 0;
+    }
+}
+
+/* the window outlives a write call, not the last reference */
+void ext2_put_inode(struct inode *inode)
+{
+    if (inode->i_count == 1) {
+        ext2_discard_prealloc(inode);
+    }
+}
+
+/*
+ * allocate a data block for inode near goal: from the preallocation
+ * window if goal is where it starts, else a fresh search that opens a
+ * new window behind the block found
+ */
+int ext2_alloc_block(struct inode *inode, uint32_t goal, uint32_t *block_n)
+{
+    struct ext2_inode_info *ei = &inode->u.ext2_i;
+
+    if (ei->i_prealloc_count && goal == ei->i_prealloc_block) {
+        *block_n = ei->i_prealloc_block++;
+        ei->i_prealloc_count--;
+        return 0;
+    }
+    ext2_discard_prealloc(inode);
+
+    if (!(inode->i_mode & EXT2_S_IFDIR)) {
+        return ext2_new_block(goal, block_n, &ei->i_prealloc_block, &ei->i_prealloc_count);
+    }
+    return ext2_new_block(goal, block_n, NULL, NULL);
+}
+
+/*
+ * where logical block block_idx of inode should go: right after the
+ * block given to its predecessor when the file grows sequentially, else
+ * the start of the inode's group
+ */
+uint32_t ext2_find_goal(struct inode *inode, uint32_t block_idx)
+{
+    struct ext2_inode_info *ei = &inode->u.ext2_i;
+
+    if (block_idx == ei->i_next_alloc_block && ei->i_next_alloc_goal) {
+        return ei->i_next_alloc_goal;
+    }
+    return ei->i_block_group * super.s_blocks_per_group;
+}
+
 /* Free an ext2 inode */
 void ext2_free_inode(struct inode *inode)
 {
@@ -103,9 +164,11 @@ void ext2_free_inode(struct inode *inode)
         return;
     }
     
-    /* Free inode bitmap */
-    unset_inode_bitmap(inode->i_no);
+    /* Free the inode number */
+    ext2_free_inode_num(inode->i_no, !!(inode->i_mode & EXT2_S_IFDIR));
     
+    ext2_discard_prealloc(inode);
+
     /* TODO: Free data blocks */
     
     printk("ext2_free_inode: freed inode %d\n", inode->i_no);
@@ -133,6 +196,11 @@ void ext2_read_inode(struct inode *inode)
     inode->i_ctime = disk_inode.i_ctime;
     inode->i_blocks = disk_inode.i_blocks;
     inode->i_nlinks = disk_inode.i_links_count;
+
+    memset(&inode->u.ext2_i, 0, sizeof(inode->u.ext2_i));
+    inode->u.ext2_i.i_block_group = (inode->i_no - 1) / super.s_inodes_per_group;
+    memcpy(inode->u.ext2_i.i_data, disk_inode.i_block, sizeof(disk_inode.i_block));
+    inode->u.ext2_i.i_flags = disk_inode.i_flags;
     
     /* Set operations based on file type */
     if (disk_inode.i_mode & EXT2_S_IFDIR) {
@@ -186,20 +254,77 @@ void ext2_delete_inode(struct inode *inode)
     ext2_free_inode(inode);
 }
 
+/*
+ * logical to physical block map with a cache in the in-core inode. The
+ * run the last lookup landed in (an extent, or consecutive pointers in
+ * one mapping block) answers a sequential reader without any metadata
+ * access; past it, the leaf indirect blocks resolved last save the
+ * walk through the double indirect block.
+ */
+uint32_t ext2_bmap(struct inode *inode, uint32_t block)
+{
+    struct ext2_inode_info *ei = &inode->u.ext2_i;
+    uint32_t per = EXT2_BLK_SIZE / sizeof(uint32_t);
+    uint32_t pblock, run = 1, leaf, base = 0;
+    int i;
+
+    if (block - ei->i_cache_lblock < ei->i_cache_len) {
+        return ei->i_cache_pblock + (block - ei->i_cache_lblock);
+    }
+
+    if (ei->i_flags & EXT4_EXTENTS_FL) {
+        pblock = ext2_ext_map(ei->i_data, block, &run);
+    }
+    else {
+        // first logical block of the leaf indirect block that maps block
+        if (block >= EXT2_NDIR_BLOCKS + per) {
+            base = EXT2_NDIR_BLOCKS + per + (block - EXT2_NDIR_BLOCKS - per) / per * per;
+        }
+        for (i = 0; base && i < EXT2_IND_CACHE; i++) {
+            if (ei->i_ind_cache[i].ic_block && ei->i_ind_cache[i].ic_lblock == base) {
+                break;
+            }
+        }
+        if (base && i < EXT2_IND_CACHE) {
+            pblock = ext2_ind_lookup(ei->i_ind_cache[i].ic_block, block - base, &run);
+        }
+        else {
+            pblock = ext2_block_map(ei->i_data, block, &run, &leaf);
+            if (base && leaf) {
+                ei->i_ind_cache[ei->i_ind_next].ic_lblock = base;
+                ei->i_ind_cache[ei->i_ind_next].ic_block = leaf;
+                ei->i_ind_next = (ei->i_ind_next + 1) % EXT2_IND_CACHE;
+            }
+        }
+    }
+
+    if (pblock) {
+        ei->i_cache_lblock = block;
+        ei->i_cache_pblock = pblock;
+        ei->i_cache_len = run;
+    }
+    return pblock;
+}
+
+/* the map changed on disk: take the new i_block, drop what was cached */
+void ext2_bmap_update(struct inode *inode, inode_t *disk_inode)
+{
+    struct ext2_inode_info *ei = &inode->u.ext2_i;
+
+    memcpy(ei->i_data, disk_inode->i_block, sizeof(ei->i_data));
+    ei->i_flags = disk_inode->i_flags;
+    ei->i_cache_len = 0;
+    memset(ei->i_ind_cache, 0, sizeof(ei->i_ind_cache));
+}
+
 /* Get block number for file offset */
 int ext2_get_block(struct inode *inode, uint32_t block_idx, uint32_t *block_num)
 {
-    inode_t disk_inode;
-    
     if (!inode || !block_num) {
         return -1;
     }
     
-    /* Read inode from disk */
-    disk_inode = get_inode(inode->i_no);
-    
-    /* Get block number */
-    *block_num = indirect_block(disk_inode, block_idx);
+    *block_num = ext2_bmap(inode, block_idx);
     
     return 0;
 }
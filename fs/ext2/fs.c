@@ -12,6 +12,11 @@
 #include "vfs.h"
 #include "dcache.h"
 #include "ext2_balloc.h"
+#include "ext2_extents.h"
+#include "ext2_dir.h"
+#include "buffer.h"
+#include "bio.h"
+#include "blkdev.h"
 
 #define KLOG(fmt, ...) printk("[ext2] " fmt "\n", ##__VA_ARGS__)
 
@@ -22,9 +27,8 @@
 #define SUPERBLOCK_OFFSET   SECTORS_PER_BLOCK
 
 
-// TODO: maybe...move this into the "disk" section?
-// in general, how to handle disk partitions.
-uint32_t filesys_start; // used for correct linear base addressing.
+// the device (partition) the filesystem lives on; blocks count from its start
+dev_t filesys_dev;
 uint8_t fs_start_set = 0;
 uint16_t n_block_groups;
 
@@ -37,21 +41,26 @@ ext2_super_block super;
 int disk_read_blk(uint32_t block_num, uint8_t *buf) {
     if (!fs_start_set) return 1;
 
-    uint32_t lba = filesys_start + block_num * SECTORS_PER_BLOCK;
+    uint32_t lba = block_num * SECTORS_PER_BLOCK;
 
-    for (int i = 0; i < SECTORS_PER_BLOCK; i++) {
-        disk_read(lba + i, buf + DISK_SECTOR_SIZE * i);
-    }
-    return 0;
+    return bio_rw_buf(filesys_dev, BIO_READ, lba, buf, S_BLOCK_SIZE);
 }
 
 int disk_write_blk(uint32_t block_num, uint8_t *buf) {
     if (!fs_start_set) return -1;
 
-    uint32_t lba = filesys_start + block_num * SECTORS_PER_BLOCK;
-    for (int i = 0; i < SECTORS_PER_BLOCK; i++) {
-        disk_write(lba + i, buf + DISK_SECTOR_SIZE * i, DISK_SECTOR_SIZE);
-    }
+    uint32_t lba = block_num * SECTORS_PER_BLOCK;
+
+    return bio_rw_buf(filesys_dev, BIO_WRITE, lba, buf, S_BLOCK_SIZE);
+}
+
+/* write-behind variant for metadata batched under blk_plug() */
+int disk_write_blk_nowait(uint32_t block_num, uint8_t *buf) {
+    if (!fs_start_set) return -1;
+
+    uint32_t lba = block_num * SECTORS_PER_BLOCK;
+
+    return bio_write_buf_nowait(filesys_dev, lba, buf, S_BLOCK_SIZE);
 }
 
 // TODO: replace disk_write_blk with disk_write_bn
@@ -59,9 +68,9 @@ int disk_write_bn(uint32_t block_num, uint8_t *buf, uint16_t len) {
     if (!fs_start_set) return -1;
     if (len > S_BLOCK_SIZE) return -1;
 
-    uint32_t lba = filesys_start + block_num * SECTORS_PER_BLOCK;
+    uint32_t lba = block_num * SECTORS_PER_BLOCK;
 
-    disk_write(lba, buf, len);
+    return bio_rw_buf(filesys_dev, BIO_WRITE, lba, buf, len);
 }
 
 
@@ -70,6 +79,7 @@ int disk_write_bn(uint32_t block_num, uint8_t *buf, uint16_t len) {
 
 inode_t new_dir_inode() {
     inode_t new_inode;
+    memset(&new_inode, 0, sizeof(inode_t));
     new_inode.i_mode = EXT2_S_IFDIR;
     new_inode.i_links_count = 1;
     new_inode.i_blocks = 0; 
@@ -81,19 +91,6 @@ inode_t new_dir_inode() {
 }
 
 
-// used for getting the filesystem superblock location
-// from a given filesystem start point (in Mb)
-uint32_t fs_start_to_lba_superblk(uint32_t mb_start) {
-    // adding a block's worth of sectors (SECTORS_PER_BLOCK)
-    // to the initial write address, since the first block 
-    // is reserved for boot records on ext2 (which we don't use).
-    //
-    // the write_addr is lba, so it's measured in disk sectors
-    // (512 byte units)
-    return mb_to_lba(mb_start) + SUPERBLOCK_OFFSET;
-}
-
-
 void set_superblock() {
     // set superblock 
     ext2_super_block b;
@@ -128,18 +125,38 @@ void set_bgdt() {
     }
 }
 
-void read_fs(uint32_t fs_start_in_mb) {
+/* 0 if we understand every incompatible feature es uses, else -1 */
+static int ext2_check_features(ext2_super_block *es)
+{
+    uint32_t unknown;
+
+    if (es->s_rev_level < EXT2_DYNAMIC_REV) {
+        return 0;
+    }
+    unknown = es->s_feature_incompat & ~EXT2_FEATURE_INCOMPAT_SUPP;
+    if (unknown) {
+        printk("ext2: unsupported incompatible features 0x%x\n", unknown);
+        return -1;
+    }
+    return 0;
+}
+
+int read_fs(dev_t dev) {
     // file-global
-    filesys_start = mb_to_lba(fs_start_in_mb);
+    filesys_dev = dev;
     fs_start_set = 1;
 
     // once filesys is set, we can use disk_read_blk.
     set_superblock();
+    if (ext2_check_features(&super)) {
+        fs_start_set = 0;
+        return -1;
+    }
 
     // now super is set, and we can use that.    
     // next, we want to set the bgdt entries.
     set_bgdt();
-
+    return 0;
 }
 
 inode_t get_inode(uint32_t inode_n) {
@@ -161,7 +178,7 @@ inode_t get_inode(uint32_t inode_n) {
 
     inode_t blk_nodes[S_BLOCK_SIZE / sizeof(inode_t)];
 
-    bh = bread(DEV_NO, inode_blk_n);
+    bh = bread(filesys_dev, inode_blk_n);
 
     if (!bh) {
         printk("failed to read buffer %d\n", inode_blk_n);
@@ -174,54 +191,87 @@ inode_t get_inode(uint32_t inode_n) {
 }
 
 
-// get the block number of the ith data block for a file. 
-// hides all the "indirect block" stuff
-// at the cost of a bit of efficiency.
-//
-uint32_t indirect_block(inode_t file, uint32_t i) {
-    struct buffer_head *bh;
-    uint32_t dir_blk_len = 12;
-    if (i < dir_blk_len) {
-        return file.i_block[i];
-    }
-
-    uint32_t ind_blk_len = S_BLOCK_SIZE / sizeof(uint32_t);
+#define EXT2_ADDR_PER_BLOCK (S_BLOCK_SIZE / sizeof(uint32_t))
 
-    if (i < dir_blk_len + ind_blk_len) {
-        /* uint32_t blocks[ind_blk_len]; */
-        /* disk_read_blk(file.i_block[12], (uint8_t *) blocks); */
+/*
+ * entry j of indirect block ind, 0 if it cannot be read. run, if set,
+ * gets how many entries from j on map consecutive physical blocks.
+ */
+uint32_t ext2_ind_lookup(uint32_t ind, uint32_t j, uint32_t *run)
+{
+    struct buffer_head *bh;
+    uint32_t *p, blk, k;
 
-        bh = bread(DEV_NO, file.i_block[12]);
-        uint16_t j = i - dir_blk_len;
-        /* return blocks[j]; */
-        return *(uint32_t *)(bh->b_data + j);
+    if (!ind || !(bh = bread(filesys_dev, ind))) {
+        return 0;
     }
+    p = (uint32_t *)bh->b_data;
+    blk = p[j];
+    if (run && blk) {
+        for (k = j + 1; k < EXT2_ADDR_PER_BLOCK && p[k] == blk + (k - j); k++)
+            ;
+        *run = k - j;
+    }
+    brelse(bh);
+    return blk;
+}
 
-    uint32_t dbl_ind_blk_len = S_BLOCK_SIZE * ind_blk_len;
-    if (i < dir_blk_len + ind_blk_len + dbl_ind_blk_len) {
-        /* uint32_t blocks[ind_blk_len]; */
-        /* disk_read_blk(file.i_block[13], (uint8_t *) blocks); */
-        bh = bread(DEV_NO, file.i_block[13]);
-
-        uint32_t j = i - dir_blk_len - ind_blk_len;
+/*
+ * block number of the ith data block of a file mapped by i_block, 0 for
+ * a hole. run, if set, gets the length of the contiguous run that
+ * starts there; leaf, if set, the indirect block holding the pointer
+ * (0 for a direct block).
+ */
+uint32_t ext2_block_map(uint32_t *i_block, uint32_t i, uint32_t *run, uint32_t *leaf)
+{
+    uint32_t per = EXT2_ADDR_PER_BLOCK;
+    uint32_t ind, blk = 0, k;
 
-        uint32_t ind_blk_index = j / ind_blk_len;
-        uint32_t blk_index = j % ind_blk_len;
-        struct buffer_head *bh2;
+    if (run) {
+        *run = 1;
+    }
+    if (leaf) {
+        *leaf = 0;
+    }
 
-        /* disk_read_blk(blocks[ind_blk_index], (uint8_t *) blocks); */
-        bh2 = bread(DEV_NO, bh->b_data[ind_blk_index]);
+    if (i < EXT2_NDIR_BLOCKS) {
+        blk = i_block[i];
+        if (run && blk) {
+            for (k = i + 1; k < EXT2_NDIR_BLOCKS && i_block[k] == blk + (k - i); k++)
+                ;
+            *run = k - i;
+        }
+        return blk;
+    }
+    i -= EXT2_NDIR_BLOCKS;
 
-        /* return blocks[blk_index]; */
+    if (i < per) {
+        ind = i_block[EXT2_NDIR_BLOCKS];
+    }
+    else if ((i -= per) < per * per) {
+        ind = ext2_ind_lookup(i_block[EXT2_NDIR_BLOCKS + 1], i / per, NULL);
+        i %= per;
+    }
+    else {
+        // TODO: triply-indirect. Past 64 MB only extent mapped files grow
+        return 0;
+    }
 
-        return *(uint32_t*)(bh->b_data + blk_index);
+    if (leaf) {
+        *leaf = ind;
     }
+    return ext2_ind_lookup(ind, i, run);
+}
 
-    // TODO: triply-independent.
-    // i.e. file needs more than 65536 1kb blocks, 
-    // so the file is greater than 65 Mb in size. 
-    // our OS is not at that point yet. 
-    return 0;
+// get the block number of the ith data block for a file. 
+// hides all the "indirect block" stuff
+// at the cost of a bit of efficiency.
+//
+uint32_t indirect_block(inode_t file, uint32_t i) {
+    if (file.i_flags & EXT4_EXTENTS_FL) {
+        return ext2_ext_map(file.i_block, i, NULL);
+    }
+    return ext2_block_map(file.i_block, i, NULL, NULL);
 }
 
 /* Get the ith block for a file. */
@@ -235,7 +285,7 @@ uint8_t *get_file_block(ext2_file_handle file, uint32_t i) {
         return NULL;
     }
 
-    if (!(bh = bread(DEV_NO, block_n))) return NULL;
+    if (!(bh = bread(filesys_dev, block_n))) return NULL;
 
     return (uint8_t*)bh->b_data;
 }
@@ -248,61 +298,95 @@ uint8_t *get_file_block(ext2_file_handle file, uint32_t i) {
  * To get around this, a future optimization could defer 
  * actually writing out to disk for a while. */
 
+/* a zeroed indirect block near goal, stored in *slot */
+static int new_ind_block(inode_t *file, uint32_t *slot, uint32_t goal) {
+    struct buffer_head *bh;
+    uint32_t blk;
+
+    if (ext2_new_block(goal, &blk, NULL, NULL)) {
+        return -1;
+    }
+    if (!(bh = getblk(filesys_dev, blk))) {
+        ext2_free_blocks(blk, 1);
+        return -1;
+    }
+    memset(bh->b_data, 0, S_BLOCK_SIZE);
+    bwrite(bh);
+    file->i_blocks += SECTORS_PER_BLOCK;
+    *slot = blk;
+    return 0;
+}
+
 int set_i_block(inode_t *file, uint32_t inode_n, uint32_t i, uint32_t blockn) {
     /* Direct blocks */
 
     struct buffer_head *bh1, *bh2;
-    uint32_t dir_blk_len = 12;
+    uint32_t dir_blk_len = EXT2_NDIR_BLOCKS;
+    uint32_t ind;
+
+    if (file->i_flags & EXT4_EXTENTS_FL) {
+        int ret = ext2_ext_insert(file, inode_n, i, blockn);
+        write_inode_table(inode_n, *file);
+        return ret;
+    }
+
     if (i < dir_blk_len) {
         file->i_block[i] = blockn;
         write_inode_table(inode_n, *file);
         return 0;
     }
+    i -= dir_blk_len;
 
     /* Indirect blocks. */
 
-    uint32_t ind_blk_len = S_BLOCK_SIZE / sizeof(uint32_t);
-
-    if (i < dir_blk_len + ind_blk_len) {
-        /* uint32_t blocks[ind_blk_len]; */
-        /* disk_read_blk(file->i_block[12], (uint8_t *) blocks); */
-        bh1 = bread(DEV_NO, file->i_block[12]);
-        uint16_t j = i - dir_blk_len;
-        /* blocks[j] = blockn; */
-        *(uint32_t*)(bh1->b_data + j) = blockn;
-        /* disk_write_blk(file->i_block[12], (uint8_t *) blocks); */
-        bwrite(bh1);
+    uint32_t per = EXT2_ADDR_PER_BLOCK;
+    uint32_t *slot;
 
-        return 0;
+    if (i < per) {
+        slot = &file->i_block[EXT2_NDIR_BLOCKS];
     }
-
-    /* Doubly-indirect blocks. 
-     * TODO: use buffer algos instead of direct disk reads
-     */
-
-    uint32_t dbl_ind_blk_len = S_BLOCK_SIZE * ind_blk_len;
-    if (i < dir_blk_len + ind_blk_len + dbl_ind_blk_len) {
-        uint32_t blocks[ind_blk_len];
-        disk_read_blk(file->i_block[13], (uint8_t *) blocks);
-
-        uint32_t j = i - dir_blk_len - ind_blk_len;
-
-        uint32_t ind_blk_index = j / ind_blk_len;
-        uint32_t blk_index = j % ind_blk_len;
-
-        uint32_t update_location = blocks[ind_blk_index];
-
-        disk_read_blk(update_location, (uint8_t *) blocks);
-
-        blocks[blk_index] = blockn;
-
-        disk_write_blk(update_location, (uint8_t *) blocks);
-
-        return 0;
+    else if ((i -= per) < per * per) {
+        /* Doubly-indirect blocks: find or make the indirect block below */
+        if (!file->i_block[EXT2_NDIR_BLOCKS + 1] &&
+            new_ind_block(file, &file->i_block[EXT2_NDIR_BLOCKS + 1], blockn)) {
+            return -1;
+        }
+        if (!(bh1 = bread(filesys_dev, file->i_block[EXT2_NDIR_BLOCKS + 1]))) {
+            return -1;
+        }
+        slot = (uint32_t *)bh1->b_data + i / per;
+        // bh1 may be reused once it is released: take the slot out first
+        ind = *slot;
+        if (!ind) {
+            if (new_ind_block(file, slot, blockn)) {
+                brelse(bh1);
+                return -1;
+            }
+            ind = *slot;
+            bwrite(bh1);
+        }
+        else {
+            brelse(bh1);
+        }
+        slot = &ind;
+        i %= per;
+    }
+    else {
+        /* Triply-indirect blocks. TODO; extent mapped files have no such limit */
+        return -1;
     }
 
-    /* Triply-indirect blocks. TODO */
+    if (!*slot && new_ind_block(file, slot, blockn)) {
+        return -1;
+    }
+    if (!(bh2 = bread(filesys_dev, *slot))) {
+        return -1;
+    }
+    ((uint32_t *)bh2->b_data)[i] = blockn;
+    bwrite(bh2);
 
+    // the inode changed if an indirect block was added to it
+    write_inode_table(inode_n, *file);
     return 0;
 }
 
@@ -312,38 +396,19 @@ uint16_t i_block_len(inode_t i) {
 
 
 int chdir(ext2_file_handle current_dir, const char *name, ext2_file_handle *ret_dir) {
-    uint16_t nblocks = i_block_len(current_dir.inode);
+    uint32_t inode_n;
 
-    // NOTE: "dentries_per_blk" only makes sense because we've regularized the size of dentries.
-    // in the future, we'll relax this restriction. 
-    uint16_t dentries_per_blk = S_BLOCK_SIZE / sizeof(dentry_t);
-    dentry_t dentries[dentries_per_blk];
-
-    for (int i = 0; i < nblocks; i++) {
-        dentry_t *dentries = (dentry_t *) get_file_block(current_dir, i);
-        if (dentries == NULL) {
-            printk("null\n");
-            return -1;
-        }
-
-        for (int i = 0; i < dentries_per_blk; i++) {
-            dentry_t d = dentries[i];
-            if (!strcmp(d.name, name)) {
-                // this is the match. 
-                ext2_file_handle f = {
-                    .inode = get_inode(d.inode),
-                    .inode_n = d.inode
-                };
-
-                *ret_dir = f;
-                return 0;
-            }
-        }
-        kfree(dentries);
+    if (ext2_find_entry(&current_dir, name, &inode_n)) {
+        // we didn't find name. 
+        return -1;
     }
 
-    // we didn't find name. 
-    return -1; 
+    ext2_file_handle f = {
+        .inode = get_inode(inode_n),
+        .inode_n = inode_n
+    };
+    *ret_dir = f;
+    return 0;
 }
 
 int add_block_to_file(ext2_file_handle *file, uint32_t new_block) {
@@ -370,7 +435,7 @@ int write_block_at(uint32_t block, uint16_t offset, uint8_t *chunk, uint16_t len
     uint8_t *buf;
     unsigned short i = 0;
     struct buffer_head *bh;
-    bh = bread(DEV_NO, block);
+    bh = bread(filesys_dev, block);
     if (!bh) {
         printk("bread failed for block %u\n", block);
     }
@@ -389,75 +454,8 @@ int write_block_at(uint32_t block, uint16_t offset, uint8_t *chunk, uint16_t len
     return 0;
 }
 
-int add_dentry_to_new_block(ext2_file_handle dir, dentry_t d) {
-    uint32_t new_block;
-    reserve_free_block(&new_block);
-
-    add_block_to_file(&dir, new_block);
-
-    // set rec_len to the end of the block
-    d.rec_len = S_BLOCK_SIZE;
-
-    return write_block_at(new_block, 0, (uint8_t *) &d, sizeof(dentry_t));
-}
-
 int add_dentry(ext2_file_handle dir, dentry_t d) {
-    // find the insert point
-    inode_t inode = dir.inode;
-    
-    uint16_t block_len = i_block_len(inode);
-
-    if (block_len == 0) {
-        return add_dentry_to_new_block(dir, d);
-    }
-
-    // at least one block in use. see if the last block is full. 
-    // TODO: if entries are deleted, directory might have 
-    // "holes" in it. 
-    uint8_t *block = get_file_block(dir, block_len - 1); 
-    if (block == NULL) return -1; 
-
-    dentry_t *curr;
-    uint8_t dentries_read = 0;
-    uint16_t pos = 0;
-    uint16_t lastpos;
-
-    while (pos < S_BLOCK_SIZE) {
-        curr = (dentry_t *) (block + pos);
-        lastpos = pos;
-        pos += curr->rec_len;
-
-        dentries_read++;
-    }
-
-    if (dentries_read >= S_BLOCK_SIZE / sizeof(dentry_t)) {
-        // we can't fit another dentry in this block.
-        return add_dentry_to_new_block(dir, d);
-    }
-
-    // we can fit another dentry in this block.
-
-    // modify the last dentry, if it exists.
-    // it will still be pointing to the end of the block, 
-    // and we don't want that. 
-    if (dentries_read > 0) {
-        curr->rec_len = sizeof(dentry_t); 
-    }
-
-    dentry_t *new_dentry = curr + 1;
-    *new_dentry = d;
-
-    // update rec_len to appropriately point to the end of the block
-    // from the start of this dentry.
-    new_dentry->rec_len = S_BLOCK_SIZE - dentries_read * sizeof(dentry_t);
-
-    // write this disk block back.
-
-    uint32_t fblock_n = indirect_block(dir.inode, block_len - 1);
-   
-    disk_write_blk(fblock_n, block);
-
-    return 0;
+    return ext2_add_entry(&dir, &d);
 }
 
 // TODO: just cache this, like we do with superblock.
@@ -533,15 +531,14 @@ int create_test_file() {
     disk_write_bn(free_block_n, (uint8_t *) data, dlen);
 
     // add to inode table in free place
-    update_inode_bg_desc(free_inode_n);
+    update_inode_bg_desc(free_inode_n, 0);
     update_block_bg_desc(free_block_n);
-    disk_sync_bgdt();
 
     // update the block group descriptor that the block belongs to.
     // update the superblock. 
     super.s_free_blocks_count -= 1;
     super.s_free_inodes_count -= 1;
-    disk_sync_super();
+    ext2_mark_super_dirty();
 }
 
 // print file in root directory. 
@@ -585,7 +582,7 @@ int create_root_directory() {
     // Create a new inode, and update the inode table with it.
     inode_t new_inode = new_dir_inode();
 
-    reserve_inode(root_inode_n);
+    reserve_inode(root_inode_n, 1);
 
     // write to inode table
     write_inode_table(root_inode_n, new_inode);
@@ -627,11 +624,11 @@ void set_initial_used_blocks() {
 }
 
 
-void finish_fs_init(uint32_t mb_start) {
+void finish_fs_init(dev_t dev) {
     // read the metadata into our "local" variables.
-    /* read_fs(mb_start); */
+    /* read_fs(dev); */
 
-    show_fs(mb_start);
+    show_fs(dev);
 
     /* set_initial_used_blocks(); */
 
@@ -681,18 +678,29 @@ int split_path(const char *usr_path, ext2_file_handle *parent, char *leaf) {
 int ls(char *path) {
     ext2_file_handle parent_dir;
     char leaf[64];
-    split_path(path, &parent_dir, leaf);
+    if (split_path(path, &parent_dir, leaf)) return -1;
     ext2_file_handle leaf_dir;
-    chdir(parent_dir, leaf, &leaf_dir);
+    if (chdir(parent_dir, leaf, &leaf_dir)) return -1;
 
     // list all files in leaf_directory
-    uint32_t block_len = i_block_len(leaf_dir.inode);
+    char name[256];
+    uint32_t block_len = ext2_dir_blocks(&leaf_dir.inode);
     for (uint32_t i = 0; i < block_len; i++) {
         // read the block
-        uint8_t *block = get_file_block(leaf_dir, i);
-
-        kfree(block); 
+        struct buffer_head *bh = ext2_dir_bread(&leaf_dir, i);
+        if (!bh) continue;
+
+        dentry_t *d;
+        uint8_t *block = (uint8_t *) bh->b_data;
+        for (uint32_t off = 0; (d = ext2_dirent_at(block, off)); off += d->rec_len) {
+            if (!d->inode) continue;
+            memcpy(name, d->name, d->name_len);
+            name[d->name_len] = '\0';
+            printk("%s\n", name);
+        }
+        brelse(bh);
     }
+    return 0;
 }
 
 int mkdir(char *path) {
@@ -706,8 +714,8 @@ int mkdir(char *path) {
     printk("\n");
 
     uint32_t new_inode_n, new_block_n;
-    reserve_free_inode(&new_inode_n);
-    reserve_free_block(&new_block_n);
+    ext2_new_inode_num(parent_dir.inode_n, 1, &new_inode_n);
+    ext2_new_block(ext2_inode_goal(new_inode_n), &new_block_n, NULL, NULL);
 
     // Create a new inode, and update the inode table with it.
     inode_t new_inode = new_dir_inode();
@@ -718,7 +726,7 @@ int mkdir(char *path) {
     // add a dentry for this new directory
     dentry_t d = {
         .inode = new_inode_n,
-        .rec_len = sizeof(dentry_t),
+        .rec_len = EXT2_DIR_REC_LEN(strlen(new_dirname)),
         .name_len = strlen(new_dirname),
         .file_type = EXT2_FT_DIR,
     };
@@ -857,7 +865,7 @@ void read_sb(struct ext2_sb_info *ext2_sb)
     ext2_super_block *s_es;
     struct buffer_head *bh;
 
-    bh = bread(DEV_NO, 2);
+    bh = bread(filesys_dev, SUPER_BLK_NO);
     if (!bh) {
         printk("failed reading buffer 1 for sb\n");
     }
@@ -873,57 +881,19 @@ static inline struct ext2_sb_info *EXT2_SB(struct super_block *sb)
 	return sb->s_fs_info;
 }
 
-/* Byte order conversion macros (simplified - assumes little endian) */
-#define cpu_to_le32(x) (x)
-#define le32_to_cpu(x) (x)
-
-/* Stub functions for counting - these would need proper implementation */
-static uint32_t ext2_count_free_blocks(struct super_block *sb)
-{
-    struct ext2_sb_info *sbi = EXT2_SB(sb);
-    return sbi->s_freeblocks_counter;
-}
-
-static uint32_t ext2_count_free_inodes(struct super_block *sb)
-{
-    struct ext2_sb_info *sbi = EXT2_SB(sb);
-    return sbi->s_freeinodes_counter;
-}
-
-/* Mark buffer as dirty */
-static void mark_buffer_dirty(struct buffer_head *bh)
-{
-    if (bh) {
-        SET_FLAG(bh->flags, BH_dirty);
-    }
-}
-
-static void ext2_sync_super(struct super_block *sb, ext2_super_block *es,
-			    int wait)
-{
-	/* ext2_clear_super_error(sb); */
-	es->s_free_blocks_count = cpu_to_le32(ext2_count_free_blocks(sb));
-	es->s_free_inodes_count = cpu_to_le32(ext2_count_free_inodes(sb));
-	/* es->s_wtime = cpu_to_le32(get_seconds()); */
-	/* unlock before we do IO */
-	mark_buffer_dirty(EXT2_SB(sb)->s_sbh);
-	/* if (wait) */
-	/* 	sync_dirty_buffer(EXT2_SB(sb)->s_sbh); */
-	sb->s_dirt = 0;
-}
-
-
+/*
+ * the allocator keeps the counters in super and bgdt; ext2_commit_super()
+ * writes super through s_sbh, so there is nothing else to copy here
+ */
 int ext2_sync_fs(struct super_block *sb, int wait)
 {
-	struct ext2_sb_info *sbi = EXT2_SB(sb);
-	ext2_super_block *es = EXT2_SB(sb)->s_es;
-
-	/* if (es->s_state & cpu_to_le16(EXT2_VALID_FS)) { */
-	/* 	es->s_state &= cpu_to_le16(~EXT2_VALID_FS); */
-	/* } */
-	
-    ext2_sync_super(sb, es, wait);
-	return 0;
+    ext2_sync_bitmaps(0);
+    ext2_commit_super(0);
+    if (wait) {
+        blkdev_issue_flush(sb->s_dev);
+    }
+    sb->s_dirt = 0;
+    return 0;
 }
 void ext2_write_super(struct super_block *sb)
 {
@@ -935,7 +905,7 @@ void write_sb(struct ext2_sb_info *ext2_sb)
     ext2_super_block *s_es;
     struct buffer_head *bh;
 
-    bh = bread(DEV_NO, 2);
+    bh = bread(filesys_dev, SUPER_BLK_NO);
     if (!bh) {
         printk("failed reading buffer 1 for sb\n");
     }
@@ -952,7 +922,11 @@ void test_fs(void)
 {
     printk("testing fs\n");
     struct buffer_head *bh;
-    bh = bread(DEV_NO, 2);
+    // nothing mounted yet: look at the root disk
+    if (!filesys_dev) {
+        filesys_dev = ROOT_DEV;
+    }
+    bh = bread(filesys_dev, SUPER_BLK_NO);
     if (!bh) {
         printk("failed reading buffer 1 for sb\n");
     }
@@ -965,7 +939,8 @@ void test_fs(void)
 
     brelse(bh);
 
-   
+    test_dirhash();
+    test_dirent();
 }
 
 void ext2_fs_init(void)
@@ -995,7 +970,7 @@ struct super_operations ext2_sops = {
     .destroy_inode = NULL,
     .write_inode = ext2_write_inode,
     .read_inode = ext2_read_inode,
-    .put_inode = NULL,
+    .put_inode = ext2_put_inode,
     .drop_inode = NULL,
     .delete_inode = ext2_delete_inode,
     .put_super = ext2_put_super,
@@ -1025,8 +1000,14 @@ struct super_block *ext2_read_super(struct super_block *sb, void *data, int sile
         return NULL;
     }
     
+    /* Every block of the filesystem goes through its own device */
+    if (!sb->s_dev) {
+        sb->s_dev = ROOT_DEV;
+    }
+    filesys_dev = sb->s_dev;
+    
     /* Read superblock from disk */
-    bh = bread(DEV_NO, 2);  /* Superblock is at block 2 */
+    bh = bread(sb->s_dev, SUPER_BLK_NO);
     if (!bh) {
         printk("ext2_read_super: failed to read superblock\n");
         kfree(sbi);
@@ -1042,6 +1023,11 @@ struct super_block *ext2_read_super(struct super_block *sb, void *data, int sile
         kfree(sbi);
         return NULL;
     }
+    if (ext2_check_features(es)) {
+        brelse(bh);
+        kfree(sbi);
+        return NULL;
+    }
     
     /* Copy superblock info to memory */
     copy_ext2_sb_to_mem(sbi, es);
@@ -1051,14 +1037,13 @@ struct super_block *ext2_read_super(struct super_block *sb, void *data, int sile
     sb->s_magic = EXT2_SUPER_MAGIC;
     sb->s_op = &ext2_sops;
     sb->s_fs_info = sbi;
-    sb->s_dev = DEV_NO;
     
     /* Keep superblock buffer */
     sbi->s_sbh = bh;
     sbi->s_es = es;
     
     /* Get root inode */
-    root_inode = iget(DEV_NO, EXT2_ROOT_INO);
+    root_inode = iget(sb->s_dev, EXT2_ROOT_INO);
     if (!root_inode) {
         printk("ext2_read_super: failed to get root inode\n");
         brelse(bh);
@@ -1104,8 +1089,13 @@ void ext2_put_super(struct super_block *sb)
             ext2_write_super(sb);
         }
         
-        /* Release superblock buffer */
+        /* Write back and let go of the held bitmaps, counters and backups */
+        ext2_sync_bitmaps(1);
+        ext2_commit_super(1);
+
+        /* Release superblock buffer, on disk first */
         if (sbi->s_sbh) {
+            sync_dirty_buffer(sbi->s_sbh);
             brelse(sbi->s_sbh);
         }
         
@@ -5,6 +5,10 @@
 #include "serial.h"
 #include "string.h"
 #include "slab.h"
+#include "bio.h"
+#include "blkdev.h"
+#include "ext2_dir.h"
+#include "ext2_extents.h"
 
 
 // Inode table size based on the 214-block reference
@@ -25,6 +29,11 @@
 
 #define SECTORS_PER_BLOCK_GROUP (SECTORS_PER_BLOCK * EXT2_BLOCKS_PER_GROUP)
 
+// block 0 is left for boot records; the superblock is block 1 of the device
+#define SUPERBLOCK_LBA SECTORS_PER_BLOCK
+
+static dev_t mkfs_dev;
+
 #define EXT2_BYTES_PER_INODE 8192 // this defines how much bytes each inode will cover at average
                                   // this is a standard
 
@@ -135,17 +144,24 @@ ext2_super_block make_super(uint16_t block_group_nr) {
     b.s_state = EXT2_VALID_FS;
     b.s_errors = EXT2_ERRORS_RO;
     b.s_creator_os = EXT2_OS_COW;
-    b.s_rev_level = 0;
+    b.s_rev_level = EXT2_DYNAMIC_REV;
     b.s_checkinterval = (1 << 24);
     b.s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
     b.s_inode_size = EXT2_GOOD_OLD_INODE_SIZE; 
     b.s_block_group_nr = block_group_nr;
 
+    // directories that outgrow a block get a hashed index
+    b.s_feature_compat = EXT2_FEATURE_COMPAT_DIR_INDEX;
+    b.s_def_hash_version = DX_HASH_HALF_MD4;
+    // new files and directories are extent mapped, so they can grow past
+    // the 64 MB the double-indirect map reaches
+    b.s_feature_incompat = EXT4_FEATURE_INCOMPAT_EXTENTS;
+
     return b;
 }
 
 void write_superblock(uint32_t location, ext2_super_block b) {
-    disk_write(location, (uint8_t *) &b, sizeof(b));
+    bio_rw_buf(mkfs_dev, BIO_WRITE, location, (uint8_t *) &b, sizeof(b));
 }
 /*
  * Refer to ext2_layout.md in docs 
@@ -195,7 +211,7 @@ void write_bgdt(uint32_t addr, bgdesc_t *table) {
     uint8_t buffer[EXT2_BLK_SIZE];
     memset(buffer, 0, EXT2_BLK_SIZE);
     memcpy(buffer, table, bgdt_size);
-    disk_write(addr, buffer, EXT2_BLK_SIZE);
+    bio_rw_buf(mkfs_dev, BIO_WRITE, addr, buffer, EXT2_BLK_SIZE);
 }
 
 static void init_bitmaps(uint32_t fs_lba,
@@ -217,7 +233,7 @@ static void init_bitmaps(uint32_t fs_lba,
         bitmap[i / 8] |= (1 << (i % 8));
     }
 
-    disk_write(fs_lba + (group_start + 0) * SECTORS_PER_BLOCK,
+    bio_rw_buf(mkfs_dev, BIO_WRITE, fs_lba + (group_start + 0) * SECTORS_PER_BLOCK,
                bitmap, EXT2_BLK_SIZE);
 
     /* Inode bitmap */
@@ -228,7 +244,7 @@ static void init_bitmaps(uint32_t fs_lba,
         bitmap[0] |= 0x3;   /* inode 1 (bad), inode 2 (root) */
     }
 
-    disk_write(fs_lba + (group_start + 1) * SECTORS_PER_BLOCK,
+    bio_rw_buf(mkfs_dev, BIO_WRITE, fs_lba + (group_start + 1) * SECTORS_PER_BLOCK,
                bitmap, EXT2_BLK_SIZE);
 }
 
@@ -241,7 +257,7 @@ static void init_inode_table(uint32_t fs_lba,
     uint32_t blocks = inode_table_blocks();
 
     for (uint32_t i = 0; i < blocks; i++) {
-        disk_write(fs_lba + (group_start + 2 + i) * SECTORS_PER_BLOCK,
+        bio_rw_buf(mkfs_dev, BIO_WRITE, fs_lba + (group_start + 2 + i) * SECTORS_PER_BLOCK,
                    zero, EXT2_BLK_SIZE);
     }
 }
@@ -273,13 +289,23 @@ static void init_inode_table(uint32_t fs_lba,
  */
 
 
-void mkfs(uint32_t mb_start, uint32_t len) {
-    uint32_t fs_lba = fs_start_to_lba_superblk(mb_start);
+void mkfs(dev_t dev, uint32_t len) {
+    uint32_t fs_lba = SUPERBLOCK_LBA;
+    struct block_device *bdev = bdget(dev);
+
+    if (!bdev) {
+        printk("mkfs: no device %u:%u\n", MAJOR(dev), MINOR(dev));
+        return;
+    }
+    if (!len || len > bdev->bd_nr_sectors / 2048) {
+        len = bdev->bd_nr_sectors / 2048;
+    }
+    mkfs_dev = dev;
 
     printk("========================================\n");
     printk("Creating ext2 filesystem\n");
     printk("========================================\n");
-    printk("Start offset:    %u MB\n", mb_start);
+    printk("Device:          %s\n", bdev->bd_name);
     printk("Filesystem size: %u MB\n", len);
     
     // Dynamically calculate filesystem parameters
@@ -335,7 +361,7 @@ void mkfs(uint32_t mb_start, uint32_t len) {
     kfree(bgdt);
 
     printk("Filesystem structure created, finalizing...\n");
-    finish_fs_init(mb_start);
+    finish_fs_init(dev);
     //TODO:
     /*
      * create the root_directory 
@@ -347,13 +373,13 @@ void mkfs(uint32_t mb_start, uint32_t len) {
 
 // Helper function to display filesystem info
 // This is separate from read_fs() which is in fs.c
-void show_fs(uint32_t mb_start) {
-    uint32_t fs_lba = fs_start_to_lba_superblk(mb_start);
+void show_fs(dev_t dev) {
+    uint32_t fs_lba = SUPERBLOCK_LBA;
     
     // Read the superblock
     ext2_super_block sb;
     uint8_t sb_buffer[EXT2_BLK_SIZE];
-    disk_read(fs_lba, sb_buffer);
+    bio_rw_buf(dev, BIO_READ, fs_lba, sb_buffer, EXT2_BLK_SIZE);
     memcpy(&sb, sb_buffer, sizeof(ext2_super_block));
 
     printk("fs_lba for superblock is %u\n", fs_lba);
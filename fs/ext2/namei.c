@@ -45,9 +45,13 @@ static struct dentry *do_lookup(struct dentry *parent, const char *name)
         return NULL;
     }
     
-    /* Check dentry cache first */
+    /* Check dentry cache first; a negative dentry is a cached miss */
     dentry = d_lookup(parent, name);
     if (dentry) {
+        if (!dentry->d_inode) {
+            dput(dentry);
+            return NULL;
+        }
         return dentry;
     }
     
@@ -57,11 +61,15 @@ static struct dentry *do_lookup(struct dentry *parent, const char *name)
         return NULL;
     }
     
-    /* Call filesystem's lookup operation */
+    /*
+     * Call filesystem's lookup operation. It hashes the dentry itself with
+     * d_add(), negative if the name is not there; a dentry left unhashed
+     * (an error) is freed by the dput() rather than cached as a miss.
+     */
     if (dir->i_op && dir->i_op->lookup) {
         struct dentry *result = dir->i_op->lookup(dir, dentry);
+        
         if (!result) {
-            /* Lookup failed, free dentry */
             dput(dentry);
             return NULL;
         }
@@ -74,54 +82,174 @@ static struct dentry *do_lookup(struct dentry *parent, const char *name)
     return NULL;
 }
 
-/* Walk path components */
-int link_path_walk(const char *path, struct nameidata *nd)
+/*
+ * Path walks start out lockless, an "rcu walk" (LOOKUP_RCU): components
+ * are found by __d_lookup_rcu() and no reference is taken on anything,
+ * so walks on different cpus don't bounce the d_count of the dentries
+ * they share, the root above all. Instead each step is checked against
+ * the d_seq of the dentries it read. When a component isn't cached, or
+ * something changed under the walk, it takes a reference on the last
+ * dentry it can still vouch for and carries on as a ref walk; if there
+ * is none, the whole walk is redone with references.
+ */
+
+/* leave the rcu walk with a reference on nd->dentry, -1 if it changed under us */
+static int unlazy_walk(struct nameidata *nd)
 {
-    char component[64];
-    struct dentry *dentry;
+    struct dentry *dentry = nd->dentry;
     
-    if (!path || !nd || !nd->dentry) {
+    nd->flags &= ~LOOKUP_RCU;
+    if (read_seqcount_retry(&rename_seq, nd->r_seq) ||
+        read_seqcount_retry(&dentry->d_seq, nd->seq)) {
         return -1;
     }
+    dget(dentry);
     
-    /* Start from current dentry */
-    dentry = nd->dentry;
-    
-    /* Skip leading slashes */
-    path = skip_slashes(path);
+    /* it may have gone before the reference was in */
+    if (read_seqcount_retry(&dentry->d_seq, nd->seq)) {
+        dput(dentry);
+        return -1;
+    }
+    return 0;
+}
+
+/* one rcu walk step: 0 done, 1 to go on with references, -1 not found */
+static int walk_component_rcu(struct nameidata *nd, const char *name)
+{
+    struct dentry *parent = nd->dentry;
+    struct dentry *dentry;
+    struct inode *inode;
+    unsigned int seq;
     
-    /* Walk through path components */
-    while (*path) {
-        /* Get next component */
-        path = get_component(path, component, sizeof(component));
-        
-        if (!component[0]) {
-            break;
-        }
-        
-        /* Handle "." */
-        if (!strcmp(component, ".")) {
-            continue;
+    if (!strcmp(name, "..")) {
+        dentry = parent->d_parent;  /* the root is its own parent */
+        seq = raw_seqcount_begin(&dentry->d_seq);
+        if (read_seqcount_retry(&parent->d_seq, nd->seq)) {
+            return 1;
         }
-        
-        /* Handle ".." */
-        if (!strcmp(component, "..")) {
-            if (dentry->d_parent != dentry) {
-                dentry = dentry->d_parent;
-            }
-            continue;
-        }
-        
-        /* Lookup component */
-        dentry = do_lookup(dentry, component);
+        nd->dentry = dentry;
+        nd->seq = seq;
+        return 0;
+    }
+    
+    dentry = __d_lookup_rcu(parent, name, &seq);
+    if (!dentry) {
+        return 1;
+    }
+    inode = dentry->d_inode;
+    
+    /* neither may have changed since we looked */
+    if (read_seqcount_retry(&dentry->d_seq, seq) ||
+        read_seqcount_retry(&parent->d_seq, nd->seq)) {
+        return 1;
+    }
+    // a plain store, as d_lookup() does: keeps what only RCU walks use,
+    // cached misses included, off the pruner
+    dentry->d_flags |= DCACHE_REFERENCED;
+    
+    /* a negative dentry is a cached miss, if nothing was renamed meanwhile */
+    if (!inode) {
+        return read_seqcount_retry(&rename_seq, nd->r_seq) ? 1 : -1;
+    }
+    nd->dentry = dentry;
+    nd->seq = seq;
+    return 0;
+}
+
+/* one ref walk step; nd->dentry holds a reference before and after */
+static int walk_component(struct nameidata *nd, const char *name)
+{
+    struct dentry *dentry;
+    
+    if (!strcmp(name, "..")) {
+        dentry = dget(nd->dentry->d_parent);
+    } else {
+        dentry = do_lookup(nd->dentry, name);
         if (!dentry) {
             return -1;  /* Component not found */
         }
     }
     
-    /* Update nameidata */
+    dput(nd->dentry);
     nd->dentry = dentry;
+    return 0;
+}
+
+/*
+ * walk path from nd->dentry, in whichever mode nd->flags says. 0 leaves
+ * a reference on nd->dentry, -1 (not found) none, and 1 means the rcu
+ * walk has to be redone with references.
+ */
+static int walk_path(const char *path, struct nameidata *nd)
+{
+    char component[64];
+    const char *next;
+    int err;
     
+    while (*(path = skip_slashes(path))) {
+        next = get_component(path, component, sizeof(component));
+        
+        /* "." stays put */
+        if (strcmp(component, ".")) {
+            if (nd->flags & LOOKUP_RCU) {
+                err = walk_component_rcu(nd, component);
+                if (err > 0) {
+                    if (unlazy_walk(nd)) {
+                        return 1;
+                    }
+                    continue;  /* same component, with references */
+                }
+            } else {
+                err = walk_component(nd, component);
+            }
+            
+            if (err) {
+                if (!(nd->flags & LOOKUP_RCU)) {
+                    dput(nd->dentry);
+                }
+                return -1;
+            }
+        }
+        path = next;
+    }
+    
+    if ((nd->flags & LOOKUP_RCU) && unlazy_walk(nd)) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Walk path components. On success nd->dentry is what path names, with
+ * a reference for path_release(); on failure it is left as it was.
+ */
+int link_path_walk(const char *path, struct nameidata *nd)
+{
+    struct dentry *start;
+    int err;
+    
+    if (!path || !nd || !nd->dentry) {
+        return -1;
+    }
+    
+    /* Start from current dentry */
+    start = nd->dentry;
+    
+    nd->flags |= LOOKUP_RCU;
+    nd->r_seq = raw_seqcount_begin(&rename_seq);
+    nd->seq = raw_seqcount_begin(&start->d_seq);
+    err = walk_path(path, nd);
+    
+    if (err > 0) {
+        nd->dentry = dget(start);
+        err = walk_path(path, nd);
+    }
+    
+    nd->flags &= ~LOOKUP_RCU;
+    if (err) {
+        nd->dentry = start;
+        return -1;
+    }
     return 0;
 }
 
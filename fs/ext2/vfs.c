@@ -4,7 +4,9 @@
 #include "disk.h"
 #include "serial.h"
 #include "vfs.h"
+#include "buffer.h"
 #include "list.h"
+#include "dcache.h"
 #include "kernel.h"
 #include <stdint.h>
 
@@ -14,14 +16,14 @@ kmem_cache_t *inode_cache;
 kmem_cache_t *file_cache; //for file table entries
 
 struct inode_cache {
-    struct list_head i_hash[DEV_NO];
+    struct list_head i_hash[NR_HASH];
     struct list_head i_free;
 }i_cache;
 
 void display_inode_cache(void) 
 {
     int iCnt = 0;
-    for (; iCnt < DEV_NO; iCnt++) {
+    for (; iCnt < NR_HASH; iCnt++) {
         struct list_head *run;
         struct inode *inode;
         printk("================ i_hash %d=================\n", iCnt);
@@ -54,7 +56,7 @@ void inode_init(struct inode *inode, unsigned short dev_no, unsigned long inum)
 {
     INIT_LIST_NULL(&inode->i_hash);
     INIT_LIST_NULL(&inode->i_sb_list);
-    INIT_LIST_NULL(&inode->i_dentry);
+    INIT_LIST_HEAD(&inode->i_dentry);
     inode->i_no = inum;
     inode->i_dev = dev_no;
     inode->i_count = 0;
@@ -71,12 +73,13 @@ void inode_init(struct inode *inode, unsigned short dev_no, unsigned long inum)
     inode->i_op = NULL;
     inode->f_op = NULL;
     inode->i_sb = NULL;
+    memset(&inode->u, 0, sizeof(inode->u));
 }
 
 void test_icache(void)
 {
     printk("testing inode cache .............\n");
-    struct inode *inode = iget(DEV_NO, 16);
+    struct inode *inode = iget(ROOT_DEV, 16);
     if (!inode) {
         printk(" iget failed \n");
         return ;
@@ -107,7 +110,7 @@ void create_inode_cache(void)
 
     create_file_cache();
 
-    for (iCnt = 0; iCnt < DEV_NO; iCnt++) {
+    for (iCnt = 0; iCnt < NR_HASH; iCnt++) {
         INIT_LIST_HEAD(&i_cache.i_hash[iCnt]);
     }
     INIT_LIST_HEAD(&i_cache.i_free);
@@ -119,10 +122,10 @@ void create_inode_cache(void)
             break;
         }
        
-        inode_init(tmp, DEV_NO, iCnt);
+        inode_init(tmp, ROOT_DEV, iCnt);
         /*
          * add to correct hash list and also to freelist */
-        list_add(&i_cache.i_hash[hash_fn(iCnt, DEV_NO)], &tmp->i_hash);
+        list_add(&i_cache.i_hash[hash_fn(iCnt, ROOT_DEV)], &tmp->i_hash);
         list_add(&i_cache.i_free, &tmp->i_free);
     }
 
@@ -173,6 +176,9 @@ struct inode *iget(unsigned short dev_no, unsigned int inum)
 void iput(struct inode *inode)
 {
     inode = locked_inode(inode);
+    if (inode->i_sb && inode->i_sb->s_op->put_inode) {
+        inode->i_sb->s_op->put_inode(inode);
+    }
     inode->i_count--;
 
     if (inode->i_count == 0) {
@@ -184,8 +190,8 @@ void iput(struct inode *inode)
         if (IS_FLAG(inode->i_state, I_DIRTY)) {
            inode->i_sb->s_op->write_inode(inode); //update the disk inode 
         }
+        list_add_tail(&i_cache.i_free, &inode->i_free);
     }
-    list_add_tail(&i_cache.i_free, &inode->i_free);
 
     unlocked_inode(inode);
 }
@@ -204,7 +210,17 @@ int vfs_create(struct inode *dir, struct dentry *dentry, int mode)
         return -1;
     }
     
-    return dir->i_op->create(dir, dentry, mode);
+    if (dir->i_op->create(dir, dentry, mode)) {
+        return -1;
+    }
+    d_drop_negative(dentry->d_parent, dentry->d_name);
+    // made on disk but no inode to show for it: leave it to the next lookup
+    if (!dentry->d_inode) {
+        d_drop(dentry);
+        return -1;
+    }
+    d_rehash(dentry);
+    return 0;
 }
 
 int vfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
@@ -218,7 +234,17 @@ int vfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
         return -1;
     }
     
-    return dir->i_op->mkdir(dir, dentry, mode);
+    if (dir->i_op->mkdir(dir, dentry, mode)) {
+        return -1;
+    }
+    d_drop_negative(dentry->d_parent, dentry->d_name);
+    // made on disk but no inode to show for it: leave it to the next lookup
+    if (!dentry->d_inode) {
+        d_drop(dentry);
+        return -1;
+    }
+    d_rehash(dentry);
+    return 0;
 }
 
 int vfs_rmdir(struct inode *dir, struct dentry *dentry)
@@ -232,7 +258,11 @@ int vfs_rmdir(struct inode *dir, struct dentry *dentry)
         return -1;
     }
     
-    return dir->i_op->rmdir(dir, dentry);
+    if (dir->i_op->rmdir(dir, dentry)) {
+        return -1;
+    }
+    d_delete(dentry);
+    return 0;
 }
 
 int vfs_unlink(struct inode *dir, struct dentry *dentry)
@@ -247,7 +277,11 @@ int vfs_unlink(struct inode *dir, struct dentry *dentry)
         return -1;
     }
     
-    return dir->i_op->rmdir(dir, dentry);
+    if (dir->i_op->rmdir(dir, dentry)) {
+        return -1;
+    }
+    d_delete(dentry);
+    return 0;
 }
 
 int vfs_rename(struct inode *old_dir, struct dentry *old_dentry,
@@ -262,7 +296,13 @@ int vfs_rename(struct inode *old_dir, struct dentry *old_dentry,
         return -1;
     }
     
-    return old_dir->i_op->rename(old_dir, old_dentry, new_dir, new_dentry);
+    if (old_dir->i_op->rename(old_dir, old_dentry, new_dir, new_dentry)) {
+        return -1;
+    }
+    d_drop_negative(new_dentry->d_parent, new_dentry->d_name);
+    d_drop(new_dentry);
+    d_move(old_dentry, new_dentry);
+    return 0;
 }
 
 ssize_t vfs_read(struct file *file, char *buf, size_t count, loff_t *pos)
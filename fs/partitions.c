@@ -0,0 +1,353 @@
+#include "blkdev.h"
+#include "bio.h"
+#include "slab.h"
+#include "string.h"
+#include "serial.h"
+
+/*
+ * partition tables. A disk with a protective MBR entry is read as GPT
+ * (the primary header, else the backup in the last sector); otherwise
+ * as an MBR with up to four primary partitions, numbered 1-4, and the
+ * logical partitions of an extended one from 5. Each partition that
+ * fits in the disk's minors becomes a block device of its own.
+ */
+
+#define MBR_PART_OFFSET     0x1be
+#define MBR_MAGIC_OFFSET    0x1fe
+#define MBR_NR_PARTS        4
+
+#define DOS_EXTENDED        0x05
+#define WIN98_EXTENDED      0x0f
+#define LINUX_EXTENDED      0x85
+#define EFI_PMBR_OSTYPE_GPT 0xee
+
+#define GPT_SIGNATURE       0x5452415020494645ULL //"EFI PART"
+#define GPT_HEADER_MIN      92
+
+/* logical partitions followed before giving up on a looping chain */
+#define MAX_EBR_CHAIN       64
+
+struct mbr_partition {
+    uint8_t boot_ind;
+    uint8_t head;
+    uint8_t sector;
+    uint8_t cyl;
+    uint8_t sys_ind;
+    uint8_t end_head;
+    uint8_t end_sector;
+    uint8_t end_cyl;
+    uint32_t start_sect;
+    uint32_t nr_sects;
+} __attribute__((packed));
+
+struct gpt_header {
+    uint64_t signature;
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc32;
+    uint32_t reserved1;
+    uint64_t my_lba;
+    uint64_t alternate_lba;
+    uint64_t first_usable_lba;
+    uint64_t last_usable_lba;
+    uint8_t disk_guid[16];
+    uint64_t partition_entry_lba;
+    uint32_t num_partition_entries;
+    uint32_t sizeof_partition_entry;
+    uint32_t partition_entry_array_crc32;
+} __attribute__((packed));
+
+struct gpt_entry {
+    uint8_t partition_type_guid[16]; //all zero: unused
+    uint8_t unique_partition_guid[16];
+    uint64_t starting_lba;
+    uint64_t ending_lba; //inclusive
+    uint64_t attributes;
+    uint16_t partition_name[36];
+} __attribute__((packed));
+
+/* a sector of the table being read; slab memory, so bios can map it */
+static uint8_t *part_buf;
+
+static int read_sector(struct block_device *disk, uint32_t sector)
+{
+    return bio_rw_buf(disk->bd_dev, BIO_READ, sector, part_buf, DISK_SECTOR_SIZE);
+}
+
+/* CRC-32 as UEFI uses it: reflected 0x04c11db7, seed and result inverted by the caller */
+static uint32_t efi_crc32(const uint8_t *p, unsigned int len, uint32_t crc)
+{
+    while (len--) {
+        crc ^= *p++;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+    return crc;
+}
+
+/* "hda" + 1 is "hda1", "ram0" + 1 is "ram0p1" */
+static void part_name(char *name, const char *disk, int partno)
+{
+    int len = strlen(disk);
+    char digits[4];
+    int n = 0;
+
+    strcpy(name, disk);
+    if (name[len - 1] >= '0' && name[len - 1] <= '9') {
+        name[len++] = 'p';
+    }
+    do {
+        digits[n++] = '0' + partno % 10;
+        partno /= 10;
+    } while (partno);
+    while (n) {
+        name[len++] = digits[--n];
+    }
+    name[len] = '\0';
+}
+
+static int add_partition(struct block_device *disk, int partno, uint32_t start, uint32_t nr_sects)
+{
+    struct block_device *part;
+    unsigned int phys = disk->bd_queue->phys_sectors;
+
+    if (!nr_sects) {
+        return 0;
+    }
+    if ((unsigned int)partno >= disk->bd_minors ||
+        strlen(disk->bd_name) + 4 > sizeof(part->bd_name)) {
+        printk("partitions: %s: no minor for partition %d\n", disk->bd_name, partno);
+        return -1;
+    }
+    if (start >= disk->bd_nr_sectors) {
+        printk("partitions: %s: partition %d starts past the end\n", disk->bd_name, partno);
+        return -1;
+    }
+    if (nr_sects > disk->bd_nr_sectors - start) {
+        printk("partitions: %s: partition %d truncated to the disk\n", disk->bd_name, partno);
+        nr_sects = disk->bd_nr_sectors - start;
+    }
+
+    part = (struct block_device *)kmalloc(sizeof(struct block_device), 0);
+    if (!part) {
+        return -1;
+    }
+    memset(part, 0, sizeof(struct block_device));
+    part->bd_dev = disk->bd_dev + partno;
+    part_name(part->bd_name, disk->bd_name, partno);
+    part->bd_queue = disk->bd_queue;
+    part->bd_nr_sectors = nr_sects;
+    part->bd_private = disk->bd_private;
+    part->bd_contains = disk;
+    part->bd_partno = partno;
+    part->bd_start_sect = start;
+    if (register_blkdev(part)) {
+        kfree(part);
+        return -1;
+    }
+
+    if (start % phys) {
+        printk("partitions: %s starts %u sectors into a %u byte physical sector;"
+               " its writes will be read-modify-write\n",
+               part->bd_name, start % phys, phys * DISK_SECTOR_SIZE);
+    }
+    return 0;
+}
+
+static int is_extended(uint8_t sys_ind)
+{
+    return sys_ind == DOS_EXTENDED || sys_ind == WIN98_EXTENDED || sys_ind == LINUX_EXTENDED;
+}
+
+/*
+ * logical partitions: a chain of EBRs, each holding the partition
+ * (relative to itself) and a link to the next EBR (relative to the
+ * extended partition).
+ */
+static void parse_extended(struct block_device *disk, uint32_t ext_start, uint32_t ext_size)
+{
+    struct mbr_partition p[2];
+    uint32_t ebr = ext_start;
+    int partno = MBR_NR_PARTS + 1;
+
+    for (int n = 0; n < MAX_EBR_CHAIN; n++) {
+        if (read_sector(disk, ebr) || part_buf[MBR_MAGIC_OFFSET] != 0x55 ||
+            part_buf[MBR_MAGIC_OFFSET + 1] != 0xaa) {
+            return;
+        }
+        memcpy(p, part_buf + MBR_PART_OFFSET, sizeof(p));
+
+        if (p[0].nr_sects && !is_extended(p[0].sys_ind)) {
+            add_partition(disk, partno++, ebr + p[0].start_sect, p[0].nr_sects);
+        }
+        if (!p[1].nr_sects || !is_extended(p[1].sys_ind) || p[1].start_sect >= ext_size) {
+            return;
+        }
+        ebr = ext_start + p[1].start_sect;
+    }
+    printk("partitions: %s: EBR chain too long\n", disk->bd_name);
+}
+
+/* returns 1 if the MBR is only there to protect a GPT */
+static int parse_mbr(struct block_device *disk)
+{
+    struct mbr_partition p[MBR_NR_PARTS];
+
+    memcpy(p, part_buf + MBR_PART_OFFSET, sizeof(p));
+    for (int i = 0; i < MBR_NR_PARTS; i++) {
+        if (p[i].sys_ind == EFI_PMBR_OSTYPE_GPT) {
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < MBR_NR_PARTS; i++) {
+        if (!p[i].nr_sects) {
+            continue;
+        }
+        if (is_extended(p[i].sys_ind)) {
+            parse_extended(disk, p[i].start_sect, p[i].nr_sects);
+        }
+        else {
+            add_partition(disk, i + 1, p[i].start_sect, p[i].nr_sects);
+        }
+    }
+    return 0;
+}
+
+/* read and check the GPT header at lba into hdr; -1 if it is not valid */
+static int read_gpt_header(struct block_device *disk, uint32_t lba, struct gpt_header *hdr)
+{
+    uint32_t crc;
+
+    if (read_sector(disk, lba)) {
+        return -1;
+    }
+    memcpy(hdr, part_buf, sizeof(*hdr));
+    if (hdr->signature != GPT_SIGNATURE || hdr->my_lba != lba ||
+        hdr->header_size < GPT_HEADER_MIN || hdr->header_size > DISK_SECTOR_SIZE) {
+        return -1;
+    }
+
+    // the CRC covers the header with its own CRC field zeroed
+    crc = hdr->header_crc32;
+    memset(part_buf + 16, 0, sizeof(uint32_t));
+    if (~efi_crc32(part_buf, hdr->header_size, ~0u) != crc) {
+        printk("partitions: %s: GPT header at %u has a bad CRC\n", disk->bd_name, lba);
+        return -1;
+    }
+
+    // entries are walked a sector at a time, so they must tile one
+    if (hdr->sizeof_partition_entry < sizeof(struct gpt_entry) ||
+        hdr->sizeof_partition_entry > DISK_SECTOR_SIZE ||
+        (hdr->sizeof_partition_entry & (hdr->sizeof_partition_entry - 1)) ||
+        hdr->partition_entry_lba >= disk->bd_nr_sectors) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * walk the entry array; with add set, register the partitions, else
+ * return the array's CRC
+ */
+static uint32_t walk_gpt_entries(struct block_device *disk, struct gpt_header *hdr, int add)
+{
+    unsigned int per_sector = DISK_SECTOR_SIZE / hdr->sizeof_partition_entry;
+    uint32_t lba = (uint32_t)hdr->partition_entry_lba;
+    uint32_t crc = ~0u;
+
+    for (uint32_t i = 0; i < hdr->num_partition_entries; i += per_sector) {
+        unsigned int n = hdr->num_partition_entries - i;
+
+        if (n > per_sector) {
+            n = per_sector;
+        }
+        if (read_sector(disk, lba++)) {
+            return 0;
+        }
+        if (!add) {
+            crc = efi_crc32(part_buf, n * hdr->sizeof_partition_entry, crc);
+            continue;
+        }
+
+        for (unsigned int j = 0; j < n; j++) {
+            struct gpt_entry *e = (struct gpt_entry *)(part_buf + j * hdr->sizeof_partition_entry);
+            int used = 0;
+
+            for (int k = 0; k < 16; k++) {
+                used |= e->partition_type_guid[k];
+            }
+            if (!used || i + j + 1 >= disk->bd_minors) {
+                continue;
+            }
+            if (e->ending_lba < e->starting_lba || e->ending_lba >= disk->bd_nr_sectors) {
+                printk("partitions: %s: GPT entry %u out of range\n", disk->bd_name, i + j + 1);
+                continue;
+            }
+            add_partition(disk, i + j + 1, (uint32_t)e->starting_lba,
+                          (uint32_t)(e->ending_lba - e->starting_lba + 1));
+        }
+    }
+    return ~crc;
+}
+
+static int parse_gpt(struct block_device *disk)
+{
+    struct gpt_header hdr;
+    uint32_t lbas[2] = { 1, disk->bd_nr_sectors - 1 };
+
+    for (int i = 0; i < 2; i++) {
+        if (read_gpt_header(disk, lbas[i], &hdr)) {
+            continue;
+        }
+        if (walk_gpt_entries(disk, &hdr, 0) != hdr.partition_entry_array_crc32) {
+            printk("partitions: %s: GPT entries at %u have a bad CRC\n", disk->bd_name,
+                   (uint32_t)hdr.partition_entry_lba);
+            continue;
+        }
+        if (i) {
+            printk("partitions: %s: primary GPT is bad, using the backup\n", disk->bd_name);
+        }
+        walk_gpt_entries(disk, &hdr, 1);
+        return 0;
+    }
+    printk("partitions: %s: protective MBR but no valid GPT\n", disk->bd_name);
+    return -1;
+}
+
+int rescan_partitions(struct block_device *disk)
+{
+    if (disk->bd_minors <= 1 || disk->bd_contains != disk || disk->bd_nr_sectors < 2) {
+        return -1;
+    }
+    if (!part_buf) {
+        part_buf = (uint8_t *)kmalloc(DISK_SECTOR_SIZE, 0);
+        if (!part_buf) {
+            return -1;
+        }
+    }
+    if (read_sector(disk, 0)) {
+        printk("partitions: %s: cannot read sector 0\n", disk->bd_name);
+        return -1;
+    }
+    if (part_buf[MBR_MAGIC_OFFSET] != 0x55 || part_buf[MBR_MAGIC_OFFSET + 1] != 0xaa) {
+        return 0; // no partition table, the whole disk is one filesystem
+    }
+
+    if (parse_mbr(disk)) {
+        return parse_gpt(disk);
+    }
+    return 0;
+}
+
+void check_partitions(void)
+{
+    for (int i = 0; i < MAX_BLKDEV; i++) {
+        struct block_device *bdev = blkdev_at(i);
+
+        if (bdev && bdev->bd_contains == bdev && bdev->bd_minors > 1) {
+            rescan_partitions(bdev);
+        }
+    }
+}
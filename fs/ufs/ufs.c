@@ -29,7 +29,7 @@ kmem_cache_t *inode_cache;
 kmem_cache_t *file_cache; //for file table entries
 
 struct inode_cache {
-    struct list_head i_hash[DEV_NO];
+    struct list_head i_hash[NR_HASH];
     struct list_head i_free;
 }i_cache;
 
@@ -73,7 +73,7 @@ uint32_t search_dir(struct inode *inode, const char *entry, int entry_len)
     uint32_t inum;
 
     while (iCnt < block) {
-        bh = bread(DEV_NO, inode->i_blocks[iCnt]);    
+        bh = bread(ROOT_DEV, inode->i_blocks[iCnt]);    
         if (!bh) {
             printk("failed bread in search_dir\n");
         }
@@ -118,7 +118,7 @@ struct inode *namei(const char *path)
     }
 
     if (path[0] == '/') {
-        /* work = iget(DEV_NO, 1); //get the root directory */
+        /* work = iget(ROOT_DEV, 1); //get the root directory */
         work = current->root;
         index++;
     }
@@ -146,7 +146,7 @@ struct inode *namei(const char *path)
         }
         kfree(curr_token);
         iput(work);
-        work = iget(DEV_NO, inode);
+        work = iget(ROOT_DEV, inode);
         index = end + 1;
     }
 
@@ -169,7 +169,7 @@ void fill_free_inode_list(s_ufs *super)
 
     while (dilb_start <= dilb_end) {
 
-        bh = bread(DEV_NO, dilb_start);
+        bh = bread(ROOT_DEV, dilb_start);
 
         if (!bh) {
             printk("failed bread for dilb start %d\n", dilb_start);
@@ -228,7 +228,7 @@ struct inode *ialloc(short dev_no)
 void init_sb(void) 
 {
     struct buffer_head *bh;
-    bh = bread(DEV_NO, 1);
+    bh = bread(ROOT_DEV, 1);
     if (!bh) {
         printk("read super blocked failed \n");
         return;
@@ -303,7 +303,7 @@ void mkufs(int mb)
 {
     int iCnt = 0, jCnt = 0;
     struct buffer_head *bh;
-    bh = bread(DEV_NO, 1);
+    bh = bread(ROOT_DEV, 1);
     if (!bh) {
         printk("read super blocked failed \n");
         return;
@@ -318,14 +318,14 @@ void mkufs(int mb)
             + super->s_blk_dilb_start; 
         printk("iCnt: %d, its_block: %d\n", iCnt, inodes_block);
         struct buffer_head *binode = NULL;
-        binode = bread(DEV_NO, inodes_block);
+        binode = bread(ROOT_DEV, inodes_block);
         if (!binode) {
             printk("bread failed at %d\n", inodes_block);
             break;
         }
         for (jCnt = 0; jCnt < INODES_PER_BLOCK; jCnt++) {
             struct d_inode *dinode = (struct d_inode*)binode->b_data + jCnt;
-            init_inode(dinode, DEV_NO, iCnt + jCnt, inodes_block);
+            init_inode(dinode, ROOT_DEV, iCnt + jCnt, inodes_block);
         }
         printk("iCnt: %d, jCnt: %d, toal_inodes: %lu\n", iCnt, jCnt, super->s_total_inodes);
 
@@ -346,7 +346,7 @@ struct d_inode get_dinode(unsigned long i_no)
 
     uint16_t i_blk_offset = (i_no % INODES_PER_BLOCK);
 
-    bh = bread(DEV_NO, i_blk);
+    bh = bread(ROOT_DEV, i_blk);
     if (!bh) {
         printk("bread failed for %u\n", i_blk);
     }
@@ -376,7 +376,7 @@ void write_inode(struct inode *inode)
 
     uint16_t i_blk_offset = (inode->i_no % INODES_PER_BLOCK);
 
-    bh = bread(DEV_NO, i_blk);
+    bh = bread(ROOT_DEV, i_blk);
     if (!bh) {
         printk("bread failed for %u\n", i_blk);
     }
@@ -389,7 +389,7 @@ void write_inode(struct inode *inode)
 void display_inode_cache(void) 
 {
     int iCnt = 0;
-    for (; iCnt < DEV_NO; iCnt++) {
+    for (; iCnt < NR_HASH; iCnt++) {
         struct list_head *run;
         struct inode *inode;
         printk("================ i_hash %d=================\n", iCnt);
@@ -439,7 +439,7 @@ void inode_init(struct inode *inode, unsigned short dev_no, unsigned long inum)
 void test_icache(void)
 {
     printk("testing inode cache .............\n");
-    struct inode *inode = iget(DEV_NO, 16);
+    struct inode *inode = iget(ROOT_DEV, 16);
     if (!inode) {
         printk(" iget failed \n");
         return ;
@@ -470,7 +470,7 @@ void create_inode_cache(void)
 
     /* create_file_cache(); */
 
-    for (iCnt = 0; iCnt < DEV_NO; iCnt++) {
+    for (iCnt = 0; iCnt < NR_HASH; iCnt++) {
         INIT_LIST_HEAD(&i_cache.i_hash[iCnt]);
     }
     INIT_LIST_HEAD(&i_cache.i_free);
@@ -482,10 +482,10 @@ void create_inode_cache(void)
             break;
         }
        
-        inode_init(tmp, DEV_NO, iCnt);
+        inode_init(tmp, ROOT_DEV, iCnt);
         /*
          * add to correct hash list and also to freelist */
-        list_add(&i_cache.i_hash[hash_fn(iCnt, DEV_NO)], &tmp->i_hash);
+        list_add(&i_cache.i_hash[hash_fn(iCnt, ROOT_DEV)], &tmp->i_hash);
         list_add(&i_cache.i_free, &tmp->i_free);
     }
 
@@ -590,7 +590,7 @@ void test_fs(void)
     s_ufs *sb;
     struct buffer_head *bh;
 
-    bh = bread(DEV_NO, 1);
+    bh = bread(ROOT_DEV, 1);
     if (!bh) {
         printk("failed bread for block 1\n");
         return;
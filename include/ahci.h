@@ -0,0 +1,154 @@
+#ifndef _AHCI_H
+#define _AHCI_H
+
+#include <stdint.h>
+#include "registers.h"
+
+/*
+ * AHCI 1.3 host bus adapter (QEMU's ich9-ahci).
+ *
+ * The HBA's registers live in memory BAR5 (ABAR): a generic block
+ * followed by one 0x80 byte block per port. Each port has a command
+ * list of 32 slots in RAM; a slot points at a command table holding the
+ * FIS to send and the PRD table for the data, and the HBA posts the
+ * FISes it receives into the port's FIS receive area.
+ */
+
+#define PCI_SUBCLASS_SATA       0x06
+#define PCI_PROG_IF_AHCI        0x01
+#define AHCI_ABAR               5
+
+#define AHCI_MAX_PORTS          32
+#define AHCI_MAX_SLOTS          32
+
+/* generic host control */
+#define HBA_CAP_NCS_SHIFT       8 //number of command slots - 1, 5 bits
+#define HBA_CAP_SNCQ            (1u << 30)
+#define HBA_GHC_HR              (1u << 0)
+#define HBA_GHC_IE              (1u << 1)
+#define HBA_GHC_AE              (1u << 31)
+
+/* port command and status */
+#define PORT_CMD_ST             (1u << 0)
+#define PORT_CMD_FRE            (1u << 4)
+#define PORT_CMD_FR             (1u << 14)
+#define PORT_CMD_CR             (1u << 15)
+
+/* port interrupt status / enable */
+#define PORT_IS_DHRS            (1u << 0) //D2H register FIS
+#define PORT_IS_PSS             (1u << 1) //PIO setup FIS
+#define PORT_IS_SDBS            (1u << 3) //set device bits FIS (NCQ done)
+#define PORT_IS_IFS             (1u << 27)
+#define PORT_IS_HBDS            (1u << 28)
+#define PORT_IS_HBFS            (1u << 29)
+#define PORT_IS_TFES            (1u << 30)
+#define PORT_IS_ERROR           (PORT_IS_IFS | PORT_IS_HBDS | PORT_IS_HBFS | PORT_IS_TFES)
+#define PORT_IE_DEFAULT         (PORT_IS_DHRS | PORT_IS_PSS | PORT_IS_SDBS | PORT_IS_ERROR)
+
+#define PORT_TFD_ERR            (1u << 0)
+#define PORT_TFD_DRQ            (1u << 3)
+#define PORT_TFD_BSY            (1u << 7)
+
+#define PORT_SSTS_DET_MASK      0x0f
+#define PORT_SSTS_DET_PRESENT   0x03
+#define PORT_SIG_ATA            0x00000101
+
+struct ahci_port_regs {
+    uint32_t clb; //command list base, 1K aligned
+    uint32_t clbu;
+    uint32_t fb; //FIS receive base, 256 byte aligned
+    uint32_t fbu;
+    uint32_t is;
+    uint32_t ie;
+    uint32_t cmd;
+    uint32_t rsv0;
+    uint32_t tfd;
+    uint32_t sig;
+    uint32_t ssts;
+    uint32_t sctl;
+    uint32_t serr;
+    uint32_t sact; //NCQ tags outstanding
+    uint32_t ci; //slots issued
+    uint32_t sntf;
+    uint32_t fbs;
+    uint32_t rsv1[11];
+    uint32_t vendor[4];
+};
+
+struct ahci_hba_regs {
+    uint32_t cap;
+    uint32_t ghc;
+    uint32_t is; //one bit per port
+    uint32_t pi; //ports implemented
+    uint32_t vs;
+    uint32_t ccc_ctl;
+    uint32_t ccc_ports;
+    uint32_t em_loc;
+    uint32_t em_ctl;
+    uint32_t cap2;
+    uint32_t bohc;
+    uint8_t rsv[0xa0 - 0x2c];
+    uint8_t vendor[0x100 - 0xa0];
+    struct ahci_port_regs ports[AHCI_MAX_PORTS];
+};
+
+/* command header flags */
+#define CMD_HDR_CFL_MASK        0x1f //command FIS length in dwords
+#define CMD_HDR_WRITE           (1 << 6)
+#define CMD_HDR_CLEAR_BUSY      (1 << 10)
+
+struct ahci_cmd_header {
+    uint16_t flags;
+    uint16_t prdtl; //PRD entries
+    uint32_t prdbc; //bytes transferred, written by the HBA
+    uint32_t ctba; //command table, 128 byte aligned
+    uint32_t ctbau;
+    uint32_t rsv[4];
+};
+
+#define PRD_DBC_MASK            0x3fffff //byte count - 1, 4M max, even counts
+
+struct ahci_prd {
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t rsv;
+    uint32_t dbc;
+};
+
+/* one page per command table */
+#define AHCI_PRDT_ENTRIES       248
+
+struct ahci_cmd_table {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t rsv[48];
+    struct ahci_prd prdt[AHCI_PRDT_ENTRIES];
+};
+
+#define FIS_TYPE_REG_H2D        0x27
+#define FIS_H2D_COMMAND         0x80 //C bit: command, not device control
+
+struct fis_reg_h2d {
+    uint8_t fis_type;
+    uint8_t flags;
+    uint8_t command;
+    uint8_t featurel;
+    uint8_t lba0;
+    uint8_t lba1;
+    uint8_t lba2;
+    uint8_t device;
+    uint8_t lba3;
+    uint8_t lba4;
+    uint8_t lba5;
+    uint8_t featureh;
+    uint8_t countl;
+    uint8_t counth;
+    uint8_t icc;
+    uint8_t control;
+    uint8_t rsv[4];
+} __attribute__((packed));
+
+void ahci_init(void);
+void ahci_irq_handler(registers_t *regs);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef _BIO_H
+#define _BIO_H
+
+#include <stdint.h>
+#include "list.h"
+#include "mm.h"
+#include "disk.h"
+
+/*
+ * block I/O request. A bio describes one contiguous run of sectors on a
+ * device and the (not necessarily contiguous) memory it is transferred
+ * to/from, as a list of page segments.
+ *
+ * Plain writes complete once the drive has them, possibly only in its
+ * write cache, and may be reordered with each other. A filesystem asks
+ * for ordering at its commit points only: BIO_flush makes everything
+ * completed before the bio durable first, BIO_fua makes the bio's own
+ * data durable before it completes.
+ */
+
+#define BIO_READ    0
+#define BIO_WRITE   1
+
+#define BIO_MAX_VECS 8
+
+/* bi_flags */
+#define BIO_uptodate 1 << 0 //transfer completed without error
+#define BIO_done     1 << 1 //bio_endio() has run
+#define BIO_flush    1 << 2 //flush the device's write cache first; alone if empty
+#define BIO_fua      1 << 3 //write: complete only once the data is on stable media
+
+struct bio_vec {
+    struct page *bv_page;
+    unsigned int bv_len; //bytes
+    unsigned int bv_offset; //byte offset inside bv_page
+};
+
+struct bio;
+typedef void (bio_end_io_t)(struct bio *, int error);
+
+struct bio {
+    unsigned short bi_dev;
+    uint32_t bi_sector; //first LBA of the transfer
+    unsigned short bi_rw; //BIO_READ or BIO_WRITE
+    unsigned short bi_flags;
+    unsigned short bi_vcnt; //segments used in bi_io_vec
+    unsigned int bi_size; //total bytes, sum of bv_len
+    struct bio_vec bi_io_vec[BIO_MAX_VECS];
+
+    bio_end_io_t *bi_end_io; //completion callback, may be NULL
+    void *bi_private; //owner cookie for bi_end_io
+
+    struct list_head bi_list;
+};
+
+#define bio_sectors(bio) ((bio)->bi_size / DISK_SECTOR_SIZE)
+
+#define bvec_virt(bv) ((uint8_t *)page_address((bv)->bv_page) + (bv)->bv_offset)
+
+#define bio_for_each_segment(bv, bio, i) \
+    for (i = 0, bv = (bio)->bi_io_vec; i < (bio)->bi_vcnt; i++, bv++)
+
+struct bio *bio_alloc(void);
+void bio_put(struct bio *bio);
+int bio_add_page(struct bio *bio, struct page *page, unsigned int len, unsigned int offset);
+int bio_add_buf(struct bio *bio, void *buf, unsigned int len);
+void submit_bio(int rw, struct bio *bio);
+int submit_bio_wait(int rw, struct bio *bio);
+void bio_endio(struct bio *bio, int error);
+
+/* synchronous helper for callers that just have a kernel buffer */
+int bio_rw_buf(unsigned short dev, int rw, uint32_t sector, void *buf, unsigned int len);
+int blkdev_issue_flush(unsigned short dev);
+int bio_write_buf_nowait(unsigned short dev, uint32_t sector, void *buf, unsigned int len);
+
+#endif
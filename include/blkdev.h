@@ -0,0 +1,207 @@
+#ifndef _BLKDEV_H
+#define _BLKDEV_H
+
+#include <stdint.h>
+#include "list.h"
+#include "bio.h"
+#include "system.h"
+
+/*
+ * per-device request queue.
+ *
+ * bios handed to generic_make_request() are merged into requests for
+ * contiguous LBA runs and held on a deadline elevator: requests sit on
+ * a sector-sorted list (served C-LOOK, one sweep upwards then wrap to
+ * the lowest sector) and on an arrival-order fifo carrying a deadline.
+ * Reads are preferred over writes, but writes are served after at most
+ * WRITES_STARVED read dispatches, and a request whose deadline passed
+ * is served before the sweep continues. A flush is a barrier: it is
+ * dispatched only after everything queued before it, and nothing queued
+ * after it overtakes it. A write bio carrying BIO_flush is queued behind
+ * such a flush; a BIO_fua write on a queue that cannot do FUA is turned
+ * into a flush once the drive has the data, and completes after it.
+ *
+ * Drivers complete requests from their interrupt handler with
+ * blk_end_request(), which only parks them on done_list; the bios'
+ * completion callbacks run later in process context, from
+ * blk_complete_requests().
+ */
+
+/*
+ * block devices are named by dev_t: an 8-bit major for the driver and an
+ * 8-bit minor for the unit. 0 is no device.
+ */
+#define MINORBITS   8
+#define MINORMASK   ((1 << MINORBITS) - 1)
+#define MAJOR(dev)  ((unsigned int)((dev) >> MINORBITS))
+#define MINOR(dev)  ((unsigned int)((dev) & MINORMASK))
+#define MKDEV(ma, mi) ((dev_t)(((ma) << MINORBITS) | (mi)))
+
+/* majors, as Linux numbers them */
+#define RAMDISK_MAJOR       1
+#define IDE0_MAJOR          3 //hda, primary channel
+#define SCSI_DISK0_MAJOR    8 //sda.. AHCI ports, 16 minors each
+#define IDE1_MAJOR          22 //hdc, secondary channel
+#define VIRTBLK_MAJOR       254 //vda.., 16 minors each
+
+/* registered devices, partitions included */
+#define MAX_BLKDEV 64
+
+/* minors a partitionable disk reserves: itself and 15 partitions */
+#define DISK_MINORS 16
+
+/* filesystem block size a device starts with; see set_blocksize() */
+#define BLKDEV_DEFAULT_BLOCK_SIZE 1024
+
+#define FMODE_READ  1 << 0
+#define FMODE_WRITE 1 << 1
+
+/* sectors per request; the most one ATA command can move */
+#define BLK_MAX_SECTORS 256
+
+/* deadlines, in timer ticks */
+#define READ_EXPIRE     50
+#define WRITE_EXPIRE    500
+#define WRITES_STARVED  2
+
+/* rq_flags */
+#define RQ_nomerge 1 << 0 //holds a bio that ends mid sector
+#define RQ_flush   1 << 1 //no data, flush the write cache
+#define RQ_fua     1 << 2 //write through to the media
+
+struct request {
+    unsigned short rq_dev;
+    unsigned short rq_rw;
+    unsigned short rq_flags;
+    uint32_t rq_sector; //first LBA
+    unsigned int rq_nr_sectors;
+    int rq_deadline; //timer_ticks by which it should be dispatched
+    int rq_errors;
+    unsigned long long rq_start_time; //TSC when queued
+    unsigned long long rq_issue_time; //TSC when handed to the driver
+
+    struct list_head rq_bios; //bios via bi_list, in LBA order
+    struct list_head rq_sort; //q->sort_list[rw], ascending rq_sector, then q->in_flight
+    struct list_head rq_fifo; //q->fifo_list[rw], arrival order, then q->done_list
+};
+
+/*
+ * per-device counters, as the fields of /proc/diskstats. A request is
+ * in flight from being queued until the driver ends it. Times are TSC
+ * cycles; diskstats_show() reports milliseconds.
+ */
+struct disk_stats {
+    unsigned long ios[2]; //requests completed, by BIO_READ / BIO_WRITE
+    unsigned long merges[2]; //bios and requests merged into another request
+    unsigned long sectors[2];
+    unsigned long long ticks[2]; //queue to completion, summed over requests
+    unsigned long flushes;
+    unsigned int in_flight;
+    unsigned long long io_ticks; //time with anything in flight
+    unsigned long long time_in_queue; //io_ticks weighted by in_flight
+    unsigned long long stamp; //of the last in_flight change
+};
+
+struct request_queue;
+typedef void (request_fn_t)(struct request_queue *q);
+
+struct request_queue {
+    unsigned short q_dev;
+    struct list_head sort_list[2]; //indexed by BIO_READ / BIO_WRITE
+    struct list_head fifo_list[2];
+    unsigned int nr_queued;
+    struct list_head in_flight; //handed to the driver (via rq_sort), not yet ended
+    unsigned int nr_in_flight;
+    struct list_head done_list; //finished by the driver, bios not yet completed
+
+    uint32_t head_pos; //sector after the last dispatched request
+    unsigned int starved; //read dispatches while writes waited
+    unsigned int plugged; //nesting depth of blk_plug()
+    unsigned int max_sectors;
+    uint32_t nr_sectors; //device capacity, 0 if unknown
+    int fua; //driver does RQ_fua writes; else each is followed by a flush
+    unsigned int phys_sectors; //sectors per physical sector; smaller or unaligned writes are read-modify-write
+
+    request_fn_t *request_fn; //driver: start work from elv_next_request(), irqs off
+    void *queuedata;
+
+    unsigned long nr_requests;
+    struct disk_stats stats;
+};
+
+#define rq_for_each_bio(bio, rq) \
+    list_for_each_entry(bio, &(rq)->rq_bios, bi_list)
+
+struct block_device;
+
+/* what a driver does beyond moving sectors through its queue */
+struct block_device_operations {
+    int (*open)(struct block_device *bdev, int mode); //first opener, may refuse
+    void (*release)(struct block_device *bdev); //last opener gone
+};
+
+/*
+ * a disk, or a partition of one. A partition shares the disk's queue;
+ * its bios are moved onto the disk by generic_make_request().
+ */
+struct block_device {
+    dev_t bd_dev;
+    char bd_name[8]; //"hda", "sdb1", "vda"
+    const struct block_device_operations *bd_ops; //may be NULL
+    struct request_queue *bd_queue;
+    uint32_t bd_nr_sectors; //capacity in DISK_SECTOR_SIZE sectors
+    unsigned int bd_block_size; //bytes per buffer cache block
+    unsigned int bd_openers;
+    void *bd_private; //driver's
+
+    unsigned int bd_minors; //disk: DISK_MINORS if it may be partitioned, else 0
+    struct block_device *bd_contains; //the whole disk; itself for a disk
+    int bd_partno; //0 for a disk
+    uint32_t bd_start_sect; //partition: first sector on bd_contains
+};
+
+/* the device mounted as / : the first disk registered */
+extern dev_t ROOT_DEV;
+
+int register_blkdev(struct block_device *bdev);
+void unregister_blkdev(struct block_device *bdev);
+struct block_device *bdget(dev_t dev);
+struct block_device *blkdev_get(dev_t dev, int mode);
+void blkdev_put(struct block_device *bdev);
+int set_blocksize(struct block_device *bdev, unsigned int size);
+
+/* registry slot of dev, for per-device tables; -1 if not registered */
+int blkdev_index(dev_t dev);
+struct block_device *blkdev_at(int index);
+
+/* one /proc/diskstats style line per registered disk, over serial */
+void diskstats_show(void);
+
+/*
+ * read the MBR or GPT of every partitionable disk and register its
+ * partitions, e.g. hda1 as MKDEV(IDE0_MAJOR, 1). Needs interrupts on.
+ */
+void check_partitions(void);
+int rescan_partitions(struct block_device *disk);
+
+struct request_queue *blk_init_queue(dev_t dev, request_fn_t *fn, void *queuedata);
+struct request_queue *blk_get_queue(dev_t dev);
+void generic_make_request(struct bio *bio);
+void blk_run_queue(struct request_queue *q);
+void blk_drain_queue(struct request_queue *q);
+void blk_complete_requests(struct request_queue *q);
+void blk_wait_completion(struct request_queue *q);
+
+/*
+ * hold back dispatch on a device while a caller issues a burst of
+ * related I/O, so it can be merged and sorted. Plugs nest.
+ */
+void blk_plug(dev_t dev);
+void blk_unplug(dev_t dev);
+
+/* driver side, called with interrupts disabled */
+struct request *elv_next_request(struct request_queue *q);
+void blk_end_request(struct request *rq, int error);
+void blk_rq_copy(struct request *rq, uint8_t *buf, int to_rq);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef _BLKTRACE_H
+#define _BLKTRACE_H
+
+#include <stdint.h>
+#include "system.h"
+
+/*
+ * blktrace: one ring of events for every block device, recording each
+ * request as it is queued, merged into, issued to the driver and
+ * completed, stamped with the TSC. Off until blk_trace_start(); once
+ * full the oldest events are overwritten. blk_trace_dump() prints it in
+ * the spirit of blkparse:
+ *
+ *   dev seq time_us action rw sector + nr_sectors [latencies]
+ */
+
+#define BLK_TRACE_ENTRIES 1024
+
+/* action */
+#define BLK_TA_QUEUE    'Q' //new request
+#define BLK_TA_MERGE    'M' //bio merged into a queued request
+#define BLK_TA_ISSUE    'D' //handed to the driver
+#define BLK_TA_COMPLETE 'C'
+
+struct blk_io_trace {
+    unsigned long long time; //TSC
+    unsigned long long q2c; //complete: cycles since queued
+    unsigned long long d2c; //complete: cycles since issued
+    uint32_t sector;
+    uint16_t nr_sectors;
+    dev_t dev;
+    char action;
+    char rw; //'R', 'W' or 'F'lush
+    short error;
+};
+
+struct request;
+
+extern int blk_trace_enabled;
+
+/* interrupts off */
+void __blk_add_trace(struct request *rq, char action, uint32_t sector, unsigned int nr_sectors);
+
+static inline void blk_add_trace(struct request *rq, char action, uint32_t sector,
+                                 unsigned int nr_sectors)
+{
+    if (blk_trace_enabled) {
+        __blk_add_trace(rq, action, sector, nr_sectors);
+    }
+}
+
+void blk_trace_start(void); //clears the ring
+void blk_trace_stop(void);
+void blk_trace_dump(void);
+
+#endif
@@ -1,9 +1,16 @@
 #ifndef _BUFFER_H
 #define _BUFFER_H
 
-#include "ufs.h"
+#include <stdint.h>
+#include "list.h"
+#include "mm.h"
+#include "disk.h"
+#include "fs.h"
+#include "blkdev.h"
 
-#define hash_fn(bno, devno) (bno % devno)
+/* buffer and inode hash chains; symmetric, so argument order does not matter */
+#define NR_HASH 64
+#define hash_fn(bno, dev) ((((unsigned long)(bno)) ^ ((unsigned long)(dev))) % NR_HASH)
 
 
 /* BUFFER_CACHE
@@ -15,21 +22,71 @@
 #define BH_uptodate 1 << 2
 #define BH_delay 1 << 3
 #define BH_old 1 << 5
+#define BH_hot 1 << 6 //buffer lives on the hot (Am) queue
 
 
 struct buffer_head{
     unsigned short flags;
     unsigned int b_count; //buffer ref count
     char* b_data; //ptr to data //1024 bytes
+    struct page *b_page; //page b_data is carved from
     unsigned short b_dev; //if ==0 means free
     unsigned long b_blocknr; //block number
     struct list_head b_hash;
-    struct list_head b_free;
+    struct list_head b_free; //node on either the cold or the hot queue
 };
 
+/*
+ * Replacement is 2Q (Johnson & Shasha):
+ *   b_cold  (A1in)  FIFO of buffers referenced once since they were loaded,
+ *                   in load order; they stay queued while in use
+ *   b_hot   (Am)    LRU of buffers that were re-referenced after leaving A1in
+ *   b_ghost (A1out) block numbers recently evicted from A1in, no data
+ * A miss that hits b_ghost comes back straight onto the hot queue, so a
+ * block touched again "soon enough" is promoted while a one-pass sequential
+ * scan only ever churns the cold queue.
+ */
+#define BGHOST_SIZE 50
+
+struct bghost {
+    unsigned short dev;
+    unsigned long blocknr;
+    int valid; //0 for an empty or forgotten slot, whose dev/block mean nothing
+};
+
+/*
+ * b_data blocks are packed BUFFERS_PER_PAGE to a page. page->private holds
+ * the bitmap of used slots and page->lru links pages with a free slot.
+ */
+#define BUFFER_SIZE 1024
+#define BUFFERS_PER_PAGE (PAGE_SIZE / BUFFER_SIZE)
+#define BLOCK_SECTORS (BUFFER_SIZE / DISK_SECTOR_SIZE) //at the default block size
+#define BUFFERS_MIN 16 //preallocated at boot, the pool never shrinks below it
+#define BCACHE_RAM_SHARE 16 //at most 1/BCACHE_RAM_SHARE of RAM holds buffers
+
 struct buffer_cache {
-    struct list_head b_hash[DEV_NO]; //the buffer hashmap
-    struct list_head b_free; //the freelist
+    struct list_head b_hash[NR_HASH]; //the buffer hashmap
+    struct list_head b_cold; //A1in, free buffers seen once
+    struct list_head b_hot;  //Am, free buffers seen more than once
+    unsigned int b_nr_cold; //resident buffers not on the hot queue
+    unsigned int b_kin; //target size of the cold queue
+    struct bghost b_ghost[BGHOST_SIZE]; //A1out ring
+    unsigned int b_ghost_next;
+
+    struct list_head b_pages; //buffer pages with at least one free slot
+    unsigned int b_nr_pages; //pages owned by the buffer cache
+    unsigned int b_nr_buffers; //buffer_heads currently allocated
+    unsigned int b_max_buffers; //growth limit, derived from RAM size
+};
+
+/* per device counters, by registry slot; see display_bcache_stats() */
+#define NR_BSTAT_DEV MAX_BLKDEV
+
+struct bcache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long ghost_hits; //misses that were promoted to the hot queue
 };
 
 
@@ -37,7 +94,13 @@ struct buffer_cache {
 void create_buffer_cache(void);
 struct buffer_head *bread(unsigned short dev_no, unsigned long blocknr);
 void bwrite(struct buffer_head *bh);
+int sync_dirty_buffer(struct buffer_head *bh); //flush + FUA, for commit points
+void mark_buffer_dirty(struct buffer_head *bh);
+int write_dirty_buffer(struct buffer_head *bh);
 void brelse(struct buffer_head *bh);
 struct buffer_head *getblk(unsigned short dev_no, unsigned long blocknr);
+struct bcache_stats *bcache_stats(unsigned short dev_no);
+int shrink_buffer_cache(int nr_pages);
+void display_bcache_stats(void);
 
 #endif
@@ -7,6 +7,10 @@
 /* Dentry cache hash table size */
 #define DENTRY_HASH_SIZE 256
 
+/* Unused dentries kept cached, and how many to free when memory runs out */
+#define DENTRY_UNUSED_MAX   512
+#define DENTRY_PRUNE_BATCH  32
+
 /* Dentry flags */
 #define DCACHE_REFERENCED 0x0001  /* recently used */
 #define DCACHE_UNHASHED   0x0002  /* not in hash table */
@@ -16,11 +20,18 @@ struct dentry *d_alloc(struct dentry *parent, const char *name);
 struct dentry *d_alloc_root(struct inode *root_inode);
 void d_instantiate(struct dentry *dentry, struct inode *inode);
 struct dentry *d_lookup(struct dentry *parent, const char *name);
+struct dentry *__d_lookup_rcu(struct dentry *parent, const char *name, unsigned int *seqp);
 void d_add(struct dentry *dentry, struct inode *inode);
 void d_delete(struct dentry *dentry);
+void d_drop(struct dentry *dentry);
+void d_drop_negative(struct dentry *parent, const char *name);
+void prune_dcache(int count);
 void dput(struct dentry *dentry);
 struct dentry *dget(struct dentry *dentry);
 
+/* bumped around renames; lockless walks check it when they finish */
+extern seqcount_t rename_seq;
+
 /* Dentry cache initialization */
 void dcache_init(void);
 
@@ -2,14 +2,17 @@
 #define _DISK_H
 
 #include <stdint.h>
+#include "registers.h"
 
 #define SECTOR_CHUNK        0xff
 #define DISK_SECTOR_SIZE    512 // matches ATA_SECTOR_SIZE in disk.c
 
 // disk commands
-void disk_write(uint32_t lba, uint8_t *buf, uint32_t nchar);
+int disk_write(uint32_t lba, uint8_t *buf, uint32_t nchar);
 void disk_read(uint32_t lba, uint8_t *buf);
 void disk_read_bootloader(uint32_t lba, uint8_t *buf, uint8_t chunk);
+void disk_init(void);
+void ata_irq_handler(registers_t *regs);
 
 void test_disk(void);
 
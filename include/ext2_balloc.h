@@ -5,9 +5,9 @@
 #include "fs.h"
 
 /* Block allocation and bitmap management */
-uint32_t first_free_bm(uint8_t *bitmap, uint8_t allowed_start);
-uint32_t first_free_block(bgdesc_t *d);
-uint32_t first_free_inode(bgdesc_t *d);
+uint32_t find_next_zero_bit(const uint8_t *bitmap, uint32_t size, uint32_t start);
+int first_free_block(uint16_t group, uint32_t *res);
+int first_free_inode(uint16_t group, uint32_t *res);
 int first_free_block_num(uint32_t *res);
 int first_free_inode_num(uint32_t *res);
 
@@ -20,19 +20,30 @@ void unset_block_bitmap(uint32_t block_num);
 void mark_inode(uint32_t inode_num, uint8_t val);
 void set_inode_bitmap(uint32_t inode_num);
 void unset_inode_bitmap(uint32_t inode_num);
+void ext2_sync_bitmaps(int release);
 
 /* Block/inode reservation */
+#define EXT2_PREALLOC_BLOCKS 8 //window claimed after a file's block
+
+int ext2_new_block(uint32_t goal, uint32_t *block_n,
+                   uint32_t *prealloc_block, uint32_t *prealloc_count);
+void ext2_free_blocks(uint32_t block, uint32_t count);
 int reserve_free_block(uint32_t *block_n);
 int reserve_free_inode(uint32_t *inode_n);
-int reserve_inode(uint32_t inode_n);
+int reserve_inode(uint32_t inode_n, int is_dir);
+int ext2_new_inode_num(uint32_t parent_ino, int is_dir, uint32_t *inode_n);
+void ext2_free_inode_num(uint32_t inode_n, int is_dir);
+uint32_t ext2_inode_goal(uint32_t inode_n);
 
 /* Block group descriptor operations */
-void update_inode_bg_desc(uint32_t free_inode_n);
+void update_inode_bg_desc(uint32_t free_inode_n, int is_dir);
 void update_block_bg_desc(uint32_t free_block_n);
-void disk_sync_bgdt(void);
+void disk_sync_bgdt(int backup);
 
 /* Superblock sync */
-void disk_sync_super(void);
+void disk_sync_super(int backup);
+void ext2_mark_super_dirty(void);
+void ext2_commit_super(int backups);
 
 /* Access to global data */
 extern bgdesc_t *get_bgdt(void);
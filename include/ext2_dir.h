@@ -0,0 +1,63 @@
+#ifndef _EXT2_DIR_H
+#define _EXT2_DIR_H
+
+#include <stdint.h>
+#include "fs.h"
+#include "buffer.h"
+
+/*
+ * directory blocks hold variable length records chained by rec_len, the
+ * last one running to the end of the block. A record's slack past its
+ * name takes new entries; a deleted record is merged into the one before
+ * it, so only a block's first record is ever left free (inode 0).
+ * A directory that outgrows its first block is indexed (the ext3 htree):
+ * block 0 becomes a dx_root, sorting leaf blocks by the hash of the names
+ * they hold.
+ */
+
+#define EXT2_INDEX_FL                   0x1000 //inode i_flags: hashed directory
+#define EXT2_FEATURE_COMPAT_DIR_INDEX   0x0020 //s_feature_compat
+
+#define EXT2_DIRENT_HDR         8 //inode, rec_len, name_len, file_type
+/* a record's size: header and name, rounded up to 4 bytes */
+#define EXT2_DIR_REC_LEN(name_len)  ((uint16_t)(((name_len) + EXT2_DIRENT_HDR + 3) & ~3))
+
+#define DX_HASH_LEGACY      0
+#define DX_HASH_HALF_MD4    1
+#define DX_HASH_TEA         2
+
+#define EXT2_HTREE_EOF      0x7fffffff
+
+struct dx_hash_info {
+    uint32_t hash; //low bit always clear, it flags collisions in the index
+    uint32_t minor_hash;
+    int hash_version;
+    uint32_t *seed; //s_hash_seed, all zero for the default
+};
+
+int ext2fs_dirhash(const char *name, int len, struct dx_hash_info *hinfo);
+void test_dirhash(void);
+
+/* directory blocks and the records in them */
+uint32_t ext2_dir_blocks(inode_t *inode);
+struct buffer_head *ext2_dir_bread(ext2_file_handle *dir, uint32_t lblock);
+struct buffer_head *ext2_dir_append(ext2_file_handle *dir, uint32_t *lblock);
+void ext2_dir_init_block(uint8_t *blk);
+void ext2_dir_init_dots(uint8_t *blk, uint32_t inode_n, uint32_t parent);
+dentry_t *ext2_dirent_at(uint8_t *blk, uint32_t off);
+dentry_t *ext2_dirent_find(uint8_t *blk, const char *name, int len);
+int ext2_dirent_add(uint8_t *blk, dentry_t *d);
+int ext2_dirent_delete(uint8_t *blk, dentry_t *de);
+struct buffer_head *ext2_find_dirent(ext2_file_handle *dir, const char *name, dentry_t **res);
+int ext2_find_entry(ext2_file_handle *dir, const char *name, uint32_t *inode_n);
+int ext2_add_entry(ext2_file_handle *dir, dentry_t *d);
+int ext2_delete_entry(ext2_file_handle *dir, const char *name);
+void test_dirent(void);
+
+/* the hashed index */
+int ext2_dx_find_entry(ext2_file_handle *dir, const char *name, int len,
+                       struct buffer_head **bhp, dentry_t **res);
+int ext2_dx_add_entry(ext2_file_handle *dir, dentry_t *d);
+int ext2_dx_make_indexed(ext2_file_handle *dir, struct buffer_head *bh, dentry_t *d);
+
+#endif
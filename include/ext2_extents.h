@@ -0,0 +1,54 @@
+#ifndef _EXT2_EXTENTS_H
+#define _EXT2_EXTENTS_H
+
+#include <stdint.h>
+#include "fs.h"
+
+/*
+ * extent mapped inodes, in the ext4 on-disk layout. i_block holds the
+ * root node: a header and up to 4 entries. A node at depth 0 holds
+ * extents (runs of logical blocks on consecutive physical blocks), one
+ * above it index entries pointing at the block of the next node down.
+ * Entries in a node are sorted by first logical block.
+ */
+
+#define EXT4_EXTENTS_FL                 0x80000 //inode i_flags
+#define EXT4_FEATURE_INCOMPAT_EXTENTS   0x0040  //s_feature_incompat
+#define EXT2_FEATURE_INCOMPAT_SUPP      EXT4_FEATURE_INCOMPAT_EXTENTS //all we can mount
+
+#define EXT4_EXT_MAGIC      0xf30a
+#define EXT_INIT_MAX_LEN    (1 << 15) //ee_len above this marks an unwritten extent
+#define EXT_MAX_DEPTH       5
+
+struct ext4_extent_header {
+    uint16_t eh_magic;
+    uint16_t eh_entries; //valid entries
+    uint16_t eh_max; //capacity of the node
+    uint16_t eh_depth; //0 for a leaf
+    uint32_t eh_generation;
+} __attribute__((packed));
+
+/* leaf entry */
+struct ext4_extent {
+    uint32_t ee_block; //first logical block
+    uint16_t ee_len;
+    uint16_t ee_start_hi; //always 0 here, block numbers are 32 bit
+    uint32_t ee_start_lo; //first physical block
+} __attribute__((packed));
+
+/* index entry */
+struct ext4_extent_idx {
+    uint32_t ei_block; //logical blocks from here on are below ei_leaf
+    uint32_t ei_leaf_lo; //block of the next node down
+    uint16_t ei_leaf_hi;
+    uint16_t ei_unused;
+} __attribute__((packed));
+
+#define EXT_FIRST_EXTENT(eh) ((struct ext4_extent *)((eh) + 1))
+#define EXT_FIRST_INDEX(eh) ((struct ext4_extent_idx *)((eh) + 1))
+
+void ext2_ext_tree_init(inode_t *inode);
+uint32_t ext2_ext_map(uint32_t *i_block, uint32_t block, uint32_t *len);
+int ext2_ext_insert(inode_t *inode, uint32_t inode_n, uint32_t block, uint32_t pblock);
+
+#endif
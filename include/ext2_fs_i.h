@@ -0,0 +1,37 @@
+#ifndef _EXT2_FS_I_H
+#define _EXT2_FS_I_H
+
+#include <stdint.h>
+
+#define EXT2_NDIR_BLOCKS    12
+#define EXT2_N_BLOCKS       15
+#define EXT2_IND_CACHE      4 //leaf indirect blocks remembered per inode
+
+/* a leaf indirect block and the first logical block it maps */
+struct ext2_ind_cache {
+    uint32_t ic_lblock;
+    uint32_t ic_block; //0 for an unused slot
+};
+
+/*
+ * ext2 state kept in the in-core inode (inode->u.ext2_i)
+ */
+struct ext2_inode_info {
+    uint32_t i_data[EXT2_N_BLOCKS]; //i_block of the disk inode
+    uint32_t i_flags; //and its i_flags
+
+    /* block map cache, see ext2_bmap() */
+    uint32_t i_cache_lblock; //last run resolved: logical start,
+    uint32_t i_cache_pblock; //physical start
+    uint32_t i_cache_len; //and length, 0 for none
+    struct ext2_ind_cache i_ind_cache[EXT2_IND_CACHE];
+    unsigned int i_ind_next; //slot replaced next
+
+    unsigned long i_block_group; //group the inode lives in
+    unsigned long i_next_alloc_block; //logical block expected to be allocated next
+    unsigned long i_next_alloc_goal; //and the physical block it should get
+    uint32_t i_prealloc_block; //first block of the preallocation window
+    uint32_t i_prealloc_count; //blocks left in it
+};
+
+#endif
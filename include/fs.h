@@ -14,7 +14,7 @@
 #include "list.h"
 #include "system.h"
 
-#define DEV_NO 4
+extern dev_t ROOT_DEV; //disk holding the root filesystem, see blkdev.h
 
 #define ROOT_USR    0
 
@@ -27,6 +27,9 @@
 
 #define EXT2_ERRORS_RO  2
 
+#define EXT2_GOOD_OLD_REV   0
+#define EXT2_DYNAMIC_REV    1 //s_feature_* are only meaningful from here on
+
 #define EXT2_GOOD_OLD_FIRST_INO 11
 #define EXT2_GOOD_OLD_INODE_SIZE 128
 
@@ -229,13 +232,14 @@ typedef struct {
 } inode_t;
 
 
-// 32, 32, 64 = 128
+// a directory record. On disk only EXT2_DIR_REC_LEN(name_len) bytes
+// of it are used, and the name is not NUL terminated.
 typedef struct {
     uint32_t inode;
     uint16_t rec_len; // points to end of block if no next
     uint8_t name_len;
     uint8_t file_type;
-    char name[64]; // wasteful
+    char name[64];
 } dentry_t;
 
 // for use in the OS. has helpful backpointers 
@@ -249,14 +253,14 @@ typedef struct {
 } ext2_file_handle;
 
 
-// make an ext2 filesystem on the disk.
-// args are in Mb
-void mkfs(uint32_t offset, uint32_t len);
+// make an ext2 filesystem on a block device (a partition, usually).
+// len is in Mb, 0 for the whole device
+void mkfs(dev_t dev, uint32_t len);
 
 // once the metadata is in place, creates the root directory.
-void finish_fs_init(uint32_t mb_start);
+void finish_fs_init(dev_t dev);
 
-void read_fs(uint32_t location);
+int read_fs(dev_t dev);
 
 void test_fs();
 
@@ -328,7 +332,6 @@ extern uint32_t g_blocks_in_last_group;
 /* the following are from the Linux manpages.*/
 int open(const char *pathname, int , int);
 
-uint32_t fs_start_to_lba_superblk(uint32_t mb_start);
 
 /* buffer cache operations */
 // void create_buffer_cache(void);
@@ -336,7 +339,7 @@ uint32_t fs_start_to_lba_superblk(uint32_t mb_start);
 // void bwrite(struct buffer_head *bh);
 // void brelse(struct buffer_head *bh);
 // struct buffer_head *getblk(unsigned short dev_no, unsigned long blocknr);
-// void show_fs(uint32_t mb_start);
+// void show_fs(dev_t dev);
 
 
 /*
@@ -381,11 +384,14 @@ struct ext2_sb_info {
 
 int disk_write_blk(uint32_t block_num, uint8_t *buf);
 int disk_read_blk(uint32_t block_num, uint8_t *buf); 
+int disk_write_blk_nowait(uint32_t block_num, uint8_t *buf);
 
 /* ext2 filesystem helper functions (from fs.c) */
 inode_t get_inode(uint32_t inode_n);
 void write_inode_table(uint32_t inode_n, inode_t new_inode);
 uint32_t indirect_block(inode_t file, uint32_t i);
+uint32_t ext2_block_map(uint32_t *i_block, uint32_t i, uint32_t *run, uint32_t *leaf);
+uint32_t ext2_ind_lookup(uint32_t ind, uint32_t j, uint32_t *run);
 int reserve_free_inode(uint32_t *inode_n);
 void unset_inode_bitmap(uint32_t inode_num);
 void set_inode_bitmap(uint32_t inode_num);
@@ -420,6 +426,15 @@ void ext2_read_inode(struct inode *inode);
 int ext2_write_inode(struct inode *inode);
 void ext2_delete_inode(struct inode *inode);
 int ext2_get_block(struct inode *inode, uint32_t block_idx, uint32_t *block_num);
+int set_i_block(inode_t *file, uint32_t inode_n, uint32_t i, uint32_t blockn);
+
+/* data block placement (ext2_inode.c) */
+void ext2_put_inode(struct inode *inode);
+void ext2_discard_prealloc(struct inode *inode);
+int ext2_alloc_block(struct inode *inode, uint32_t goal, uint32_t *block_n);
+uint32_t ext2_find_goal(struct inode *inode, uint32_t block_idx);
+uint32_t ext2_bmap(struct inode *inode, uint32_t block);
+void ext2_bmap_update(struct inode *inode, inode_t *disk_inode);
 #endif
 
 
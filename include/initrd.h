@@ -0,0 +1,19 @@
+#ifndef _INITRD_H
+#define _INITRD_H
+
+#include <stdint.h>
+#include "multiboot.h"
+
+/*
+ * the first multiboot module, if GRUB loaded one, is an initial RAM
+ * disk image. Physical addresses; 0 when there is none. Its pages are
+ * kept out of the allocators.
+ */
+extern uint32_t initrd_start, initrd_end;
+
+void reserve_initrd(multiboot_info_t *mbi);
+
+/* ram0, and the initrd as a block device if there is one */
+void rd_init(void);
+
+#endif
@@ -7,9 +7,13 @@
 #ifndef IRQ_H
 #define IRQ_H
 
+#include <stdint.h>
 #include "registers.h"
 
+typedef void (*irq_handler_t)(registers_t *);
+
 void irq_handler(registers_t *regs);
 void install_handlers(void);
+int request_irq(uint8_t irq, irq_handler_t handler);
 
 #endif
\ No newline at end of file
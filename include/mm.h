@@ -12,6 +12,21 @@
 #define IS_FLAG(var, flag) ((var & flag) == (flag)) 
 
 
+/*
+ * caches that can give pages back under memory pressure register a
+ * shrinker. alloc_pages() walks them before failing an allocation.
+ */
+struct shrinker {
+    int (*shrink)(int nr_pages); //try to free nr_pages, returns pages freed
+    struct list_head list;
+};
+
+void register_shrinker(struct shrinker *shrinker);
+void unregister_shrinker(struct shrinker *shrinker);
+int shrink_caches(int nr_pages);
+
+void *ioremap(unsigned long phys_addr, unsigned long size);
+
 void memset(void *addr, char val, unsigned int size);
 void *memcpy(void *dest, const void *src, unsigned int size);
 void init_mem(multiboot_info_t *);
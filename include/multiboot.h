@@ -18,6 +18,8 @@ extern uint8_t __kernel_start;
 extern uint8_t __kernel_end;
 
 #define MULTIBOOT_FLAG_MEM   (1 << 0)
+#define MULTIBOOT_FLAG_CMDLINE (1 << 2)
+#define MULTIBOOT_FLAG_MODS  (1 << 3)
 #define MULTIBOOT_FLAG_MMAP  (1 << 6)
 
 #define KERNEL_START ((uintptr_t)&__kernel_start)
@@ -56,4 +58,12 @@ typedef struct multiboot_mmap_entry {
   uint32_t type;
 } __attribute__((packed)) multiboot_mmap_entry_t;
 
+/* mods_addr points at mods_count of these; addresses are physical */
+typedef struct multiboot_module {
+  uint32_t mod_start;
+  uint32_t mod_end; //first byte past the module
+  uint32_t cmdline;
+  uint32_t pad;
+} __attribute__((packed)) multiboot_module_t;
+
 #endif
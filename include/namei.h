@@ -7,6 +7,7 @@
 #define LOOKUP_FOLLOW    0x0001  /* follow symbolic links */
 #define LOOKUP_DIRECTORY 0x0002  /* must be a directory */
 #define LOOKUP_PARENT    0x0004  /* return parent directory */
+#define LOOKUP_RCU       0x0008  /* walking without references, internal to namei.c */
 
 /* Path lookup context */
 struct nameidata {
@@ -15,6 +16,8 @@ struct nameidata {
     unsigned int flags;         /* lookup flags */
     int last_type;              /* type of last component */
     char *last_name;            /* last component name */
+    unsigned int seq;           /* d_seq of dentry, in an rcu walk */
+    unsigned int r_seq;         /* rename_seq when the rcu walk started */
 };
 
 /* Path lookup functions */
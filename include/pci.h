@@ -0,0 +1,67 @@
+#ifndef _PCI_H
+#define _PCI_H
+
+#include <stdint.h>
+
+/* configuration mechanism #1 */
+#define PCI_CONFIG_ADDRESS  0xcf8
+#define PCI_CONFIG_DATA     0xcfc
+
+/* config space offsets */
+#define PCI_VENDOR_ID       0x00
+#define PCI_DEVICE_ID       0x02
+#define PCI_COMMAND         0x04
+#define PCI_STATUS          0x06
+#define PCI_CLASS_REVISION  0x08
+#define PCI_PROG_IF         0x09
+#define PCI_SUBCLASS        0x0a
+#define PCI_CLASS           0x0b
+#define PCI_HEADER_TYPE     0x0e
+#define PCI_BAR0            0x10
+#define PCI_INTERRUPT_LINE  0x3c
+
+/* PCI_COMMAND bits */
+#define PCI_COMMAND_IO          1 << 0
+#define PCI_COMMAND_MEMORY      1 << 1
+#define PCI_COMMAND_MASTER      1 << 2
+
+#define PCI_HEADER_MULTIFUNC    0x80
+
+#define PCI_BAR_IO              0x01 //bit 0 of a BAR: I/O space
+#define PCI_BAR_IO_MASK         0xfffffffc
+#define PCI_BAR_MEM_MASK        0xfffffff0
+
+#define PCI_CLASS_STORAGE       0x01
+#define PCI_SUBCLASS_IDE        0x01
+
+#define PCI_VENDOR_NONE         0xffff
+
+struct pci_dev {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint16_t vendor;
+    uint16_t device;
+    uint8_t class;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t irq_line;
+    uint32_t bar[6];
+};
+
+uint32_t pci_read_config_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+uint16_t pci_read_config_word(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+uint8_t pci_read_config_byte(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+void pci_write_config_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t val);
+void pci_write_config_word(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t val);
+
+/*
+ * find the nth (from 0) function of the given class/subclass, or with
+ * the given vendor/device id.
+ * fills dev and returns 0, or -1 if there is none.
+ */
+int pci_find_class(uint8_t class, uint8_t subclass, int nth, struct pci_dev *dev);
+int pci_find_device(uint16_t vendor, uint16_t device, int nth, struct pci_dev *dev);
+void pci_set_master(struct pci_dev *dev);
+
+#endif
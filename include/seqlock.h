@@ -0,0 +1,65 @@
+#ifndef _SEQLOCK_H
+#define _SEQLOCK_H
+
+#include "system.h"
+
+/*
+ * sequence counters. A writer makes the count odd while it changes the
+ * data it guards and even again after; a reader that sees the same even
+ * count before and after its reads knows they were consistent. Readers
+ * never store to the counter, so they share its cache line for free, and
+ * never wait: on a mismatch they retry or fall back to a locked path.
+ */
+
+typedef struct {
+    unsigned int sequence;
+} seqcount_t;
+
+#define SEQCNT_ZERO { 0 }
+
+static inline void seqcount_init(seqcount_t *s)
+{
+    s->sequence = 0;
+}
+
+/*
+ * start a read section. With a writer in progress the section is lost
+ * already: the odd bit is dropped so the retry fails, rather than spin
+ * on a writer that may be the code we interrupted.
+ */
+static inline unsigned int raw_seqcount_begin(const seqcount_t *s)
+{
+    unsigned int ret = *(volatile const unsigned int *)&s->sequence;
+
+    rmb();
+    return ret & ~1u;
+}
+
+/* nonzero if the data changed since start, and what was read must be dropped */
+static inline int read_seqcount_retry(const seqcount_t *s, unsigned int start)
+{
+    rmb();
+    return *(volatile const unsigned int *)&s->sequence != start;
+}
+
+static inline void write_seqcount_begin(seqcount_t *s)
+{
+    s->sequence++;
+    wmb();
+}
+
+static inline void write_seqcount_end(seqcount_t *s)
+{
+    wmb();
+    s->sequence++;
+}
+
+/* fail every read section in progress, for data that goes away rather than changes */
+static inline void write_seqcount_invalidate(seqcount_t *s)
+{
+    wmb();
+    s->sequence += 2;
+    wmb();
+}
+
+#endif /* _SEQLOCK_H */
@@ -3,7 +3,49 @@
 
 typedef long ssize_t;
 typedef long long loff_t;
+typedef unsigned short dev_t; //MKDEV(major, minor), see blkdev.h
 
+/* save EFLAGS and disable interrupts; restore puts IF back as it was */
+#define local_irq_save(flags) \
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=g"(flags) : : "memory")
+#define local_irq_restore(flags) \
+    __asm__ __volatile__("pushl %0; popfl" : : "g"(flags) : "memory", "cc")
 
+/*
+ * memory ordering against a device reading our memory. x86 keeps stores
+ * in order and loads in order, so only the compiler needs stopping there;
+ * a store followed by a load needs a locked instruction.
+ */
+#define barrier() __asm__ __volatile__("" : : : "memory")
+#define wmb()     barrier()
+#define rmb()     barrier()
+#define mb()      __asm__ __volatile__("lock; addl $0, 0(%%esp)" : : : "memory", "cc")
+
+static inline unsigned long long rdtsc(void)
+{
+    unsigned long long tsc;
+
+    __asm__ __volatile__("rdtsc" : "=A"(tsc));
+    return tsc;
+}
+
+/*
+ * n /= base for a 64-bit n and 32-bit base, evaluating to the remainder.
+ * 64-bit adds, subtracts and multiplies are inlined; a 64-bit / or % is a
+ * call into libgcc's full 64 by 64 bit divide, where two divl will do.
+ */
+#define do_div(n, base) ({                                              \
+    unsigned long __upper, __low, __high, __mod, __base = (base);      \
+    __asm__("" : "=a"(__low), "=d"(__high) : "A"(n));                  \
+    __upper = __high;                                                   \
+    if (__high) {                                                       \
+        __upper = __high % __base;                                      \
+        __high = __high / __base;                                       \
+    }                                                                   \
+    __asm__("divl %2" : "=a"(__low), "=d"(__mod)                        \
+            : "rm"(__base), "0"(__low), "1"(__upper));                  \
+    __asm__("" : "=A"(n) : "a"(__low), "d"(__high));                   \
+    __mod;                                                              \
+})
 
 #endif
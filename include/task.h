@@ -2,9 +2,19 @@
 #define _TASK_H
 
 #include "list.h"
-#include "ufs.h"
+#include <stdint.h>
 // #include "vfs.h"
 
+/*
+ * only pointers to these: ufs and ext2 each define their own struct
+ * inode, so task.h must not pull either one's header in
+ */
+struct inode;
+struct file;
+#ifndef NR_OPEN
+#define NR_OPEN 30
+#endif
+
 #define NR_TASKS 10
 typedef int (*fn_ptr)();
 
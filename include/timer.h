@@ -3,6 +3,14 @@
 
 #include "registers.h"
 
+extern int timer_ticks;
+
 void timer_driver(registers_t *regs);
 
+/* TSC cycles per millisecond, measured against the PIT */
+extern unsigned long tsc_khz;
+
+void tsc_calibrate(void);
+unsigned long tsc_to_us(unsigned long long cycles);
+
 #endif
\ No newline at end of file
@@ -28,7 +28,7 @@
 #define LOCKED(var) ((var == 1 ? 1 : 0))
 #define LOCK(var) (*var = 1)
 
-#define DEV_NO 4
+extern dev_t ROOT_DEV; //disk holding the root filesystem, see blkdev.h
 
 #define I_DIRTY 1 << 1
 #define I_lock 1 << 0
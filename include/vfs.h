@@ -4,8 +4,10 @@
 #include "system.h"
 #include "kernel.h"
 #include "list.h"
+#include "seqlock.h"
 #include "mm.h"
 #include "string.h"
+#include "ext2_fs_i.h"
 #include <stddef.h>
 #include <stdbool.h>
 
@@ -50,10 +52,12 @@ struct dentry {
                               //directories dentries in the same parent directory
     
     struct list_head d_subdirs; //for directories, head of list of subdirs
+    struct list_head d_alias; //node in the inode's i_dentry list
     struct dentry_operations *d_op;
     struct super_block *sb;
     
     struct list_head d_hash; //node for entry in hash of dentyr cache
+    seqcount_t d_seq; //bumped when d_inode, d_parent or d_name change, see namei.c
 };
 
 struct file_operations {
@@ -120,7 +124,7 @@ struct inode_operations {
 
 struct super_block {
     struct list_head s_list; //super block list
-    unsigned char s_dev;
+    dev_t s_dev;
     unsigned long s_blocksize; //block size in bytes
     unsigned char s_dirt;      //has been modified
     struct super_operations *s_op; //superblock methods that will point to fs specific  
@@ -175,6 +179,9 @@ struct inode {
     struct inode_operations *i_op; //inode operations 
     struct file_operations *f_op; //def file operations
     struct super_block *i_sb; //pointer to superblock object
+    union {
+        struct ext2_inode_info ext2_i;
+    } u; //filesystem specific state
 
 };
 
@@ -212,6 +219,7 @@ static inline struct inode *unlocked_inode(struct inode *inode) {
 
 void create_inode_cache(void);
 struct inode *iget(unsigned short dev_no, unsigned int inum);
+void iput(struct inode *inode);
 
 /* VFS operation wrappers */
 int vfs_create(struct inode *dir, struct dentry *dentry, int mode);
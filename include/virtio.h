@@ -0,0 +1,135 @@
+#ifndef _VIRTIO_H
+#define _VIRTIO_H
+
+#include <stdint.h>
+
+/*
+ * virtio over PCI, legacy (0.9.5) interface: the device's registers
+ * are in I/O BAR0 and each queue is a split virtqueue in one physically
+ * contiguous block of guest memory, handed to the device by page frame.
+ *
+ * A split virtqueue is three rings: the descriptor table (buffers),
+ * the available ring (heads of descriptor chains the driver offers) and
+ * the used ring (heads the device is done with, plus the byte count it
+ * wrote).
+ */
+
+#define VIRTIO_PCI_VENDOR           0x1af4
+
+/* legacy register block, offsets from BAR0 */
+#define VIRTIO_PCI_HOST_FEATURES    0x00
+#define VIRTIO_PCI_GUEST_FEATURES   0x04
+#define VIRTIO_PCI_QUEUE_PFN        0x08
+#define VIRTIO_PCI_QUEUE_NUM        0x0c
+#define VIRTIO_PCI_QUEUE_SEL        0x0e
+#define VIRTIO_PCI_QUEUE_NOTIFY     0x10
+#define VIRTIO_PCI_STATUS           0x12
+#define VIRTIO_PCI_ISR              0x13
+#define VIRTIO_PCI_CONFIG           0x14 //device specific, without MSI-X
+
+#define VIRTIO_PCI_ISR_QUEUE        0x01
+#define VIRTIO_PCI_QUEUE_ADDR_SHIFT 12
+
+/* device status */
+#define VIRTIO_STATUS_ACKNOWLEDGE   1
+#define VIRTIO_STATUS_DRIVER        2
+#define VIRTIO_STATUS_DRIVER_OK     4
+#define VIRTIO_STATUS_FAILED        128
+
+/* ring feature bits */
+#define VIRTIO_RING_F_INDIRECT_DESC 28
+#define VIRTIO_RING_F_EVENT_IDX     29
+
+#define VRING_DESC_F_NEXT           1
+#define VRING_DESC_F_WRITE          2 //device writes the buffer
+#define VRING_DESC_F_INDIRECT       4 //buffer is a table of descriptors
+
+#define VRING_USED_F_NO_NOTIFY      1
+#define VRING_AVAIL_F_NO_INTERRUPT  1
+
+#define VRING_ALIGN                 4096
+
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vring_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[]; //num entries, then used_event
+};
+
+struct vring_used_elem {
+    uint32_t id; //head of the chain
+    uint32_t len; //bytes written by the device
+};
+
+struct vring_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct vring_used_elem ring[]; //num entries, then avail_event
+};
+
+/*
+ * with VIRTIO_RING_F_EVENT_IDX each side publishes the index at which it
+ * next wants to hear from the other: the driver interrupts only once the
+ * used index passes used_event, the device is kicked only once the avail
+ * index passes avail_event.
+ */
+#define vring_used_event(vq)  ((vq)->avail->ring[(vq)->num])
+#define vring_avail_event(vq) (*(uint16_t *)&(vq)->used->ring[(vq)->num])
+
+/* did moving from old to new_idx step over event_idx */
+static inline int vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old);
+}
+
+/* one buffer of a request, in the order the device consumes them */
+struct vring_sg {
+    uint32_t addr; //physical
+    uint32_t len;
+    int write; //device to memory
+};
+
+struct virtqueue {
+    unsigned short iobase;
+    uint16_t index;
+    uint16_t num;
+
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    unsigned int order; //pages backing the rings
+
+    uint16_t free_head; //descriptors free, chained through next
+    uint16_t num_free;
+    uint16_t avail_idx; //our copy of avail->idx
+    uint16_t num_added; //since the last kick
+    uint16_t last_used_idx;
+
+    int indirect;
+    int event_idx;
+    void **data; //caller's token per chain head
+};
+
+struct virtqueue *vring_setup(unsigned short iobase, uint16_t index, uint32_t features);
+void vring_free(struct virtqueue *vq);
+
+/*
+ * queue one request. with indirect descriptors and a table from the
+ * caller (room for nsg entries) it costs a single ring slot. returns -1
+ * if the ring is full.
+ */
+int virtqueue_add_buf(struct virtqueue *vq, struct vring_sg *sg, unsigned int nsg, void *data,
+                      struct vring_desc *indirect, uint32_t indirect_phys);
+void virtqueue_kick(struct virtqueue *vq);
+void *virtqueue_get_buf(struct virtqueue *vq, uint32_t *len);
+
+/* ask for an interrupt on the next completion; 0 if some already arrived */
+int virtqueue_enable_cb(struct virtqueue *vq);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef _VIRTIO_BLK_H
+#define _VIRTIO_BLK_H
+
+#include <stdint.h>
+#include "registers.h"
+
+#define VIRTIO_BLK_PCI_DEVICE   0x1001 //transitional, legacy interface
+
+/* feature bits */
+#define VIRTIO_BLK_F_SIZE_MAX   1
+#define VIRTIO_BLK_F_SEG_MAX    2
+#define VIRTIO_BLK_F_RO         5
+#define VIRTIO_BLK_F_BLK_SIZE   6
+#define VIRTIO_BLK_F_FLUSH      9
+#define VIRTIO_BLK_F_TOPOLOGY   10
+
+/* device config, from VIRTIO_PCI_CONFIG */
+#define VIRTIO_BLK_CFG_CAPACITY 0 //u64, 512 byte sectors
+#define VIRTIO_BLK_CFG_SIZE_MAX 8
+#define VIRTIO_BLK_CFG_SEG_MAX  12
+#define VIRTIO_BLK_CFG_PHYS_EXP 24 //u8, log2 of logical blocks per physical block
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_T_FLUSH      4
+
+#define VIRTIO_BLK_S_OK         0
+#define VIRTIO_BLK_S_IOERR      1
+#define VIRTIO_BLK_S_UNSUPP     2
+
+/* every request: this header, the data, then one status byte */
+struct virtio_blk_outhdr {
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector;
+};
+
+void virtio_blk_init(void);
+void virtblk_irq_handler(registers_t *regs);
+
+#endif
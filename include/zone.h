@@ -44,15 +44,24 @@
 #define PG_FLAG_TAKEN 1<<6
 #define PG_FLAG_RESERVED 1<<7
 #define PG_FLAG_slab 1<<8
+#define PG_FLAG_buffer 1<<9 //page backs buffer cache b_data blocks
 
 /* Hardware flags */
 #define PG_PRESENT 1<<0
 #define PG_RW 1<<1 //if not set , the page is read only
 #define PG_USER 1<<2 //if set, everyone can access the page
+#define PG_PWT 1<<3 //write-through
+#define PG_PCD 1<<4 //cache disabled, for device memory
 #define PG_ACCESSED 1<<5
 #define PG_DIRTY 1<<6 //set when page has been written to
 
 #define PAGE_OFFSET 0xC0000000
+
+/* kernel virtual window for ioremap()ed device memory */
+#define IOREMAP_START 0xF0000000
+#define IOREMAP_END   0xFFC00000
+/* RAM is direct mapped from PAGE_OFFSET up to the window, 768MB at most */
+#define LOWMEM_MAX_PFN ((IOREMAP_START - PAGE_OFFSET) >> PAGE_SHIFT)
 #define ZONE_HIGH_MEM 0x38000000  // 896MB
 #define PAGE_SHIFT 12
                                     
@@ -98,6 +107,8 @@ struct phy_layout {
     unsigned int highend_pfn; //Page frame number of the last page frame not directly mapped by the kernel
 };
 
+extern struct phy_layout phy_layout;
+
 void machine_specific_memory_setup(multiboot_info_t *mbi, memory_blocks_t* blocks, int num_blocks);
 void enable_paging(unsigned long int);
 unsigned long get_free_page(void);
@@ -213,6 +213,10 @@ void trap_init(void)
 	set_trap_gate(16,&coprocessor_error);
 	for (i=17;i<32;i++)
 		set_trap_gate(i,&reserved);
+
+	/* hardware interrupts, remapped by the PIC to 32-47 */
+	for (i=0;i<16;i++)
+		set_intr_gate(32+i,irq_stub_table[i]);
 }
 
 
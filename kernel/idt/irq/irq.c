@@ -12,15 +12,44 @@
 #include "pic.h"
 #include "serial.h"
 #include "timer.h"
-
-typedef void (*irq_handler_t)(registers_t *);
+#include "disk.h"
 
 irq_handler_t irq_handlers[16];
 
+/* PCI lines can be shared: every handler on the line runs and checks its device */
+#define IRQ_MAX_SHARED 4
+static irq_handler_t irq_shared[16][IRQ_MAX_SHARED];
+
 /* Install drivers */
 void install_handlers(void) {
   irq_handlers[0] = timer_driver;
   irq_handlers[1] = keyboard_driver;
+  irq_handlers[14] = ata_irq_handler;
+  irq_handlers[15] = ata_irq_handler;
+}
+
+/* hook a driver onto a line only known at runtime (PCI interrupt line) */
+int request_irq(uint8_t irq, irq_handler_t handler) {
+  int i;
+
+  if (irq >= 16 || (irq_handlers[irq] && !irq_shared[irq][0])) {
+    printk("request_irq: IRQ %u unavailable\n", irq);
+    return -1;
+  }
+  if (!irq_handlers[irq]) {
+    irq_handlers[irq] = handler;
+    irq_shared[irq][0] = handler;
+    IRQ_clear_mask(irq);
+    return 0;
+  }
+
+  for (i = 1; i < IRQ_MAX_SHARED && irq_shared[irq][i]; i++);
+  if (i == IRQ_MAX_SHARED) {
+    printk("request_irq: IRQ %u has too many handlers\n", irq);
+    return -1;
+  }
+  irq_shared[irq][i] = handler;
+  return 0;
 }
 
 /* Interrupt handler */
@@ -34,7 +63,10 @@ void irq_handler(registers_t *regs) {
   serial_writeint(irq);
   serial_writestring(" hit\n");
 
-  if (irq_handlers[irq])
+  if (irq_shared[irq][0]) {
+    for (int i = 0; i < IRQ_MAX_SHARED && irq_shared[irq][i]; i++)
+      irq_shared[irq][i](regs);
+  } else if (irq_handlers[irq])
     irq_handlers[irq](regs);
 
   send_EOI(irq);
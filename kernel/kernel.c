@@ -32,11 +32,17 @@
 #include "mm.h"
 #include "task.h"
 #include "disk.h"
+#include "ahci.h"
+#include "virtio_blk.h"
+#include "initrd.h"
 /* #include "fs.h" */
 #include "string.h"
 /* #include "vfs.h" */
 #include "ufs.h"
 #include "buffer.h"
+#include "blkdev.h"
+#include "timer.h"
+#include "blktrace.h"
 
 #if defined(__linux__)
 #error                                                                         \
@@ -50,6 +56,29 @@
 
 
 
+/* is word one of the space separated options on the multiboot command line */
+static int cmdline_has(multiboot_info_t *mbi, const char *word)
+{
+    const char *p = (const char *)mbi->cmdline;
+    size_t len = strlen(word);
+
+    if (!(mbi->flags & MULTIBOOT_FLAG_CMDLINE) || !p) {
+        return 0;
+    }
+    while (*p) {
+        if (!strncmp(p, word, len) && (p[len] == ' ' || !p[len])) {
+            return 1;
+        }
+        while (*p && *p != ' ') {
+            p++;
+        }
+        while (*p == ' ') {
+            p++;
+        }
+    }
+    return 0;
+}
+
 /* Main kernel entry point */
 void kernel_main(uint32_t magic, uint32_t addr) {
 
@@ -115,7 +144,17 @@ void kernel_main(uint32_t magic, uint32_t addr) {
     printk("Boot complete.\n");
 
     printk("working out hard disk \n");
+    // "blktrace" on the command line traces block I/O from here on
+    if (cmdline_has(mbi, "blktrace")) {
+        blk_trace_start();
+    }
+    disk_init();
+    ahci_init();
+    virtio_blk_init();
+    rd_init();
+    check_partitions();
     test_disk();
+    tsc_calibrate();
 
     printk("initializing buffer cache\n");
     create_buffer_cache();
@@ -128,6 +167,10 @@ void kernel_main(uint32_t magic, uint32_t addr) {
 
     printk("testing fs\n");
     test_fs();
+    diskstats_show();
+    if (blk_trace_enabled) {
+        blk_trace_dump();
+    }
     /* printk("initializing ext2_fs \n"); */
     /* ext2_fs_init(); */
 
@@ -99,9 +99,42 @@ block_found:
     return page;
 }
 
+static LIST_HEAD(shrinker_list);
+
+void register_shrinker(struct shrinker *shrinker)
+{
+    list_add_tail(&shrinker_list, &shrinker->list);
+}
+
+void unregister_shrinker(struct shrinker *shrinker)
+{
+    list_del(&shrinker->list);
+}
+
+/*
+ * ask every registered cache to give back pages until nr_pages
+ * have been freed or nobody has anything left
+ */
+int shrink_caches(int nr_pages)
+{
+    struct shrinker *shrinker = NULL;
+    int freed = 0;
+
+    list_for_each_entry(shrinker, &shrinker_list, list) {
+        freed += shrinker->shrink(nr_pages - freed);
+        if (freed >= nr_pages)
+            break;
+    }
+    return freed;
+}
+
 struct page *alloc_pages(int flags, short order)
 {
-    return allocate_block(&zone, order);
+    struct page *page = allocate_block(&zone, order);
+
+    if (!page && shrink_caches(1 << order))
+        page = allocate_block(&zone, order);
+    return page;
 }
 
 int PagePrivate(struct page *page)
@@ -14,6 +14,7 @@
 #include "utils.h"
 #include "zone.h"
 #include "mm.h"
+#include "initrd.h"
 
 
 
@@ -21,6 +22,7 @@
 uintptr_t heap_start, heap_end, kalloc_ptr;
 size_t heap_size = HEAP_SIZE;
 memory_blocks_t free_memory_blocks[MAX_MEMORY_BLOCKS];
+uint32_t initrd_start, initrd_end;
 
 
 static int test_allocator();
@@ -117,8 +119,35 @@ static int test_allocator() {
   return 0;
 }
 
+/*
+ * GRUB loads modules right after the kernel image, where the early
+ * allocator would start handing out memory. Note the first one as the
+ * initrd; find_available_memory() then starts free memory past it.
+ */
+void reserve_initrd(multiboot_info_t *mbi)
+{
+    multiboot_module_t *mod;
+
+    initrd_start = initrd_end = 0;
+    if (!(mbi->flags & MULTIBOOT_FLAG_MODS) || !mbi->mods_count) {
+        return;
+    }
+
+    mod = (multiboot_module_t *) (uintptr_t) mbi->mods_addr;
+    initrd_start = mod->mod_start;
+    initrd_end = mod->mod_end;
+
+    serial_writestring("initrd at 0x");
+    serial_writehex(initrd_start);
+    serial_writestring(" - 0x");
+    serial_writehex(initrd_end);
+    serial_writestring("\n");
+}
+
 int find_available_memory(multiboot_info_t *mbi)
 {
+    uint32_t reserved_end = (uint32_t)KERNEL_END;
+
     serial_writestring("\n--- Multiboot Memory Info ---\n");
 
     serial_writestring("mmap addr = ");
@@ -134,6 +163,11 @@ int find_available_memory(multiboot_info_t *mbi)
         return 0;
     }
 
+    reserve_initrd(mbi);
+    if (initrd_end > reserved_end) {
+        reserved_end = (initrd_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    }
+
     int num_blocks = 0;
     uint8_t *mmap = (uint8_t *) (uintptr_t) mbi->mmap_addr;
     uint8_t *mmap_end = mmap + mbi->mmap_length;
@@ -155,12 +189,12 @@ int find_available_memory(multiboot_info_t *mbi)
             uint32_t entry_start = entry->addr;
             uint32_t entry_end   = entry_start + entry->len;
 
-            // Adjust for kernel end
-            if (entry_start <= (uint32_t)KERNEL_END && entry_end > (uint32_t)KERNEL_END) {
-                free_memory_blocks[num_blocks].start = (uint32_t)KERNEL_END;
+            // Adjust for kernel end (and the initrd behind it)
+            if (entry_start <= reserved_end && entry_end > reserved_end) {
+                free_memory_blocks[num_blocks].start = reserved_end;
                 free_memory_blocks[num_blocks].end   = entry_end;
             } 
-            else if (entry_start > (uint32_t)KERNEL_END) {
+            else if (entry_start > reserved_end) {
                 free_memory_blocks[num_blocks].start = entry_start;
                 free_memory_blocks[num_blocks].end   = entry_end;
             }
@@ -114,6 +114,13 @@ void machine_specific_memory_setup(multiboot_info_t *mbi, memory_blocks_t *block
     unsigned long total_ram_pfn   = total_ram_bytes / PAGE_SIZE;
     unsigned long lowmem_limit_pfn = ((mbi->mem_lower * 1024) / PAGE_SIZE);
 
+    // there is no highmem: RAM past the direct map's end is left unused
+    if (total_ram_pfn > LOWMEM_MAX_PFN) {
+        printk("\n ignoring %u MB of RAM above the ioremap window",
+               (total_ram_pfn - LOWMEM_MAX_PFN) >> (20 - PAGE_SHIFT));
+        total_ram_pfn = LOWMEM_MAX_PFN;
+    }
+
     phy_layout.highest_usable_pfn = (mbi->mem_upper * 1024) / PAGE_SIZE;
     phy_layout.totalram_pages = total_ram_pfn;
     phy_layout.max_pfn = phy_layout.highest_usable_pfn;
@@ -379,6 +386,57 @@ void setup_paging(unsigned int pgdir_entries)
 }
 
 
+/*
+ * map device memory (PCI memory BARs) uncached into the IOREMAP window.
+ * The identity/PAGE_OFFSET maps only cover RAM. Mappings are never torn
+ * down; the window is handed out bottom up.
+ */
+void *ioremap(unsigned long phys_addr, unsigned long size)
+{
+    static unsigned long ioremap_next = IOREMAP_START;
+    unsigned long offset = phys_addr % PAGE_SIZE;
+    unsigned long start = ioremap_next;
+    unsigned long npages;
+
+    phys_addr -= offset;
+    npages = (size + offset + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    // the window must not reuse the direct map's page tables
+    if (ioremap_next < PAGE_OFFSET + phy_layout.totalram_pages * PAGE_SIZE) {
+        printk("ioremap: window overlaps the direct map\n");
+        return NULL;
+    }
+
+    if (npages > (IOREMAP_END - ioremap_next) / PAGE_SIZE) {
+        printk("ioremap: window exhausted mapping %x\n", phys_addr);
+        return NULL;
+    }
+
+    for (unsigned long i = 0; i < npages; i++) {
+        unsigned long va = start + i * PAGE_SIZE;
+        unsigned int pgd = pgd_index(va);
+        unsigned long *pg_table;
+
+        if (!(swapper_pg_dir[pgd] & PG_PRESENT)) {
+            struct page *page = alloc_pages(0, 0);
+            if (!page) {
+                printk("ioremap: no page for a page table\n");
+                return NULL;
+            }
+            memset(page_address(page), 0, PAGE_SIZE);
+            swapper_pg_dir[pgd] = (page_to_phys(page) & 0xFFFFF000) | PG_PRESENT | PG_RW;
+        }
+
+        pg_table = (unsigned long *)__va(swapper_pg_dir[pgd] & 0xFFFFF000);
+        pg_table[(va / PAGE_SIZE) % PG_TABLE_ENTRIES] =
+            ((phys_addr + i * PAGE_SIZE) & 0xFFFFF000) | PG_PRESENT | PG_RW | PG_PCD | PG_PWT;
+        __asm__ volatile("invlpg (%0)" : : "r"(va) : "memory");
+    }
+
+    ioremap_next += npages * PAGE_SIZE;
+    return (void *)(start + offset);
+}
+
 void init_mem(multiboot_info_t *mbi)
 {
     register int iCnt = 0, jCnt = 0;